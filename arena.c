@@ -0,0 +1,100 @@
+/*
+ * file:        arena.c
+ * description: bump allocator for per-line data (the command AST)
+ *
+ * 每一行命令解析出来的语法树（见ast.c）只在执行这一行的时候有用，
+ * 所以不需要一个节点一个节点地malloc/free：
+ *   - 从一大块内存（chunk）里按顺序切出来，分配只是移动一个指针
+ *   - 一个chunk用完了就再申请一个（至少和这次请求一样大）
+ *   - 一行执行完调用arena_reset，所有内存一次性"释放"
+ *   - reset时如果有多个chunk，合并成一个同样大小的，下一行同样大小的
+ *     命令就只需要一个chunk，之后不会再调用malloc
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+/* 第一个chunk的大小，普通的命令行远远用不完 */
+#define ARENA_CHUNK 4096
+
+struct arena_chunk {
+    struct arena_chunk *next;   /* 更早申请的chunk */
+    size_t size;                /* data的大小 */
+    size_t used;
+    alignas(max_align_t) char data[];
+};
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+    struct arena_chunk *c = malloc(sizeof(*c) + size);
+    if (c == NULL) {
+        perror("arena");
+        exit(EXIT_FAILURE);
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+void arena_init(struct arena *a)
+{
+    a->head = NULL;
+    a->total = 0;
+}
+
+/*
+ * arena_alloc: 分配n个字节（按max_align_t对齐，内容未初始化）
+ *
+ * 返回值：永远不会返回NULL，内存不够时打印错误并退出（和xrealloc一样）
+ */
+void *arena_alloc(struct arena *a, size_t n)
+{
+    n = (n + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+    struct arena_chunk *c = a->head;
+    if (c == NULL || c->size - c->used < n) {
+        size_t size = ARENA_CHUNK;
+        while (size < n)
+            size *= 2;
+        c = new_chunk(size);
+        c->next = a->head;
+        a->head = c;
+        a->total += size;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+/* 释放所有分配（保留内存给下一行用） */
+void arena_reset(struct arena *a)
+{
+    struct arena_chunk *c = a->head;
+    if (c == NULL)
+        return;
+    if (c->next == NULL) {
+        c->used = 0;
+        return;
+    }
+    /* 有多个chunk：换成一个能装下全部内容的 */
+    size_t total = a->total;
+    arena_free(a);
+    a->head = new_chunk(total);
+    a->total = total;
+}
+
+/* 把所有chunk还给系统 */
+void arena_free(struct arena *a)
+{
+    struct arena_chunk *c = a->head;
+    while (c != NULL) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    arena_init(a);
+}
@@ -0,0 +1,31 @@
+/*
+ * file:        arena.h
+ * description: bump allocator for per-line data (the command AST)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* memory comes from a list of chunks; allocation just bumps a pointer
+ * and nothing is freed individually. arena_reset() gives everything
+ * back at once (at the end of each command line).
+ */
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *head;   /* chunk being allocated from */
+    size_t total;               /* bytes in all chunks */
+};
+
+/* function declarations:
+*/
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t n);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * file:        ast.c
+ * description: build the command line syntax tree from tokens
+ *
+ * 原来 execute_command 先用 strcmp 把所有token扫一遍找 "|"，再扫一遍找
+ * "<" 和 ">"，然后 execute_with_redirection / execute_pipeline 又各自
+ * 重新扫描，拼出 clean_tokens 或者命令表。
+ *
+ * 现在 tokenize 已经给每个token标好了类型（TOK_WORD/PIPE/IN/OUT），
+ * 这里只扫描一遍，直接建出语法树：
+ *
+ *   pipeline -> stage -> stage -> ...
+ *                 |
+ *                 +-- argv:   ["cat", "-n", NULL]
+ *                 +-- redirs: (<, "in.txt") -> (>, "out.txt")
+ *
+ * |+（扇出）和 | 一样开始一个新命令，只是这个命令标上branch：
+ * "a |+ b | c |+ d" 是 a -> b(branch) -> c -> d(branch)，
+ * a的输出同时送给 "b | c" 和 "d"（见fanout.c）。
+ *
+ * 所有节点和argv数组都从arena中分配，字符串直接指向tokenizer的缓冲区，
+ * 不复制。一行执行完后arena_reset，整棵树一起释放。
+ *
+ * 变量在建树时展开（见vars.c）：含有 '$' 的单词（单引号中的除外）先量出
+ * 展开后的长度，再把结果写进arena，每个这样的单词只分配一次；其它单词
+ * 仍然直接指向tokenizer的缓冲区。命令名之前的 NAME=value 是赋值，
+ * 放在stage->assigns中。
+ *
+ * $(...)（命令替换）在建树之前先按顺序执行（见command_subst），没有
+ * 引号时结果按空格、制表符、换行拆成多个参数，所以argv要多留位置。
+ * <(...) 和 >(...)（进程替换）也在这时启动（见process_subst），
+ * 这个单词换成连到它的管道的路径 /dev/fd/N。
+ *
+ * <<WORD 后面的token在建树之前已经换成了here-document的内容（见
+ * read_heredocs），<<< 后面是一个单词；它们都变成REDIR_DATA重定向，
+ * 内容在redir->file中。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "vars.h"
+
+static struct stage *new_stage(struct arena *a, char **argv)
+{
+    struct stage *st = arena_alloc(a, sizeof(*st));
+    memset(st, 0, sizeof(*st)); // 资源统计（ru、end）在回收时才填写
+    st->argv = argv;
+    st->argc = 0;
+    st->assigns = argv;
+    st->n_assigns = 0;
+    st->redirs = NULL;
+    st->pid = -1;
+    st->status = 1;
+    st->place = -1;
+    st->cpu = -1;
+    st->next = NULL;
+    return st;
+}
+
+/*
+ * 展开一个单词：prefix（不展开）+ text中的变量引用
+ * 单引号中的单词、没有 '$'（和 \$）的单词不复制，直接返回tokenizer中的文字；
+ * subst不是NULL时，它是已经展开好的text（含有 $(...) 的单词，见expand_subst）
+ */
+static char *expand_word(struct arena *a, const char *prefix, size_t prefix_len,
+                         const struct token *t, char *subst)
+{
+    if (prefix_len == 0 && subst != NULL)
+        return subst;
+    if (prefix_len == 0 && (t->quote == '\'' || (memchr(t->text, '$', t->len) == NULL &&
+                                                 memchr(t->text, ESC_DOLLAR, t->len) == NULL)))
+        return t->text;
+    size_t len = prefix_len + (subst != NULL ? strlen(subst) :
+                               (t->quote == '\'') ? t->len : var_expand(t->text, t->len, NULL));
+    char *out = arena_alloc(a, len + 1);
+    memcpy(out, prefix, prefix_len);
+    if (subst != NULL)
+        strcpy(out + prefix_len, subst);
+    else if (t->quote == '\'')
+        memcpy(out + prefix_len, t->text, t->len);
+    else
+        var_expand(t->text, t->len, out + prefix_len);
+    out[len] = '\0';
+    return out;
+}
+
+/* 一个 $(...) 和它的输出 */
+struct subst {
+    const char *from, *to;  /* "$(" 和 ")" 之后的位置 */
+    char *out;
+    size_t out_len;
+};
+
+/*
+ * 展开一个含有 $(...) 的单词：先从左往右执行每一个 $(...)，
+ * 再量出总长度，把其它部分的变量展开和命令的输出一起写进arena
+ */
+static char *expand_subst(struct arena *a, const struct token *t)
+{
+    const char *end = t->text + t->len;
+    int n = 0;
+    for (const char *d = t->text; (d = tok_find_subst(d, end)) != NULL; n++) {
+        d = tok_subst_end(d + 2, end);
+        if (d < end)
+            d++;
+    }
+
+    struct subst *subs = arena_alloc(a, n * sizeof(*subs));
+    const char *s = t->text;
+    size_t len = 0;
+    for (int k = 0; k < n; k++) {
+        const char *d = tok_find_subst(s, end);
+        const char *close = tok_subst_end(d + 2, end);
+        len += var_expand(s, d - s, NULL);
+        subs[k].from = d;
+        subs[k].to = (close < end) ? close + 1 : end;
+        subs[k].out = command_subst(a, d + 2, close - (d + 2), &subs[k].out_len);
+        len += subs[k].out_len;
+        s = subs[k].to;
+    }
+    len += var_expand(s, end - s, NULL);
+
+    char *out = arena_alloc(a, len + 1), *o = out;
+    s = t->text;
+    for (int k = 0; k < n; k++) {
+        o += var_expand(s, subs[k].from - s, o);
+        memcpy(o, subs[k].out, subs[k].out_len);
+        o += subs[k].out_len;
+        s = subs[k].to;
+    }
+    o += var_expand(s, end - s, o);
+    *o = '\0';
+    return out;
+}
+
+/* 字段之间的分隔符：空格、制表符、换行 */
+#define IS_IFS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n')
+
+/* 拆开以后有几个字段 */
+static int count_fields(const char *s)
+{
+    int n = 0;
+    for (int in_field = 0; *s; s++) {
+        if (IS_IFS(*s))
+            in_field = 0;   // 下一个不是分隔符的字符开始一个新字段
+        else if (!in_field) {
+            in_field = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * build_ast: 把一行的token变成语法树
+ *
+ * 参数说明：
+ *   a: 分配节点用的arena
+ *   toks, n: tokenize()的结果
+ *
+ * 变量引用和 $(...) 在这里展开，$? 和 $! 的值由调用者事先用var_special设置。
+ * 没有引号的单词展开成空字符串时被去掉（例如 $UNSET），和sh一样
+ *
+ * 返回值：
+ *   语法树；有语法错误时返回NULL：
+ *     - | 在开头、在结尾，或者连续两个 |（|+ 也一样）
+ *     - 管道中的某个命令只有重定向、没有命令名
+ *     - < 或 > 后面没有文件名
+ *     - & 不在最后，或者 & 前面没有命令
+ *     - 有 ;、&& 或 ||（命令列表要先经过compile）
+ *     - <(...) 或 >(...) 启动不了（已经打印了错误信息）
+ *
+ * text/text_len由调用者填写
+ */
+struct pipeline *build_ast(struct arena *a, const struct token *toks, int n)
+{
+    struct pipeline *pl = arena_alloc(a, sizeof(*pl));
+
+    /*
+     * 先执行所有的 $(...)，启动所有的 <(...) 和 >(...)，subst[i]是第i个
+     * token展开的结果（没有替换的token为NULL）。没有引号时 $(...) 的结果
+     * 要拆开，extra是多出来的参数个数
+     */
+    char **subst = NULL;
+    int extra = 0;
+    for (int i = 0; i < n; i++) {
+        if (!toks[i].subst && !toks[i].procsub)
+            continue;
+        if (subst == NULL) {
+            subst = arena_alloc(a, n * sizeof(char *));
+            memset(subst, 0, n * sizeof(char *));
+        }
+        if (toks[i].procsub) {
+            subst[i] = process_subst(a, toks[i].text, toks[i].len, toks[i].procsub);
+            if (subst[i] == NULL)
+                return NULL;
+            continue;
+        }
+        subst[i] = expand_subst(a, &toks[i]);
+        if (toks[i].quote == 0 && count_fields(subst[i]) > 1)
+            extra += count_fields(subst[i]) - 1;
+    }
+
+    /*
+     * 所有命令的argv共用一块内存，一个接一个地放：
+     * 单词的个数 + 每个命令结尾的NULL，最多 n+1 个
+     * （每多一个命令就多一个 | token，而 | 不占argv的位置），加上extra
+     */
+    char **next_arg = arena_alloc(a, (n + 1 + extra) * sizeof(char *));
+
+    struct stage *st = new_stage(a, next_arg);
+    struct redir **rlink = &st->redirs; // 重定向链表的结尾，保持命令行中的顺序
+    pl->stages = st;
+    pl->n_stages = 1;
+    pl->background = 0;
+    pl->pipe_size = 0;
+    pl->timeout_ms = 0;
+    pl->kill_after_ms = 0;
+    pl->timed_out = 0;
+    pl->place = -1;
+    pl->n_branches = 0;
+    pl->fanout_pid = 0;
+    pl->pgid = 0;
+    pl->tty = -1;
+    pl->text = NULL;
+    pl->text_len = 0;
+
+    for (int i = 0; i < n; i++) {
+        const struct token *t = &toks[i];
+
+        if (t->type == TOK_WORD && st->argc == 0 && t->quote == 0 && !t->procsub
+            && var_name_len(t->text) > 0) {
+            /*
+             * 赋值 NAME=value，放在这个命令的argv前面。A="x y"：引号中的
+             * 部分紧跟在 "A=" 后面（joined），是它的值
+             */
+            // 赋值的值不拆开
+            const struct token *v = NULL;
+            if (t->text[t->len - 1] == '=' && i + 1 < n && toks[i + 1].type == TOK_WORD
+                && toks[i + 1].quote != 0 && toks[i + 1].joined)
+                v = &toks[++i];
+            *next_arg++ = v ? expand_word(a, t->text, t->len, v, subst ? subst[i] : NULL)
+                            : expand_word(a, "", 0, t, subst ? subst[i] : NULL);
+            st->n_assigns++;
+            st->argv = next_arg;
+        } else if (t->type == TOK_WORD && t->subst && t->quote == 0) {
+            // 没有引号的 $(...)：输出按空格、制表符、换行拆成多个参数
+            for (char *f = strtok(subst[i], " \t\n"); f != NULL; f = strtok(NULL, " \t\n")) {
+                *next_arg++ = f;
+                st->argc++;
+            }
+        } else if (t->type == TOK_WORD) {
+            // 命令名或参数
+            char *word = expand_word(a, "", 0, t, subst ? subst[i] : NULL);
+            if (word[0] == '\0' && t->quote == 0)
+                continue;
+            *next_arg++ = word;
+            st->argc++;
+        } else if (t->type == TOK_PIPE || t->type == TOK_FANOUT) {
+            // 当前命令结束，开始下一个命令（|+ 时是一个新的分支）
+            if (st->argc == 0)
+                return NULL;
+            *next_arg++ = NULL;
+            st->next = new_stage(a, next_arg);
+            st = st->next;
+            rlink = &st->redirs;
+            pl->n_stages++;
+            if (t->type == TOK_FANOUT) {
+                st->branch = 1;
+                pl->n_branches++;
+            }
+        } else if (t->type == TOK_AMP) {
+            // 在后台执行，& 只能是最后一个token
+            if (i != n - 1 || (st->argc == 0 && st->redirs == NULL))
+                return NULL;
+            pl->background = 1;
+        } else if (t->type == TOK_SEMI || t->type == TOK_AND || t->type == TOK_OR) {
+            // 命令列表由compile处理（见control.c），这里只有一个管道
+            return NULL;
+        } else {
+            // < 或 >，下一个token必须是文件名（<< 和 <<< 时是内容）
+            if (i + 1 == n || toks[i + 1].type != TOK_WORD)
+                return NULL;
+            struct redir *r = arena_alloc(a, sizeof(*r));
+            r->type = (t->type == TOK_IN) ? REDIR_IN :
+                      (t->type == TOK_OUT) ? REDIR_OUT : REDIR_DATA;
+            i++;
+            r->file = expand_word(a, "", 0, &toks[i], subst ? subst[i] : NULL);
+            if (t->type == TOK_HERESTR) {
+                // here-string的结尾加一个换行（和bash一样）
+                size_t len = strlen(r->file);
+                char *text = arena_alloc(a, len + 2);
+                memcpy(text, r->file, len);
+                text[len] = '\n';
+                text[len + 1] = '\0';
+                r->file = text;
+            }
+            r->next = NULL;
+            *rlink = r;
+            rlink = &r->next;
+        }
+    }
+    *next_arg = NULL;
+
+    // | 在结尾
+    if (pl->n_stages > 1 && st->argc == 0)
+        return NULL;
+    return pl;
+}
@@ -0,0 +1,91 @@
+/*
+ * file:        ast.h
+ * description: command line syntax tree for shell56
+ */
+
+/* standard include file protection:
+*/
+#ifndef __AST_H__
+#define __AST_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "parser.h"
+#include "arena.h"
+
+/* redirection types:
+*/
+enum {
+    REDIR_IN = 0,       /* < file */
+    REDIR_OUT,          /* > file */
+    REDIR_DATA,         /* <<EOF, <<<word: stdin is the text in file */
+};
+
+struct redir {
+    int type;           /* REDIR_xxx */
+    char *file;         /* file name; for REDIR_DATA the text itself */
+    struct redir *next; /* in command line order */
+};
+
+/* one command of a pipeline. argv holds only the command words;
+ * the operators and file names are in the redirection list, and
+ * leading NAME=value words in assigns. all words are already expanded.
+ */
+struct stage {
+    char **argv;        /* NULL-terminated */
+    int argc;
+    char **assigns;     /* NAME=value words before the command name */
+    int n_assigns;
+    struct redir *redirs;
+    pid_t pid;          /* set when the stage is started, -1 if it wasn't */
+    int status;         /* exit status, once it has been reaped */
+    struct rusage ru;   /* from wait4, once it has been reaped */
+    struct timespec end;/* CLOCK_MONOTONIC time it was reaped */
+    int pipe_cap;       /* capacity of the pipe to the next stage (pipestat) */
+    unsigned long long rchar, wchar;    /* /proc/<pid>/io just before reaping */
+    unsigned long long run_ns, wait_ns; /* /proc/<pid>/schedstat, ditto */
+    int place;          /* LLC group it was pinned to (place.c), -1 = none */
+    int cpu;            /* CPU it last ran on, just before reaping (placestat) */
+    int branch;         /* first stage of a fan-out branch (after |+) */
+    struct stage *next;
+};
+
+/* a whole command line: stage | stage | ... [&]. with |+ the stages
+ * before the first |+ feed every branch: src |+ branch |+ branch ...
+ * (each branch a pipeline of its own, see fanout.c)
+ */
+struct pipeline {
+    struct stage *stages;
+    int n_stages;
+    int background;     /* ended with & */
+    int pipe_size;      /* from the pipesize prefix, 0 = use set -o pipesize */
+    int timeout_ms;     /* from the timeout prefix, 0 = no deadline */
+    int kill_after_ms;  /* SIGKILL this long after the SIGTERM of a timeout */
+    int timed_out;      /* 1 = SIGTERM sent at the deadline, 2 = SIGKILL too */
+    int place;          /* from the place prefix (PLACE_xxx), -1 = use set -o place */
+    int n_branches;     /* number of |+ branches, 0 = plain pipeline */
+    pid_t fanout_pid;   /* the fan-out helper once started, 0 = none */
+    pid_t pgid;         /* process group of the started stages, 0 = none */
+    int tty;            /* terminal fd handed to pgid while it runs, -1 = none */
+    const char *text;   /* the command line (for the job table) */
+    size_t text_len;
+};
+
+/* function declarations:
+*/
+struct pipeline *build_ast(struct arena *a, const struct token *toks, int n);
+
+/* $(...): run cmd and return its output, trailing newlines removed,
+ * allocated from a. provided by the shell (shell56.c).
+ */
+char *command_subst(struct arena *a, const char *cmd, size_t len, size_t *out_len);
+
+/* <(...) / >(...): start cmd on a pipe and return "/dev/fd/N" for the
+ * shell's end (allocated from a), or NULL if it could not be started.
+ * provided by the shell (shell56.c).
+ */
+char *process_subst(struct arena *a, const char *cmd, size_t len, int dir);
+
+#endif
@@ -0,0 +1,519 @@
+/*
+ * file:        bccache.c
+ * description: compiled script cache (tokens + command trees, mmap'ed)
+ *
+ * "./shell56 deploy.sh" 每次都要把整个脚本重新读一遍：每一行tokenize，
+ * 有控制结构的几行再接起来编译（见control.c）。几万行的脚本每个作业
+ * 启动时都执行，每次的结果都一样。
+ *
+ * 设置了 SHELL56_CACHE=目录 时，第一次执行脚本先把整个脚本编译好
+ * （token、here-document的内容、编译好的命令树），写成一个缓存文件；
+ * 以后直接mmap这个文件执行，不再读脚本，也不再tokenize、编译。
+ *
+ * 缓存文件（本机格式，不能拿到别的机器上用）：
+ *
+ *   header | units[] | tokens[] | nodes[] | 字符串
+ *
+ * 里面没有指针，都是下标和偏移量（position-independent），mmap到哪里
+ * 都能用。一个unit是主循环一次执行的东西：一行（一个管道），或者
+ * 接在一起编译的几行（命令列表、控制结构）。执行到一个unit时才把它的
+ * token和命令树还原成struct token / struct node（见bc_unit），
+ * 只是把下标换成指针，每个token、节点一次赋值。
+ *
+ * 缓存文件按脚本的路径命名（见bc_cache_path），header中记着脚本的
+ * dev/ino、大小、修改时间和内容的哈希值（FNV-1a）：
+ *   - stat的结果都一样：直接用，不读脚本
+ *   - 只有修改时间不一样（touch、git checkout）：哈希值一样就还能用，
+ *     把新的修改时间写回header
+ *   - 其它情况：过期了，重新编译、覆盖
+ * 新的缓存文件先写到临时文件，再rename，同时执行的shell不会读到
+ * 写了一半的文件。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bccache.h"
+
+/* 文件格式的版本：记录的布局改变时加一，旧的缓存文件就过期了 */
+#define BC_MAGIC "shell56"
+#define BC_VERSION 2
+
+struct bc_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_units, n_toks, n_nodes;
+    uint64_t pool_len;
+    /* 编译的是哪个脚本 */
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t hash;
+};
+
+struct bc_unit {
+    uint32_t kind;      /* BC_xxx */
+    uint32_t tok, n_toks;       /* tokens[tok .. tok+n_toks) */
+    int32_t node;       /* BC_LIST: 第一个节点，-1表示有语法错误 */
+    uint32_t text, text_len;    /* BC_CMD以 & 结尾时：这一行（作业表要用） */
+};
+
+struct bc_token {
+    uint8_t type, quote, joined, subst, procsub, pad[3];
+    uint32_t text, len;
+};
+
+/* 节点中的token下标是这个unit中的下标；-1表示没有 */
+struct bc_node {
+    int32_t type, join;
+    int32_t tok, n_toks;
+    int32_t text, text_len, var;
+    int32_t cond, body, orelse, next;
+    int32_t redir, n_redirs;    /* fi/done后面的重定向 */
+};
+
+/* FNV-1a，64位 */
+static uint64_t hash_bytes(const char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* 脚本内容的哈希值：整个mmap进来算 */
+static uint64_t hash_file(int fd, size_t size)
+{
+    if (size == 0)
+        return hash_bytes("", 0);
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    uint64_t h = hash_bytes(p, size);
+    munmap(p, size);
+    return h;
+}
+
+/*
+ * bc_cache_path: 脚本的缓存文件的路径，"DIR/名字-哈希值.bc"
+ * 哈希值是脚本的绝对路径的（不同目录中的同名脚本各有各的缓存）
+ * 返回值：malloc的字符串；脚本不存在时返回NULL
+ */
+char *bc_cache_path(const char *dir, const char *script)
+{
+    char real[PATH_MAX];
+    if (realpath(script, real) == NULL)
+        return NULL;
+    const char *name = strrchr(real, '/') + 1;
+    size_t len = strlen(dir) + strlen(name) + 24;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/%s-%016llx.bc", dir, name,
+                 (unsigned long long)hash_bytes(real, strlen(real)));
+    return path;
+}
+
+/* 记下脚本的stat结果 */
+static void stamp(struct bc_header *h, const struct stat *sb)
+{
+    h->dev = sb->st_dev;
+    h->ino = sb->st_ino;
+    h->size = sb->st_size;
+    h->mtime_sec = sb->st_mtim.tv_sec;
+    h->mtime_nsec = sb->st_mtim.tv_nsec;
+}
+
+/* 各部分的大小和文件大小对得上 */
+static int image_ok(const char *image, size_t len)
+{
+    const struct bc_header *h = (const struct bc_header *)image;
+    if (len < sizeof(*h) || memcmp(h->magic, BC_MAGIC, 8) != 0 || h->version != BC_VERSION)
+        return 0;
+    return len == sizeof(*h) + (uint64_t)h->n_units * sizeof(struct bc_unit)
+                 + (uint64_t)h->n_toks * sizeof(struct bc_token)
+                 + (uint64_t)h->n_nodes * sizeof(struct bc_node) + h->pool_len;
+}
+
+/*
+ * bc_open: 打开并mmap脚本的缓存文件
+ *
+ * 参数说明：
+ *   s: 输出
+ *   path: 缓存文件（bc_cache_path）
+ *   sb, script_fd: 脚本的stat结果和fd（修改时间变了时用来算哈希值）
+ *
+ * 返回值：0；没有缓存文件、格式不对或者过期了时返回-1（调用者重新编译）
+ *
+ * 映射是可写的私有映射（MAP_PRIVATE）：token的文字直接指向映射，
+ * 万一有命令改写参数，改的只是自己的一份，不会改到文件
+ */
+int bc_open(struct bc_script *s, const char *path, const struct stat *sb, int script_fd)
+{
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat cb;
+    if (fd == -1 || fstat(fd, &cb) == -1 || (size_t)cb.st_size < sizeof(struct bc_header)) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    char *image = mmap(NULL, cb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    struct bc_header *h = (struct bc_header *)image;
+    int ok = image_ok(image, cb.st_size) && h->dev == (uint64_t)sb->st_dev
+             && h->ino == (uint64_t)sb->st_ino && h->size == (uint64_t)sb->st_size;
+    if (ok && (h->mtime_sec != sb->st_mtim.tv_sec || h->mtime_nsec != sb->st_mtim.tv_nsec)) {
+        // 修改时间变了：内容一样就还能用，记下新的修改时间
+        ok = (hash_file(script_fd, sb->st_size) == h->hash);
+        if (ok) {
+            struct bc_header nh = *h;
+            stamp(&nh, sb);
+            pwrite(fd, &nh, sizeof(nh), 0);    // 只读的缓存写不了：下次再算一次
+        }
+    }
+    close(fd);
+    if (!ok) {
+        munmap(image, cb.st_size);
+        return -1;
+    }
+    s->image = image;
+    s->len = cb.st_size;
+    s->mapped = 1;
+    return 0;
+}
+
+void bc_close(struct bc_script *s)
+{
+    if (s->mapped)
+        munmap(s->image, s->len);
+    else
+        free(s->image);
+    free(s->toks);
+    memset(s, 0, sizeof(*s));
+}
+
+void bc_init(struct bc_builder *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void bc_free(struct bc_builder *b)
+{
+    free(b->units);
+    free(b->toks);
+    free(b->nodes);
+    free(b->pool);
+    memset(b, 0, sizeof(*b));
+}
+
+/* 保证数组*p至少有need个元素的位置（容量加倍） */
+static int grow(struct bc_builder *b, void **p, int *cap, int need, size_t size)
+{
+    if (need <= *cap)
+        return 0;
+    int n = *cap ? *cap : 256;
+    while (n < need)
+        n *= 2;
+    void *q = realloc(*p, (size_t)n * size);
+    if (q == NULL) {
+        b->failed = 1;
+        return -1;
+    }
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+/* 把一个字符串加到字符串区，返回它的偏移量 */
+static uint32_t add_str(struct bc_builder *b, const char *p, size_t len)
+{
+    if (b->pool_len + len + 1 > b->pool_cap) {
+        size_t cap = b->pool_cap ? b->pool_cap : 65536;
+        while (cap < b->pool_len + len + 1)
+            cap *= 2;
+        char *q = realloc(b->pool, cap);
+        if (q == NULL) {
+            b->failed = 1;
+            return 0;
+        }
+        b->pool = q;
+        b->pool_cap = cap;
+    }
+    uint32_t off = b->pool_len;
+    memcpy(b->pool + off, p, len);
+    b->pool[off + len] = '\0';
+    b->pool_len += len + 1;
+    return off;
+}
+
+/* 把一个命令列表（和里面的列表）加到节点数组，返回第一个节点的下标 */
+static int32_t add_list(struct bc_builder *b, const struct token *toks, const struct node *list)
+{
+    int32_t first = -1, prev = -1;
+    for (const struct node *nd = list; nd != NULL; nd = nd->next) {
+        if (grow(b, (void **)&b->nodes, &b->nodes_cap, b->n_nodes + 1, sizeof(struct bc_node)) == -1)
+            return -1;
+        int32_t i = b->n_nodes++;
+        struct bc_node r = {
+            .type = nd->type, .join = nd->join,
+            .tok = nd->toks ? nd->toks - toks : -1, .n_toks = nd->n_toks,
+            .text = nd->text ? (int32_t)add_str(b, nd->text, nd->text_len) : -1,
+            .text_len = nd->text_len,
+            .var = nd->var ? (int32_t)add_str(b, nd->var, strlen(nd->var)) : -1,
+            .next = -1,
+            .redir = nd->redirs ? nd->redirs - toks : -1, .n_redirs = nd->n_redirs,
+        };
+        r.cond = add_list(b, toks, nd->cond);   // b->nodes可能换了地方，最后再写
+        r.body = add_list(b, toks, nd->body);
+        r.orelse = add_list(b, toks, nd->orelse);
+        b->nodes[i] = r;
+        if (prev >= 0)
+            b->nodes[prev].next = i;
+        else
+            first = i;
+        prev = i;
+    }
+    return first;
+}
+
+/*
+ * bc_add: 在编译好的脚本后面加一个unit
+ *
+ * 参数说明：
+ *   kind: BC_xxx
+ *   toks, n: 它的token（here-document已经换成了内容）
+ *   list: BC_LIST时编译好的命令树（节点指向toks中的token），NULL表示有语法错误
+ *   text, len: BC_CMD时的这一行（只有后台命令用得到，其它的不保存）
+ */
+void bc_add(struct bc_builder *b, int kind, const struct token *toks, int n,
+            const struct node *list, const char *text, size_t len)
+{
+    if (grow(b, (void **)&b->units, &b->units_cap, b->n_units + 1, sizeof(struct bc_unit)) == -1
+        || grow(b, (void **)&b->toks, &b->toks_cap, b->n_toks + n, sizeof(struct bc_token)) == -1)
+        return;
+    struct bc_unit *u = &b->units[b->n_units++];
+    u->kind = kind;
+    u->tok = b->n_toks;
+    u->n_toks = n;
+    if (text == NULL || n == 0 || toks[n - 1].type != TOK_AMP)
+        len = 0;    // 只有后台命令要记下这一行
+    u->text = len ? add_str(b, text, len) : 0;
+    u->text_len = len;
+    for (int i = 0; i < n; i++) {
+        struct bc_token *t = &b->toks[b->n_toks++];
+        memset(t, 0, sizeof(*t));
+        t->type = toks[i].type;
+        t->quote = toks[i].quote;
+        t->joined = toks[i].joined;
+        t->subst = toks[i].subst;
+        t->procsub = toks[i].procsub;
+        t->text = add_str(b, toks[i].text, toks[i].len);
+        t->len = toks[i].len;
+    }
+    u->node = add_list(b, toks, list);
+}
+
+/*
+ * bc_finish: 把编译好的脚本排成一块image，交给s执行（不经过文件）
+ * 返回值：0；内存不够时返回-1
+ */
+int bc_finish(struct bc_builder *b, struct bc_script *s, const struct stat *sb, int script_fd)
+{
+    memset(s, 0, sizeof(*s));
+    if (b->failed)
+        return -1;
+    struct bc_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BC_MAGIC, 8);
+    h.version = BC_VERSION;
+    h.n_units = b->n_units;
+    h.n_toks = b->n_toks;
+    h.n_nodes = b->n_nodes;
+    h.pool_len = b->pool_len;
+    stamp(&h, sb);
+    h.hash = hash_file(script_fd, sb->st_size);
+
+    size_t sizes[] = {
+        sizeof(h), b->n_units * sizeof(struct bc_unit), b->n_toks * sizeof(struct bc_token),
+        b->n_nodes * sizeof(struct bc_node), b->pool_len,
+    };
+    const void *parts[] = { &h, b->units, b->toks, b->nodes, b->pool };
+    size_t len = 0;
+    for (int i = 0; i < 5; i++)
+        len += sizes[i];
+    char *image = malloc(len), *o = image;
+    if (image == NULL)
+        return -1;
+    for (int i = 0; i < 5; i++) {
+        if (sizes[i] > 0)
+            memcpy(o, parts[i], sizes[i]);
+        o += sizes[i];
+    }
+    s->image = image;
+    s->len = len;
+    return 0;
+}
+
+/*
+ * bc_write: 把image写成缓存文件（先写临时文件，再rename）
+ * 返回值：0；写不了时返回-1（只是这次没有缓存，不算错误）
+ */
+int bc_write(const struct bc_script *s, const char *path)
+{
+    size_t len = strlen(path) + 8;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return -1;
+    }
+    size_t done = 0;
+    while (done < s->len) {
+        ssize_t w = write(fd, s->image + done, s->len - done);
+        if (w <= 0)
+            break;
+        done += w;
+    }
+    int ret = (close(fd) == 0 && done == s->len && rename(tmp, path) == 0) ? 0 : -1;
+    if (ret == -1)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+static const struct bc_header *header(const struct bc_script *s)
+{
+    return (const struct bc_header *)s->image;
+}
+
+int bc_n_units(const struct bc_script *s)
+{
+    return header(s)->n_units;
+}
+
+/* 各部分的开头 */
+static struct bc_unit *units(const struct bc_script *s)
+{
+    return (struct bc_unit *)(s->image + sizeof(struct bc_header));
+}
+
+static struct bc_token *tokens(const struct bc_script *s)
+{
+    return (struct bc_token *)(units(s) + header(s)->n_units);
+}
+
+static struct bc_node *nodes(const struct bc_script *s)
+{
+    return (struct bc_node *)(tokens(s) + header(s)->n_toks);
+}
+
+static char *pool(const struct bc_script *s)
+{
+    return (char *)(nodes(s) + header(s)->n_nodes);
+}
+
+/* 还原一个命令列表；下标不对（文件坏了）时*bad设为1 */
+static struct node *load_list(struct bc_script *s, struct arena *a, const struct token *toks,
+                              int n_toks, int32_t i, int *budget, int *bad)
+{
+    const struct bc_header *h = header(s);
+    struct node *first = NULL, **link = &first;
+    for (; i != -1 && !*bad; i = nodes(s)[i].next) {
+        const struct bc_node *r = &nodes(s)[i];
+        if (i < 0 || (uint32_t)i >= h->n_nodes || --*budget < 0 || r->n_toks < 0
+            || (r->tok != -1 && (r->tok < 0 || r->tok + r->n_toks > n_toks))
+            || r->n_redirs < 0
+            || (r->redir != -1 && (r->redir < 0 || r->redir + r->n_redirs > n_toks))
+            || (r->text != -1 && (uint64_t)r->text + r->text_len >= h->pool_len)
+            || (r->var != -1 && (uint64_t)r->var >= h->pool_len)) {
+            *bad = 1;
+            break;
+        }
+        struct node *nd = arena_alloc(a, sizeof(*nd));
+        nd->type = r->type;
+        nd->join = r->join;
+        nd->toks = (r->tok != -1) ? toks + r->tok : NULL;
+        nd->n_toks = r->n_toks;
+        nd->text = (r->text != -1) ? pool(s) + r->text : NULL;
+        nd->text_len = r->text_len;
+        nd->var = (r->var != -1) ? pool(s) + r->var : NULL;
+        nd->redirs = (r->redir != -1) ? toks + r->redir : NULL;
+        nd->n_redirs = r->n_redirs;
+        nd->cond = load_list(s, a, toks, n_toks, r->cond, budget, bad);
+        nd->body = load_list(s, a, toks, n_toks, r->body, budget, bad);
+        nd->orelse = load_list(s, a, toks, n_toks, r->orelse, budget, bad);
+        nd->next = NULL;
+        *link = nd;
+        link = &nd->next;
+    }
+    return first;
+}
+
+/*
+ * bc_unit: 还原第i个unit
+ *
+ * 参数说明：
+ *   a: 命令树从这里分配（执行完这个unit就可以清空）
+ *   toks, n: 输出，它的token（在s->toks中，下一次调用时覆盖）
+ *   list: 输出，BC_LIST时的命令树（有语法错误时为NULL）
+ *   text, len: 输出，BC_CMD时的这一行
+ *
+ * 返回值：unit的种类BC_xxx；文件坏了时返回-1
+ */
+int bc_unit(struct bc_script *s, int i, struct arena *a, const struct token **toks, int *n,
+            struct node **list, const char **text, size_t *len)
+{
+    const struct bc_header *h = header(s);
+    const struct bc_unit *u = &units(s)[i];
+    if ((uint64_t)u->tok + u->n_toks > h->n_toks
+        || (uint64_t)u->text + u->text_len > h->pool_len)
+        return -1;
+    if ((int)u->n_toks > s->tok_cap) {
+        int cap = s->tok_cap ? s->tok_cap : 256;
+        while (cap < (int)u->n_toks)
+            cap *= 2;
+        struct token *p = realloc(s->toks, cap * sizeof(*p));
+        if (p == NULL)
+            return -1;
+        s->toks = p;
+        s->tok_cap = cap;
+    }
+
+    const struct bc_token *r = &tokens(s)[u->tok];
+    for (uint32_t k = 0; k < u->n_toks; k++, r++) {
+        if ((uint64_t)r->text + r->len >= h->pool_len)
+            return -1;
+        struct token *t = &s->toks[k];
+        t->type = r->type;
+        t->quote = r->quote;
+        t->joined = r->joined;
+        t->subst = r->subst;
+        t->procsub = r->procsub;
+        t->text = pool(s) + r->text;
+        t->len = r->len;
+    }
+    *toks = s->toks;
+    *n = u->n_toks;
+    *text = u->text_len ? pool(s) + u->text : NULL;
+    *len = u->text_len;
+
+    int budget = h->n_nodes, bad = 0;
+    *list = (u->kind == BC_LIST) ? load_list(s, a, s->toks, u->n_toks, u->node, &budget, &bad) : NULL;
+    return bad ? -1 : (int)u->kind;
+}
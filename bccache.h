@@ -0,0 +1,75 @@
+/*
+ * file:        bccache.h
+ * description: compiled script cache (tokens + command trees, mmap'ed)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __BCCACHE_H__
+#define __BCCACHE_H__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "parser.h"
+#include "arena.h"
+#include "control.h"
+
+/* unit kinds. a unit is what the main loop runs in one go:
+*/
+enum {
+    BC_CMD = 0,         /* one line holding a single pipeline (run_command) */
+    BC_LIST,            /* ; && || or control flow, compiled (run_list) */
+    BC_EOF,             /* a control structure still open at end of file */
+};
+
+/* the records, defined in bccache.c
+*/
+struct bc_unit;
+struct bc_token;
+struct bc_node;
+
+/* a compiled script being built. bc_finish() lays the arrays out as
+ * one position-independent image (indices and offsets, no pointers).
+ */
+struct bc_builder {
+    struct bc_unit *units;
+    struct bc_token *toks;
+    struct bc_node *nodes;
+    char *pool;         /* all strings, each NUL-terminated */
+    int n_units, n_toks, n_nodes;
+    int units_cap, toks_cap, nodes_cap;
+    size_t pool_len, pool_cap;
+    int failed;         /* out of memory: the image would be incomplete */
+};
+
+/* a compiled script being run: the image (the mapped cache file, or
+ * malloc'ed memory on a cold run). bc_unit() rebuilds the tokens of one
+ * unit into toks[] and its command tree in an arena.
+ */
+struct bc_script {
+    char *image;
+    size_t len;
+    int mapped;
+    struct token *toks;
+    int tok_cap;
+};
+
+/* function declarations:
+*/
+char *bc_cache_path(const char *dir, const char *script);
+int bc_open(struct bc_script *s, const char *path, const struct stat *sb, int script_fd);
+void bc_close(struct bc_script *s);
+
+void bc_init(struct bc_builder *b);
+void bc_add(struct bc_builder *b, int kind, const struct token *toks, int n,
+            const struct node *list, const char *text, size_t len);
+int bc_finish(struct bc_builder *b, struct bc_script *s, const struct stat *sb, int script_fd);
+int bc_write(const struct bc_script *s, const char *path);
+void bc_free(struct bc_builder *b);
+
+int bc_n_units(const struct bc_script *s);
+int bc_unit(struct bc_script *s, int i, struct arena *a, const struct token **toks, int *n,
+            struct node **list, const char **text, size_t *len);
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Copy throughput: the in-kernel data mover (copy.c) vs. the same copy
+# through /bin/cat, for file -> file, file -> pipe and pipe -> file.
+#
+# Both run inside shell56; "/bin/cat" is not a pure copy stage, so it
+# starts the external program and moves the data through user space.
+#
+# usage: bench/copy.sh [MB]
+#        SHELL56=./shell56-release bench/copy.sh 2000
+#
+
+SHELL56=$(realpath "${SHELL56:-./shell56}")
+MB=${1:-500}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+head -c $((MB * 1000000)) /dev/urandom > "$TMP/in"
+sync
+cat "$TMP/in" > /dev/null     # the first copy should not pay for writeback
+
+echo "=== Copy throughput ($SHELL56, $MB MB) ==="
+printf "%-16s %12s %12s\n" "copy" "cat MB/s" "/bin/cat MB/s"
+
+while IFS=: read -r name cmd; do
+    rates=()
+    for cat in cat /bin/cat; do
+        # three runs, the fastest one counts
+        {
+            echo 'date +%s%N'
+            for i in 1 2 3; do
+                echo "${cmd//CAT/$cat}"
+                echo 'date +%s%N'
+            done
+        } > "$TMP/script"
+        sync
+        rates+=("$(cd "$TMP" && "$SHELL56" script < /dev/null | awk -v mb="$MB" '
+            { t[++k] = $1 }
+            END {
+                for (i = 2; i <= k; i++)
+                    if (best == 0 || t[i] - t[i - 1] < best)
+                        best = t[i] - t[i - 1]
+                printf "%.0f", mb / (best / 1e9)
+            }')")
+        rm -f "$TMP/out"
+    done
+    printf "%-16s %12s %12s\n" "$name" "${rates[0]}" "${rates[1]}"
+done <<'EOF'
+file -> file:CAT < in > out
+file -> pipe:CAT in | wc -c > /dev/null
+pipe -> file:head -c 2000000000 in | CAT > out
+EOF
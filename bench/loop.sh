@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# Loop throughput: a compiled loop (control.c) vs. the same work written
+# out as one line per iteration, the only way to repeat a command before
+# shell56 had loops.
+#
+# The loop body is tokenized and compiled once; the unrolled script reads,
+# tokenizes and builds every line. The bodies are fork-free (assignments
+# and : ), so the numbers are the shell's own per-command overhead.
+#
+# usage: bench/loop.sh [iterations]
+#        SHELL56=./shell56-release bench/loop.sh 1000000
+#
+
+SHELL56=${SHELL56:-./shell56}
+ITERS=${1:-100000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+echo "=== Loop throughput ($SHELL56, $ITERS iterations) ==="
+printf "%-28s %10s %14s\n" "script" "ms" "iterations/s"
+
+run() {
+    local name=$1 script=$2
+    local start end ms
+    start=$(date +%s%N)
+    "$SHELL56" "$script" < /dev/null
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    printf "%-28s %10d %14d\n" "$name" "$ms" $(( ITERS * 1000 / (ms > 0 ? ms : 1) ))
+}
+
+# for loop over $(seq), one assignment per iteration
+echo "for i in \$(seq $ITERS); do x=\$i; done" > "$TMP/for"
+# the same written out
+seq "$ITERS" | sed 's/^/x=/' > "$TMP/unrolled"
+# two commands and a test per iteration
+echo "for i in \$(seq $ITERS); do x=\$i; if test \$x = 0; then :; fi; done" > "$TMP/for-if"
+seq "$ITERS" | sed 's/.*/x=&\nif test $x = 0; then :; fi/' > "$TMP/unrolled-if"
+
+run "for (x=\$i)" "$TMP/for"
+run "unrolled (x=N)" "$TMP/unrolled"
+run "for (x=\$i; if test)" "$TMP/for-if"
+run "unrolled (x=N; if test)" "$TMP/unrolled-if"
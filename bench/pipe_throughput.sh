@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Pipe throughput: MB/s through 2..8 stage pipelines at different pipe
+# capacities (the pipesize prefix, F_SETPIPE_SZ).
+#
+# The first stage is head -c on /dev/zero, every other stage is /bin/cat
+# (plain "cat" would be a pure copy stage and run inside the shell, see
+# copy.c). Each cell is the best of three runs.
+#
+# usage: bench/pipe_throughput.sh [MB]
+#        SHELL56=./shell56-release bench/pipe_throughput.sh 2000
+#
+
+SHELL56=${SHELL56:-./shell56}
+MB=${1:-1000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+SIZES="64K 256K 1M"
+max=$(cat /proc/sys/fs/pipe-max-size 2> /dev/null)
+
+echo "=== Pipe throughput ($SHELL56, $MB MB, pipe-max-size ${max:-unknown}) ==="
+printf "%-8s" "stages"
+for size in $SIZES; do
+    printf " %10s" "$size MB/s"
+done
+printf "\n"
+
+for stages in 2 3 4 5 6 7 8; do
+    line="head -c $((MB * 1000000)) /dev/zero"
+    for ((i = 2; i <= stages; i++)); do
+        line="$line | /bin/cat"
+    done
+    line="$line > /dev/null"
+
+    printf "%-8s" "$stages"
+    for size in $SIZES; do
+        {
+            echo 'date +%s%N'
+            for i in 1 2 3; do
+                echo "pipesize $size $line"
+                echo 'date +%s%N'
+            done
+        } > "$TMP/script"
+        "$SHELL56" "$TMP/script" < /dev/null | awk -v mb="$MB" '
+            { t[++k] = $1 }
+            END {
+                for (i = 2; i <= k; i++)
+                    if (best == 0 || t[i] - t[i - 1] < best)
+                        best = t[i] - t[i - 1]
+                printf " %10.0f", mb / (best / 1e9)
+            }'
+    done
+    printf "\n"
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Pipeline spawn benchmark: time to start and reap an N-stage pipeline of
+# `true` commands, for N = 2 .. 64.
+#
+# usage: bench/pipeline_spawn.sh [iterations]
+#        SHELL56=./shell56-release bench/pipeline_spawn.sh
+#
+
+SHELL56=${SHELL56:-./shell56}
+ITERS=${1:-200}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+echo "=== Pipeline spawn benchmark ($SHELL56, $ITERS pipelines per row) ==="
+printf "%8s %12s %14s %14s\n" "stages" "total ms" "us/pipeline" "us/stage"
+
+for n in 2 4 8 16 32 64; do
+    # build "true|true|...|true" with n stages, repeated ITERS times
+    line="true"
+    for ((i = 1; i < n; i++)); do
+        line="$line|true"
+    done
+    : > "$SCRIPT"
+    for ((i = 0; i < ITERS; i++)); do
+        echo "$line" >> "$SCRIPT"
+    done
+
+    start=$(date +%s%N)
+    "$SHELL56" "$SCRIPT"
+    end=$(date +%s%N)
+
+    awk -v n="$n" -v ns="$((end - start))" -v it="$ITERS" 'BEGIN {
+        printf "%8d %12.1f %14.1f %14.1f\n", n, ns / 1e6, ns / 1e3 / it, ns / 1e3 / it / n
+    }'
+done
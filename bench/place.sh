@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Placement: MB/s through 4-stage pipelines with the place prefix off,
+# llc (adjacent stages on cores sharing a last-level cache) and node
+# (llc, plus memory preferred on that NUMA node), with 1..J copies of
+# the pipeline running at the same time (each copy starts in the next
+# LLC group, see place.c). The MB/s column is the total of all copies.
+#
+# The stages are head -c on /dev/zero and /bin/cat (plain "cat" would
+# run inside the shell, see copy.c). Each cell is the best of three runs.
+# The LLC groups the shell found are listed first: with a single group
+# (one socket, or a VM without cache topology) all three columns should
+# be the same.
+#
+# usage: bench/place.sh [MB] [max copies]
+#        SHELL56=./shell56-release bench/place.sh 2000 8
+#
+
+SHELL56=${SHELL56:-./shell56}
+MB=${1:-1000}
+JOBS=${2:-$(nproc)}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+line="head -c $((MB * 1000000)) /dev/zero | /bin/cat | /bin/cat | /bin/cat > /dev/null"
+
+echo "=== Pipeline placement ($SHELL56, $MB MB per pipeline, $(nproc) CPUs) ==="
+# the LLC groups as the kernel reports them (place.c only uses the allowed CPUs)
+groups=$(for f in /sys/devices/system/cpu/cpu*/cache/index3/shared_cpu_list; do cat "$f"; done 2> /dev/null | sort -u | tr '\n' ' ')
+echo "LLC groups: ${groups:-unknown}"
+printf "%-8s" "copies"
+for mode in off llc node; do
+    printf " %10s" "$mode MB/s"
+done
+printf "\n"
+
+for ((j = 1; j <= JOBS; j *= 2)); do
+    printf "%-8s" "$j"
+    for mode in off llc node; do
+        {
+            echo 'date +%s%N'
+            for i in 1 2 3; do
+                for ((k = 0; k < j; k++)); do
+                    echo "place $mode $line &"
+                done
+                echo "wait"
+                echo 'date +%s%N'
+            done
+        } > "$TMP/script"
+        "$SHELL56" "$TMP/script" < /dev/null | awk -v mb="$((MB * j))" '
+            { t[++k] = $1 }
+            END {
+                for (i = 2; i <= k; i++)
+                    if (best == 0 || t[i] - t[i - 1] < best)
+                        best = t[i] - t[i - 1]
+                printf " %10.0f", mb / (best / 1e9)
+            }'
+    done
+    printf "\n"
+done
+
+# one placed pipeline, with the report
+printf 'set -o placestat\nplace llc %s\n' "$line" > "$TMP/script"
+"$SHELL56" "$TMP/script" < /dev/null
@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# sh -c latency: full startup-to-exit time of one "shell -c 'cmd'", the
+# way make, system() and xargs run commands. Each case is run N times in
+# a row from this script; the time of running /bin/true directly the same
+# way is listed first, the difference is what the shell adds.
+#
+#   -c true        the builtin: no child at all
+#   -c /bin/true   a single simple command: exec'ed in place, no fork
+#   -c 'a; b'      a list: the shell forks for the first command
+#
+# usage: bench/sh_c.sh [runs]
+#        SHELL56=./shell56-release bench/sh_c.sh 2000
+#
+
+SHELL56=${SHELL56:-./shell56}
+RUNS=${1:-1000}
+
+# best of three, in microseconds per run
+per_run() {
+    local b=0 start end t i
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        for ((i = 0; i < RUNS; i++)); do
+            "$@"
+        done
+        end=$(date +%s%N)
+        t=$(( (end - start) / RUNS ))
+        if [ $b -eq 0 ] || [ $t -lt $b ]; then b=$t; fi
+    done
+    printf "%d.%01d" $((b / 1000)) $((b % 1000 / 100))
+}
+
+echo "=== sh -c startup to exit ($SHELL56 vs /bin/sh -> $(readlink -f /bin/sh), $RUNS runs) ==="
+printf "%-36s %12s\n" "command" "us/run"
+printf "%-36s %12s\n" "/bin/true (no shell)" "$(per_run /bin/true)"
+printf "%-36s %12s\n" "/bin/sh -c true" "$(per_run /bin/sh -c true)"
+printf "%-36s %12s\n" "shell56 -c true" "$(per_run "$SHELL56" -c true)"
+printf "%-36s %12s\n" "/bin/sh -c /bin/true" "$(per_run /bin/sh -c /bin/true)"
+printf "%-36s %12s\n" "shell56 -c /bin/true" "$(per_run "$SHELL56" -c /bin/true)"
+printf "%-36s %12s\n" "/bin/sh -c '/bin/true; /bin/true'" "$(per_run /bin/sh -c '/bin/true; /bin/true')"
+printf "%-36s %12s\n" "shell56 -c '/bin/true; /bin/true'" "$(per_run "$SHELL56" -c '/bin/true; /bin/true')"
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Script startup: a large generated script run without the cache, with an
+# empty cache (cold: compile + write the cache file) and with a valid
+# cache (warm: mmap the cache file, nothing tokenized or compiled).
+#
+# The script is fork-free (assignments, : and if/test/for on builtins),
+# so the times are almost all reading, tokenizing and compiling.
+#
+# usage: bench/startup.sh [lines]
+#        SHELL56=./shell56-release bench/startup.sh 100000
+#
+
+SHELL56=${SHELL56:-./shell56}
+LINES=${1:-20000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# four kinds of lines, repeated
+for ((i = 0; i < LINES; i += 4)); do
+    echo "VERSION_$i=\"release-$i\" STEP=$i"
+    echo ": configure --prefix=/opt/app/$i --with-feature=\$VERSION_$i 'quoted arg'"
+    echo "if test \"\$VERSION_$i\" = skip; then : skipped; else : step $i; fi"
+    echo "for host in web1 web2 db1; do : \$host $i; done"
+done > "$TMP/deploy.sh"
+
+# best of five, in ms
+best() {
+    local b=0 start end t
+    for run in 1 2 3 4 5; do
+        [ -n "$1" ] && rm -rf "$TMP/cache"
+        start=$(date +%s%N)
+        SHELL56_CACHE=$2 "$SHELL56" "$TMP/deploy.sh" < /dev/null
+        end=$(date +%s%N)
+        t=$(( (end - start) / 1000 ))
+        if [ $b -eq 0 ] || [ $t -lt $b ]; then b=$t; fi
+    done
+    printf "%d.%03d" $((b / 1000)) $((b % 1000))
+}
+
+echo "=== Script startup ($SHELL56, $LINES lines, $(stat -c %s "$TMP/deploy.sh") bytes) ==="
+printf "%-28s %10s\n" "run" "ms"
+printf "%-28s %10s\n" "no cache" "$(best "" "")"
+printf "%-28s %10s\n" "cold (compile + write)" "$(best clear "$TMP/cache")"
+printf "%-28s %10s\n" "warm (mmap cache)" "$(best "" "$TMP/cache")"
+echo "cache file: $(stat -c %s "$TMP"/cache/*.bc) bytes"
@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Build-variant benchmark: spawn latency and parser throughput of several
+# shell56 binaries (debug, ASan, release, PGO, ...), side by side.
+#
+#   spawn us/cmd     one "true" per line: start + reap of one command
+#   pipe us/stage    8-stage "true|...|true" pipelines, per stage
+#   parse MB/s       long command lines that end with a dangling "|": each
+#   parse ns/line    line is read, tokenized and built into a syntax tree,
+#                    then rejected as a syntax error, so nothing is spawned
+#
+# usage: bench/variants.sh [binary...]     (default: every variant that exists)
+#        make bench
+#
+
+ITERS=${ITERS:-500}
+PARSE_LINES=${PARSE_LINES:-200000}
+
+if [ $# -eq 0 ]; then
+    for b in ./shell56-debug ./shell56 ./shell56-release ./shell56-pgo; do
+        [ -x "$b" ] && set -- "$@" "$b"
+    done
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# the same three scripts for every binary
+yes true | head -n "$ITERS" > "$TMP/spawn"
+yes 'true|true|true|true|true|true|true|true' | head -n "$ITERS" > "$TMP/pipe"
+yes "grep -v -e 'first pattern' -e \"second pattern\" < input.txt | sort -k2,2 -t: | uniq -c | awk '{ print \$2, \$1 }' > out.txt |" \
+    | head -n "$PARSE_LINES" > "$TMP/parse"
+PARSE_BYTES=$(wc -c < "$TMP/parse")
+
+# run a script, print the elapsed time in ns
+run() {
+    local start end
+    start=$(date +%s%N)
+    "$1" "$2" < /dev/null > /dev/null 2>&1
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+echo "=== Build variant benchmark ($ITERS commands/pipelines, $PARSE_LINES parse lines) ==="
+printf "%-20s %14s %14s %12s %14s\n" "binary" "spawn us/cmd" "pipe us/stage" "parse MB/s" "parse ns/line"
+
+for b in "$@"; do
+    spawn=$(run "$b" "$TMP/spawn")
+    pipe=$(run "$b" "$TMP/pipe")
+    parse=$(run "$b" "$TMP/parse")
+    awk -v b="$b" -v s="$spawn" -v p="$pipe" -v x="$parse" -v it="$ITERS" \
+        -v lines="$PARSE_LINES" -v bytes="$PARSE_BYTES" 'BEGIN {
+        printf "%-20s %14.1f %14.1f %12.1f %14.1f\n", b, s / 1e3 / it,
+               p / 1e3 / it / 8, bytes / (x / 1e9) / 1e6, x / lines
+    }'
+done
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Spawn rate vs. shell size: commands/sec with posix_spawn (default) and
+# with the fork server (-z), as the shell's RSS grows from ~10 MB to ~1 GB.
+#
+# The shell is grown by a ballast line: one very long command line that
+# ends with a dangling "|". It is tokenized and built into a syntax tree
+# (the tokenizer and arena keep that memory for later lines) and then
+# rejected as a syntax error. The RSS column is measured, not assumed.
+#
+# usage: bench/zygote_rss.sh [commands per row]
+#        SHELL56=./shell56-release bench/zygote_rss.sh
+#
+
+SHELL56=${SHELL56:-./shell56}
+CMDS=${1:-500}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+yes true | head -n "$CMDS" > "$TMP/cmds"
+
+echo "=== Spawn rate vs. shell RSS ($SHELL56, $CMDS commands per row) ==="
+printf "%-8s %10s %12s %12s\n" "mode" "target MB" "shell RSS MB" "cmds/sec"
+
+for mb in 10 100 1000; do
+    # about 5.5 bytes of shell memory per byte of ballast line
+    head -c $((mb * 1000000 * 2 / 11)) /dev/zero | tr '\0' 'x' | fold -w 7 | tr '\n' ' ' \
+        > "$TMP/ballast"
+    {
+        cat "$TMP/ballast"
+        echo '|'
+        echo "sh -c 'grep VmRSS /proc/\$PPID/status'"
+        echo 'date +%s%N'
+        cat "$TMP/cmds"
+        echo 'date +%s%N'
+    } > "$TMP/script"
+
+    for mode in spawn zygote; do
+        flag=
+        [ "$mode" = zygote ] && flag=-z
+        "$SHELL56" $flag "$TMP/script" < /dev/null 2> /dev/null | awk -v mode="$mode" \
+            -v mb="$mb" -v n="$CMDS" '
+            /VmRSS/ { rss = $2 / 1024; next }
+            /^[0-9]+$/ { t[++k] = $1 }
+            END {
+                printf "%-8s %10d %12.0f %12.0f\n", mode, mb, rss, n / ((t[2] - t[1]) / 1e9)
+            }'
+    done
+done
@@ -0,0 +1,623 @@
+/*
+ * file:        builtins.c
+ * description: builtin command registry, dispatch and fork-free utilities
+ *
+ * 原来 is_builtin_command 是一串strcmp，只认识几个命令；echo、true、
+ * false、test/[ 这些在脚本的控制逻辑里到处都是的命令，每一次都要启动
+ * 一个外部程序。
+ *
+ * 现在所有内置命令都登记在 builtins.def 里（命令名、函数、标志）：
+ *   - builtins.h 用它生成函数声明，这里用它生成命令表
+ *   - mkbuiltins 在编译时为命令名生成一个完美哈希（builtins_hash.h），
+ *     查找只需要一次哈希和一次strcmp
+ *
+ * 执行方式（见shell56.c的execute_command和launch_pipeline）：
+ *   - 单独的命令：总是在shell进程内执行，重定向时临时dup2标准输入/输出
+ *     （builtin_run），所以 "cd /tmp > log" 也能改变shell的目录
+ *   - 管道中的一个命令：带BI_NOFORK的（echo、test等，不改变shell的
+ *     状态、不读标准输入）在shell进程内执行，其它的（cd、exit、parallel等）
+ *     在fork出的子进程中执行（builtin_fork），和sh的子shell语义一样
+ *   - 后台命令（&）：总是在子进程中执行
+ */
+
+#define _GNU_SOURCE	/* close_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "builtins.h"
+#include "zygote.h"
+
+static const struct builtin builtin_table[] = {
+#define BUILTIN(name, fn, flags) { name, fn, flags },
+#include "builtins.def"
+#undef BUILTIN
+};
+
+#include "builtins_hash.h"
+
+/*
+ * builtin_lookup: 按命令名查找内置命令
+ *
+ * 返回值：命令表中的项；不是内置命令时返回NULL
+ */
+const struct builtin *builtin_lookup(const char *name)
+{
+    int i = builtin_slot[builtin_name_hash(name, BUILTIN_HASH_SEED) & BUILTIN_HASH_MASK];
+    if (i < 0 || strcmp(builtin_table[i].name, name) != 0)
+        return NULL;
+    return &builtin_table[i];
+}
+
+/* 把fd临时移到to（0或1），原来的to保存在*saved中（原来没有打开时为-1） */
+static void redirect_fd(int fd, int to, int *saved)
+{
+    *saved = fcntl(to, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, to);
+}
+
+static void restore_fd(int to, int saved)
+{
+    if (saved == -1) {
+        close(to);
+    } else {
+        dup2(saved, to);
+        close(saved);
+    }
+}
+
+/*
+ * builtin_run: 在shell进程内执行一个内置命令
+ *
+ * 参数说明：
+ *   b: 内置命令
+ *   argv, argc: 命令的参数
+ *   in_fd, out_fd: 标准输入/输出，-1表示不变（属于调用者，这里不关闭）
+ *
+ * 返回值：命令的退出状态码
+ *
+ * 执行期间忽略SIGPIPE：读的一端已经关闭时（例如 "echo hi | true"），
+ * 写入失败，但不能让shell自己被SIGPIPE杀死
+ */
+int builtin_run(const struct builtin *b, char **argv, int argc, int in_fd, int out_fd)
+{
+    int saved_in = -1, saved_out = -1;
+
+    fflush(stdout);
+    if (in_fd >= 0 && in_fd != STDIN_FILENO)
+        redirect_fd(in_fd, STDIN_FILENO, &saved_in);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+        redirect_fd(out_fd, STDOUT_FILENO, &saved_out);
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    int status = b->fn(argv, argc);
+
+    fflush(stdout);
+    clearerr(stdout);
+    signal(SIGPIPE, old_pipe);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+        restore_fd(STDOUT_FILENO, saved_out);
+    if (in_fd >= 0 && in_fd != STDIN_FILENO)
+        restore_fd(STDIN_FILENO, saved_in);
+    return status;
+}
+
+/*
+ * builtin_fork: 在fork出的子进程中执行一个内置命令，不等待
+ *
+ * 参数说明：和builtin_run一样；pgid和struct spawn中的一样（见spawn.h）
+ *
+ * 返回值：子进程的pid；失败时返回-1（已经打印错误信息）
+ *
+ * 子进程只保留0/1/2：shell持有的其它fd（别的管道、脚本文件）都关闭，
+ * 否则管道的写端留在子进程里，读的一方永远等不到EOF。
+ * 子进程里再启动命令（例如parallel）时不用zygote：socket是和父进程共用的
+ */
+pid_t builtin_fork(const struct builtin *b, char **argv, int argc,
+                   int in_fd, int out_fd, pid_t pgid)
+{
+    fflush(NULL);   // 否则缓冲区里的内容会被父子进程各输出一次
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0) {
+        // 父子进程都设置一次进程组，不管谁先运行，返回时组都已经存在
+        if (pgid != 0)
+            setpgid(pid, pgid == -1 ? pid : pgid);
+        return pid;
+    }
+
+    if (pgid != 0)
+        setpgid(0, pgid == -1 ? 0 : pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    if (in_fd >= 0)
+        dup2(in_fd, STDIN_FILENO);
+    if (out_fd >= 0)
+        dup2(out_fd, STDOUT_FILENO);
+    zygote_close();
+#ifdef __linux__
+    close_range(3, ~0U, 0);
+#else
+    for (int fd = 3; fd < 1024; fd++)
+        close(fd);
+#endif
+
+    int status = b->fn(argv, argc);
+    fflush(stdout);
+    _exit(status);
+}
+
+/* : 和 true：什么都不做，成功 */
+int builtin_true(char **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    return 0;
+}
+
+/* false：什么都不做，失败 */
+int builtin_false(char **argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    return 1;
+}
+
+/*
+ * 解释一个反斜杠转义（s指向反斜杠后面的字符），结果放在*c中
+ *
+ * 返回值：转义序列后面的位置；\c 返回NULL（停止输出）
+ *
+ * octal_zero: 1表示八进制写成 \0nnn（echo -e、printf %b），
+ *             0表示写成 \nnn（printf的格式字符串）
+ */
+static const char *unescape(const char *s, int *c, int octal_zero)
+{
+    int n, digits;
+
+    switch (*s) {
+    case 'a': *c = '\a'; return s + 1;
+    case 'b': *c = '\b'; return s + 1;
+    case 'e': *c = 033; return s + 1;
+    case 'f': *c = '\f'; return s + 1;
+    case 'n': *c = '\n'; return s + 1;
+    case 'r': *c = '\r'; return s + 1;
+    case 't': *c = '\t'; return s + 1;
+    case 'v': *c = '\v'; return s + 1;
+    case '\\': *c = '\\'; return s + 1;
+    case 'c': return NULL;
+    case 'x':
+        if (!isxdigit((unsigned char)s[1]))
+            break;
+        n = 0;
+        for (digits = 0, s++; digits < 2 && isxdigit((unsigned char)*s); digits++, s++)
+            n = n * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+        *c = n;
+        return s;
+    default:
+        if (*s < '0' || *s > '7' || (octal_zero && *s != '0'))
+            break;
+        if (octal_zero)
+            s++;
+        n = 0;
+        for (digits = 0; digits < 3 && *s >= '0' && *s <= '7'; digits++, s++)
+            n = n * 8 + (*s - '0');
+        *c = n & 0xff;
+        return s;
+    }
+    // 不认识的转义：原样输出反斜杠（后面的字符照常输出）
+    *c = '\\';
+    return s;
+}
+
+/* 输出字符串，解释其中的转义；遇到 \c 返回-1 */
+static int put_escaped(const char *s, int octal_zero)
+{
+    while (*s) {
+        if (*s != '\\' || s[1] == '\0') {
+            putchar(*s++);
+            continue;
+        }
+        int c;
+        s = unescape(s + 1, &c, octal_zero);
+        if (s == NULL)
+            return -1;
+        putchar(c);
+    }
+    return 0;
+}
+
+/*
+ * echo [-neE] [参数...]
+ *
+ *   -n: 最后不输出换行
+ *   -e: 解释转义（\n \t \\ \0nnn \xHH，\c 停止输出）
+ *   -E: 不解释转义（默认）
+ *
+ * 和bash一样，只有完全由n、e、E组成的 "-xxx" 才算选项
+ */
+int builtin_echo(char **argv, int argc)
+{
+    int newline = 1, escapes = 0, i = 1;
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break;
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'n')
+                newline = 0;
+            else
+                escapes = (*o == 'e');
+        }
+    }
+
+    for (int first = i; i < argc; i++) {
+        if (i > first)
+            putchar(' ');
+        if (!escapes)
+            fputs(argv[i], stdout);
+        else if (put_escaped(argv[i], 1) == -1)
+            return 0;
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/*
+ * printf的数值参数：十进制、0x十六进制、0八进制，或者 'c（字符的编码）
+ * 不是合法的数时打印错误，*bad置1，按已经解析的部分计算
+ */
+static long long printf_number(const char *s, int *bad)
+{
+    if (s == NULL)
+        return 0;
+    if (s[0] == '\'' || s[0] == '"')
+        return (unsigned char)s[1];
+
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", s);
+        *bad = 1;
+    }
+    return v;
+}
+
+/*
+ * printf 格式 [参数...]
+ *
+ * 格式字符串中的转义（\n \t \nnn ...）和转换说明：
+ *   %s %b（参数中的转义也解释） %c %d %i %u %o %x %X %f %e %g %E %G %%
+ * 可以带标志（-+ #0）、宽度和精度，宽度和精度可以是 *（从参数中取）。
+ * 参数比转换说明多时，重复使用格式字符串；参数不够时当作空字符串或0。
+ *
+ * 返回值：0；有参数不是合法的数时为1；格式错误时为2
+ */
+int builtin_printf(char **argv, int argc)
+{
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *fmt = argv[1];
+    char **args = argv + 2;
+    int n_args = argc - 2, next = 0, bad = 0;
+
+    do {
+        int used_before = next;
+        for (const char *p = fmt; *p; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                int c;
+                const char *q = unescape(p + 1, &c, 0);
+                if (q == NULL)
+                    return bad;
+                putchar(c);
+                p = q - 1;
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            /*
+             * 一个转换说明：把标志、宽度、精度重新拼成一个格式（* 换成
+             * 参数的值），再按类型交给标准库的printf
+             */
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = '%';
+            for (p++; *p && strchr("-+ #0", *p) && n < 8; p++)
+                spec[n++] = *p;
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*p != '.')
+                        break;
+                    spec[n++] = *p++;
+                }
+                if (*p == '*') {
+                    int w = (int)printf_number(next < n_args ? args[next++] : NULL, &bad);
+                    n += snprintf(spec + n, sizeof(spec) - n, "%d", w);
+                    p++;
+                } else {
+                    while (isdigit((unsigned char)*p) && n < 40)
+                        spec[n++] = *p++;
+                }
+            }
+
+            const char *arg = next < n_args ? args[next++] : NULL;
+            switch (*p) {
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                printf(spec, arg ? arg : "");
+                break;
+            case 'b':
+                // 宽度和精度对 %b 不起作用
+                if (arg != NULL && put_escaped(arg, 1) == -1)
+                    return bad;
+                break;
+            case 'c':
+                if (arg != NULL && arg[0] != '\0')
+                    putchar(arg[0]);
+                break;
+            case 'd': case 'i':
+                strcpy(spec + n, "lld");
+                printf(spec, printf_number(arg, &bad));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = *p;
+                spec[n] = '\0';
+                printf(spec, (unsigned long long)printf_number(arg, &bad));
+                break;
+            case 'f': case 'e': case 'g': case 'E': case 'G':
+                spec[n++] = *p;
+                spec[n] = '\0';
+                printf(spec, arg ? strtod(arg, NULL) : 0.0);
+                break;
+            default:
+                fprintf(stderr, "printf: `%c': invalid format character\n", *p ? *p : '%');
+                return 2;
+            }
+        }
+        // 一个参数都没有用到时不重复，否则会死循环
+        if (next == used_before)
+            break;
+    } while (next < n_args);
+
+    return bad;
+}
+
+/*
+ * test / [ 的表达式求值（递归下降）：
+ *
+ *   or      := and { -o and }
+ *   and     := not { -a not }
+ *   not     := ! not | primary
+ *   primary := ( or ) | 字符串 二元运算符 字符串 | 一元运算符 字符串 | 字符串
+ *
+ * 和POSIX的规则一致的地方：先看是不是二元表达式（所以 "test ! = x"、
+ * "test -n = -n" 是字符串比较）；一元运算符后面没有参数时当作普通字符串
+ * （所以 "test -n" 为真）
+ */
+struct test_state {
+    char **argv;
+    int argc;
+    int pos;
+    const char *name;   /* "test" 或 "["，用于错误信息 */
+    int err;
+};
+
+static int test_or(struct test_state *t);
+
+static int is_binop(const char *s)
+{
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                 "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++)
+        if (strcmp(s, ops[i]) == 0)
+            return 1;
+    return 0;
+}
+
+static int is_unop(const char *s)
+{
+    return s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr("bcdefghLnprsStwxz", s[1]);
+}
+
+static long long test_int(struct test_state *t, const char *s)
+{
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        if (!t->err)
+            fprintf(stderr, "%s: %s: integer expression expected\n", t->name, s);
+        t->err = 1;
+    }
+    return v;
+}
+
+static int test_unary(struct test_state *t, char op, const char *arg)
+{
+    struct stat st;
+
+    switch (op) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': return isatty((int)test_int(t, arg));
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0)
+        return 0;
+    switch (op) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+    return 0;
+}
+
+/* -nt / -ot：按修改时间比较，不存在的文件比任何文件都旧 */
+static int test_newer(const char *a, const char *b)
+{
+    struct stat sa, sb;
+    if (stat(a, &sa) != 0)
+        return 0;
+    if (stat(b, &sb) != 0)
+        return 1;
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+        return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec;
+    return sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+}
+
+static int test_binary(struct test_state *t, const char *a, const char *op, const char *b)
+{
+    struct stat sa, sb;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+    if (strcmp(op, "-nt") == 0) return test_newer(a, b);
+    if (strcmp(op, "-ot") == 0) return test_newer(b, a);
+    if (strcmp(op, "-ef") == 0)
+        return stat(a, &sa) == 0 && stat(b, &sb) == 0 &&
+               sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+
+    long long x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;  /* -ge */
+}
+
+static int test_primary(struct test_state *t)
+{
+    char **v = t->argv;
+    int left = t->argc - t->pos;
+
+    if (left <= 0) {
+        if (!t->err)
+            fprintf(stderr, "%s: argument expected\n", t->name);
+        t->err = 1;
+        return 0;
+    }
+    if (left >= 3 && is_binop(v[t->pos + 1])) {
+        t->pos += 3;
+        return test_binary(t, v[t->pos - 3], v[t->pos - 2], v[t->pos - 1]);
+    }
+    if (strcmp(v[t->pos], "(") == 0 && left >= 2) {
+        t->pos++;
+        int r = test_or(t);
+        if (t->pos >= t->argc || strcmp(v[t->pos], ")") != 0) {
+            if (!t->err)
+                fprintf(stderr, "%s: `)' expected\n", t->name);
+            t->err = 1;
+            return 0;
+        }
+        t->pos++;
+        return r;
+    }
+    if (left >= 2 && is_unop(v[t->pos])) {
+        t->pos += 2;
+        return test_unary(t, v[t->pos - 2][1], v[t->pos - 1]);
+    }
+    return v[t->pos++][0] != '\0';
+}
+
+static int test_not(struct test_state *t)
+{
+    int left = t->argc - t->pos;
+    if (left >= 2 && strcmp(t->argv[t->pos], "!") == 0 &&
+        !(left >= 3 && is_binop(t->argv[t->pos + 1]))) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct test_state *t)
+{
+    int r = test_not(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        int r2 = test_not(t);
+        r = r && r2;
+    }
+    return r;
+}
+
+static int test_or(struct test_state *t)
+{
+    int r = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        int r2 = test_and(t);
+        r = r || r2;
+    }
+    return r;
+}
+
+/*
+ * test 表达式 / [ 表达式 ]
+ *
+ * 返回值：0表示真，1表示假，2表示表达式有错误
+ */
+int builtin_test(char **argv, int argc)
+{
+    struct test_state t = { .argv = argv + 1, .argc = argc - 1, .pos = 0,
+                            .name = argv[0], .err = 0 };
+
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        t.argc--;
+    }
+    if (t.argc == 0)
+        return 1;
+
+    int r = test_or(&t);
+    if (!t.err && t.pos < t.argc) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", t.name, t.argv[t.pos]);
+        t.err = 1;
+    }
+    if (t.err)
+        return 2;
+    return r ? 0 : 1;
+}
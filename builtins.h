@@ -0,0 +1,45 @@
+/*
+ * file:        builtins.h
+ * description: builtin command registry and perfect-hash dispatch
+ */
+
+/* standard include file protection:
+*/
+#ifndef __BUILTINS_H__
+#define __BUILTINS_H__
+
+#include <sys/types.h>
+
+/* builtin flags (see builtins.def):
+*/
+#define BI_NOFORK 1         /* may run in-process as a pipeline stage */
+
+struct builtin {
+    const char *name;
+    int (*fn)(char **argv, int argc);   /* returns the exit status */
+    int flags;
+};
+
+/* seeded FNV-1a over the name; mkbuiltins picks the seed that makes it
+ * collision-free for the names in builtins.def
+ */
+static inline unsigned builtin_name_hash(const char *s, unsigned seed)
+{
+    unsigned h = 2166136261u ^ seed;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h ^ (h >> 16);
+}
+
+/* function declarations:
+*/
+#define BUILTIN(name, fn, flags) int fn(char **argv, int argc);
+#include "builtins.def"
+#undef BUILTIN
+
+const struct builtin *builtin_lookup(const char *name);
+int builtin_run(const struct builtin *b, char **argv, int argc, int in_fd, int out_fd);
+pid_t builtin_fork(const struct builtin *b, char **argv, int argc,
+                   int in_fd, int out_fd, pid_t pgid);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * file:        control.c
+ * description: command lists and control flow (; && || if while until for)
+ *
+ * 原来shell56只能一行执行一个命令（管道），没有任何控制结构。要重复
+ * 做一件事只能生成一个把循环展开的大脚本，每一行都要重新读取、
+ * 重新tokenize、重新建树。
+ *
+ * 这里把一行（或者几行）的token编译成一棵命令树：
+ *
+ *   for f in *.log; do grep -q ERROR $f && echo $f; done
+ *
+ *   FOR(var f, words [*.log])
+ *    +-- body: CMD [grep -q ERROR $f] -> CMD(&&) [echo $f]
+ *
+ * 每个NODE_CMD只是token数组中的一段（不复制），执行时才交给build_ast
+ * 展开变量、建成语法树（见run_list），所以循环体只编译一次，之后每次
+ * 执行都不再tokenize，也不再解析控制结构，变量照样是每次的值。
+ *
+ * 语法（和sh一样，关键字只在命令开头、没有引号时才是关键字）：
+ *   list:     command [; | && | || | & | 换行] command ...
+ *   if:       if list; then list; [elif list; then list;]... [else list;] fi
+ *   while:    while list; do list; done    （until：条件不成立时执行）
+ *   for:      for NAME [in word...]; do list; done
+ * && 和 || 的优先级相同，从左往右：前面的状态码是0（&&）/不是0（||）
+ * 时才执行。换行由调用者变成 ";"（见run_script）。
+ * 控制结构后面可以有重定向，对整个结构有效（"done < file"、"fi > log"，
+ * 见run_node），但不能再接管道。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "control.h"
+
+/* 编译的状态：toks[pos]是下一个token */
+struct compiler {
+    struct arena *a;
+    const struct token *toks;
+    int n, pos;
+    int error;          /* 已经报告过语法错误 */
+    int report;         /* 打印错误信息 */
+};
+
+/* 这个token是不是关键字kw（没有引号的单词） */
+static int is_kw(const struct token *t, const char *kw)
+{
+    return t->type == TOK_WORD && t->quote == 0 && !t->procsub && strcmp(t->text, kw) == 0;
+}
+
+/* 开始一个控制结构的关键字 */
+static int opens(const struct token *t)
+{
+    return is_kw(t, "if") || is_kw(t, "while") || is_kw(t, "until") || is_kw(t, "for");
+}
+
+/* 结束一个列表的关键字（列表后面跟着它们） */
+static int closes(const struct token *t)
+{
+    return is_kw(t, "then") || is_kw(t, "else") || is_kw(t, "elif") || is_kw(t, "fi")
+        || is_kw(t, "do") || is_kw(t, "done");
+}
+
+/* 重定向的操作符：后面跟着文件名（<< 和 <<< 时是内容） */
+static int redirects(int type)
+{
+    return type == TOK_IN || type == TOK_OUT || type == TOK_HEREDOC || type == TOK_HERESTR;
+}
+
+/* 分隔命令的token：它后面是一个新命令的开头 */
+static int separates(int type)
+{
+    return type == TOK_SEMI || type == TOK_AND || type == TOK_OR || type == TOK_AMP
+        || type == TOK_PIPE || type == TOK_FANOUT;
+}
+
+/*
+ * is_control: 这一行要不要经过compile（有 ; && ||、不在最后的 &，
+ * 或者以关键字开头）。其它的行照常直接build_ast
+ */
+int is_control(const struct tokenizer *t)
+{
+    if (t->n_tokens == 0)
+        return 0;
+    int amp_last = (t->tokens[t->n_tokens - 1].type == TOK_AMP);
+    return t->n_seps > amp_last || opens(&t->tokens[0]) || closes(&t->tokens[0]);
+}
+
+/*
+ * control_complete: 控制结构是不是都结束了
+ *
+ * 返回值：1表示完整；0表示还有没结束的 if/while/until/for，
+ *         调用者要再读一行接在后面（交互模式下提示 "> "）
+ */
+int control_complete(const struct token *toks, int n)
+{
+    int depth = 0, start = 1;
+    for (int i = 0; i < n; i++) {
+        const struct token *t = &toks[i];
+        int at_start = start;
+        start = separates(t->type);
+        if (!at_start || t->type != TOK_WORD)
+            continue;
+        if (opens(t))
+            depth++;
+        else if (is_kw(t, "fi") || is_kw(t, "done"))
+            depth--;
+        // 这些关键字后面紧跟着一个命令
+        if ((opens(t) && !is_kw(t, "for")) || (closes(t) && !is_kw(t, "fi") && !is_kw(t, "done")))
+            start = 1;
+    }
+    return depth <= 0;
+}
+
+static void syntax_error(struct compiler *c)
+{
+    if (c->error)
+        return;
+    c->error = 1;
+    if (!c->report)
+        return;
+    if (c->pos < c->n)
+        fprintf(stderr, "syntax error near unexpected token `%s'\n", c->toks[c->pos].text);
+    else
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+}
+
+static int at_kw(struct compiler *c, const char *kw)
+{
+    return c->pos < c->n && is_kw(&c->toks[c->pos], kw);
+}
+
+static int expect(struct compiler *c, const char *kw)
+{
+    if (at_kw(c, kw)) {
+        c->pos++;
+        return 1;
+    }
+    syntax_error(c);
+    return 0;
+}
+
+static struct node *new_node(struct compiler *c, int type)
+{
+    struct node *nd = arena_alloc(c->a, sizeof(*nd));
+    memset(nd, 0, sizeof(*nd));
+    nd->type = type;
+    return nd;
+}
+
+/* 后台命令在作业表中显示的文字：token用空格连起来（引号和 \$ 加回去） */
+static void cmd_text(struct compiler *c, struct node *nd)
+{
+    size_t len = 0;
+    for (int i = 0; i < nd->n_toks; i++)
+        len += 2 * nd->toks[i].len + 3;
+    char *text = arena_alloc(c->a, len + 1), *o = text;
+    for (int i = 0; i < nd->n_toks; i++) {
+        const struct token *t = &nd->toks[i];
+        if (i > 0 && !t->joined)
+            *o++ = ' ';
+        if (t->quote)
+            *o++ = t->quote;
+        for (size_t k = 0; k < t->len; k++) {
+            if (t->text[k] == ESC_DOLLAR)
+                *o++ = '\\';   // \$ 也加回去
+            *o++ = (t->text[k] == ESC_DOLLAR) ? '$' : t->text[k];
+        }
+        if (t->quote)
+            *o++ = t->quote;
+    }
+    *o = '\0';
+    nd->text = text;
+    nd->text_len = o - text;
+}
+
+static struct node *parse_list(struct compiler *c);
+
+/* 一个管道：到 ; && || 为止，& 也包括在内 */
+static struct node *parse_simple(struct compiler *c)
+{
+    struct node *nd = new_node(c, NODE_CMD);
+    int start = c->pos;
+    while (c->pos < c->n) {
+        int type = c->toks[c->pos].type;
+        if (type == TOK_SEMI || type == TOK_AND || type == TOK_OR)
+            break;
+        c->pos++;
+        if (type == TOK_AMP)
+            break;
+    }
+    if (c->pos == start) {
+        syntax_error(c);
+        return NULL;
+    }
+    nd->toks = &c->toks[start];
+    nd->n_toks = c->pos - start;
+    if (c->toks[c->pos - 1].type == TOK_AMP)
+        cmd_text(c, nd);
+    return nd;
+}
+
+/* 不能为空的列表（条件、循环体等） */
+static struct node *parse_body(struct compiler *c)
+{
+    struct node *list = parse_list(c);
+    if (list == NULL)
+        syntax_error(c);
+    return list;
+}
+
+/* if ...; then ...; [elif ...; then ...;] [else ...;] fi（c->pos指向if或elif） */
+static struct node *parse_if(struct compiler *c)
+{
+    struct node *nd = new_node(c, NODE_IF);
+    c->pos++;
+    if ((nd->cond = parse_body(c)) == NULL || !expect(c, "then"))
+        return NULL;
+    if ((nd->body = parse_body(c)) == NULL)
+        return NULL;
+    if (at_kw(c, "elif"))
+        return (nd->orelse = parse_if(c)) != NULL ? nd : NULL; // 它读到fi为止
+    if (at_kw(c, "else")) {
+        c->pos++;
+        if ((nd->orelse = parse_body(c)) == NULL)
+            return NULL;
+    }
+    return expect(c, "fi") ? nd : NULL;
+}
+
+/* while/until ...; do ...; done */
+static struct node *parse_loop(struct compiler *c, int type)
+{
+    struct node *nd = new_node(c, type);
+    c->pos++;
+    if ((nd->cond = parse_body(c)) == NULL || !expect(c, "do"))
+        return NULL;
+    if ((nd->body = parse_body(c)) == NULL || !expect(c, "done"))
+        return NULL;
+    return nd;
+}
+
+/* 变量名：字母或下划线开头，后面是字母、数字、下划线 */
+static int valid_name(const char *s)
+{
+    if (!(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')))
+        return 0;
+    for (s++; *s; s++)
+        if (!(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')
+              || (*s >= '0' && *s <= '9')))
+            return 0;
+    return 1;
+}
+
+/* for NAME [in word...]; do ...; done */
+static struct node *parse_for(struct compiler *c)
+{
+    struct node *nd = new_node(c, NODE_FOR);
+    c->pos++;
+    if (c->pos == c->n || c->toks[c->pos].type != TOK_WORD || c->toks[c->pos].quote
+        || !valid_name(c->toks[c->pos].text)) {
+        syntax_error(c);
+        return NULL;
+    }
+    nd->var = c->toks[c->pos++].text;
+    if (at_kw(c, "in")) {
+        c->pos++;
+        nd->toks = &c->toks[c->pos];
+        while (c->pos < c->n && c->toks[c->pos].type == TOK_WORD)
+            c->pos++;
+        nd->n_toks = &c->toks[c->pos] - nd->toks;
+    }
+    // 单词后面是 ; 或者换行，然后是do
+    if (c->pos < c->n && c->toks[c->pos].type != TOK_SEMI && !at_kw(c, "do")) {
+        syntax_error(c);
+        return NULL;
+    }
+    while (c->pos < c->n && c->toks[c->pos].type == TOK_SEMI)
+        c->pos++;
+    if (!expect(c, "do") || (nd->body = parse_body(c)) == NULL || !expect(c, "done"))
+        return NULL;
+    return nd;
+}
+
+/*
+ * fi/done后面的重定向（"done < file"）：只记下token，执行时才展开、
+ * 打开文件（见run_node）
+ */
+static struct node *parse_redirs(struct compiler *c, struct node *nd)
+{
+    if (nd == NULL)
+        return NULL;
+    nd->redirs = &c->toks[c->pos];
+    while (c->pos < c->n && redirects(c->toks[c->pos].type)) {
+        if (c->pos + 1 == c->n || c->toks[c->pos + 1].type != TOK_WORD) {
+            c->pos++;
+            syntax_error(c);
+            return NULL;
+        }
+        c->pos += 2;
+    }
+    nd->n_redirs = &c->toks[c->pos] - nd->redirs;
+    return nd;
+}
+
+static struct node *parse_command(struct compiler *c)
+{
+    if (at_kw(c, "if"))
+        return parse_redirs(c, parse_if(c));
+    if (at_kw(c, "while"))
+        return parse_redirs(c, parse_loop(c, NODE_WHILE));
+    if (at_kw(c, "until"))
+        return parse_redirs(c, parse_loop(c, NODE_UNTIL));
+    if (at_kw(c, "for"))
+        return parse_redirs(c, parse_for(c));
+    return parse_simple(c);
+}
+
+/*
+ * 一个列表：命令之间用 ; && || & 分隔，在结束列表的关键字
+ * （then、do、fi……）或者token用完时结束
+ * 返回值：第一个命令；列表为空或者有语法错误时返回NULL（c->error区分）
+ */
+static struct node *parse_list(struct compiler *c)
+{
+    struct node *head = NULL, **link = &head;
+    int join = JOIN_SEQ;
+    for (;;) {
+        while (c->pos < c->n && c->toks[c->pos].type == TOK_SEMI)
+            c->pos++;   // 空命令（空行）
+        if (c->pos == c->n || closes(&c->toks[c->pos])) {
+            if (join != JOIN_SEQ) {
+                syntax_error(c);    // && 或 || 后面没有命令
+                return NULL;
+            }
+            break;
+        }
+        struct node *nd = parse_command(c);
+        if (nd == NULL)
+            return NULL;
+        nd->join = join;
+        *link = nd;
+        link = &nd->next;
+
+        join = JOIN_SEQ;
+        if (c->pos == c->n)
+            break;
+        int type = c->toks[c->pos].type;
+        if (type == TOK_AND || type == TOK_OR) {
+            join = (type == TOK_AND) ? JOIN_AND : JOIN_OR;
+            c->pos++;
+        } else if (type == TOK_SEMI) {
+            c->pos++;
+        } else if (c->toks[c->pos - 1].type != TOK_AMP && !closes(&c->toks[c->pos])) {
+            syntax_error(c);        // 例如 "done | wc"
+            return NULL;
+        }
+    }
+    return head;
+}
+
+/*
+ * compile: 把token编译成命令树
+ *
+ * 参数说明：
+ *   a: 分配节点用的arena
+ *   toks, n: 完整的命令（control_complete返回1），节点直接指向这些token
+ *   report: 有语法错误时打印信息（脚本缓存预先编译时不打印，见bccache.c）
+ *
+ * 返回值：命令列表的第一个命令；有语法错误时返回NULL
+ */
+struct node *compile(struct arena *a, const struct token *toks, int n, int report)
+{
+    struct compiler c = { a, toks, n, 0, 0, report };
+    struct node *list = parse_list(&c);
+    if (list == NULL && !c.error)
+        c.pos = 0;      // 只有 ";"
+    if (list == NULL || c.pos < n) {
+        syntax_error(&c);
+        return NULL;
+    }
+    return list;
+}
@@ -0,0 +1,59 @@
+/*
+ * file:        control.h
+ * description: command lists and control flow (; && || if while until for)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include "parser.h"
+#include "arena.h"
+
+/* node types:
+*/
+enum {
+    NODE_CMD = 0,       /* one pipeline: toks[0..n_toks), maybe ending in & */
+    NODE_IF,            /* if cond; then body; else orelse; fi */
+    NODE_WHILE,         /* while cond; do body; done */
+    NODE_UNTIL,         /* until cond; do body; done */
+    NODE_FOR,           /* for var in toks...; do body; done */
+};
+
+/* how a node follows the one before it in its list:
+*/
+enum {
+    JOIN_SEQ = 0,       /* ; or a new line: always runs */
+    JOIN_AND,           /* &&: runs if the status so far is 0 */
+    JOIN_OR,            /* ||: runs if it is not */
+};
+
+/* one command of a list. the tokens are not copied: they must stay
+ * valid as long as the tree is used. bodies are compiled once and run
+ * as often as needed; the words are expanded each time a NODE_CMD runs
+ * (build_ast) or a NODE_FOR starts.
+ */
+struct node {
+    int type;           /* NODE_xxx */
+    int join;           /* JOIN_xxx */
+    const struct token *toks;   /* NODE_CMD: the pipeline; NODE_FOR: the words */
+    int n_toks;
+    const char *text;   /* NODE_CMD ending in &: the command, for the job table */
+    size_t text_len;
+    const char *var;    /* NODE_FOR: loop variable */
+    struct node *cond;  /* NODE_IF, NODE_WHILE, NODE_UNTIL */
+    struct node *body;
+    struct node *orelse;        /* NODE_IF: else part (elif is an if here) */
+    const struct token *redirs; /* NODE_IF..NODE_FOR: redirections after fi/done */
+    int n_redirs;
+    struct node *next;  /* next command of the list */
+};
+
+/* function declarations:
+*/
+int is_control(const struct tokenizer *t);
+int control_complete(const struct token *toks, int n);
+struct node *compile(struct arena *a, const struct token *toks, int n, int report);
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * file:        copy.c
+ * description: in-kernel data mover for pure copy stages (cat, < in > out)
+ *
+ * "cat < big.log > out.log"、"cat a | cat > b" 这样的命令只是搬数据：
+ * 原来要启动一个cat进程，数据从内核读到cat的缓冲区，再写回内核。
+ *
+ * 现在shell自己认出这种"纯复制"的命令（copy_stage），在shell进程内
+ * 直接在打开的fd之间搬数据，数据不经过用户态：
+ *   - 普通文件 -> 普通文件：copy_file_range（同一个文件系统上可能只是
+ *     共享数据块（reflink），或者由服务器端复制（NFS））
+ *   - 普通文件 -> 任意fd：sendfile
+ *   - 有一端是管道：splice
+ *   - 都不行（终端、/dev下的设备、不支持的文件系统）：read/write
+ * 每一种方法不支持时（EINVAL、EXDEV、ENOSYS……）换下一种，已经复制的
+ * 部分不受影响：所有方法都用fd自己的文件位置，接着往下复制。
+ *
+ * /proc、/sys下的文件大小是0，copy_file_range和sendfile可能直接返回0
+ * （看起来像是空文件），所以第一次调用就返回0时也换下一种方法再确认一次。
+ *
+ * 其它系统上只有read/write。
+ */
+
+#define _GNU_SOURCE	/* copy_file_range, splice */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "copy.h"
+
+/* 每次系统调用最多搬多少：大到系统调用次数可以忽略，小到Ctrl+C能及时生效 */
+#define COPY_CHUNK (16 << 20)
+
+/* read/write方式的缓冲区 */
+#define COPY_BUF (128 << 10)
+
+/* 复制期间收到SIGINT（shell平时忽略它，见main） */
+static volatile sig_atomic_t copy_interrupted;
+
+static void copy_sigint(int sig)
+{
+    (void)sig;
+    copy_interrupted = 1;
+}
+
+/* 这个错误是"这种方法不支持"，可以换下一种 */
+static int unsupported(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP
+        || err == EBADF || err == ESPIPE;
+}
+
+/* 有没有这种重定向（here-document/here-string也算输入重定向） */
+static int has_redir(const struct stage *st, int type)
+{
+    for (const struct redir *r = st->redirs; r != NULL; r = r->next)
+        if (r->type == type || (type == REDIR_IN && r->type == REDIR_DATA))
+            return 1;
+    return 0;
+}
+
+/*
+ * copy_stage: 这个命令是不是只复制数据
+ *
+ * 返回值：1表示是，可以用copy_run代替；0表示不是
+ *
+ *   - cat，没有选项（参数都是文件名，"-"表示标准输入）
+ *   - 没有命令、只有重定向，而且有输入重定向："< in > out"、"< in"、"<<EOF"
+ *     （和zsh一样把它当成cat；只有 "> out" 时照旧只创建文件）
+ * "/bin/cat" 照常执行外部程序
+ */
+int copy_stage(const struct stage *st)
+{
+    if (st->argc == 0)
+        return has_redir(st, REDIR_IN);
+    if (strcmp(st->argv[0], "cat") != 0)
+        return 0;
+    for (int i = 1; i < st->argc; i++)
+        if (st->argv[i][0] == '-' && st->argv[i][1] != '\0')
+            return 0;
+    return 1;
+}
+
+/* 复制命令会不会读标准输入（没有文件参数，或者有 "-"，而且没有输入重定向） */
+int copy_reads_stdin(const struct stage *st)
+{
+    if (has_redir(st, REDIR_IN))
+        return 0;
+    if (st->argc == 1)
+        return 1;
+    for (int i = 1; i < st->argc; i++)
+        if (strcmp(st->argv[i], "-") == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * copy_absorbs: 管道中复制命令st后面的next能不能合并进来
+ *
+ * 例如 "cat a | cat > b"：第二个cat只是把输入原样输出，合并以后
+ * 直接从a复制到b，不需要中间的管道。st不能有输出重定向（否则next
+ * 读到的是空输入），next只能是不带参数的cat，而且没有输入重定向
+ */
+int copy_absorbs(const struct stage *st, const struct stage *next)
+{
+    return !has_redir(st, REDIR_OUT) && next->argc == 1
+        && strcmp(next->argv[0], "cat") == 0 && !has_redir(next, REDIR_IN);
+}
+
+/* read/write：任何fd都可以 */
+static ssize_t copy_rw(int in_fd, int out_fd, ssize_t done)
+{
+    static char *buf;
+    if (buf == NULL && (buf = malloc(COPY_BUF)) == NULL)
+        return -1;
+
+    for (;;) {
+        ssize_t n = read(in_fd, buf, COPY_BUF);
+        if (n == 0)
+            return done;
+        if (n == -1) {
+            if (errno == EINTR && !copy_interrupted)
+                continue;
+            return -1;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out_fd, buf + off, n - off);
+            if (w == -1) {
+                if (errno == EINTR && !copy_interrupted)
+                    continue;
+                return -1;
+            }
+            off += w;
+        }
+        done += n;
+    }
+}
+
+/*
+ * copy_fd: 把in_fd剩下的数据全部复制到out_fd（都从当前位置开始）
+ *
+ * 返回值：复制的字节数；出错时返回-1（errno是原因，
+ *         被Ctrl+C打断时是EINTR）
+ */
+ssize_t copy_fd(int in_fd, int out_fd)
+{
+    ssize_t done = 0;
+#ifdef __linux__
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+        return copy_rw(in_fd, out_fd, 0);
+
+    /*
+     * 依次尝试三种内核内的复制方法，方法m返回-1时表示出错，
+     * 返回0时表示读完了；不支持时换下一种
+     */
+    for (int m = 0; m < 3; m++) {
+        if (m == 0 && !(S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)))
+            continue;
+        if (m == 1 && !S_ISREG(in_st.st_mode))
+            continue;
+        if (m == 2 && !S_ISFIFO(in_st.st_mode) && !S_ISFIFO(out_st.st_mode))
+            continue;
+
+        int first = 1;
+        for (;;) {
+            ssize_t n;
+            if (m == 0)
+                n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+            else if (m == 1)
+                n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+            else
+                n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+            if (n > 0) {
+                done += n;
+                first = 0;
+                continue;
+            }
+            if (n == 0 && !(first && m < 2))
+                return done;
+            if (n == -1 && errno == EINTR && !copy_interrupted)
+                continue;
+            if (n == -1 && !unsupported(errno))
+                return -1;
+            break;  // 不支持，或者第一次就返回0（/proc的文件），换下一种
+        }
+    }
+#endif
+    return copy_rw(in_fd, out_fd, done);
+}
+
+/* 复制一个输入；出错时打印信息，返回状态码 */
+static int copy_one(int in_fd, int out_fd, const char *name)
+{
+    if (copy_fd(in_fd, out_fd) != -1)
+        return 0;
+    if (copy_interrupted)
+        return 128 + SIGINT;
+    if (errno == EPIPE)
+        return 128 + SIGPIPE;   // 和被SIGPIPE杀死的cat一样，不打印信息
+    fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+    return 1;
+}
+
+/*
+ * copy_run: 在shell进程内执行一个复制命令（copy_stage返回1的命令）
+ *
+ * 参数说明：
+ *   st: 命令（cat的参数是要复制的文件）
+ *   in_fd, out_fd: 标准输入/输出，-1表示shell自己的（属于调用者，这里不关闭）
+ *
+ * 返回值：命令的退出状态码（和cat一样：有文件打不开时为1）
+ *
+ * 执行期间忽略SIGPIPE（读的一端关闭了，例如 "cat big | head -1"，
+ * 复制停止，但shell不能被杀死）；Ctrl+C停止复制，状态码130
+ */
+int copy_run(const struct stage *st, int in_fd, int out_fd)
+{
+    if (in_fd < 0)
+        in_fd = STDIN_FILENO;
+    if (out_fd < 0)
+        out_fd = STDOUT_FILENO;
+    fflush(stdout);     // 之前printf的内容要先输出
+
+    struct sigaction sa, old_int, old_pipe;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = copy_sigint;    // 没有SA_RESTART：阻塞的read/splice返回EINTR
+    sigaction(SIGINT, &sa, &old_int);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &old_pipe);
+    copy_interrupted = 0;
+
+    int status = 0;
+    if (st->argc <= 1) {
+        status = copy_one(in_fd, out_fd, "stdin");
+    } else {
+        for (int i = 1; i < st->argc && !copy_interrupted; i++) {
+            const char *name = st->argv[i];
+            if (strcmp(name, "-") == 0) {
+                int s = copy_one(in_fd, out_fd, "stdin");
+                if (s != 0)
+                    status = s;
+                continue;
+            }
+            int fd = open(name, O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+                status = 1;
+                continue;
+            }
+            int s = copy_one(fd, out_fd, name);
+            close(fd);
+            if (s != 0)
+                status = s;
+            if (s > 128)
+                break;  // 被打断，或者读的一端关闭了
+        }
+    }
+
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    sigaction(SIGINT, &old_int, NULL);
+    return status;
+}
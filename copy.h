@@ -0,0 +1,23 @@
+/*
+ * file:        copy.h
+ * description: in-kernel data mover for pure copy stages (cat, < in > out)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __COPY_H__
+#define __COPY_H__
+
+#include <sys/types.h>
+
+#include "ast.h"
+
+/* function declarations:
+*/
+int copy_stage(const struct stage *st);
+int copy_reads_stdin(const struct stage *st);
+int copy_absorbs(const struct stage *st, const struct stage *next);
+int copy_run(const struct stage *st, int in_fd, int out_fd);
+ssize_t copy_fd(int in_fd, int out_fd);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * file:        evloop.c
+ * description: child supervision: one epoll set of pidfds, with deadlines
+ *
+ * shell等待子进程原来只有两种办法：waitpid等一个指定的子进程（一直
+ * 阻塞），或者wait4(-1)等任意一个。两种都不能"最多等到某个时间"，
+ * 所以没法给命令设期限：一个卡住的命令可以让shell一直等下去。
+ *
+ * 这里是所有等待的中心（前台管道、单个命令、$(...)、<(...)、parallel、
+ * wait/fg）：每个要等的子进程用pidfd_open得到一个pidfd，放进同一个
+ * epoll集合（子进程结束时pidfd变成可读）。ev_wait返回下一个结束的
+ * 子进程（注册时给的data），或者在期限到了时返回0，由调用者决定
+ * 怎么办（例如 timeout 先发SIGTERM，再发SIGKILL）：
+ *
+ *   ev_watch(pid1, st1); ev_watch(pid2, st2);
+ *   while ((r = ev_wait(&deadline, &data)) != -1) {
+ *       r == 1：data对应的子进程结束了，用wait4回收它
+ *       r == 0：期限到了
+ *   }
+ *
+ * ev_wait只告诉调用者谁结束了，回收（wait4）仍然由调用者做，这样
+ * 资源统计（rusage）和状态码都和原来一样。只看注册了的子进程，后台
+ * 作业的子进程不会被误当成前台的（它们留给jobs.c）。
+ * 集合只有一个：ev_watch/ev_wait的等待不嵌套（一个循环结束之前不会
+ * 开始另一个）。只等一个子进程时用ev_reap，它不用这个集合，所以可以
+ * 在ev_wait的循环中间调用。
+ *
+ * 没有pidfd的系统（旧内核、其它系统）上改用SIGCHLD：先阻塞SIGCHLD，
+ * 用waitid(WNOWAIT)看看在等的子进程有没有结束（不回收），没有就用
+ * pselect原子地解除阻塞，等到SIGCHLD或者期限。期限一样起作用，
+ * 检查和等待之间结束的子进程也不会错过。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>	/* SYS_pidfd_open */
+#endif
+
+#include "evloop.h"
+
+/* 正在等待的子进程：pid为0的位置是空的，可以重用 */
+struct watch {
+    pid_t pid;
+    int fd;             /* pidfd，-1表示没有（等SIGCHLD） */
+    void *data;         /* 调用者的数据（例如struct stage） */
+};
+
+static int epfd = -1;      /* 第一次ev_watch时创建 */
+static int no_pidfd;       /* pidfd_open是ENOSYS：不再尝试 */
+static struct watch *watches;
+static int n_watches, watches_cap, n_live;
+static int n_polled;       /* 其中没有pidfd的个数 */
+
+static void on_sigchld(int sig)
+{
+    (void)sig;
+}
+
+/*
+ * SIGCHLD要有处理函数（平常是jobs.c的），否则它被丢掉，
+ * pselect等不到。SIG_IGN时子进程自动回收，也就没有什么可等的了
+ */
+static void need_sigchld(void)
+{
+    struct sigaction sa;
+    if (sigaction(SIGCHLD, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_sigchld;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction(SIGCHLD, &sa, NULL);
+    }
+}
+
+/* 这个子进程的pidfd，放进epoll集合；不可用时返回-1 */
+static int open_pidfd(pid_t pid, int i)
+{
+#if defined(SYS_pidfd_open) && defined(EPOLL_CLOEXEC)
+    if (no_pidfd)
+        return -1;
+    if (epfd == -1 && (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        no_pidfd = 1;
+        return -1;
+    }
+    int fd = syscall(SYS_pidfd_open, pid, 0);  /* pidfd总是close-on-exec */
+    if (fd == -1) {
+        if (errno == ENOSYS)
+            no_pidfd = 1;
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)pid;
+    (void)i;
+    return -1;
+#endif
+}
+
+/*
+ * ev_watch: 开始等待一个子进程
+ *
+ * 没有pidfd时这个子进程由SIGCHLD驱动（见文件开头），调用者不用管
+ */
+void ev_watch(pid_t pid, void *data)
+{
+    int i = 0;
+    while (i < n_watches && watches[i].pid != 0)
+        i++;
+    if (i == watches_cap) {
+        int cap = watches_cap ? watches_cap * 2 : 16;
+        struct watch *w = realloc(watches, cap * sizeof(*w));
+        if (w == NULL) {
+            perror("evloop");
+            exit(EXIT_FAILURE);
+        }
+        watches = w;
+        watches_cap = cap;
+    }
+
+    watches[i].pid = pid;
+    watches[i].fd = open_pidfd(pid, i);
+    watches[i].data = data;
+    if (watches[i].fd == -1) {
+        need_sigchld();
+        n_polled++;
+    }
+    if (i == n_watches)
+        n_watches++;
+    n_live++;
+}
+
+/* 离期限还有多少毫秒（向上取整，已经过了时为0） */
+static int remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL
+                 + (deadline->tv_nsec - now.tv_nsec);
+    if (ns <= 0)
+        return 0;
+    long long ms = (ns + 999999) / 1000000;
+    return ms > 1000000000 ? 1000000000 : (int)ms;
+}
+
+/* 在等的子进程中已经结束的一个（waitid不回收它）；没有时返回-1 */
+static int find_exited(void)
+{
+    for (int i = 0; i < n_watches; i++) {
+        if (watches[i].pid == 0)
+            continue;
+        siginfo_t si;
+        si.si_pid = 0;
+        if (waitid(P_PID, watches[i].pid, &si, WEXITED | WNOHANG | WNOWAIT) == -1
+            || si.si_pid != 0)
+            return i;   /* ECHILD：已经不是我们的子进程了，交给调用者的wait4 */
+    }
+    return -1;
+}
+
+/*
+ * 等待结束的子进程，最多ms毫秒（-1表示一直等）
+ * 返回值：结束的子进程的下标；-1表示没有（超时或者被信号打断）；-2表示出错
+ */
+static int wait_sigchld(int ms)
+{
+    sigset_t chld, old, during;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    int i = find_exited();
+    if (i == -1) {
+        during = old;
+        sigdelset(&during, SIGCHLD);
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+        if (pselect(0, NULL, NULL, NULL, ms < 0 ? NULL : &ts, &during) == -1 && errno != EINTR)
+            i = -2;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return i;
+}
+
+static int wait_epoll(int ms)
+{
+#if defined(SYS_pidfd_open) && defined(EPOLL_CLOEXEC)
+    struct epoll_event ev;
+    int r = epoll_wait(epfd, &ev, 1, ms);
+    if (r == -1)
+        return (errno == EINTR) ? -1 : -2;
+    if (r == 0 || watches[ev.data.u32].pid == 0)
+        return -1;
+    return ev.data.u32;
+#else
+    (void)ms;
+    return -2;
+#endif
+}
+
+/*
+ * 从epoll集合中删除再关闭：刚fork出的子进程（还没有exec）可能还有
+ * 这个pidfd的副本，只close的话它还留在集合里，下一次epoll_wait又报告它
+ * （所以wait_epoll也忽略空位置的事件）
+ */
+static void close_pidfd(int fd)
+{
+#if defined(SYS_pidfd_open) && defined(EPOLL_CLOEXEC)
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    close(fd);
+}
+
+/*
+ * ev_wait: 等待下一个结束的子进程
+ *
+ * 参数说明：
+ *   deadline: 最多等到这个时间（CLOCK_MONOTONIC，见ev_deadline）；NULL表示一直等
+ *   data: 返回结束的子进程注册时的data（它已经不再等待）
+ *
+ * 返回值：1表示有子进程结束；0表示期限到了；
+ *         -1表示没有在等的子进程了（ECHILD）或者出错
+ */
+int ev_wait(const struct timespec *deadline, void **data)
+{
+    for (;;) {
+        int ms = -1;
+        if (deadline != NULL && (ms = remaining_ms(deadline)) == 0)
+            return 0;
+        if (n_live == 0) {
+            errno = ECHILD;
+            return -1;
+        }
+        /* 有没有pidfd的子进程时，所有的都用waitid检查 */
+        int i = (n_polled > 0) ? wait_sigchld(ms) : wait_epoll(ms);
+        if (i == -2)
+            return -1;
+        if (i == -1)
+            continue;   /* 上面再检查一次期限（epoll_wait的精度是毫秒） */
+
+        struct watch *w = &watches[i];
+        *data = w->data;
+        if (w->fd != -1)
+            close_pidfd(w->fd);
+        else
+            n_polled--;
+        w->pid = 0;
+        w->fd = -1;
+        n_live--;
+        if (n_live == 0)
+            n_watches = 0;
+        return 1;
+    }
+}
+
+/* ev_clear: 不再等待任何子进程（出错、放弃等待时） */
+void ev_clear(void)
+{
+    for (int i = 0; i < n_watches; i++)
+        if (watches[i].pid != 0 && watches[i].fd != -1)
+            close_pidfd(watches[i].fd);
+    n_watches = n_live = n_polled = 0;
+}
+
+/*
+ * ev_reap: 等待一个子进程结束，再回收它（wait4）
+ *
+ * 参数说明：
+ *   pid: 子进程
+ *   wstatus, ru: 和wait4的一样，可以是NULL
+ *
+ * 返回值：wait4的返回值（pid；已经不是我们的子进程了时是-1）
+ *
+ * 只等这一个子进程，不用上面的watch集合：它可以在别的等待中间调用
+ * （例如parallel启动作业时，zygote回收exec失败的子进程），不会拿走
+ * 外面那个等待的子进程。有pidfd时poll它自己的pidfd，没有时用
+ * waitid(P_PID, WNOWAIT)，两种都只在这个子进程结束时返回
+ */
+pid_t ev_reap(pid_t pid, int *wstatus, struct rusage *ru)
+{
+    int fd = -1;
+#ifdef SYS_pidfd_open
+    if (!no_pidfd && (fd = syscall(SYS_pidfd_open, pid, 0)) == -1 && errno == ENOSYS)
+        no_pidfd = 1;
+#endif
+    if (fd != -1) {
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        while (poll(&p, 1, -1) == -1 && errno == EINTR)
+            ;
+        close(fd);
+    } else {
+        siginfo_t si;
+        while (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) == -1 && errno == EINTR)
+            ;
+    }
+    pid_t r;
+    while ((r = wait4(pid, wstatus, 0, ru)) == -1 && errno == EINTR)
+        ;
+    return r;
+}
+
+/* ev_deadline: 从现在开始ms毫秒以后的时间，给ev_wait用 */
+void ev_deadline(struct timespec *t, long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, t);
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
@@ -0,0 +1,23 @@
+/*
+ * file:        evloop.h
+ * description: child supervision: one epoll set of pidfds, with deadlines
+ */
+
+/* standard include file protection:
+*/
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* function declarations:
+*/
+void ev_watch(pid_t pid, void *data);
+int ev_wait(const struct timespec *deadline, void **data);
+void ev_clear(void);
+pid_t ev_reap(pid_t pid, int *wstatus, struct rusage *ru);
+void ev_deadline(struct timespec *t, long ms);
+
+#endif
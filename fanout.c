@@ -0,0 +1,295 @@
+/*
+ * file:        fanout.c
+ * description: in-kernel fan-out of one pipe into several (the |+ operator)
+ *
+ * "make 2>&1 |+ gzip > build.log.gz |+ grep -i error" 把make的输出同时
+ * 送给gzip和grep。原来要 "make | tee build.log | grep -i error"，再单独
+ * 压缩build.log：tee进程把每个字节读进自己的缓冲区、再写出去N次，
+ * 还要写一次磁盘、再读回来。
+ *
+ * 现在 |+ 前面的命令（生产者）写一个管道，shell fork出的一个小helper进程
+ * （不exec）把这个管道的数据在内核中分给每个分支的管道：
+ *   - tee(2) 把管道中的数据复制到另一个管道，不取走，不经过用户态
+ *     （只是增加内存页的引用计数）
+ *   - 最后一个分支用 splice(2) 把数据移过去，同时从生产者的管道中取走
+ *
+ * 背压（backpressure）：tee/splice在分支的管道满了时阻塞，生产者的管道
+ * 因此也会满，生产者就停下来等最慢的分支，内存占用不会无限增长
+ * （和tee命令一样）。一个分支结束了（读的一端都关闭了，EPIPE）时
+ * 只是不再给它数据，其它分支照常；所有分支都结束后helper退出，
+ * 生产者再写时收到SIGPIPE。
+ *
+ * 分支的管道满了时，tee可能只复制了一部分。tee总是从管道的开头复制，
+ * 没法接着复制剩下的部分，所以这一轮的数据改为读到缓冲区，剩下的部分
+ * 用write补上。这只在分支跟不上的时候发生，这时本来就在等它。
+ *
+ * 其它系统上（或者tee不支持时）helper用read/write。
+ *
+ * 每个分支的命令是管道中普通的命令，状态码各自记在st->status中
+ * （PIPESTATUS），见launch_pipeline
+ */
+
+#define _GNU_SOURCE	/* tee, splice, close_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "zygote.h"
+
+/* tee/splice每次最多复制多少（实际上不会超过管道中现有的数据） */
+#define FANOUT_CHUNK (16 << 20)
+
+/* read/write方式的缓冲区 */
+#define FANOUT_BUF (128 << 10)
+
+/* 这个分支不再要数据了（读的一端都关闭了） */
+static void drop(int *out_fds, int i, int *n_live)
+{
+    close(out_fds[i]);
+    out_fds[i] = -1;
+    (*n_live)--;
+}
+
+/* 写完n个字节；出错（EPIPE）时返回-1 */
+static int write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* 读满n个字节（数据已经在管道里了）；出错或者提前EOF时返回-1 */
+static int read_all(int fd, char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* read/write：任何fd都可以 */
+static int fanout_rw(int in_fd, int *out_fds, int n, int n_live)
+{
+    char *buf = malloc(FANOUT_BUF);
+    if (buf == NULL)
+        return 1;
+    ssize_t r = 0;
+    while (n_live > 0) {
+        r = read(in_fd, buf, FANOUT_BUF);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        for (int i = 0; i < n; i++)
+            if (out_fds[i] != -1 && write_all(out_fds[i], buf, r) == -1)
+                drop(out_fds, i, &n_live);
+    }
+    free(buf);
+    return r == -1;
+}
+
+/*
+ * fanout_run: 把in_fd的数据复制到out_fds中的每一个，直到in_fd读完
+ *
+ * 参数说明：
+ *   in_fd: 生产者的管道的读端
+ *   out_fds, n: 每个分支的管道的写端（结束的分支被关闭，换成-1）
+ *
+ * 返回值：0；读in_fd出错时为1
+ */
+int fanout_run(int in_fd, int *out_fds, int n)
+{
+    int n_live = n;
+#ifdef __linux__
+    size_t *got = malloc(n * sizeof(size_t));  // 这一轮每个分支拿到了多少
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    if (got == NULL)
+        return fanout_rw(in_fd, out_fds, n, n_live);
+
+    while (n_live > 0) {
+        int first = 0, last = n - 1;
+        while (out_fds[first] == -1)
+            first++;
+        while (out_fds[last] == -1)
+            last--;
+
+        // 只剩一个分支：直接移过去
+        if (first == last) {
+            ssize_t m = splice(in_fd, NULL, out_fds[first], NULL, FANOUT_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m > 0 || (m == -1 && errno == EINTR))
+                continue;
+            if (m == -1 && errno == EPIPE)
+                drop(out_fds, first, &n_live);
+            else if (m == -1 && errno == EINVAL)
+                break;      // 不支持，用read/write
+            else
+                n_live = 0; // 读完了
+            continue;
+        }
+
+        /*
+         * 第一步：复制到第一个分支，它决定这一轮的长度len
+         */
+        ssize_t len = tee(in_fd, out_fds[first], FANOUT_CHUNK, 0);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && errno == EPIPE) {
+            drop(out_fds, first, &n_live);
+            continue;
+        }
+        if (len == -1 && errno == EINVAL)
+            break;
+        if (len <= 0) {
+            n_live = 0;
+            continue;
+        }
+
+        /*
+         * 第二步：中间的分支各复制len个字节（分支的管道满时可能只复制一部分）
+         */
+        int incomplete = 0;
+        for (int i = first + 1; i < last; i++) {
+            got[i] = len;
+            if (out_fds[i] == -1)
+                continue;
+            ssize_t m;
+            while ((m = tee(in_fd, out_fds[i], len, 0)) == -1 && errno == EINTR)
+                ;
+            if (m == -1) {
+                drop(out_fds, i, &n_live);
+                continue;
+            }
+            got[i] = m;
+            if (m < len)
+                incomplete = 1;
+        }
+
+        /*
+         * 第三步：把这一轮的数据从生产者的管道移到最后一个分支
+         */
+        size_t done = 0;
+        while (!incomplete && done < (size_t)len) {
+            ssize_t m = splice(in_fd, NULL, out_fds[last], NULL, len - done,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m <= 0) {
+                drop(out_fds, last, &n_live);
+                break;
+            }
+            done += m;
+        }
+
+        /*
+         * 剩下的数据读到缓冲区：补给没有拿全的中间分支和最后一个分支
+         * （有分支没拿全时done为0）；最后一个分支结束了时只是取走丢掉
+         */
+        if (done < (size_t)len) {
+            if (buf_cap < (size_t)len) {
+                free(buf);
+                buf_cap = len;
+                if ((buf = malloc(buf_cap)) == NULL)
+                    break;
+            }
+            if (read_all(in_fd, buf, len - done) == -1)
+                break;
+            for (int i = first + 1; incomplete && i < last; i++)
+                if (out_fds[i] != -1 && got[i] < (size_t)len
+                    && write_all(out_fds[i], buf + got[i], len - got[i]) == -1)
+                    drop(out_fds, i, &n_live);
+            if (incomplete && out_fds[last] != -1 && write_all(out_fds[last], buf, len) == -1)
+                drop(out_fds, last, &n_live);
+        }
+    }
+    free(buf);
+    free(got);
+#endif
+    return fanout_rw(in_fd, out_fds, n, n_live);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * fanout_start: fork出helper进程执行fanout_run，不等待它结束
+ *
+ * 参数说明：
+ *   in_fd, out_fds, n: 同fanout_run（属于调用者，调用者自己关闭）
+ *   pgid: 放进哪个进程组（管道的进程组，pipekill时一起结束），0表示不改变
+ *
+ * 返回值：helper的pid；失败时返回-1（已经打印错误信息）
+ *
+ * helper只留下in_fd、out_fds和0/1/2：shell的其它fd（例如在shell进程内
+ * 执行的命令的管道）留在helper里的话，读它们的命令永远等不到EOF
+ */
+pid_t fanout_start(int in_fd, int *out_fds, int n, pid_t pgid)
+{
+    fflush(NULL);   // 否则缓冲区里的内容会被父子进程各输出一次
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0) {
+        if (pgid > 0)
+            setpgid(pid, pgid);
+        return pid;
+    }
+
+    if (pgid > 0)
+        setpgid(0, pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);   // 分支结束时tee/splice/write返回EPIPE
+    zygote_close();
+
+    int *keep = malloc((n + 1) * sizeof(int));
+    if (keep == NULL)
+        _exit(1);
+    keep[0] = in_fd;
+    memcpy(keep + 1, out_fds, n * sizeof(int));
+    qsort(keep, n + 1, sizeof(int), cmp_int);
+    int lo = 3;
+    for (int i = 0; i <= n; i++) {
+#ifdef __linux__
+        if (keep[i] > lo)
+            close_range(lo, keep[i] - 1, 0);
+#else
+        for (int fd = lo; fd < keep[i]; fd++)
+            close(fd);
+#endif
+        if (keep[i] >= lo)
+            lo = keep[i] + 1;
+    }
+#ifdef __linux__
+    close_range(lo, ~0U, 0);
+#else
+    for (int fd = lo; fd < 1024; fd++)
+        close(fd);
+#endif
+    free(keep);
+
+    _exit(fanout_run(in_fd, out_fds, n));
+}
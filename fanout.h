@@ -0,0 +1,18 @@
+/*
+ * file:        fanout.h
+ * description: in-kernel fan-out of one pipe into several (the |+ operator)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <sys/types.h>
+
+/* function declarations:
+*/
+int fanout_run(int in_fd, int *out_fds, int n);
+pid_t fanout_start(int in_fd, int *out_fds, int n, pid_t pgid);
+
+#endif
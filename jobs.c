@@ -0,0 +1,306 @@
+/*
+ * file:        jobs.c
+ * description: background job table and SIGCHLD-driven reaping
+ *
+ * 以 & 结尾的命令在后台执行：shell启动所有子进程之后不等待，
+ * 马上读下一行。这些子进程记在作业表里，每个作业是一个管道：
+ *
+ *   [1]  sleep 10 | cat         pids = {1234, 1235}
+ *   [2]  make -j32              pids = {1240}
+ *
+ * 后台子进程结束时内核发SIGCHLD。信号处理函数里能做的事情很少
+ * （不能malloc、不能printf，作业表也可能正在被修改），所以这里用
+ * self-pipe：处理函数只往一个管道里写一个字节，真正的回收（waitpid）
+ * 在主循环里做（jobs_reap）。管道是非阻塞的：没有字节就说明没有子进程
+ * 结束，连waitpid都不用调用。
+ *
+ * 前台命令照旧由shell56.c等待（evloop.c，只等它自己的子进程）；
+ * jobs_reap只在两条命令之间调用，那时前台的子进程都已经回收了，
+ * 所以 waitpid(-1) 不会抢走前台命令的退出状态。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "spawn.h"
+#include "evloop.h"
+
+static struct job **jobs;   /* 按启动顺序，最后一个是"当前作业" */
+static int n_jobs, jobs_cap;
+
+/* SIGCHLD的self-pipe：[0]由主循环读，[1]由信号处理函数写 */
+static int chld_pipe[2] = {-1, -1};
+
+static void on_sigchld(int sig)
+{
+    int saved = errno;
+    (void)sig;
+    /* 管道满了也没关系：已经有字节在里面，主循环一样会去回收 */
+    if (write(chld_pipe[1], "", 1) == -1) {}
+    errno = saved;
+}
+
+/* 创建self-pipe，安装SIGCHLD处理函数 */
+void jobs_init(void)
+{
+    if (spawn_pipe(chld_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(chld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(chld_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    /* SA_RESTART：read/waitpid 被打断后自动重新开始，不会返回EINTR */
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (p == NULL) {
+        perror("jobs");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * job_add: 把一个刚启动的后台管道加入作业表
+ *
+ * 参数说明：
+ *   pids, n: 每个命令的子进程ID（没有启动的为-1）
+ *   cmd, len: 命令行（结尾的 & 和空白会被去掉）
+ *
+ * 返回值：新的作业（编号是现有最大编号 + 1）
+ */
+struct job *job_add(const pid_t *pids, int n, const char *cmd, size_t len)
+{
+    struct job *j = xmalloc(sizeof(*j));
+
+    j->id = n_jobs ? jobs[n_jobs - 1]->id + 1 : 1;
+    j->pgid = -1;
+    j->n_procs = n;
+    j->n_live = 0;
+    j->pids = xmalloc(n * sizeof(pid_t));
+    j->status = xmalloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        j->pids[i] = pids[i];
+        if (pids[i] > 0) {
+            j->status[i] = -1;  // 还没有结束
+            j->n_live++;
+            if (j->pgid == -1)
+                j->pgid = pids[i];
+        } else {
+            j->status[i] = 1;   // 没有启动，和前台一样视为状态码1
+        }
+    }
+
+    while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t'))
+        len--;
+    if (len > 0 && cmd[len - 1] == '&')
+        len--;
+    while (len > 0 && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t'))
+        len--;
+    j->cmd = xmalloc(len + 1);
+    memcpy(j->cmd, cmd, len);
+    j->cmd[len] = 0;
+
+    if (n_jobs == jobs_cap) {
+        jobs_cap = jobs_cap ? jobs_cap * 2 : 8;
+        jobs = realloc(jobs, jobs_cap * sizeof(*jobs));
+        if (jobs == NULL) {
+            perror("jobs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    jobs[n_jobs++] = j;
+    return j;
+}
+
+/*
+ * job_record: 记录一个后台子进程的退出状态（和前台管道一样，被信号杀死记为128+信号编号）
+ *
+ * 返回值：1表示是作业表里的进程，0表示不是
+ */
+static int job_record(pid_t pid, int wstatus)
+{
+    for (int k = 0; k < n_jobs; k++) {
+        struct job *j = jobs[k];
+        for (int i = 0; i < j->n_procs; i++) {
+            if (j->pids[i] == pid && j->status[i] == -1) {
+                j->status[i] = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus)
+                                                    : WEXITSTATUS(wstatus);
+                j->n_live--;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * jobs_reap: 回收已经结束的后台子进程（不阻塞）
+ *
+ * 在主循环里每读一行之前调用。self-pipe里没有字节说明没有子进程结束，
+ * 直接返回
+ */
+void jobs_reap(void)
+{
+    char buf[64];
+    int got = 0;
+
+    while (read(chld_pipe[0], buf, sizeof(buf)) > 0)
+        got = 1;
+    if (!got || n_jobs == 0)
+        return;
+
+    pid_t pid;
+    int wstatus;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0)
+        job_record(pid, wstatus);
+}
+
+/* 作业的退出状态：和前台管道一样，是最后一个命令的状态 */
+int job_status(const struct job *j)
+{
+    return j->status[j->n_procs - 1];
+}
+
+/*
+ * job_wait: 等待一个作业的所有子进程结束（阻塞，经过evloop.c）
+ *
+ * 返回值：作业的退出状态
+ */
+int job_wait(struct job *j)
+{
+    for (int i = 0; i < j->n_procs; i++) {
+        if (j->status[i] != -1)
+            continue;
+        int wstatus;
+        if (ev_reap(j->pids[i], &wstatus, NULL) == j->pids[i]) {
+            j->status[i] = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus)
+                                                : WEXITSTATUS(wstatus);
+        } else {
+            j->status[i] = 127;  // 不是我们的子进程了（理论上不会发生）
+        }
+        j->n_live--;
+    }
+    return job_status(j);
+}
+
+/* 从作业表中删除一个作业 */
+void job_remove(struct job *j)
+{
+    for (int k = 0; k < n_jobs; k++) {
+        if (jobs[k] == j) {
+            memmove(&jobs[k], &jobs[k + 1], (n_jobs - k - 1) * sizeof(*jobs));
+            n_jobs--;
+            break;
+        }
+    }
+    free(j->pids);
+    free(j->status);
+    free(j->cmd);
+    free(j);
+}
+
+/* 当前作业：最近启动的那个 */
+struct job *job_current(void)
+{
+    return n_jobs ? jobs[n_jobs - 1] : NULL;
+}
+
+/* 查找包含某个子进程的作业 */
+struct job *job_find_pid(pid_t pid)
+{
+    for (int k = 0; k < n_jobs; k++)
+        for (int i = 0; i < jobs[k]->n_procs; i++)
+            if (jobs[k]->pids[i] == pid)
+                return jobs[k];
+    return NULL;
+}
+
+/*
+ * job_find: 按作业说明查找作业
+ *
+ *   NULL、"%%"、"%+": 当前作业
+ *   "%n":            编号为n的作业
+ *   "n":             包含进程n的作业
+ */
+struct job *job_find(const char *spec)
+{
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        return job_current();
+
+    char *end;
+    long n = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+    if (*end != '\0' || end == spec || n <= 0)
+        return NULL;
+    if (spec[0] != '%')
+        return job_find_pid((pid_t)n);
+    for (int k = 0; k < n_jobs; k++)
+        if (jobs[k]->id == n)
+            return jobs[k];
+    return NULL;
+}
+
+static void print_job(FILE *fp, const struct job *j, int k)
+{
+    char state[32];
+    char mark = (k == n_jobs - 1) ? '+' : (k == n_jobs - 2) ? '-' : ' ';
+
+    if (j->n_live > 0)
+        snprintf(state, sizeof(state), "Running");
+    else if (job_status(j) == 0)
+        snprintf(state, sizeof(state), "Done");
+    else
+        snprintf(state, sizeof(state), "Exit %d", job_status(j));
+    fprintf(fp, "[%d]%c  %-24s%s%s\n", j->id, mark, state, j->cmd,
+            j->n_live > 0 ? " &" : "");
+}
+
+/* 删除所有已经结束的作业（已经报告过了） */
+static void remove_done(void)
+{
+    for (int k = n_jobs - 1; k >= 0; k--)
+        if (jobs[k]->n_live == 0)
+            job_remove(jobs[k]);
+}
+
+/* jobs 命令：列出所有作业；已经结束的列出之后就删除 */
+void jobs_list(FILE *fp)
+{
+    for (int k = 0; k < n_jobs; k++)
+        print_job(fp, jobs[k], k);
+    remove_done();
+}
+
+/* 交互模式下，在提示符之前报告已经结束的作业（报告之后删除） */
+void jobs_notify(FILE *fp)
+{
+    for (int k = 0; k < n_jobs; k++)
+        if (jobs[k]->n_live == 0)
+            print_job(fp, jobs[k], k);
+    remove_done();
+}
+
+/* wait 命令不带参数：等待所有作业结束，然后全部删除 */
+void jobs_wait_all(void)
+{
+    while (n_jobs > 0) {
+        job_wait(jobs[0]);
+        job_remove(jobs[0]);
+    }
+}
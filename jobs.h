@@ -0,0 +1,42 @@
+/*
+ * file:        jobs.h
+ * description: background job table and SIGCHLD-driven reaping
+ */
+
+/* standard include file protection:
+*/
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* one background pipeline. pids[i] is stage i (-1 if it never
+ * started); status[i] is its exit status once it has been reaped.
+ */
+struct job {
+    int id;             /* %1, %2, ... */
+    pid_t pgid;
+    int n_procs;
+    int n_live;         /* started and not yet reaped */
+    pid_t *pids;
+    int *status;
+    char *cmd;          /* command line, for jobs/fg */
+};
+
+/* function declarations:
+*/
+void jobs_init(void);
+struct job *job_add(const pid_t *pids, int n, const char *cmd, size_t len);
+void jobs_reap(void);
+int job_wait(struct job *j);
+int job_status(const struct job *j);
+void job_remove(struct job *j);
+struct job *job_find(const char *spec);
+struct job *job_find_pid(pid_t pid);
+struct job *job_current(void);
+void jobs_list(FILE *fp);
+void jobs_notify(FILE *fp);
+void jobs_wait_all(void);
+
+#endif
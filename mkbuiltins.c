@@ -0,0 +1,63 @@
+/*
+ * file:        mkbuiltins.c
+ * description: build-time generator of the builtin perfect hash
+ *
+ * 读builtins.def中的命令名，找一个种子，使得
+ *     builtin_name_hash(name, seed) & mask
+ * 对所有命令名都不相同（完美哈希），然后输出builtins_hash.h：
+ *
+ *     #define BUILTIN_HASH_SEED ...
+ *     #define BUILTIN_HASH_MASK ...
+ *     static const signed char builtin_slot[] = { 表中的下标，空位为-1 };
+ *
+ * 查找一个命令名只需要算一次哈希、比较一次字符串（见builtin_lookup）。
+ * 表的大小从命令个数的2倍（2的幂）开始，找不到种子时再加倍。
+ *
+ * make时自动运行：builtins.def改了，builtins_hash.h就重新生成。
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "builtins.h"
+
+static const char *names[] = {
+#define BUILTIN(name, fn, flags) name,
+#include "builtins.def"
+#undef BUILTIN
+};
+#define N_NAMES ((int)(sizeof(names) / sizeof(names[0])))
+
+int main(void)
+{
+    signed char slot[1024];
+    unsigned size = 1;
+    while (size < 2 * N_NAMES)
+        size *= 2;
+
+    for (; size <= sizeof(slot); size *= 2) {
+        for (unsigned seed = 1; seed < 1000000; seed++) {
+            int ok = 1;
+            memset(slot, -1, size);
+            for (int i = 0; i < N_NAMES && ok; i++) {
+                unsigned h = builtin_name_hash(names[i], seed) & (size - 1);
+                if (slot[h] != -1)
+                    ok = 0;
+                slot[h] = i;
+            }
+            if (!ok)
+                continue;
+
+            printf("/* generated by mkbuiltins from builtins.def -- do not edit */\n");
+            printf("#define BUILTIN_HASH_SEED %uu\n", seed);
+            printf("#define BUILTIN_HASH_MASK %uu\n", size - 1);
+            printf("static const signed char builtin_slot[%u] = {", size);
+            for (unsigned h = 0; h < size; h++)
+                printf("%s%d", h == 0 ? "\n    " : h % 16 ? ", " : ",\n    ", slot[h]);
+            printf("\n};\n");
+            return 0;
+        }
+    }
+    fprintf(stderr, "mkbuiltins: no perfect hash found\n");
+    return 1;
+}
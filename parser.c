@@ -6,131 +6,516 @@
  */
 
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "parser.h"
 
-/* types: 
-*/
+/* character classes. the tokenizer looks up every byte here instead
+ * of running it through a chain of comparisons.
+ */
 enum {
-    NO_SPLIT = 0,
-    SPLIT = 1,
-    NO_SAVE = 0,
-    SAVE = 2
+    C_WORD = 0,         /* part of a word */
+    C_SPACE,            /* separates words */
+    C_SQUOTE,           /* ' */
+    C_DQUOTE,           /* " */
+    C_OP,               /* single-character operator, see op_type[] */
+    C_ESCAPE,           /* \ - part of a word, but escapes the next byte */
+};
+
+static const unsigned char cclass[256] = {
+    [0] = C_SPACE,
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+    ['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+    ['\''] = C_SQUOTE, ['"'] = C_DQUOTE,
+    ['|'] = C_OP, ['<'] = C_OP, ['>'] = C_OP, ['&'] = C_OP, [';'] = C_OP,
+    ['\\'] = C_ESCAPE,
 };
 
-/* makes a bit of logic below prettier */
-int isquote(int c)
+static const unsigned char op_type[256] = {
+    ['|'] = TOK_PIPE, ['<'] = TOK_IN, ['>'] = TOK_OUT, ['&'] = TOK_AMP,
+    [';'] = TOK_SEMI,
+};
+
+/* word-at-a-time helpers (see "Bit Twiddling Hacks"): test 8 bytes at
+ * once for any byte that could end a word - a control/space character
+ * (< 0x21) or one of the quote, operator and backslash characters. a hit only
+ * means "look closer"; the exact decision is made with cclass[].
+ */
+#define ONES    0x0101010101010101ULL
+#define HIGHS   0x8080808080808080ULL
+#define HAS_ZERO(v)     (((v) - ONES) & ~(v) & HIGHS)
+#define HAS_LESS(v, n)  (((v) - ONES * (n)) & ~(v) & HIGHS)
+#define HAS_BYTE(v, c)  HAS_ZERO((v) ^ (ONES * (unsigned char)(c)))
+
+static const char *skip_word(const char *p, const char *end)
+{
+    while (end - p >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        if (HAS_LESS(v, 0x21) | HAS_BYTE(v, '\'') | HAS_BYTE(v, '"') |
+            HAS_BYTE(v, '|') | HAS_BYTE(v, '<') | HAS_BYTE(v, '>') |
+            HAS_BYTE(v, '&') | HAS_BYTE(v, ';') | HAS_BYTE(v, '\\'))
+            break;
+        p += 8;
+    }
+    while (p < end && cclass[(unsigned char)*p] == C_WORD)
+        p++;
+    return p;
+}
+
+void tok_init(struct tokenizer *t)
+{
+    memset(t, 0, sizeof(*t));
+}
+
+void tok_free(struct tokenizer *t)
 {
-    return c == '"' || c == '\'';
+    free(t->tokens);
+    free(t->argv);
+    free(t->buf);
+    tok_init(t);
 }
 
-/* really simple command line parser.
- * probably fails in a lot of corner cases.
+static void *xrealloc(void *p, size_t n)
+{
+    if ((p = realloc(p, n)) == NULL) {
+        perror("tokenize");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* the first " or \ in [p, end), or end
  */
+static const char *dquote_span(const char *p, const char *end)
+{
+    while (p < end && *p != '"' && *p != '\\')
+        p++;
+    return p;
+}
 
-/* tokenizer, takes previous char c1 (=0 at start) and current char c2.
- * returns the OR of the following values:
- *   SPLIT - c2 goes in a new word
- *   SAVE - c2 gets stored in its word
- * it's horribly ad-hoc, and the approach fails for more complex grammars
- * (e.g. it can't do wildcards right without extensive modification)
+/* p is just past an opening ": find the closing one (\" does not
+ * close it), or end
  */
-static int in_2quote;
-static int in_1quote;
-int split(char c1, char c2)
+static const char *dquote_end(const char *p, const char *end)
 {
-    if (c1 == 0) 
-        return NO_SPLIT | (isspace(c2) ? NO_SAVE : SAVE);
-    if (in_2quote) {
-        if (c2 == '"') {
-            in_2quote = 0;
-            return SPLIT | NO_SAVE;
+    while ((p = dquote_span(p, end)) < end && *p == '\\')
+        p += (p + 1 < end) ? 2 : 1;
+    return p;
+}
+
+/* find the first "$(" in [p, end), or NULL
+ */
+const char *tok_find_subst(const char *p, const char *end)
+{
+    while ((p = memchr(p, '$', end - p)) != NULL && p + 1 < end) {
+        if (p[1] == '(')
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* p points just past "$(" (or "<(", ">("): find the matching ')', skipping quoted
+ * text and nested parentheses. returns end if there is none (an
+ * unterminated substitution runs to the end of the line).
+ */
+const char *tok_subst_end(const char *p, const char *end)
+{
+    int depth = 1;
+    for (; p < end; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;        /* \) \" etc. are ordinary characters */
+        } else if (*p == '\'') {
+            if ((p = memchr(p + 1, '\'', end - p - 1)) == NULL)
+                return end;
+        } else if (*p == '"') {
+            if ((p = dquote_end(p + 1, end)) == end)
+                return end;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
         }
-        else
-            return NO_SPLIT | SAVE;
     }
-    else if (in_1quote) {
-        if (c2 == '\'') {
-            in_1quote = 0;
-            return SPLIT | NO_SAVE;
+    return end;
+}
+
+/* append a token whose text is already at out (see scan_word). the
+ * buffer was sized for the whole line up front, so it never reallocates.
+ */
+static char *add_token(struct tokenizer *t, char *out, int type, int quote,
+                       int joined, size_t len)
+{
+    if (t->n_tokens == t->tok_cap) {
+        t->tok_cap = t->tok_cap ? t->tok_cap * 2 : 64;
+        t->tokens = xrealloc(t->tokens, t->tok_cap * sizeof(*t->tokens));
+    }
+    struct token *tok = &t->tokens[t->n_tokens++];
+    tok->type = type;
+    tok->quote = quote;
+    tok->joined = joined;
+    tok->subst = 0;
+    tok->procsub = 0;
+    tok->text = out;
+    tok->len = len;
+    out[len] = 0;
+    return out + len + 1;
+}
+
+/* append a token, copying its text into the buffer.
+ */
+static char *emit(struct tokenizer *t, char *out, int type, int quote,
+                  int joined, const char *text, size_t len)
+{
+    memcpy(out, text, len);
+    return add_token(t, out, type, quote, joined, len);
+}
+
+/* copy one word to out, removing backslash escapes:
+ *  - quote 0: the word runs to the next space, quote or operator, and
+ *    a backslash makes the next character part of it
+ *  - quote '"': p is just past the opening quote and the word runs to
+ *    the closing one. only \$ \` \" and \\ are escapes; a backslash
+ *    before anything else is kept
+ * an escaped $ is stored as ESC_DOLLAR, so no variable or $(...) starts
+ * there. $(...) is copied unchanged (its command is tokenized again when
+ * it runs) and sets *subst.
+ *
+ * returns: the end of the word (the closing quote, or end if none);
+ *          *out is advanced past the copied text
+ */
+static const char *scan_word(const char *p, const char *end, int quote,
+                             char **out, int *subst)
+{
+    char *o = *out;
+    for (;;) {
+        const char *q = quote ? dquote_span(p, end) : skip_word(p, end);
+        const char *d = tok_find_subst(p, q);
+        if (d != NULL) {
+            /* the word goes on after $(...) */
+            q = tok_subst_end(d + 2, end);
+            q = (q < end) ? q + 1 : end;
+            *subst = 1;
+        }
+        memcpy(o, p, q - p);
+        o += q - p;
+        p = q;
+        if (d != NULL)
+            continue;
+        if (p == end || *p != '\\')
+            break;
+        if (p + 1 == end) {
+            *o++ = *p++;    /* a backslash at the end of the line stays */
+            break;
         }
-        else
-            return NO_SPLIT | SAVE;
+        char c = p[1];
+        if (c == '$')
+            *o++ = ESC_DOLLAR;
+        else if (!quote || c == '"' || c == '\\' || c == '`')
+            *o++ = c;
+        else {
+            *o++ = '\\';
+            *o++ = c;
+        }
+        p += 2;
     }
-    if (c2 == '"') {
-        in_2quote = 1;
-        return (isspace(c1) ? NO_SPLIT : SPLIT) | NO_SAVE;
+    *out = o;
+    return p;
+}
+
+/* split a line into tokens:
+ *  - whitespace separates words
+ *  - | < > & ; are tokens by themselves, and so are |+ << <<- <<< && ||
+ *  - '...' is copied literally and "..." with its backslash escapes
+ *    removed (see scan_word); both always form a word of their own (a
+ *    quote also ends the word before it). an unterminated quote runs
+ *    to the end of the line
+ *  - outside quotes a backslash makes the next character part of the
+ *    word (a\ b is the one word "a b")
+ *  - tokens that follow the previous one without a space are marked
+ *    joined (A="x y" is the word A= joined with the quoted x y)
+ *  - $(...) inside a word or "..." is part of it, spaces, quotes and
+ *    operators included; such words are marked subst
+ *  - <(...) and >(...) are a word of their own holding the command
+ *    between the parentheses, marked procsub
+ *
+ * there is no limit on line length or number of tokens. results are in
+ * t->tokens / t->argv.
+ *
+ * returns: number of tokens
+ */
+int tokenize(struct tokenizer *t, const char *line, size_t len)
+{
+    /* every byte yields at most one byte of text plus one NUL */
+    if (t->buf_cap < 2 * len + 1) {
+        t->buf_cap = 2 * len + 1;
+        t->buf = xrealloc(t->buf, t->buf_cap);
+    }
+    char *out = t->buf;
+    const char *p = line, *end = line + len;
+    t->n_tokens = 0;
+    t->n_heredocs = 0;
+    t->n_seps = 0;
+
+    while (p < end) {
+        unsigned char c = *p;
+        int joined = p > line && cclass[(unsigned char)p[-1]] != C_SPACE;
+        switch (cclass[c]) {
+        case C_SPACE:
+            p++;
+            break;
+        case C_OP:
+            if ((c == '<' || c == '>') && p + 1 < end && p[1] == '(') {
+                const char *q = tok_subst_end(p + 2, end);
+                out = emit(t, out, TOK_WORD, 0, joined, p + 2, q - p - 2);
+                t->tokens[t->n_tokens - 1].procsub = c;
+                p = (q < end) ? q + 1 : end;
+                break;
+            }
+            if (c == '|' && p + 1 < end && p[1] == '+') {
+                out = emit(t, out, TOK_FANOUT, 0, joined, p, 2);
+                p += 2;
+                break;
+            }
+            if ((c == '&' || c == '|') && p + 1 < end && p[1] == c) {
+                out = emit(t, out, c == '&' ? TOK_AND : TOK_OR, 0, joined, p, 2);
+                t->n_seps++;
+                p += 2;
+                break;
+            }
+            t->n_seps += (c == ';' || c == '&');
+            if (c == '<' && p + 1 < end && p[1] == '<') {
+                /* <<< here-string, <<- or << here-document */
+                size_t n = (p + 2 < end && (p[2] == '<' || p[2] == '-')) ? 3 : 2;
+                int type = (n == 3 && p[2] == '<') ? TOK_HERESTR : TOK_HEREDOC;
+                out = emit(t, out, type, 0, joined, p, n);
+                t->n_heredocs += (type == TOK_HEREDOC);
+                p += n;
+                break;
+            }
+            out = emit(t, out, op_type[c], 0, joined, p, 1);
+            p++;
+            break;
+        case C_SQUOTE: {
+            const char *q = memchr(p + 1, c, end - p - 1);
+            const char *stop = q ? q : end;
+            out = emit(t, out, TOK_WORD, c, joined, p + 1, stop - p - 1);
+            p = q ? q + 1 : end;
+            break;
+        }
+        case C_DQUOTE:
+        default: {
+            char *text = out;
+            int subst = 0;
+            p = scan_word(c == '"' ? p + 1 : p, end, c == '"' ? c : 0, &out, &subst);
+            out = add_token(t, text, TOK_WORD, c == '"' ? c : 0, joined, out - text);
+            t->tokens[t->n_tokens - 1].subst = subst;
+            if (c == '"')
+                p = (p < end) ? p + 1 : end;
+            break;
+        }
+        }
+    }
+
+    t->argv = xrealloc(t->argv, (t->n_tokens + 1) * sizeof(char *));
+    for (int i = 0; i < t->n_tokens; i++)
+        t->argv[i] = t->tokens[i].text;
+    t->argv[t->n_tokens] = NULL;
+    return t->n_tokens;
+}
+
+#ifdef TEST
+/* tokenizer throughput benchmark.
+ *
+ *   parser-bench [rounds] [corpus-file]
+ *
+ * without a file, builds a corpus of typical command lines plus a few
+ * xargs-style lines with thousands of arguments and one 1MB line. each
+ * round tokenizes the whole corpus; the original split()-based parser
+ * is run over the same lines (with buffers big enough) for comparison.
+ */
+#include <time.h>
+
+static int in_2quote;
+static int in_1quote;
+static int legacy_split(char c1, char c2)
+{
+    enum { NO_SPLIT = 0, SPLIT = 1, NO_SAVE = 0, SAVE = 2 };
+#define isq(c) ((c) == '"' || (c) == '\'')
+#define issp(c) (cclass[(unsigned char)(c)] == C_SPACE && (c) != 0)
+    if (c1 == 0)
+        return NO_SPLIT | (issp(c2) ? NO_SAVE : SAVE);
+    if (in_2quote) {
+        if (c2 == '"') { in_2quote = 0; return SPLIT | NO_SAVE; }
+        return NO_SPLIT | SAVE;
     }
-    if (c2 == '\'') {
-        in_1quote = 1;
-        return (isspace(c1) ? NO_SPLIT : SPLIT) | NO_SAVE;
+    if (in_1quote) {
+        if (c2 == '\'') { in_1quote = 0; return SPLIT | NO_SAVE; }
+        return NO_SPLIT | SAVE;
     }
+    if (c2 == '"') { in_2quote = 1; return (issp(c1) ? NO_SPLIT : SPLIT) | NO_SAVE; }
+    if (c2 == '\'') { in_1quote = 1; return (issp(c1) ? NO_SPLIT : SPLIT) | NO_SAVE; }
     if (c2 == '|')
-	return (isspace(c1) ? NO_SPLIT : SPLIT) | SAVE;
-    if (c1 == '|') 
-	return SPLIT | (isspace(c2) ? NO_SAVE : SAVE);
-    if (isspace(c2))
-        return ((isspace(c1) || isquote(c1)) ? NO_SPLIT : SPLIT) | NO_SAVE;
+        return (issp(c1) ? NO_SPLIT : SPLIT) | SAVE;
+    if (c1 == '|')
+        return SPLIT | (issp(c2) ? NO_SAVE : SAVE);
+    if (issp(c2))
+        return ((issp(c1) || isq(c1)) ? NO_SPLIT : SPLIT) | NO_SAVE;
     if (c2 == '>' || c2 == '<')
-        return (isspace(c1) ? NO_SPLIT : SPLIT) | SAVE;
+        return (issp(c1) ? NO_SPLIT : SPLIT) | SAVE;
     if (c1 == '>' || c1 == '<')
-        return SPLIT | (isspace(c2) ? NO_SAVE : SAVE);
+        return SPLIT | (issp(c2) ? NO_SAVE : SAVE);
     return NO_SPLIT | SAVE;
 }
 
-/* parse an input line, copying individual words (plus terminating
- * null characters) into an output buffer, and storing pointers to 
- * those words in an argv-like array, both passed by the caller.
- *
- * returns: number of words in argv
- */
-int parse(const char *line, int argc_max, char **argv, char *buf, int buf_len)
+static int legacy_parse(const char *line, int argc_max, char **argv, char *buf, int buf_len)
 {
     in_1quote = in_2quote = 0;
     char *ptr = buf;
     int i = 0, prev = 0;
     argv[i] = ptr;
     for (const char *p = line; *p != 0; p++) {
-	int val = split(prev, *p);
-	if (val & SPLIT) {
-	    *ptr++ = 0;
-	    argv[++i] = ptr;
-	}
-	if (val & SAVE)
-	    *ptr++ = *p;
-	prev = *p;
-	if (ptr > buf+buf_len-2)
-	    break;
-	if (i >= argc_max-1)
-	    break;
+        int val = legacy_split(prev, *p);
+        if (val & 1) {
+            *ptr++ = 0;
+            argv[++i] = ptr;
+        }
+        if (val & 2)
+            *ptr++ = *p;
+        prev = *p;
+        if (ptr > buf + buf_len - 2 || i >= argc_max - 1)
+            break;
     }
-    if (ptr != argv[i]) { /* in word at line end? */
-	*ptr++ = 0;
-	i++;
+    if (ptr != argv[i]) {
+        *ptr++ = 0;
+        i++;
     }
     argv[i] = NULL;
     return i;
 }
 
-#ifdef TEST
-#include <stdio.h>
-int main(int argc, char **argv)
+struct corpus {
+    char **lines;
+    size_t *lens;
+    int n, cap;
+    size_t bytes, longest;
+};
+
+static void add_line(struct corpus *c, const char *s, size_t len)
 {
-    FILE *fp = stdin;
-    if (argc > 1)
-	fp = fopen(argv[1], "r");
-    char line[1024], buf[1024], *words[20];
-    while (fgets(line, sizeof(line), fp)) {
-	const char *comma = "";
-	int n = parse(line, 20, words, buf, sizeof(buf));
-	printf("[");
-	for (int i = 0; i < n; i++) {
-	    printf("%s'%s'", comma, words[i]);
-	    comma = ", ";
-	}
-	printf("]\n");
+    if (c->n == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->lines = xrealloc(c->lines, c->cap * sizeof(char *));
+        c->lens = xrealloc(c->lens, c->cap * sizeof(size_t));
     }
+    c->lines[c->n] = xrealloc(NULL, len + 1);
+    memcpy(c->lines[c->n], s, len);
+    c->lines[c->n][len] = 0;
+    c->lens[c->n++] = len;
+    c->bytes += len;
+    if (len > c->longest)
+        c->longest = len;
+}
+
+static void add_args_line(struct corpus *c, const char *cmd, int nargs)
+{
+    size_t cap = strlen(cmd) + nargs * 32 + 1, len = 0;
+    char *s = xrealloc(NULL, cap);
+    len += sprintf(s, "%s", cmd);
+    for (int i = 0; i < nargs; i++)
+        len += sprintf(s + len, " /data/in/part-%06d.log", i);
+    add_line(c, s, len);
+    free(s);
+}
+
+static void build_corpus(struct corpus *c)
+{
+    static const char *typical[] = {
+        "ls -l /home/user/projects/shell56",
+        "cat < input.txt | grep 'foo bar' | sort | uniq -c > counts.txt",
+        "echo \"hello world\" 'single quoted' plain words here",
+        "gcc -O2 -Wall -o shell56 shell56.c parser.c pathcache.c spawn.c",
+        "find . -name '*.c' | xargs wc -l | sort -n | tail -5",
+        "cd /tmp",
+        "pwd",
+        "zcat access.log.gz | cut -d\" \" -f1 | sort | uniq -c | sort -rn > top.txt",
+    };
+    int nt = sizeof(typical) / sizeof(typical[0]);
+    for (int i = 0; i < 200000; i++)
+        add_line(c, typical[i % nt], strlen(typical[i % nt]));
+    for (int i = 0; i < 50; i++)
+        add_args_line(c, "rm -f", 2000);
+    add_args_line(c, "tar cf out.tar", 45000);      /* ~1MB line */
+}
+
+static void read_corpus(struct corpus *c, const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL) {
+        perror(file);
+        exit(1);
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) != -1) {
+        if (len > 0 && line[len-1] == '\n')
+            len--;
+        add_line(c, line, len);
+    }
+    free(line);
+    fclose(fp);
 }
-#endif
 
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, struct corpus *c, int rounds,
+                   long tokens, double secs)
+{
+    printf("%-12s %8.1f MB/s %10.0f lines/s %12.0f tokens/s  (%.3f s)\n", name,
+           c->bytes * (double)rounds / secs / 1e6, c->n * (double)rounds / secs,
+           tokens / secs, secs);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    struct corpus c = {0};
+
+    if (argc > 2)
+        read_corpus(&c, argv[2]);
+    else
+        build_corpus(&c);
+    printf("corpus: %d lines, %.1f MB, longest line %zu bytes, %d rounds\n",
+           c.n, c.bytes / 1e6, c.longest, rounds);
+
+    struct tokenizer t;
+    tok_init(&t);
+    long tokens = 0;
+    double t0 = now();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < c.n; i++)
+            tokens += tokenize(&t, c.lines[i], c.lens[i]);
+    report("tokenize", &c, rounds, tokens, now() - t0);
+    tok_free(&t);
+
+    int argc_max = c.longest + 2;
+    char **words = xrealloc(NULL, argc_max * sizeof(char *));
+    char *buf = xrealloc(NULL, 2 * c.longest + 2);
+    tokens = 0;
+    t0 = now();
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < c.n; i++)
+            tokens += legacy_parse(c.lines[i], argc_max, words, buf, 2 * c.longest + 2);
+    report("split()", &c, rounds, tokens, now() - t0);
+    return 0;
+}
+#endif
@@ -1,18 +1,72 @@
 /*
- * file:        parser.c
+ * file:        parser.h
  * description: skeleton code for simple shell
  *
  * Peter Desnoyers, Northeastern CS5600 Fall 2023
  */
 
-/* standard include file protection: 
+/* standard include file protection:
 */
 #ifndef __PARSER_H__
 #define __PARSER_H__
 
-/* function declarations: 
+#include <stddef.h>
+
+/* token types:
 */
-int parse(const char *line, int argc_max, char **argv, char *buf, int buf_len);
+enum {
+    TOK_WORD = 0,       /* ordinary or quoted word */
+    TOK_PIPE,           /* | */
+    TOK_IN,             /* < */
+    TOK_OUT,            /* > */
+    TOK_AMP,            /* & */
+    TOK_FANOUT,         /* |+ */
+    TOK_HEREDOC,        /* << or <<- (text tells which) */
+    TOK_HERESTR,        /* <<< */
+    TOK_SEMI,           /* ; */
+    TOK_AND,            /* && */
+    TOK_OR,             /* || */
+};
 
-#endif
+/* a \$ in token text is stored as this byte: a literal $ that starts
+ * no variable or $(...) (var_expand turns it back into $)
+ */
+#define ESC_DOLLAR '\001'
+
+/* one token. text is a NUL-terminated copy inside the tokenizer's
+ * buffer, valid until the next call to tokenize() or tok_free().
+ */
+struct token {
+    int type;           /* TOK_xxx */
+    int quote;          /* 0, '\'' or '"' if the word came from quotes */
+    int joined;         /* no space between this token and the previous one */
+    int subst;          /* the word contains $(...) */
+    int procsub;        /* '<' or '>' for <(...) / >(...): text is the command */
+    char *text;
+    size_t len;
+};
 
+/* tokenizer context. all state lives here, so separate contexts can
+ * be used independently (and from different threads). output arrays
+ * grow as needed and are reused from one line to the next.
+ */
+struct tokenizer {
+    struct token *tokens;   /* n_tokens tokens */
+    char **argv;            /* token texts, NULL-terminated */
+    int n_tokens;
+    int tok_cap;
+    char *buf;              /* token text storage */
+    size_t buf_cap;
+    int n_heredocs;         /* TOK_HEREDOC tokens in the line */
+    int n_seps;             /* TOK_SEMI, TOK_AND, TOK_OR and TOK_AMP tokens */
+};
+
+/* function declarations:
+*/
+void tok_init(struct tokenizer *t);
+int tokenize(struct tokenizer *t, const char *line, size_t len);
+void tok_free(struct tokenizer *t);
+const char *tok_find_subst(const char *p, const char *end);
+const char *tok_subst_end(const char *p, const char *end);
+
+#endif
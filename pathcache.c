@@ -0,0 +1,306 @@
+/*
+ * file:        pathcache.c
+ * description: PATH lookup cache for shell56
+ *
+ * execvp() 每次都要把 $PATH 里的目录挨个试一遍 execve，命令拼错时
+ * 更是要把整个 PATH 扫完才失败。这里在 shell 父进程里维护一张
+ * "命令名 -> 绝对路径" 的哈希表（开放寻址 + 线性探测），子进程拿到
+ * 解析好的路径后直接 execve。
+ *
+ *   - 正向条目：找到了命令，保存绝对路径
+ *   - 负向条目：命令不存在/没有执行权限，保存 errno；只在短时间内有效，
+ *     这样新安装的命令不会被一直挡住
+ *   - PATH 改变时整张表失效；hash -r 手动清空；hash -d 删除单个条目
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>	/* PATH_MAX */
+#include <sys/stat.h>
+
+#include "pathcache.h"
+#include "vars.h"
+
+/* PATH 未设置时使用的默认值（和 glibc 的 execvp 一致） */
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/* 负向条目的有效期（毫秒） */
+#define NEG_TTL_MS 1000
+
+/* 初始容量（必须是2的幂），装载因子超过 1/2 时扩容 */
+#define INITIAL_CAP 64
+
+struct pc_entry {
+    char *name;          /* NULL 表示空槽 */
+    char *path;          /* NULL 表示负向条目 */
+    int err;             /* 负向条目对应的 errno */
+    unsigned hits;       /* 命中次数（hash 命令显示） */
+    uint32_t hash;
+    int64_t stamp_ms;    /* 负向条目的创建时间 */
+};
+
+static struct pc_entry *table;
+static size_t cap, count;
+
+/* 建表时的 PATH；和当前 PATH 不同就整表作废 */
+static char *table_path;
+static int have_table_path;
+
+static struct {
+    unsigned long lookups, hits, neg_hits, misses, invalidated;
+} stats;
+
+/* FNV-1a 哈希 */
+static uint32_t hash_str(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* 在表中查找 name，返回它所在的槽，或者它应该插入的空槽 */
+static struct pc_entry *find_slot(const char *name, uint32_t h)
+{
+    size_t mask = cap - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        struct pc_entry *e = &table[i];
+        if (e->name == NULL)
+            return e;
+        if (e->hash == h && strcmp(e->name, name) == 0)
+            return e;
+    }
+}
+
+static void grow(void)
+{
+    struct pc_entry *old = table;
+    size_t old_cap = cap;
+
+    cap = cap ? cap * 2 : INITIAL_CAP;
+    table = calloc(cap, sizeof(*table));
+    if (table == NULL) {
+        perror("hash");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].name != NULL)
+            *find_slot(old[i].name, old[i].hash) = old[i];
+    free(old);
+}
+
+/*
+ * 删除一个槽里的条目。线性探测不能直接留空洞，否则后面同一条探测链上的
+ * 条目就找不到了，所以把后续条目往前挪（backward shift deletion）
+ */
+static void remove_slot(struct pc_entry *e)
+{
+    size_t mask = cap - 1;
+    size_t i = e - table;
+
+    free(e->name);
+    free(e->path);
+    count--;
+
+    for (size_t j = (i + 1) & mask; table[j].name != NULL; j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        /* home 不在 (i, j] 区间内，说明 j 可以挪到 i */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    memset(&table[i], 0, sizeof(table[i]));
+}
+
+void path_clear(void)
+{
+    if (cap == 0)
+        return;
+    for (size_t i = 0; i < cap; i++) {
+        free(table[i].name);
+        free(table[i].path);
+    }
+    memset(table, 0, cap * sizeof(*table));
+    count = 0;
+}
+
+/* PATH 变了吗？变了就清空缓存并记下新的 PATH */
+static void sync_path(const char *path)
+{
+    if (have_table_path && (path == NULL ? table_path == NULL :
+                            table_path != NULL && strcmp(path, table_path) == 0))
+        return;
+    path_clear();
+    free(table_path);
+    table_path = path ? strdup(path) : NULL;
+    have_table_path = 1;
+}
+
+/*
+ * 按照 execvp 的规则在 PATH 中查找命令：
+ *   - 空的 PATH 元素表示当前目录
+ *   - 找到可执行的普通文件就返回它的路径（malloc 得到）
+ *   - 有同名文件但不能执行时记为 EACCES，否则是 ENOENT
+ */
+static char *search_path(const char *name, const char *path, int *err)
+{
+    size_t name_len = strlen(name);
+    int saw_eacces = 0;
+    char buf[PATH_MAX];
+
+    if (path == NULL)
+        path = DEFAULT_PATH;
+
+    for (const char *p = path; ; p++) {
+        const char *end = strchr(p, ':');
+        size_t dir_len = end ? (size_t)(end - p) : strlen(p);
+        const char *dir = dir_len ? p : ".";
+
+        if (dir_len == 0)
+            dir_len = 1;
+        if (dir_len + 1 + name_len < sizeof(buf)) {
+            struct stat st;
+            memcpy(buf, dir, dir_len);
+            buf[dir_len] = '/';
+            memcpy(buf + dir_len + 1, name, name_len + 1);
+
+            if (stat(buf, &st) == 0) {
+                if (S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+                    return strdup(buf);
+                saw_eacces = 1;
+            } else if (errno == EACCES) {
+                saw_eacces = 1;
+            }
+        }
+        if (end == NULL)
+            break;
+        p = end;
+    }
+    *err = saw_eacces ? EACCES : ENOENT;
+    return NULL;
+}
+
+/*
+ * path_lookup: 把命令名解析成可以直接 execve 的路径
+ *
+ * 参数说明：
+ *   name: 命令名（例如 "ls"）
+ *   err:  找不到时写入 errno 值（ENOENT 或 EACCES）
+ *
+ * 返回值：
+ *   成功返回路径（由缓存持有，调用者不要 free；下一次 path_clear/path_forget
+ *   之前一直有效），失败返回 NULL
+ *
+ * 含有 '/' 的命令名不查 PATH，原样返回。
+ */
+const char *path_lookup(const char *name, int *err)
+{
+    if (name[0] == '\0') {
+        *err = ENOENT;
+        return NULL;
+    }
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    const char *path = var_get("PATH");
+    sync_path(path);
+    stats.lookups++;
+
+    uint32_t h = hash_str(name);
+    if (cap == 0)
+        grow();
+    struct pc_entry *e = find_slot(name, h);
+
+    if (e->name != NULL) {
+        if (e->path != NULL) {
+            e->hits++;
+            stats.hits++;
+            return e->path;
+        }
+        if (now_ms() - e->stamp_ms < NEG_TTL_MS) {
+            e->hits++;
+            stats.neg_hits++;
+            *err = e->err;
+            return NULL;
+        }
+        /* 负向条目过期了，重新查找 */
+        remove_slot(e);
+    }
+
+    stats.misses++;
+    int search_err = 0;
+    char *found = search_path(name, path, &search_err);
+
+    if ((count + 1) * 2 > cap)
+        grow();
+    e = find_slot(name, h);
+    e->name = strdup(name);
+    e->path = found;
+    e->err = search_err;
+    e->hits = 1;
+    e->hash = h;
+    e->stamp_ms = found ? 0 : now_ms();
+    count++;
+
+    if (found == NULL)
+        *err = search_err;
+    return found;
+}
+
+/* 删除一个条目（路径失效时，或者 hash -d） */
+void path_forget(const char *name)
+{
+    if (cap == 0)
+        return;
+    struct pc_entry *e = find_slot(name, hash_str(name));
+    if (e->name != NULL) {
+        if (e->path != NULL)
+            stats.invalidated++;
+        remove_slot(e);
+    }
+}
+
+/* 打印缓存内容（hash 命令不带参数时），返回条目数 */
+int path_list(FILE *fp)
+{
+    if (count == 0)
+        return 0;
+    fprintf(fp, "hits\tcommand\n");
+    for (size_t i = 0; i < cap; i++) {
+        struct pc_entry *e = &table[i];
+        if (e->name == NULL)
+            continue;
+        if (e->path != NULL)
+            fprintf(fp, "%4u\t%s\n", e->hits, e->path);
+        else
+            fprintf(fp, "%4u\t%s (%s)\n", e->hits, e->name, strerror(e->err));
+    }
+    return (int)count;
+}
+
+/* 打印查找统计（hash -s） */
+void path_stats(FILE *fp)
+{
+    fprintf(fp, "entries: %zu\n", count);
+    fprintf(fp, "lookups: %lu\n", stats.lookups);
+    fprintf(fp, "hits: %lu\n", stats.hits);
+    fprintf(fp, "negative hits: %lu\n", stats.neg_hits);
+    fprintf(fp, "misses: %lu\n", stats.misses);
+    fprintf(fp, "invalidated: %lu\n", stats.invalidated);
+}
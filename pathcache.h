@@ -0,0 +1,21 @@
+/*
+ * file:        pathcache.h
+ * description: PATH lookup cache (command name -> absolute path) for shell56
+ */
+
+/* standard include file protection:
+*/
+#ifndef __PATHCACHE_H__
+#define __PATHCACHE_H__
+
+#include <stdio.h>
+
+/* function declarations:
+*/
+const char *path_lookup(const char *name, int *err);
+void path_forget(const char *name);
+void path_clear(void);
+int path_list(FILE *fp);
+void path_stats(FILE *fp);
+
+#endif
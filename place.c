@@ -0,0 +1,352 @@
+/*
+ * file:        place.c
+ * description: CPU/NUMA placement of pipeline stages (LLC groups)
+ *
+ * 管道中相邻的两个命令通过管道交换数据：上游write时数据复制进内核的
+ * 管道缓冲区，下游read时再复制出来。两个进程在共享最后一级缓存（LLC，
+ * 一般是L3）的两个核上时，这些数据一直在LLC里；调度器把它们放到两个
+ * socket上时，每一页数据都要经过socket之间的互连，还可能在另一个NUMA
+ * 节点上分配内存。
+ *
+ * 这里把允许shell使用的CPU（sched_getaffinity）按LLC分组（来自
+ * /sys/devices/system/cpu/cpuN/cache/ 中级别最高的缓存），每组记下
+ * 它的NUMA节点。一个管道从某一组开始，按顺序每个命令一个核：
+ *
+ *   组0 = CPU 0-7 (节点0)   组1 = CPU 8-15 (节点0)   组2 = CPU 16-23 (节点1)
+ *   a | b | c    ->  a、b、c都限制在组0
+ *   十个命令      ->  前8个在组0，后2个在组1（同一个节点的组排在一起）
+ *
+ * 每个命令限制在整组CPU上而不是一个核上：组内怎么分由调度器决定，
+ * 组里有一个核很忙也没关系。下一个管道从下一组开始，几个管道同时运行时
+ * 不会都挤在第一组。
+ *
+ * 怎么限制子进程：shell在启动这个命令之前把自己的CPU集合（和内存策略）
+ * 设成这一组，子进程在exec之前就继承了它们（posix_spawn和fork都一样），
+ * 全部启动以后shell恢复自己原来的设置（place_leave）。zygote（-z）创建
+ * 的子进程继承不到，启动以后再用sched_setaffinity设置（place_pid），
+ * 这时没有内存策略。
+ *
+ * PLACE_NODE：同时把内存策略设成MPOL_PREFERRED这一组的节点（这个节点
+ * 的内存用完了仍然可以用别的节点的），管道缓冲区和命令自己的内存都在
+ * 本地。设置之前先用get_mempolicy记下shell原来的策略（例如在
+ * numactl --membind/--preferred下启动时继承来的），恢复时还原这个策略。
+ *
+ * 没有这些信息时（其它系统、/sys没有挂载），所有允许的CPU是一组。
+ */
+
+#define _GNU_SOURCE	/* cpu_set_t, sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>	/* SYS_set_mempolicy, SYS_get_mempolicy */
+#endif
+
+#include "place.h"
+
+/* linux/mempolicy.h中的值（不依赖libnuma的numaif.h） */
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#endif
+
+/* 内存策略的节点掩码：最多1024个节点（内核的MAX_NUMNODES） */
+#define MAX_NODES 1024
+#define MASK_LONGS (MAX_NODES / (8 * sizeof(unsigned long)))
+
+/* 一个LLC组：共享最后一级缓存的CPU（只包括允许shell使用的） */
+struct group {
+    cpu_set_t cpus;
+    int n_cpus;
+    int first;          /* 最小的CPU编号 */
+    int node;           /* NUMA节点，-1表示不知道 */
+};
+
+static struct group *groups;
+static int n_groups;
+static int loaded;
+static cpu_set_t allowed;   /* shell原来的CPU集合，place_leave恢复它 */
+static int set_cpus, set_mem;   /* shell自己的设置现在被改过 */
+static int next_start;      /* 下一个管道从哪一组开始 */
+static int saved_mode;      /* shell原来的内存策略，place_leave恢复它 */
+static unsigned long saved_mask[MASK_LONGS];
+
+/* 读一个/sys文件的第一行；失败时返回-1 */
+static int read_line(const char *path, char *buf, size_t len)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int ok = fgets(buf, len, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+/* "0-3,8-11" 这样的CPU列表 */
+static void parse_cpulist(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    for (;;) {
+        char *end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s)
+            break;
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        for (long c = a; c <= b && c < CPU_SETSIZE; c++)
+            CPU_SET(c, set);
+        if (*end != ',')
+            break;
+        s = end + 1;
+    }
+}
+
+/* 和cpu共享级别最高的缓存的CPU；没有缓存信息时返回-1 */
+static int cpu_llc(int cpu, cpu_set_t *set)
+{
+    char path[128], buf[4096];
+    int best = -1, best_level = 0;
+    for (int i = 0; ; i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+        if (read_line(path, buf, sizeof(buf)) == -1)
+            break;
+        if (atoi(buf) >= best_level) {
+            best_level = atoi(buf);
+            best = i;
+        }
+    }
+    if (best == -1)
+        return -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+             cpu, best);
+    if (read_line(path, buf, sizeof(buf)) == -1)
+        return -1;
+    parse_cpulist(buf, set);
+    return 0;
+}
+
+/* cpu所在的NUMA节点：/sys/devices/system/cpu/cpuN/ 中的 nodeX */
+static int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return -1;
+    int node = -1;
+    struct dirent *e;
+    while (node == -1 && (e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+            node = atoi(e->d_name + 4);
+    }
+    closedir(d);
+    return node;
+}
+
+static int find_group(int cpu)
+{
+    for (int g = 0; g < n_groups; g++)
+        if (CPU_ISSET(cpu, &groups[g].cpus))
+            return g;
+    return -1;
+}
+
+/* 同一个节点的组排在一起，节点内按CPU编号 */
+static int group_cmp(const void *a, const void *b)
+{
+    const struct group *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    return x->first - y->first;
+}
+
+/* 第一次用到时读取拓扑 */
+static void load(void)
+{
+    if (loaded)
+        return;
+    loaded = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || find_group(cpu) != -1)
+            continue;
+        cpu_set_t set;
+        if (cpu_llc(cpu, &set) == -1)
+            set = allowed;
+        CPU_AND(&set, &set, &allowed);
+        CPU_SET(cpu, &set);
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &set) && find_group(c) != -1)
+                CPU_CLR(c, &set);   // 缓存信息不一致时，每个CPU只在一组中
+
+        struct group *g = realloc(groups, (n_groups + 1) * sizeof(*g));
+        if (g == NULL)
+            break;
+        groups = g;
+        g = &groups[n_groups++];
+        g->cpus = set;
+        g->n_cpus = CPU_COUNT(&set);
+        g->first = cpu;
+        g->node = cpu_node(cpu);
+    }
+    qsort(groups, n_groups, sizeof(*groups), group_cmp);
+}
+
+/* place_parse: "off"、"llc"、"node" -> PLACE_xxx；不认识时返回-1 */
+int place_parse(const char *s)
+{
+    if (strcmp(s, "off") == 0)
+        return PLACE_OFF;
+    if (strcmp(s, "llc") == 0)
+        return PLACE_LLC;
+    if (strcmp(s, "node") == 0)
+        return PLACE_NODE;
+    return -1;
+}
+
+const char *place_name(int mode)
+{
+    return mode == PLACE_LLC ? "llc" : mode == PLACE_NODE ? "node" : "off";
+}
+
+/*
+ * place_start: 给一个n_stages个命令的管道选第一组（轮流）
+ *
+ * 返回值：组的编号；不能放置时返回-1
+ */
+int place_start(int n_stages)
+{
+    load();
+    if (n_groups == 0)
+        return -1;
+    int start = next_start % n_groups;
+    next_start = (place_group(start, n_stages - 1) + 1) % n_groups;
+    return start;
+}
+
+/* place_group: 从start组开始的管道中，第i个命令（从0开始）放在哪一组 */
+int place_group(int start, int i)
+{
+    int g = start;
+    while (i >= groups[g].n_cpus) {
+        i -= groups[g].n_cpus;
+        g = (g + 1) % n_groups;
+    }
+    return g;
+}
+
+/*
+ * place_enter: 把shell自己的CPU集合（PLACE_NODE时还有内存策略）设成
+ * group这一组，接下来启动的子进程继承它们
+ *
+ * 返回值：0；设置失败时返回-1（子进程不受限制）
+ */
+int place_enter(int group, int mode)
+{
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &groups[group].cpus) == -1)
+        return -1;
+    set_cpus = 1;
+#ifdef SYS_set_mempolicy
+    int node = groups[group].node;
+    if (mode == PLACE_NODE && node >= 0 && node < MAX_NODES) {
+        unsigned long mask[MASK_LONGS];
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        /* 读不到原来的策略就不改：没法恢复 */
+        if (syscall(SYS_get_mempolicy, &saved_mode, saved_mask, MAX_NODES, NULL, 0) == 0
+            && syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES) == 0)
+            set_mem = 1;
+    }
+#else
+    (void)mode;
+#endif
+    return 0;
+}
+
+/* place_leave: 恢复shell原来的CPU集合和内存策略 */
+void place_leave(void)
+{
+    if (set_cpus)
+        sched_setaffinity(0, sizeof(cpu_set_t), &allowed);
+#ifdef SYS_set_mempolicy
+    if (set_mem)
+        syscall(SYS_set_mempolicy, saved_mode, saved_mask, MAX_NODES);
+#endif
+    set_cpus = set_mem = 0;
+}
+
+/* place_pid: 已经启动的子进程（zygote创建的）放进group这一组 */
+void place_pid(pid_t pid, int group)
+{
+    sched_setaffinity(pid, sizeof(cpu_set_t), &groups[group].cpus);
+}
+
+/*
+ * place_cpu: 进程最后一次在哪个CPU上运行（/proc/<pid>/stat的第39项）。
+ * 结束以后、回收之前（僵尸进程）也能读
+ *
+ * 返回值：CPU编号；读不到时返回-1
+ */
+int place_cpu(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (read_line(path, buf, sizeof(buf)) == -1)
+        return -1;
+    char *p = strrchr(buf, ')');   // 命令名中可能有空格和括号
+    if (p == NULL)
+        return -1;
+    int field = 2;
+    for (p++; *p != '\0'; p++) {
+        if (*p != ' ')
+            continue;
+        if (++field == 39)
+            return atoi(p + 1);
+    }
+    return -1;
+}
+
+/* place_llc / place_node: cpu所在的组、NUMA节点；不知道时返回-1 */
+int place_llc(int cpu)
+{
+    load();
+    return (cpu >= 0 && cpu < CPU_SETSIZE) ? find_group(cpu) : -1;
+}
+
+int place_node(int cpu)
+{
+    int g = place_llc(cpu);
+    return (g >= 0) ? groups[g].node : -1;
+}
+
+/*
+ * place_format: 把group这一组的CPU写成 "0-3,8" 这样的列表
+ *
+ * 返回值：写了多少个字符（和snprintf一样，不包括结尾的NUL）
+ */
+int place_format(int group, char *buf, size_t len)
+{
+    const cpu_set_t *set = &groups[group].cpus;
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, set))
+            continue;
+        int end = c;
+        while (end + 1 < CPU_SETSIZE && CPU_ISSET(end + 1, set))
+            end++;
+        int n = (end > c) ? snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", c, end)
+                          : snprintf(buf + used, len - used, "%s%d", used ? "," : "", c);
+        if (n < 0 || (size_t)n >= len - used)
+            break;
+        used += n;
+        c = end;
+    }
+    return (int)used;
+}
@@ -0,0 +1,35 @@
+/*
+ * file:        place.h
+ * description: CPU/NUMA placement of pipeline stages (LLC groups)
+ */
+
+/* standard include file protection:
+*/
+#ifndef __PLACE_H__
+#define __PLACE_H__
+
+#include <sys/types.h>
+
+/* placement modes (set -o place=MODE, the place prefix):
+*/
+enum {
+    PLACE_OFF = 0,      /* the scheduler puts stages anywhere */
+    PLACE_LLC,          /* adjacent stages on cores sharing a last-level cache */
+    PLACE_NODE,         /* PLACE_LLC, and memory preferred on that NUMA node */
+};
+
+/* function declarations:
+*/
+int place_parse(const char *s);
+const char *place_name(int mode);
+int place_start(int n_stages);
+int place_group(int start, int i);
+int place_enter(int group, int mode);
+void place_leave(void);
+void place_pid(pid_t pid, int group);
+int place_cpu(pid_t pid);
+int place_llc(int cpu);
+int place_node(int cpu);
+int place_format(int group, char *buf, size_t len);
+
+#endif
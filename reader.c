@@ -0,0 +1,358 @@
+/*
+ * file:        reader.c
+ * description: line reader for script files, pipes and terminals
+ *
+ * 原来main用fgets/getline一行一行地从FILE*读取：每一行都要经过stdio的
+ * 锁和缓冲区，再复制一遍到line里。把几百万行生成的命令用管道喂给shell56
+ * 时，读输入本身就很显眼。
+ *
+ * 这里直接用系统调用：
+ *   - 普通文件（脚本文件，或者 ./shell56 < script）：整个mmap进来，
+ *     madvise(MADV_SEQUENTIAL)让内核积极预读；之后不再有任何系统调用
+ *   - 管道、终端：用大块的read()读进缓冲区；行比缓冲区长时缓冲区加倍，
+ *     所以行的长度没有限制
+ *   - 用memchr找换行符（glibc的memchr是SIMD实现的，一次比较16/32个字节）
+ *   - 返回的行直接指向映射/缓冲区（指针 + 长度），不复制，
+ *     tokenize()本来就接受指针 + 长度
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "reader.h"
+
+/* 管道/终端的初始缓冲区大小 */
+#define READ_CHUNK (64 * 1024)
+
+/*
+ * reader_open: 准备从fd读取行
+ *
+ * 参数说明：
+ *   r: 读取器
+ *   fd: 已经打开的文件描述符（reader_close不会关闭它）
+ *
+ * 返回值：成功返回0；内存不够返回-1
+ *
+ * 从当前的文件偏移量开始读（stdin不一定在文件开头）
+ */
+int reader_open(struct reader *r, int fd)
+{
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t off = lseek(fd, 0, SEEK_CUR);
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (off >= 0 && p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            r->data = p;
+            r->start = r->scan = (off < st.st_size) ? off : st.st_size;
+            r->end = st.st_size;
+            r->mapped = 1;
+            r->eof = 1;
+            /*
+             * stdin是和子进程共享的：子进程（例如脚本里的cat）应该从
+             * 当前行之后开始读，所以每读一行都要把偏移量移过去；
+             * 子进程读走的部分shell也要跳过（见reader_getline）
+             */
+            r->sync = (fd == STDIN_FILENO);
+            r->synced = r->start;
+            return 0;
+        }
+        if (p != MAP_FAILED)
+            munmap(p, st.st_size);
+    }
+
+    /* 不能映射（管道、终端、/proc下大小为0的文件等）：用read() */
+    r->cap = READ_CHUNK;
+    r->data = malloc(r->cap);
+    return r->data ? 0 : -1;
+}
+
+/*
+ * reader_open_mem: 从内存中的字符串读取行（-c 的命令字符串）
+ * data由调用者持有，读完之前要一直有效；reader_close不释放它
+ */
+void reader_open_mem(struct reader *r, const char *data, size_t len)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->data = (char *)data;
+    r->end = len;
+    r->eof = 1;
+    r->borrowed = 1;
+}
+
+/* 再读一些数据到缓冲区；没有更多数据时设置eof */
+static void fill(struct reader *r)
+{
+    /* 已经交出去的行不再需要，把剩下的半行挪到开头 */
+    if (r->start > 0) {
+        memmove(r->data, r->data + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->scan -= r->start;
+        r->start = 0;
+    }
+    /* 缓冲区里是一整行还没有结束，加倍 */
+    if (r->end == r->cap) {
+        char *p = realloc(r->data, r->cap * 2);
+        if (p == NULL) {
+            perror("read");
+            r->eof = 1;
+            return;
+        }
+        r->data = p;
+        r->cap *= 2;
+    }
+
+    ssize_t n;
+    do {
+        n = read(r->fd, r->data + r->end, r->cap - r->end);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        r->eof = 1;     /* 读错误和文件末尾一样处理（和fgets一样） */
+    else
+        r->end += n;
+}
+
+/* 交出 data[start..stop)，下一行从next开始 */
+static ssize_t take(struct reader *r, const char **line, size_t stop, size_t next)
+{
+    *line = r->data + r->start;
+    ssize_t len = stop - r->start;
+    r->start = r->scan = next;
+    if (r->sync) {
+        lseek(r->fd, r->start, SEEK_SET);
+        r->synced = r->start;
+    }
+    return len;
+}
+
+/*
+ * reader_getline: 读取下一行
+ *
+ * 参数说明：
+ *   r: 读取器
+ *   line: 输出，指向行的第一个字符（不以NUL结尾）
+ *
+ * 返回值：
+ *   行的长度（不包括换行符）；没有更多的行时返回-1
+ *   最后一行没有换行符也照样返回
+ *
+ * *line在下一次调用reader_getline之前有效
+ */
+ssize_t reader_getline(struct reader *r, const char **line)
+{
+    /*
+     * 偏移量和上次设置的不一样：上一条命令从stdin读走了一部分
+     * （例如 "cat" 一直读到文件末尾），从它停下的地方继续
+     */
+    if (r->sync) {
+        off_t off = lseek(r->fd, 0, SEEK_CUR);
+        if (off >= 0 && (size_t)off != r->synced)
+            r->start = r->scan = ((size_t)off < r->end) ? (size_t)off : r->end;
+    }
+
+    for (;;) {
+        char *nl = memchr(r->data + r->scan, '\n', r->end - r->scan);
+        if (nl != NULL) {
+            size_t stop = nl - r->data;
+            return take(r, line, stop, stop + 1);
+        }
+        r->scan = r->end;   // 这一段已经找过了，下次从新数据开始找
+        if (r->eof) {
+            if (r->start == r->end)
+                return -1;
+            return take(r, line, r->end, r->end);
+        }
+        fill(r);
+    }
+}
+
+void reader_close(struct reader *r)
+{
+    if (r->mapped)
+        munmap(r->data, r->end);
+    else if (!r->borrowed)
+        free(r->data);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+#ifdef TEST
+/* input benchmark: commands/sec through the old stdio path vs. the
+ * reader, from a regular file and from a pipe.
+ *
+ *   reader-bench [lines] [file]
+ *
+ * without a file, writes a corpus of typical command lines to a
+ * temporary file. every line is tokenized, as the shell would; the
+ * "read only" column leaves that out to show the input cost alone.
+ */
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "parser.h"
+
+enum { M_FGETS, M_GETLINE, M_READER };
+static const char *mode_name[] = { "fgets[1024]", "getline", "reader" };
+
+static const char *typical[] = {
+    "ls -l /home/user/projects/shell56",
+    "cat < input.txt | grep 'foo bar' | sort | uniq -c > counts.txt",
+    "echo \"hello world\" 'single quoted' plain words here",
+    "gcc -O2 -Wall -o shell56 shell56.c parser.c pathcache.c spawn.c",
+    "find . -name '*.c' | xargs wc -l | sort -n | tail -5",
+    "cd /tmp",
+    "pwd",
+    "zcat access.log.gz | cut -d\" \" -f1 | sort | uniq -c | sort -rn > top.txt",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void write_corpus(const char *file, long n)
+{
+    FILE *fp = fopen(file, "w");
+    if (fp == NULL) {
+        perror(file);
+        exit(1);
+    }
+    int nt = sizeof(typical) / sizeof(typical[0]);
+    for (long i = 0; i < n; i++)
+        fprintf(fp, "%s\n", typical[i % nt]);
+    fclose(fp);
+}
+
+/* feed the file into a pipe from a child process; returns the read end */
+static int pipe_from(const char *file, pid_t *pid)
+{
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    if ((*pid = fork()) == 0) {
+        close(fds[0]);
+        int fd = open(file, O_RDONLY);
+        static char buf[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            if (write(fds[1], buf, n) != n)
+                break;
+        _exit(0);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/* read every line from fd with the given method; returns lines read */
+static long run(int mode, int fd, int do_tokenize, size_t *bytes)
+{
+    struct tokenizer t;
+    long lines = 0;
+    *bytes = 0;
+    tok_init(&t);
+
+    if (mode == M_READER) {
+        struct reader r;
+        const char *line;
+        ssize_t len;
+        reader_open(&r, fd);
+        while ((len = reader_getline(&r, &line)) != -1) {
+            if (do_tokenize)
+                tokenize(&t, line, len);
+            *bytes += len + 1;
+            lines++;
+        }
+        reader_close(&r);
+    } else {
+        FILE *fp = fdopen(fd, "r");
+        char buf[1024], *line = NULL;
+        size_t cap = 0;
+        for (;;) {
+            ssize_t len;
+            if (mode == M_FGETS) {
+                if (fgets(buf, sizeof(buf), fp) == NULL)
+                    break;
+                len = strlen(buf);
+                line = buf;
+            } else if ((len = getline(&line, &cap, fp)) == -1) {
+                break;
+            }
+            *bytes += len;
+            if (len > 0 && line[len - 1] == '\n')
+                len--;
+            if (do_tokenize)
+                tokenize(&t, line, len);
+            lines++;
+        }
+        if (mode == M_GETLINE)
+            free(line);
+        fclose(fp);
+        fd = -1;
+    }
+    if (fd != -1)
+        close(fd);
+    tok_free(&t);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 2000000;
+    char tmp[] = "/tmp/reader-bench-XXXXXX";
+    const char *file = argc > 2 ? argv[2] : NULL;
+
+    if (file == NULL) {
+        int fd = mkstemp(tmp);
+        if (fd == -1) {
+            perror("mkstemp");
+            return 1;
+        }
+        close(fd);
+        write_corpus(tmp, n);
+        file = tmp;
+    }
+
+    printf("%-8s %-12s %14s %14s %10s\n", "input", "method",
+           "read only", "read+tokenize", "MB/s");
+    for (int is_pipe = 0; is_pipe < 2; is_pipe++) {
+        for (int mode = M_FGETS; mode <= M_READER; mode++) {
+            double rate[2], mbs = 0;
+            for (int tok = 0; tok < 2; tok++) {
+                pid_t pid = -1;
+                int fd = is_pipe ? pipe_from(file, &pid) : open(file, O_RDONLY);
+                size_t bytes;
+                double t0 = now();
+                long lines = run(mode, fd, tok, &bytes);
+                double secs = now() - t0;
+                if (pid > 0)
+                    waitpid(pid, NULL, 0);
+                rate[tok] = lines / secs;
+                if (tok == 0)
+                    mbs = bytes / secs / 1e6;
+            }
+            printf("%-8s %-12s %11.0f /s %11.0f /s %10.1f\n",
+                   is_pipe ? "pipe" : "file", mode_name[mode],
+                   rate[0], rate[1], mbs);
+        }
+    }
+
+    if (file == tmp)
+        unlink(tmp);
+    return 0;
+}
+#endif
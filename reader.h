@@ -0,0 +1,40 @@
+/*
+ * file:        reader.h
+ * description: line reader for script files, pipes and terminals
+ */
+
+/* standard include file protection:
+*/
+#ifndef __READER_H__
+#define __READER_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* regular files are mapped whole; anything else is read into a
+ * buffer that grows to hold the longest line. lines are handed out
+ * as pointer + length into that memory (no copy, no NUL), valid until
+ * the next reader_getline() call.
+ */
+struct reader {
+    int fd;
+    char *data;         /* the mapping, or buf */
+    size_t start;       /* first byte not handed out yet */
+    size_t scan;        /* no '\n' in data[start..scan) */
+    size_t end;         /* valid bytes in data */
+    size_t cap;         /* size of buf (0 when mapped) */
+    int mapped;
+    int eof;            /* nothing more to read from fd */
+    int sync;           /* keep the fd offset at start (mapped stdin) */
+    int borrowed;       /* data belongs to the caller (reader_open_mem) */
+    size_t synced;      /* offset we last set */
+};
+
+/* function declarations:
+*/
+int reader_open(struct reader *r, int fd);
+void reader_open_mem(struct reader *r, const char *data, size_t len);
+ssize_t reader_getline(struct reader *r, const char **line);
+void reader_close(struct reader *r);
+
+#endif
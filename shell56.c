@@ -7,10 +7,48 @@
  * Features implemented:
  * - Step 1: Signal handling (ignore SIGINT in interactive mode)
  * - Step 2: Builtin commands (cd, pwd, exit)
- * - Step 3: External command execution (fork/exec/wait)
- * - Step 4: $? variable expansion
+ * - Step 3: External command execution (spawn/wait, see spawn.c)
+ * - Step 4: $? variable expansion (now $NAME, ${NAME} and $! too, see below)
  * - Step 5: File redirection (< and >)
  * - Step 6: Pipeline execution (|)
+ * - PATH lookup cache with the hash builtin (pathcache.c)
+ * - Each line is parsed once into a syntax tree (ast.c) that lives in a
+ *   per-line arena (arena.c)
+ * - Input lines come from a zero-copy reader: mmap for script files,
+ *   large read() buffers for pipes and terminals (reader.c)
+ * - Background jobs (&) with the jobs, wait and fg builtins (jobs.c)
+ * - parallel builtin: run a command template over input lines, N at a time
+ * - time prefix: per-stage wall/CPU time, max RSS and context switches (wait4)
+ * - -z: spawn commands through a small fork-server process (zygote.c)
+ * - Builtin registry with perfect-hash dispatch; builtins take redirections
+ *   and can be pipeline stages; fork-free echo, printf, test/[, true, false, :
+ * - Pure copy stages (cat, < in > out) move data in-kernel (copy.c)
+ * - set -o pipesize/pipestat and the pipesize prefix: pipe capacity tuning
+ * - Pipelines run in their own process group, reaped via pidfds;
+ *   set -o pipefail/pipekill and the PIPESTATUS variable
+ * - Shell variables in a hashed symbol table (vars.c): $NAME and ${NAME}
+ *   anywhere in a word, NAME=value, export/unset/read, VAR=x cmd prefixes
+ * - Command substitution $(...), captured through a pipe (or a memfd)
+ *   into memory and split into words when unquoted
+ * - Process substitution <(...) and >(...): the command runs on a pipe
+ *   passed as /dev/fd/N, concurrently with the command that opens it
+ * - Fan-out operator |+: one producer feeds several branches, the stream
+ *   duplicated in-kernel with tee(2)/splice(2) (fanout.c)
+ * - Here-documents (<<EOF, <<-EOF) and here-strings (<<<) fed from a pipe
+ *   or a sealed memfd, never a temp file on disk
+ * - Command lists (; && ||) and if/while/until/for, compiled once into a
+ *   command tree (control.c) and run without re-reading the body; break
+ *   and continue
+ * - SHELL56_CACHE=dir: scripts are compiled once into a position-
+ *   independent cache file that later runs mmap and execute (bccache.c)
+ * - -c 'command' and -s: a short startup path for sh -c callers; a single
+ *   simple command is exec'ed in place of the shell, no fork and no wait
+ * - Every wait goes through evloop.c: one epoll set of pidfds, or SIGCHLD
+ *   where pidfds are missing; the timeout prefix gives a pipeline a
+ *   deadline, then SIGTERM and SIGKILL
+ * - set -o place and the place prefix: adjacent pipeline stages pinned to
+ *   cores sharing a last-level cache, optionally NUMA-local memory
+ *   (place.c); set -o placestat reports where each stage ran
  *
  * Peter Desnoyers, Northeastern CS5600 Fall 2025
  */
@@ -37,6 +75,34 @@
 /* " " 表示先检查当前目录，再检查系统库 */
 // 本地解析器，用于将用户输入的字符串分割成命令和参数
 #include "parser.h"
+// PATH查找缓存：命令名 -> 绝对路径
+#include "pathcache.h"
+// 进程创建（posix_spawn）：启动外部命令并连接好标准输入输出
+#include "spawn.h"
+// 语法树：管道 -> 命令 -> 参数 + 重定向列表（从arena中分配）
+#include "ast.h"
+// 行读取器：mmap脚本文件 / 大块read()管道，按行返回（不复制）
+#include "reader.h"
+// 作业表：后台执行的命令（&），由SIGCHLD驱动回收
+#include "jobs.h"
+// zygote：启动时fork出的小进程，-z 时由它创建子进程
+#include "zygote.h"
+// 内置命令表（builtins.def）和完美哈希查找，echo/test/printf等
+#include "builtins.h"
+// 纯复制命令（cat、"< in > out"）在内核中搬数据
+#include "copy.h"
+// shell变量：哈希表、导出的变量组成的envp、$NAME 展开
+#include "vars.h"
+// 扇出 |+：在内核中把一个管道的数据复制给多个分支
+#include "fanout.h"
+// 命令列表和控制结构：; && || if while until for，编译成命令树
+#include "control.h"
+// 脚本缓存：编译好的token和命令树写成文件，下次直接mmap执行
+#include "bccache.h"
+// 等待子进程的中心：pidfd放进epoll（没有pidfd时用SIGCHLD），可以设期限（timeout 前缀）
+#include "evloop.h"
+// 管道中的命令按LLC分组放在CPU上（set -o place、place 前缀）
+#include "place.h"
 
 /* 
  * 以下头文件提供系统级功能：
@@ -45,20 +111,19 @@
 #include <sys/types.h>
 // 进程等待功能（如waitpid）
 #include <sys/wait.h>
+// 资源使用统计（struct rusage，wait4/getrusage）
+#include <sys/resource.h>
+// 单调时钟（clock_gettime），time 命令计时用
+#include <time.h>
 // 信号处理功能（如signal, SIGINT等）
 #include <signal.h>
 // 文件操作功能（如open, O_RDONLY等）
 #include <fcntl.h>
+// 文件信息（fstat），命令替换读memfd时用
+#include <sys/stat.h>
 // 系统限制常量（如PATH_MAX，表示路径的最大长度）
 #include <limits.h>	/* PATH_MAX */
 
-/*
- * 常量定义
- */
-// 定义最大token数（token就是命令被分割后的每个单词）
-// 例如命令 "ls -l /home" 会被分割成3个token: "ls", "-l", "/home"
-#define MAX_TOKENS 32
-
 /* 
  * 全局变量
  * 
@@ -68,25 +133,122 @@
  */
 int last_exit_status = 0;
 
+/*
+ * last_bg_pid: 最近一个后台作业的子进程ID（管道中最后一个命令），供 $! 使用
+ * interactive: 是否为交互模式（在main中设置；后台作业和fg的行为和它有关）
+ */
+pid_t last_bg_pid = 0;
+bool interactive = false;
+
+/*
+ * set -o 设置的选项（见builtin_set）
+ * opt_pipesize: 新建管道的容量（字节），0表示系统默认（64 KiB）
+ * opt_pipestat: 前台管道结束后，报告每个命令读写了多少字节、阻塞了多久
+ */
+int opt_pipesize = 0;
+bool opt_pipestat = false;
+/*
+ * opt_pipefail: 管道的状态码是最右边一个失败的命令的（见wait_pipeline）
+ * opt_pipekill: 管道中一个命令失败时，马上结束其它命令
+ */
+bool opt_pipefail = false;
+bool opt_pipekill = false;
+/*
+ * opt_place: 管道中的命令怎么放在CPU上（PLACE_xxx，见place.c）
+ * opt_placestat: 前台管道结束后，报告每个命令限制在哪些CPU上、在哪里运行
+ */
+int opt_place = PLACE_OFF;
+bool opt_placestat = false;
+
+/*
+ * ran_subst: 这一行执行过 $(...)（见command_subst）。只有赋值的命令
+ * （例如 "A=$(false)"）的状态码是最后一个 $(...) 的状态码，否则是0
+ */
+bool ran_subst = false;
+
+/*
+ * 进程替换 <(...) / >(...)（见process_subst）：这一行启动的内部命令，
+ * 执行完这一行以后关闭shell这一端、回收它们（procsub_finish）
+ *   pl/tz/tree: 内部命令的语法树（等待时要用）
+ *   fd: shell这一端的管道（命令行中的 /dev/fd/N），-1表示已经关闭
+ *   detached: 属于后台作业了，由作业表回收
+ * procsub_base: 当前这一行的第一个（$(...) 中的命令行从后面开始）
+ */
+struct procsub {
+    struct pipeline *pl;
+    struct tokenizer tz;
+    struct arena tree;
+    int fd;
+    bool detached;
+};
+struct procsub *procsubs = NULL;
+int n_procsubs = 0;
+int procsubs_cap = 0;
+int procsub_base = 0;
+
+/*
+ * 循环（见run_node）：loop_depth是正在执行的 while/until/for 的层数，
+ * break n / continue n 把loop_break / loop_continue设为n，一层一层地减，
+ * 减到的那一层循环结束（break），或者开始下一次（continue）
+ */
+int loop_depth = 0;
+int loop_break = 0;
+int loop_continue = 0;
+
 /* 
  * 函数声明
  * 这些函数在main函数之后定义，所以需要先声明它们的存在
  * 这样main函数才能调用它们
  */
 // 主命令执行函数：决定命令是内置命令还是外部命令
-void execute_command(char **tokens, int n_tokens);
+void execute_command(struct pipeline *pl);
 // 判断一个命令是否是内置命令（shell自己实现的命令）
 int is_builtin_command(char *command);
-// 执行内置命令（如cd, pwd, exit）
-int execute_builtin(char **tokens, int n_tokens);
 // 执行外部命令（如ls, cat等系统命令）
-void execute_external(char **tokens, int n_tokens);
-// 展开 $? 变量（将 $? 替换为实际的上一个命令的退出状态码）
-void expand_dollar_question(char **tokens, int n_tokens);
+void execute_external(struct stage *st);
 // 执行带重定向的命令（处理 < 和 > 操作符）
-void execute_with_redirection(char **tokens, int n_tokens);
+void execute_with_redirection(struct stage *st);
 // 执行管道命令（处理 | 操作符，如 "ls | grep test"）
-void execute_pipeline(char **tokens, int n_tokens);
+void execute_pipeline(struct pipeline *pl);
+// 启动管道中的所有命令（不等待）/ 等待它们结束
+void launch_pipeline(struct pipeline *pl, int in_fd, int out_fd, pid_t pgid);
+int wait_pipeline(struct pipeline *pl);
+// 打开一个命令的所有重定向文件
+int open_redirections(struct stage *st, int *in_fd, int *out_fd);
+// 等待一个子进程结束，返回它的退出状态码
+int wait_for_child(pid_t pid);
+// 等待一个命令的子进程结束，同时记下它的资源使用（wait4）
+int wait_stage(struct stage *st);
+// time 前缀：执行命令并打印每个命令的时间和资源使用
+void execute_timed(struct pipeline *pl);
+// pipestat：打印管道中每个命令读写的字节数和阻塞的时间
+void print_pipestat(struct pipeline *pl, const struct timespec *start);
+// placestat：打印管道中每个命令限制在哪些CPU上、最后在哪个CPU上运行
+void print_placestat(struct pipeline *pl);
+// 解析 "64K"、"1M" 这样的大小 / "30"、"1.5m"、"2h" 这样的时间长度（毫秒）
+int parse_size(const char *s);
+int parse_duration(const char *s);
+// 把每个命令的状态码放进变量 PIPESTATUS
+void set_pipestatus(struct pipeline *pl);
+// 读出这一行中的here-document（<<EOF ... EOF）
+void read_heredocs(struct reader *rd, struct arena *a, struct tokenizer *tz);
+// 建立一个命令（管道）的语法树并执行，执行完清空arena
+void run_command(struct arena *a, const struct token *toks, int n, const char *text, size_t len);
+// -c 只有一个简单的外部命令时：直接exec它（不返回），否则返回
+void exec_simple(const char *command);
+// 有 ; && || 或者控制结构的命令：读完整、编译，再执行
+void run_script(struct reader *rd, struct arena *a, struct tokenizer *tz);
+// SHELL56_CACHE：用编译好的缓存文件执行脚本（没有或者过期了时先编译）
+int run_cached(const char *script, int fd, struct arena *a);
+// 执行编译好的命令列表 / 其中一个命令（if、while、for……）
+void run_list(struct node *list, struct arena *a);
+void run_node(struct node *nd, struct arena *a);
+// 命令替换 $(...)：执行命令，取得它的输出（build_ast调用，在ast.h中声明）
+// 进程替换 <(...)/>(...)：启动命令，返回 /dev/fd/N（同上）
+// 进程替换的fd留给接下来启动的命令 / 执行完以后关闭fd、回收内部命令
+void procsub_inherit(int mark);
+void procsub_finish(int mark);
+// 内置命令的函数（builtin_cd, builtin_hash, ...）由builtins.h按builtins.def声明
 
 /*
  * main函数：程序的入口点
@@ -103,7 +265,43 @@ void execute_pipeline(char **tokens, int n_tokens);
 int main(int argc, char **argv)
 {
     /*
-     * 第一步：判断shell的运行模式
+     * 第一步：处理选项
+     * 
+     * -z（./shell56 -z [script]）：在shell还很小的时候fork出zygote，
+     *     之后由它创建所有的子进程（见zygote.c），shell后来占用多少内存
+     *     都不影响启动命令的速度
+     * -c 'command'：执行这个字符串（可以有多行），不读标准输入或者脚本
+     *     文件。make的 SHELL=、system() 都这样用
+     * -s：从标准输入读命令（后面的参数不当作脚本文件）
+     * 
+     * 去掉选项之后，后面的参数处理和原来一样（argv[0]仍然是程序名）。
+     * -c 和 -s 后面的参数（sh中的 $0、$1……）shell56没有位置参数，忽略
+     */
+    bool use_zygote = false, read_stdin = false;
+    const char *command = NULL;
+    while (argc > 1 && command == NULL && !read_stdin) {
+        if (strcmp(argv[1], "-z") == 0) {
+            use_zygote = true;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) {
+                fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            command = argv[2];
+        } else if (strcmp(argv[1], "-s") == 0) {
+            read_stdin = true;
+        } else {
+            break;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (command != NULL || read_stdin)
+        argc = 1;
+    
+    /*
+     * 第二步：判断shell的运行模式
      * 
      * interactive: 是否为交互模式
      *   - true: 用户在终端直接输入命令（交互模式）
@@ -111,14 +309,34 @@ int main(int argc, char **argv)
      * 
      * isatty()函数检查标准输入是否是一个终端设备
      * 如果用户直接在终端运行shell，返回true；如果是从文件输入，返回false
+     * 
+     * -c 时走最短的启动路径（make每一行命令都要启动一次shell，启动的时间
+     * 就是主要的开销）：
+     *   - 不检查终端，不是交互模式（没有提示符，不忽略Ctrl+C）
+     *   - stdout直接设为全缓冲，stdio第一次输出时不再去探测它是不是终端
+     *   - 只有一个简单命令时直接exec它（见exec_simple）：不fork，不等待，
+     *     命令的状态码就是shell的状态码
+     */
+    if (command != NULL)
+        setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+    else
+        interactive = isatty(STDIN_FILENO);
+    
+    /*
+     * shell变量：导入环境变量（都是导出的，见vars.c）
      */
-    bool interactive = isatty(STDIN_FILENO);
+    vars_init();
+    
+    if (command != NULL)
+        exec_simple(command);   // 只在不能直接exec时返回
+    if (use_zygote)
+        zygote_start();
     
     /*
-     * fp: 文件指针，指向我们要读取命令的来源
-     * 默认是stdin（标准输入，通常是键盘），如果是批处理模式，会改为指向文件
+     * fd: 文件描述符，指向我们要读取命令的来源
+     * 默认是标准输入（通常是键盘），如果是批处理模式，会改为指向文件
      */
-    FILE *fp = stdin;
+    int fd = STDIN_FILENO;
     
     /* 
      * 步骤1：处理信号 - 在交互模式下忽略SIGINT信号
@@ -131,10 +349,18 @@ int main(int argc, char **argv)
     if (interactive) {
         // SIG_IGN表示忽略SIGINT信号（即Ctrl+C）
         signal(SIGINT, SIG_IGN);
+        // fg 把终端交给作业、再拿回来时（tcsetpgrp），shell不在前台进程组，
+        // 会收到SIGTTOU，忽略它
+        signal(SIGTTOU, SIG_IGN);
     }
+    
+    /*
+     * 后台作业：创建SIGCHLD的self-pipe，安装信号处理函数（见jobs.c）
+     */
+    jobs_init();
 
     /*
-     * 第二步：处理命令行参数
+     * 第三步：处理命令行参数
      * 
      * 如果用户提供了文件名作为参数（argc == 2），说明要执行脚本文件
      * 例如：./shell56 script.txt
@@ -143,9 +369,10 @@ int main(int argc, char **argv)
         // 设置为批处理模式
         interactive = false;
         // 打开用户指定的文件作为输入源
-        fp = fopen(argv[1], "r");
+        // O_CLOEXEC：脚本文件的fd不会被子进程继承
+        fd = open(argv[1], O_RDONLY | O_CLOEXEC);
         // 如果文件打开失败（文件不存在、权限不足等），打印错误并退出
-        if (fp == NULL) {
+        if (fd == -1) {
             fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
             exit(EXIT_FAILURE);
         }
@@ -161,23 +388,52 @@ int main(int argc, char **argv)
     }
     
     /*
-     * 第三步：准备存储用户输入和解析结果的变量
+     * 第四步：准备存储用户输入和解析结果的变量
      * 
-     * line: 存储用户输入的整行命令（最多1024个字符）
-     * linebuf: 解析器使用的缓冲区（用于存储token的字符串）
-     * tokens: 存储解析后的token指针数组（每个token是指向linebuf中某个位置的指针）
+     * rd: 行读取器（见reader.c）。脚本文件直接mmap，管道和终端用大块read()，
+     *     行的长度没有限制；-c 时直接读命令字符串
+     * tz: 解析器（tokenizer）的上下文，保存解析出来的token和它们的字符串，
+     *     内部的数组同样按需扩大，并且在各行之间重复使用
+     * arena: 语法树的内存，每一行执行完之后整体清空（见arena.c）
      */
-    char line[1024], linebuf[1024];
-    char *tokens[MAX_TOKENS];
+    struct arena arena;
+    arena_init(&arena);
     
     /*
-     * 第四步：主循环 - 不断读取和执行命令
+     * 脚本文件，并且设置了 SHELL56_CACHE=目录：执行编译好的缓存文件
+     * （见run_cached），不再一行一行地读脚本
+     */
+    if (argc == 2 && run_cached(argv[1], fd, &arena) == 0) {
+        arena_free(&arena);
+        return 0;
+    }
+    
+    struct reader rd;
+    if (command != NULL) {
+        reader_open_mem(&rd, command, strlen(command));
+    } else if (reader_open(&rd, fd) == -1) {
+        perror("reader");
+        exit(EXIT_FAILURE);
+    }
+    struct tokenizer tz;
+    tok_init(&tz);
+    
+    /*
+     * 第五步：主循环 - 不断读取和执行命令
      * 
      * 这个循环会一直运行，直到：
      *   - 用户输入EOF（在终端按Ctrl+D，或文件读到末尾）
      *   - 用户执行exit命令退出shell
      */
     while (true) {
+        /*
+         * 回收已经结束的后台作业（没有子进程结束时只是一次非阻塞的read）
+         * 交互模式下在提示符之前报告它们，例如 "[1]+  Done   sleep 1"
+         */
+        jobs_reap();
+        if (interactive)
+            jobs_notify(stderr);
+        
         /*
          * 如果处于交互模式，显示提示符 "$ "
          * 
@@ -196,41 +452,60 @@ int main(int argc, char **argv)
         /*
          * 读取用户输入的一行命令
          * 
-         * fgets()函数从文件指针fp读取一行（最多1023个字符，留一个给字符串结束符'\0'）
-         * 如果读到文件末尾（EOF），返回NULL，这时我们break退出循环
+         * reader_getline()读取一整行，让line指向这一行（不复制，也不以NUL结尾）
+         * （原来的fgets只能读1023个字符，更长的行会被从中间截断）
+         * 返回行的长度（不包括换行符）；读到文件末尾（EOF）时返回-1，这时我们break退出循环
          */
-        if (!fgets(line, sizeof(line), fp))
+        const char *line;
+        ssize_t len = reader_getline(&rd, &line);
+        if (len == -1)
             break;
 
         /*
          * 解析用户输入的命令
          * 
-         * parse()函数将用户输入的字符串（如 "ls -l /home"）分割成多个token
+         * tokenize()函数将用户输入的字符串（如 "ls -l /home"）分割成多个token
          * 例如："ls -l /home" 会被分割成：
          *   tokens[0] = "ls"
          *   tokens[1] = "-l"
          *   tokens[2] = "/home"
          *   n_tokens = 3
          * 
-         * 这个函数会处理引号、空格等特殊情况
+         * 这个函数会处理引号、空格等特殊情况；token的个数没有限制。
+         * 每个token都带有类型（单词、|、<、>），tz.tokens是token数组
          */
-        int n_tokens = parse(line, MAX_TOKENS, tokens, linebuf, sizeof(linebuf));
-
+        int n_tokens = tokenize(&tz, line, len);
+        
         /*
-         * 步骤4：展开 $? 变量
-         * 
-         * 在执行命令之前，我们需要先将命令中所有的 $? 替换为实际的上一个命令的退出状态码
-         * 例如：用户输入 "echo $?"，如果上一个命令成功（退出码0），
-         * 那么这个函数会将 $? 替换为 "0"，变成 "echo 0"
+         * 空行，什么都不做
          */
-        expand_dollar_question(tokens, n_tokens);
-
+        if (n_tokens == 0)
+            continue;
+        
+        /*
+         * 有 ;、&&、|| 或者以 if/while/until/for 开头：先编译成命令树
+         * （没有结束的控制结构要再读几行），再执行（见run_script）
+         */
+        if (is_control(&tz)) {
+            run_script(&rd, &arena, &tz);
+            continue;
+        }
+        
         /*
-         * 如果解析后有token（即用户确实输入了命令，而不是空行），执行命令
+         * here-document（<<EOF）：内容是接下来的几行，在建树之前读出来。
+         * 再读一行以后line就失效了，所以先把这一行复制到arena（作业表要用）
          */
-        if (n_tokens > 0) {
-            execute_command(tokens, n_tokens);
+        if (tz.n_heredocs > 0) {
+            char *copy = arena_alloc(&arena, len);
+            memcpy(copy, line, len);
+            line = copy;
+            read_heredocs(&rd, &arena, &tz);
         }
+        
+        /*
+         * 建立语法树并执行（见run_command），执行完arena清空
+         */
+        run_command(&arena, tz.tokens, n_tokens, line, len);
     }
 
     /*
@@ -240,6 +515,15 @@ int main(int argc, char **argv)
      */
     if (interactive)
         printf("\n");
+    
+    arena_free(&arena);
+    tok_free(&tz);
+    reader_close(&rd);
+    
+    /*
+     * -c 的状态码是最后一个命令的（make靠它判断这一行命令是否成功）
+     */
+    return (command != NULL) ? last_exit_status : 0;
 }
 
 /*
@@ -248,93 +532,353 @@ int main(int argc, char **argv)
  * 这个函数是整个shell的核心，它决定如何执行用户输入的命令
  * 
  * 参数说明：
- *   tokens: 解析后的命令token数组（例如：["ls", "-l", "/home"]）
- *   n_tokens: token的数量（例如：3）
+ *   pl: 这一行命令的语法树（一个管道，包含一个或多个命令）
  * 
  * 执行流程：
  *   1. 首先检查是否是内置命令（shell自己实现的命令）
  *   2. 如果不是内置命令，检查是否有管道（|）
  *   3. 如果没有管道，检查是否有重定向（< 或 >）
  *   4. 如果都没有，执行普通的外部命令
+ * 
+ * 原来每一步都要用strcmp把所有token扫一遍；现在语法树里已经有了
+ * 命令的个数和重定向列表，每一步只是检查一个字段
  */
-void execute_command(char **tokens, int n_tokens) {
+void execute_command(struct pipeline *pl) {
+    struct stage *first = pl->stages;
+    
+    /*
+     * time 前缀（例如 "time ls | wc -l"）：计时整个管道，见execute_timed
+     */
+    if (first->argc > 0 && strcmp(first->argv[0], "time") == 0) {
+        execute_timed(pl);
+        return;
+    }
+    
+    /*
+     * pipesize 前缀（例如 "pipesize 1M zcat big.gz | sort | uniq"）：
+     * 这个管道中的管道容量，代替 set -o pipesize 的设置
+     */
+    if (first->argc > 0 && strcmp(first->argv[0], "pipesize") == 0) {
+        int size = (first->argc > 2) ? parse_size(first->argv[1]) : -1;
+        if (size <= 0) {
+            fprintf(stderr, "usage: pipesize SIZE command [| command ...]\n");
+            last_exit_status = 2;
+            return;
+        }
+        pl->pipe_size = size;
+        first->argv += 2;
+        first->argc -= 2;
+        execute_command(pl);
+        return;
+    }
+    
     /*
-     * 如果没有token（空命令），直接返回，什么都不做
+     * place 前缀（例如 "place node zcat big.gz | sort | uniq -c"）：
+     * 这个管道的放置方式（llc、node或者off），代替 set -o place 的设置
      */
-    if (n_tokens == 0) return;
+    if (first->argc > 0 && strcmp(first->argv[0], "place") == 0) {
+        int mode = (first->argc > 2) ? place_parse(first->argv[1]) : -1;
+        if (mode < 0) {
+            fprintf(stderr, "usage: place llc|node|off command [| command ...]\n");
+            last_exit_status = 2;
+            return;
+        }
+        pl->place = mode;
+        first->argv += 2;
+        first->argc -= 2;
+        execute_command(pl);
+        return;
+    }
+    
+    /*
+     * timeout 前缀（例如 "timeout 30m make -j8 | tee build.log"）：整个管道
+     * 最多执行DURATION，到时给管道的进程组发SIGTERM，再过KILL_AFTER
+     * （-k，默认5秒）还没有结束就发SIGKILL（见wait_pipeline）。
+     * 状态码和coreutils的timeout一样：超时是124（要用SIGKILL才结束的是137），
+     * 用法错误是125。DURATION为0表示没有期限。
+     * 管道中的命令（包括内置命令）都放在子进程中执行（见launch_pipeline），
+     * 只有一个内置命令时仍然在shell进程内执行，不受限制；
+     * 后台命令（&）也不受限制
+     */
+    if (first->argc > 0 && strcmp(first->argv[0], "timeout") == 0) {
+        int kill_after = 5000, skip = 1;
+        if (first->argc > 2 && strcmp(first->argv[1], "-k") == 0) {
+            kill_after = parse_duration(first->argv[2]);
+            skip = 3;
+        }
+        int ms = (first->argc > skip + 1 && kill_after >= 0) ? parse_duration(first->argv[skip]) : -1;
+        if (ms < 0) {
+            fprintf(stderr, "usage: timeout [-k DURATION] DURATION command [| command ...]\n");
+            last_exit_status = 125;
+            return;
+        }
+        pl->timeout_ms = ms;
+        pl->kill_after_ms = kill_after;
+        first->argv += skip + 1;
+        first->argc -= skip + 1;
+        execute_command(pl);
+        return;
+    }
+    
+    /*
+     * 没有命令名，只有赋值（例如 "A=1"、"A=1 B=$A > file"）：设置shell变量
+     * （新的变量不导出，已经导出的变量仍然是导出的），状态码为0
+     * （"A=$(cmd)" 时是cmd的状态码）。
+     * 管道和后台命令中只有赋值的命令，build_ast当作语法错误。
+     * 参数全部展开成空的（例如 "$UNSET"）时什么都不执行
+     */
+    if (first->argc == 0 && pl->n_stages == 1) {
+        for (int i = 0; i < first->n_assigns; i++)
+            var_assign(first->assigns[i], 0);
+        if (first->redirs == NULL) {
+            if (!ran_subst)
+                last_exit_status = 0;
+            return;
+        }
+    }
     
     /*
-     * 检查第一个token（即命令名）是否是内置命令
+     * 检查第一个命令的命令名是否是内置命令
      * 
      * 内置命令是shell自己实现的命令，不需要启动新进程
-     * 例如：cd（改变目录）、pwd（显示当前目录）、exit（退出shell）
+     * 例如：cd（改变目录）、pwd（显示当前目录）、exit（退出shell）、echo
+     * 
+     * 这里只处理单独的内置命令；管道中的内置命令和后台的内置命令（&）
+     * 由launch_pipeline处理（在shell进程内执行，或者在子进程中执行）
      */
-    if (is_builtin_command(tokens[0])) {
+    const struct builtin *b = (first->argc > 0) ? builtin_lookup(first->argv[0]) : NULL;
+    if (b != NULL && pl->n_stages == 1 && !pl->background) {
         /*
          * 步骤2：执行内置命令
          * 内置命令在shell进程内直接执行，不需要fork新进程
+         * 
+         * 有重定向时（例如 "echo hi > file"）先打开文件，执行期间临时换掉
+         * shell的标准输入/输出，执行完再换回来（builtin_run）；
+         * 文件打不开时命令不执行，状态码为1
+         * 
+         * builtin_run在换回来之前会刷新stdout：内置命令用printf输出，
+         * 否则它的输出会排到后面外部命令的输出之后
+         * 
+         * "VAR=x cmd" 的赋值只在执行期间有效（vars_push/vars_pop），
+         * 例如 "HOME=/tmp cd" 进入/tmp，但HOME不变
          */
-        last_exit_status = execute_builtin(tokens, n_tokens);
-    } else {
+        int in_fd = -1, out_fd = -1;
+        if (open_redirections(first, &in_fd, &out_fd) == -1) {
+            last_exit_status = 1;
+            return;
+        }
+        int mark = vars_push(first->assigns, first->n_assigns);
+        last_exit_status = builtin_run(b, first->argv, first->argc, in_fd, out_fd);
+        vars_pop(mark);
+        if (in_fd != -1) close(in_fd);
+        if (out_fd != -1) close(out_fd);
+    } else if (pl->n_stages == 1 && !pl->background && copy_stage(first)) {
         /*
-         * 如果不是内置命令，就是外部命令（如ls, cat等系统命令）
-         * 外部命令需要检查是否有特殊的操作符
+         * 只是复制数据的命令（例如 "cat < big.log > out.log"、"< in > out"）：
+         * 不启动cat，shell直接在打开的文件之间搬数据（copy_file_range、
+         * sendfile或splice，数据不经过用户态，见copy.c）
          */
-        
+        int in_fd = -1, out_fd = -1;
+        if (open_redirections(first, &in_fd, &out_fd) == -1) {
+            last_exit_status = 1;
+            return;
+        }
+        last_exit_status = copy_run(first, in_fd, out_fd);
+        if (in_fd != -1) close(in_fd);
+        if (out_fd != -1) close(out_fd);
+    } else if (pl->n_stages > 1 || (pl->background && first->argc > 0) || pl->timeout_ms > 0) {
         /*
-         * 第一步：检查是否有管道操作符（|）
+         * 步骤6：执行管道命令（有多个命令，如 "ls | grep test"）
+         * 管道是最复杂的，因为需要创建多个进程并通过管道连接它们
          * 
-         * 管道允许将一个命令的输出作为另一个命令的输入
-         * 例如："ls | grep test" 表示将ls的输出传给grep命令
+         * 后台命令（以 & 结尾）也走这里，哪怕只有一个命令：
+         * execute_pipeline负责把它们放进作业表，而不是等待它们。
+         * 有期限的命令（timeout）也是：它有自己的进程组，超时的时候
+         * 它启动的子进程也一起结束
          */
-        bool has_pipes = false;
-        // 遍历所有token，查找是否有 "|" 符号
-        for (int i = 0; i < n_tokens; i++) {
-            if (strcmp(tokens[i], "|") == 0) {
-                has_pipes = true;
-                break; // 找到一个就够了，可以退出循环
-            }
-        }
+        execute_pipeline(pl);
+    } else if (first->redirs != NULL) {
+        /*
+         * 步骤5：执行带重定向的命令（< 或 >）
+         * 
+         * < 表示输入重定向：将文件内容作为命令的输入
+         *   例如："cat < file.txt" 表示从file.txt读取内容
+         * > 表示输出重定向：将命令的输出写入文件
+         *   例如："ls > output.txt" 表示将ls的输出写入output.txt
+         */
+        execute_with_redirection(first);
+    } else {
+        /*
+         * 步骤3：执行普通的外部命令
+         * 这是最简单的情况：直接启动一个新进程，执行命令
+         */
+        execute_external(first);
+    }
+}
+
+/*
+ * execute_timed: time 前缀，执行命令并报告每个命令的资源使用
+ * 
+ * 参数说明：
+ *   pl: 第一个命令以 "time" 开头的语法树（这个函数会把 "time" 去掉）
+ * 
+ * 例如：
+ *   $ time sort big.txt | uniq -c | sort -n > /dev/null
+ *             real     user      sys     maxrss   vcsw  ivcsw  command
+ *   [1]      2.731    2.402    0.188    501236K     12    290  sort big.txt
+ *   [2]      2.954    0.210    0.031      1740K   1688     25  uniq -c
+ *   [3]      2.958    0.004    0.002      1920K     15      1  sort -n
+ *   total    2.958    2.616    0.221    501236K   1715    316
+ * 
+ *   real: 从命令开始到这个命令结束的时间（单调时钟，不受系统时间调整影响）
+ *   user/sys: 这个命令使用的用户态/内核态CPU时间（秒）
+ *   maxrss: 最大常驻内存（KB）。posix_spawn的子进程在exec之前和shell共享内存，
+ *           Linux把那时的RSS也算进去，所以它不会小于shell自己的常驻内存
+ *   vcsw/ivcsw: 自愿（等待I/O、管道）/非自愿（时间片用完）的上下文切换次数
+ * 
+ * 这些数据都来自wait4（见wait_stage和wait_pipeline），不需要额外的系统调用。
+ * 报告写到标准错误；同时设置导出的变量，脚本（和子进程）可以读取：
+ *   TIME_REAL TIME_USER TIME_SYS TIME_MAXRSS TIME_VCSW TIME_IVCSW: 总计
+ *   TIME_STAGES: 每个命令一组 "real,user,sys,maxrss,vcsw,ivcsw"，空格分隔
+ * 
+ * 内置命令（例如 "time cd /"）没有子进程，用shell自己的getrusage的差值。
+ * 后台命令（"time cmd &"）不等待，所以只执行，不计时
+ */
+void execute_timed(struct pipeline *pl) {
+    struct stage *first = pl->stages;
+    first->argv++;
+    first->argc--;
+    
+    if (first->argc == 0 && first->redirs == NULL && pl->n_stages > 1) {
+        fprintf(stderr, "time: syntax error\n");
+        last_exit_status = 1;
+        return;
+    }
+    if (pl->background) {
+        if (first->argc > 0)
+            execute_command(pl);
+        return;
+    }
+    
+    /*
+     * 第一步：执行命令，前后各记一次时间
+     * 只有 "time" 本身（没有命令）时什么都不执行，报告的时间是0
+     */
+    struct timespec start, end;
+    struct rusage self0, self1;
+    getrusage(RUSAGE_SELF, &self0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (first->argc > 0 || first->redirs != NULL)
+        execute_command(pl);
+    else
+        last_exit_status = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self1);
+    
+    bool builtin = pl->n_stages == 1 && !pl->background
+                   && (copy_stage(first) || (first->argc > 0 && is_builtin_command(first->argv[0])));
+    if (builtin) {
+        first->ru = self1;
+        long utime = (self1.ru_utime.tv_sec - self0.ru_utime.tv_sec) * 1000000L
+                   + (self1.ru_utime.tv_usec - self0.ru_utime.tv_usec);
+        long stime = (self1.ru_stime.tv_sec - self0.ru_stime.tv_sec) * 1000000L
+                   + (self1.ru_stime.tv_usec - self0.ru_stime.tv_usec);
+        first->ru.ru_utime.tv_sec = utime / 1000000;
+        first->ru.ru_utime.tv_usec = utime % 1000000;
+        first->ru.ru_stime.tv_sec = stime / 1000000;
+        first->ru.ru_stime.tv_usec = stime % 1000000;
+        first->ru.ru_nvcsw = self1.ru_nvcsw - self0.ru_nvcsw;
+        first->ru.ru_nivcsw = self1.ru_nivcsw - self0.ru_nivcsw;
+        first->end = end;
+    }
+    
+    /*
+     * 第二步：每个命令一行，最后一行是总计
+     * 没有启动的命令（找不到命令、重定向文件打不开）显示 "-"
+     */
+    double total_user = 0, total_sys = 0;
+    long max_rss = 0, total_vcsw = 0, total_ivcsw = 0;
+    double real = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    // TIME_STAGES 的长度和命令个数成正比，按需增长
+    char *stages_var = NULL;
+    size_t used = 0, cap = 0;
+    
+    fprintf(stderr, "%-6s %8s %8s %8s %10s %6s %6s  %s\n",
+            "", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+    int i = 1;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next, i++) {
+        if (st->argc == 0)
+            continue; // 只有重定向，没有命令
+        char label[16];
+        snprintf(label, sizeof(label), "[%d]", i);
+        fprintf(stderr, "%-6s ", label);
         
-        if (has_pipes) {
-            /*
-             * 步骤6：执行管道命令
-             * 管道是最复杂的，因为需要创建多个进程并通过管道连接它们
-             */
-            execute_pipeline(tokens, n_tokens);
+        if (st->pid <= 0 && !(st == first && builtin)) {
+            fprintf(stderr, "%8s %8s %8s %10s %6s %6s ", "-", "-", "-", "-", "-", "-");
         } else {
-            /*
-             * 第二步：检查是否有重定向操作符（< 或 >）
-             * 
-             * < 表示输入重定向：将文件内容作为命令的输入
-             *   例如："cat < file.txt" 表示从file.txt读取内容
-             * > 表示输出重定向：将命令的输出写入文件
-             *   例如："ls > output.txt" 表示将ls的输出写入output.txt
-             */
-            bool has_redirection = false;
-            // 遍历所有token，查找是否有 "<" 或 ">" 符号
-            for (int i = 0; i < n_tokens; i++) {
-                if (strcmp(tokens[i], "<") == 0 || strcmp(tokens[i], ">") == 0) {
-                    has_redirection = true;
-                    break;
-                }
-            }
+            double st_real = (st->end.tv_sec - start.tv_sec)
+                           + (st->end.tv_nsec - start.tv_nsec) / 1e9;
+            double st_user = st->ru.ru_utime.tv_sec + st->ru.ru_utime.tv_usec / 1e6;
+            double st_sys = st->ru.ru_stime.tv_sec + st->ru.ru_stime.tv_usec / 1e6;
+            fprintf(stderr, "%8.3f %8.3f %8.3f %9ldK %6ld %6ld ", st_real, st_user, st_sys,
+                    st->ru.ru_maxrss, st->ru.ru_nvcsw, st->ru.ru_nivcsw);
             
-            if (has_redirection) {
-                /*
-                 * 步骤5：执行带重定向的命令
-                 * 需要打开文件，并将标准输入或标准输出重定向到文件
-                 */
-                execute_with_redirection(tokens, n_tokens);
-            } else {
-                /*
-                 * 步骤3：执行普通的外部命令
-                 * 这是最简单的情况：直接fork一个新进程，执行命令
-                 */
-                execute_external(tokens, n_tokens);
+            total_user += st_user;
+            total_sys += st_sys;
+            if (st->ru.ru_maxrss > max_rss)
+                max_rss = st->ru.ru_maxrss;
+            total_vcsw += st->ru.ru_nvcsw;
+            total_ivcsw += st->ru.ru_nivcsw;
+            
+            char entry[160];
+            int n = snprintf(entry, sizeof(entry), "%s%.3f,%.3f,%.3f,%ld,%ld,%ld",
+                             used ? " " : "", st_real, st_user, st_sys,
+                             st->ru.ru_maxrss, st->ru.ru_nvcsw, st->ru.ru_nivcsw);
+            if (n > 0 && (size_t)n < sizeof(entry)) {
+                if (used + n + 1 > cap) {
+                    size_t new_cap = cap ? cap * 2 : 256;
+                    while (used + n + 1 > new_cap)
+                        new_cap *= 2;
+                    char *p = realloc(stages_var, new_cap);
+                    if (p == NULL) {
+                        perror("time: realloc");
+                        exit(1);
+                    }
+                    stages_var = p;
+                    cap = new_cap;
+                }
+                memcpy(stages_var + used, entry, n + 1);
+                used += n;
             }
         }
+        
+        // 命令本身（参数用空格连接）
+        for (int k = 0; k < st->argc; k++)
+            fprintf(stderr, " %s", st->argv[k]);
+        fprintf(stderr, "\n");
     }
+    fprintf(stderr, "%-6s %8.3f %8.3f %8.3f %9ldK %6ld %6ld\n", "total",
+            real, total_user, total_sys, max_rss, total_vcsw, total_ivcsw);
+    
+    /*
+     * 第三步：把结果放进（导出的）变量
+     */
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.3f", real);
+    var_set("TIME_REAL", buf, VAR_EXPORT);
+    snprintf(buf, sizeof(buf), "%.3f", total_user);
+    var_set("TIME_USER", buf, VAR_EXPORT);
+    snprintf(buf, sizeof(buf), "%.3f", total_sys);
+    var_set("TIME_SYS", buf, VAR_EXPORT);
+    snprintf(buf, sizeof(buf), "%ld", max_rss);
+    var_set("TIME_MAXRSS", buf, VAR_EXPORT);
+    snprintf(buf, sizeof(buf), "%ld", total_vcsw);
+    var_set("TIME_VCSW", buf, VAR_EXPORT);
+    snprintf(buf, sizeof(buf), "%ld", total_ivcsw);
+    var_set("TIME_IVCSW", buf, VAR_EXPORT);
+    var_set("TIME_STAGES", stages_var ? stages_var : "", VAR_EXPORT);
+    free(stages_var);
 }
 
 /*
@@ -347,353 +891,1012 @@ void execute_command(char **tokens, int n_tokens) {
  *   1: 是内置命令
  *   0: 不是内置命令（是外部命令）
  * 
- * 内置命令是shell自己实现的命令，不需要启动外部程序
- * 我们的shell实现了三个内置命令：
- *   - cd: 改变当前工作目录
- *   - pwd: 打印当前工作目录
- *   - exit: 退出shell程序
+ * 内置命令是shell自己实现的命令，不需要启动外部程序。
+ * 所有内置命令都登记在builtins.def中，原来这里是一串strcmp，
+ * 现在用编译时生成的完美哈希查找（见builtins.c）：
+ *   - cd, pwd, exit: 目录和退出
+ *   - hash: 查看/清空PATH查找缓存
+ *   - jobs, wait, fg: 后台作业
+ *   - parallel: 对每一行输入并行执行一个命令
+ *   - export, unset: shell变量（见vars.c）
+ *   - :, true, false, echo, printf, test, [: 不需要创建进程的常用命令
  */
 int is_builtin_command(char *command) {
-    // strcmp函数比较两个字符串，如果相等返回0
-    if (strcmp(command, "cd") == 0) return 1;    // cd命令：改变目录
-    if (strcmp(command, "pwd") == 0) return 1;   // pwd命令：显示当前目录
-    if (strcmp(command, "exit") == 0) return 1;  // exit命令：退出shell
-    return 0; // 不是内置命令，返回0表示这是外部命令
+    return builtin_lookup(command) != NULL;
 }
 
 /*
- * execute_builtin: 执行内置命令
- * 
- * 参数说明：
- *   tokens: 解析后的命令token数组
- *   n_tokens: token的数量
- * 
- * 返回值：
- *   0: 命令执行成功
- *   1: 命令执行失败（或非0的退出状态码）
+ * builtin_cd: cd 内置命令，改变当前工作目录
  * 
- * 这个函数直接在当前shell进程中执行内置命令，不需要fork新进程
+ * cd命令可以：
+ *   - cd         : 无参数，切换到HOME目录
+ *   - cd /path   : 一个参数，切换到指定目录
+ *   - cd a b     : 多个参数，这是错误的，应该报错
  */
-int execute_builtin(char **tokens, int n_tokens) {
-    /*
-     * 处理 cd 命令：改变当前工作目录
-     * 
-     * cd命令可以：
-     *   - cd         : 无参数，切换到HOME目录
-     *   - cd /path   : 一个参数，切换到指定目录
-     *   - cd a b     : 多个参数，这是错误的，应该报错
-     */
-    if (strcmp(tokens[0], "cd") == 0) {
-        char *target_dir; // 目标目录路径
-        
-        if (n_tokens == 1) {
-            /*
-             * 情况1：没有参数，切换到HOME目录
-             * getenv("HOME")获取环境变量HOME的值（通常是用户的主目录，如/home/username）
-             */
-            target_dir = getenv("HOME");
-            // 如果HOME环境变量未设置，报错
-            if (target_dir == NULL) {
-                fprintf(stderr, "cd: HOME not set\n");
-                return 1;
-            }
-        } else if (n_tokens == 2) {
-            /*
-             * 情况2：有一个参数，切换到用户指定的目录
-             * 例如：cd /tmp，tokens[1]就是 "/tmp"
-             */
-            target_dir = tokens[1];
-        } else {
-            /*
-             * 情况3：多个参数，这是错误的
-             * 例如：cd /tmp /home，这是不允许的
-             * 
-             * 注意：根据测试要求，错误消息应该是 "wrong number of arguments"
-             */
-            fprintf(stderr, "cd: wrong number of arguments\n");
-            return 1;
-        }
-        
-        /*
-         * chdir()是系统调用，用于改变当前工作目录
-         * 如果成功，返回0；如果失败（目录不存在、权限不足等），返回-1并设置errno
-         */
-        if (chdir(target_dir) != 0) {
-            // 打印错误信息，strerror(errno)将错误码转换为可读的错误描述
-            fprintf(stderr, "cd: %s\n", strerror(errno));
-            return 1;
-        }
-        return 0; // 成功，返回0
-        
-    } else if (strcmp(tokens[0], "pwd") == 0) {
+int builtin_cd(char **tokens, int n_tokens) {
+    const char *target_dir; // 目标目录路径
+    
+    if (n_tokens == 1) {
         /*
-         * 处理 pwd 命令：打印当前工作目录
-         * 
-         * pwd命令应该没有参数，如果有参数就报错
-         * 例如：
-         *   pwd        : 正确，显示当前目录
-         *   pwd /tmp   : 错误，pwd不接受参数
+         * 情况1：没有参数，切换到HOME目录
+         * var_get("HOME")获取变量HOME的值（通常是用户的主目录，如/home/username）
          */
-        if (n_tokens > 1) {
-            fprintf(stderr, "pwd: too many arguments\n");
+        target_dir = var_get("HOME");
+        // 如果HOME环境变量未设置，报错
+        if (target_dir == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
             return 1;
         }
-        
-        /*
-         * 准备一个缓冲区来存储当前目录路径
-         * PATH_MAX是系统定义的常量，表示路径的最大长度（通常是4096）
-         */
-        char cwd[PATH_MAX];
-        
+    } else if (n_tokens == 2) {
         /*
-         * getcwd()函数获取当前工作目录的完整路径
-         * 参数说明：
-         *   cwd: 存储路径的缓冲区
-         *   sizeof(cwd): 缓冲区的大小
-         * 返回值：成功返回cwd的指针，失败返回NULL
+         * 情况2：有一个参数，切换到用户指定的目录
+         * 例如：cd /tmp，tokens[1]就是 "/tmp"
          */
-        if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            // 成功获取路径，打印出来并换行
-            printf("%s\n", cwd);
-            return 0;
-        } else {
-            // 获取失败（理论上不应该发生，但以防万一）
-            perror("pwd"); // perror会自动打印错误信息
-            return 1;
-        }
-        
-    } else if (strcmp(tokens[0], "exit") == 0) {
+        target_dir = tokens[1];
+    } else {
         /*
-         * 处理 exit 命令：退出shell程序
+         * 情况3：多个参数，这是错误的
+         * 例如：cd /tmp /home，这是不允许的
          * 
-         * exit命令可以：
-         *   - exit      : 无参数，以状态码0退出（表示成功）
-         *   - exit 5    : 一个参数，以指定的状态码退出
-         *   - exit 5 6  : 多个参数，这是错误的
+         * 注意：根据测试要求，错误消息应该是 "wrong number of arguments"
          */
-        if (n_tokens > 2) {
-            fprintf(stderr, "exit: too many arguments\n");
-            return 1;
-        }
-        
-        if (n_tokens == 1) {
-            /*
-             * 无参数：以状态码0退出（表示成功退出）
-             */
-            exit(0);
-        } else {
-            /*
-             * 有一个参数：将参数转换为整数，作为退出状态码
-             * atoi()函数将字符串转换为整数
-             * 例如：exit 5 -> 以状态码5退出
-             */
-            exit(atoi(tokens[1]));
-        }
+        fprintf(stderr, "cd: wrong number of arguments\n");
+        return 1;
     }
     
-    return 0; // 理论上不应该到达这里，但为了代码完整性
+    /*
+     * chdir()是系统调用，用于改变当前工作目录
+     * 如果成功，返回0；如果失败（目录不存在、权限不足等），返回-1并设置errno
+     */
+    if (chdir(target_dir) != 0) {
+        // 打印错误信息，strerror(errno)将错误码转换为可读的错误描述
+        fprintf(stderr, "cd: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0; // 成功，返回0
 }
 
-
 /*
- * execute_external: 执行外部命令（如ls, cat等系统命令）
- * 
- * 参数说明：
- *   tokens: 解析后的命令token数组（例如：["ls", "-l", "/home"]）
- *   n_tokens: token的数量
+ * builtin_pwd: pwd 内置命令，打印当前工作目录
  * 
- * 这个函数使用经典的fork/exec/wait模式：
- *   1. fork: 创建一个子进程（复制当前进程）
- *   2. exec: 在子进程中替换为要执行的命令程序
- *   3. wait: 父进程等待子进程执行完成
- * 
- * 为什么要fork新进程？
- *   因为exec会替换整个程序，如果我们不fork就直接exec，shell程序本身会被替换，
- *   执行完命令后shell就消失了。通过fork，我们可以保留shell进程，只替换子进程。
+ * pwd命令应该没有参数，如果有参数就报错
+ * 例如：
+ *   pwd        : 正确，显示当前目录
+ *   pwd /tmp   : 错误，pwd不接受参数
  */
-void execute_external(char **tokens, int n_tokens) {
+int builtin_pwd(char **tokens, int n_tokens) {
+    if (n_tokens > 1) {
+        fprintf(stderr, "pwd: too many arguments\n");
+        return 1;
+    }
+    
     /*
-     * fork()函数创建一个新的子进程
-     * 
-     * fork()的返回值有三种情况：
-     *   - 在子进程中：返回0
-     *   - 在父进程中：返回子进程的PID（进程ID，一个正整数）
-     *   - 出错：返回-1
-     * 
-     * fork之后，有两个几乎完全相同的进程在运行：
-     *   - 父进程：继续执行shell的逻辑，等待子进程完成
-     *   - 子进程：即将被替换为要执行的命令程序
+     * 准备一个缓冲区来存储当前目录路径
+     * PATH_MAX是系统定义的常量，表示路径的最大长度（通常是4096）
      */
-    pid_t pid = fork();
+    char cwd[PATH_MAX];
     
-    if (pid == 0) {
-        /*
-         * 子进程代码块
-         * 这个代码块只在子进程中执行
-         */
-        
-        /*
-         * 恢复SIGINT信号为默认行为
-         * 
-         * 在main函数中，我们设置了忽略SIGINT（Ctrl+C），这样shell不会被中断。
-         * 但在子进程中，我们希望命令能够被Ctrl+C中断（这是正常行为）。
-         * 所以我们将SIGINT恢复为默认行为（SIG_DFL）。
-         */
-        signal(SIGINT, SIG_DFL);
-        
-        /*
-         * execvp()函数用新的程序替换当前进程
-         * 
-         * 参数说明：
-         *   tokens[0]: 要执行的程序名（例如："ls"）
-         *   tokens: 传递给程序的参数数组（例如：["ls", "-l", "/home", NULL]）
-         * 
-         * execvp会在系统的PATH环境变量指定的目录中查找可执行文件
-         * 例如：execvp("ls", ...) 会在 /bin/ls、/usr/bin/ls 等目录中查找ls程序
-         * 
-         * 重要：如果execvp成功，它不会返回（因为整个进程都被替换了）
-         *       只有当出错时才会返回（例如程序不存在）
-         */
-        execvp(tokens[0], tokens);
-        
-        /*
-         * 如果代码执行到这里，说明execvp失败了
-         * （通常是因为命令不存在、没有执行权限等原因）
-         */
-        fprintf(stderr, "%s: %s\n", tokens[0], strerror(errno));
-        exit(EXIT_FAILURE); // 以失败状态码退出子进程
-        
-    } else if (pid > 0) {
+    /*
+     * getcwd()函数获取当前工作目录的完整路径
+     * 参数说明：
+     *   cwd: 存储路径的缓冲区
+     *   sizeof(cwd): 缓冲区的大小
+     * 返回值：成功返回cwd的指针，失败返回NULL
+     */
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        // 成功获取路径，打印出来并换行
+        printf("%s\n", cwd);
+        return 0;
+    } else {
+        // 获取失败（理论上不应该发生，但以防万一）
+        perror("pwd"); // perror会自动打印错误信息
+        return 1;
+    }
+}
+
+/*
+ * builtin_exit: exit 内置命令，退出shell程序
+ * 
+ * exit命令可以：
+ *   - exit      : 无参数，以状态码0退出（表示成功）
+ *   - exit 5    : 一个参数，以指定的状态码退出
+ *   - exit 5 6  : 多个参数，这是错误的
+ */
+int builtin_exit(char **tokens, int n_tokens) {
+    if (n_tokens > 2) {
+        fprintf(stderr, "exit: too many arguments\n");
+        return 1;
+    }
+    
+    if (n_tokens == 1) {
         /*
-         * 父进程代码块
-         * 这个代码块只在父进程中执行（pid是子进程的ID，是一个正数）
+         * 无参数：以状态码0退出（表示成功退出）
          */
-        
+        exit(0);
+    } else {
         /*
-         * 父进程需要等待子进程执行完成
-         * 
-         * waitpid()函数等待指定的子进程结束
-         * 
-         * 参数说明：
-         *   pid: 要等待的子进程ID
-         *   &status: 用于存储子进程的退出状态（通过这个变量返回）
-         *   WUNTRACED: 选项标志，表示也要等待被暂停的进程
-         * 
-         * 返回值：成功返回子进程ID，失败返回-1
+         * 有一个参数：将参数转换为整数，作为退出状态码
+         * atoi()函数将字符串转换为整数
+         * 例如：exit 5 -> 以状态码5退出
          */
-        int status;
-        
-        /*
-         * 使用循环等待，直到子进程真正退出或被信号终止
-         * 
-         * WIFEXITED(status): 检查子进程是否正常退出（调用exit）
-         * WIFSIGNALED(status): 检查子进程是否被信号终止（如Ctrl+C）
-         * 
-         * 这个循环是为了处理一些特殊情况，比如子进程可能被暂停和恢复
-         */
-        do {
-            waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+        exit(atoi(tokens[1]));
+    }
+}
+
+/*
+ * builtin_hash: hash 内置命令
+ * 
+ * 用法：
+ *   hash            : 列出缓存的命令（命中次数 + 路径）
+ *   hash -r         : 清空整个缓存
+ *   hash -d name... : 从缓存中删除指定命令
+ *   hash -s         : 显示查找统计（命中/未命中/负向命中）
+ *   hash name...    : 查找命令并放入缓存
+ */
+int builtin_hash(char **tokens, int n_tokens) {
+    if (n_tokens == 1) {
+        if (path_list(stdout) == 0)
+            printf("hash: hash table empty\n");
+        return 0;
+    }
+    if (strcmp(tokens[1], "-r") == 0) {
+        path_clear();
+        return 0;
+    }
+    if (strcmp(tokens[1], "-s") == 0) {
+        path_stats(stdout);
+        return 0;
+    }
+    
+    int status = 0;
+    bool forget = strcmp(tokens[1], "-d") == 0;
+    for (int i = forget ? 2 : 1; i < n_tokens; i++) {
+        int err;
+        if (forget)
+            path_forget(tokens[i]);
+        else if (path_lookup(tokens[i], &err) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", tokens[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+/*
+ * builtin_jobs: jobs 内置命令
+ * 
+ * 列出所有后台作业，例如：
+ *   [1]-  Running                 sleep 10 &
+ *   [2]+  Done                    make
+ * + 是当前作业（fg、wait不带参数时默认的作业），- 是前一个
+ * 已经结束的作业列出之后就从作业表中删除
+ */
+int builtin_jobs(char **tokens, int n_tokens) {
+    (void)tokens;
+    if (n_tokens > 1) {
+        fprintf(stderr, "jobs: too many arguments\n");
+        return 1;
+    }
+    jobs_reap();
+    jobs_list(stdout);
+    return 0;
+}
+
+/*
+ * builtin_wait: wait 内置命令
+ * 
+ * 用法：
+ *   wait           : 等待所有后台作业结束，状态码为0
+ *   wait %n        : 等待作业n，状态码是它的状态码（最后一个命令的）
+ *   wait pid       : 等待这个进程所在的作业，状态码是这个进程的状态码
+ *                    （例如 "sleep 1 &" 之后 "wait $!"）
+ * 有多个参数时逐个等待，状态码是最后一个的
+ * 等待过的作业从作业表中删除
+ */
+int builtin_wait(char **tokens, int n_tokens) {
+    if (n_tokens == 1) {
+        jobs_wait_all();
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 1; i < n_tokens; i++) {
+        struct job *j = job_find(tokens[i]);
+        if (j == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", tokens[i]);
+            status = 127;
+            continue;
+        }
+        status = job_wait(j);
+        // wait pid：返回的是这个进程自己的状态码
+        if (tokens[i][0] != '%') {
+            pid_t pid = (pid_t)atol(tokens[i]);
+            for (int k = 0; k < j->n_procs; k++) {
+                if (j->pids[k] == pid)
+                    status = j->status[k];
+            }
+        }
+        job_remove(j);
+    }
+    return status;
+}
+
+/*
+ * builtin_fg: fg 内置命令
+ * 
+ * 用法：
+ *   fg        : 把当前作业调到前台，等待它结束
+ *   fg %n     : 把作业n调到前台
+ * 
+ * 先打印作业的命令行；交互模式下把终端交给作业的进程组（tcsetpgrp），
+ * 这样作业可以读终端、Ctrl+C也只发给它，结束后再把终端拿回来
+ * 状态码是作业的状态码（和前台命令一样，会成为 $?）
+ */
+int builtin_fg(char **tokens, int n_tokens) {
+    if (n_tokens > 2) {
+        fprintf(stderr, "fg: too many arguments\n");
+        return 1;
+    }
+    struct job *j = job_find(n_tokens == 2 ? tokens[1] : NULL);
+    if (j == NULL) {
+        if (n_tokens == 2)
+            fprintf(stderr, "fg: %s: no such job\n", tokens[1]);
+        else
+            fprintf(stderr, "fg: no current job\n");
+        return 1;
+    }
+    
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    
+    bool give_tty = interactive && j->pgid > 0;
+    if (give_tty) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+        kill(-j->pgid, SIGCONT); // 作业可能因为读终端被停止了（SIGTTIN）
+    }
+    int status = job_wait(j);
+    if (give_tty) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    
+    job_remove(j);
+    return status;
+}
+
+/*
+ * parse_duration: 解析时间长度，可以有小数，可以带s、m、h、d后缀
+ * （秒、分、时、天，没有后缀是秒），例如 "10"、"0.5"、"1.5m"、"2h"
+ * 
+ * 返回值：毫秒数；格式不对或者超出int范围时返回-1
+ */
+int parse_duration(const char *s) {
+    char *end;
+    errno = 0;
+    double n = strtod(s, &end);
+    if (end == s || !(n >= 0) || errno != 0)
+        return -1;
+    double unit = 1000;
+    if (*end == 's') {
+        end++;
+    } else if (*end == 'm') {
+        unit = 60 * 1000.0;
+        end++;
+    } else if (*end == 'h') {
+        unit = 60 * 60 * 1000.0;
+        end++;
+    } else if (*end == 'd') {
+        unit = 24 * 60 * 60 * 1000.0;
+        end++;
+    }
+    if (*end != '\0' || n * unit > INT_MAX)
+        return -1;
+    return (int)(n * unit);
+}
+
+/*
+ * parse_size: 解析大小，可以带K或M后缀（1024的倍数），例如 "65536"、"64K"、"1M"
+ * 
+ * 返回值：字节数；格式不对或者超出int范围时返回-1
+ */
+int parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0 || errno != 0)
+        return -1;
+    if (*end == 'k' || *end == 'K') {
+        n <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        n <<= 20;
+        end++;
+    }
+    if (*end != '\0' || n > INT_MAX)
+        return -1;
+    return (int)n;
+}
+
+/*
+ * builtin_set: set 内置命令，设置shell的选项
+ * 
+ * 用法：
+ *   set [-o]                : 列出所有选项
+ *   set -o pipesize=SIZE    : 之后创建的管道的容量（例如 1M），最大为
+ *                             /proc/sys/fs/pipe-max-size
+ *   set +o pipesize         : 恢复系统默认（64 KiB）
+ *   set -o pipestat         : 每个前台管道结束后，在标准错误上报告每个命令
+ *                             读写的字节数和阻塞的时间（见print_pipestat）
+ *   set -o pipefail         : 管道的状态码是最右边一个失败的命令的状态码
+ *   set -o pipekill         : 管道中一个命令失败时，马上结束其它命令
+ *   set -o place=MODE       : 管道中的命令怎么放在CPU上（见place.c）：
+ *                             llc: 相邻的命令放在共享LLC的核上；node: 同时
+ *                             使用那个NUMA节点的内存；off: 不限制（默认）
+ *   set -o placestat        : 每个前台管道结束后，在标准错误上报告每个命令
+ *                             限制在哪些CPU上、在哪里运行（见print_placestat）
+ *   set +o NAME             : 关闭选项
+ * 
+ * 只对一个管道生效的容量、放置方式用 pipesize、place 前缀（见execute_command）
+ */
+static const struct {
+    const char *name;
+    bool *value;
+} bool_options[] = {
+    { "pipestat", &opt_pipestat },
+    { "pipefail", &opt_pipefail },
+    { "pipekill", &opt_pipekill },
+    { "placestat", &opt_placestat },
+};
+#define N_BOOL_OPTIONS ((int)(sizeof(bool_options) / sizeof(bool_options[0])))
+
+int builtin_set(char **tokens, int n_tokens) {
+    if (n_tokens == 1 || (n_tokens == 2 && strcmp(tokens[1], "-o") == 0)) {
+        if (opt_pipesize > 0)
+            printf("pipesize\t%d\n", opt_pipesize);
+        else
+            printf("pipesize\tdefault\n");
+        printf("place\t%s\n", place_name(opt_place));
+        for (int i = 0; i < N_BOOL_OPTIONS; i++)
+            printf("%s\t%s\n", bool_options[i].name, *bool_options[i].value ? "on" : "off");
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 1; i < n_tokens; i++) {
+        bool on = strcmp(tokens[i], "-o") == 0;
+        if ((!on && strcmp(tokens[i], "+o") != 0) || i + 1 == n_tokens) {
+            fprintf(stderr, "usage: set [-o|+o option]...\n");
+            return 2;
+        }
+        const char *name = tokens[++i];
         
-        /*
-         * 子进程已经结束，提取退出状态码
-         * 
-         * WEXITSTATUS(status)从status中提取退出码（0表示成功，非0表示失败）
-         * 我们将这个值保存到全局变量中，这样用户可以在下一个命令中使用 $? 来获取它
-         */
-        last_exit_status = WEXITSTATUS(status);
+        int k = 0;
+        while (k < N_BOOL_OPTIONS && strcmp(name, bool_options[k].name) != 0)
+            k++;
+        if (k < N_BOOL_OPTIONS) {
+            *bool_options[k].value = on;
+        } else if (!on && strcmp(name, "pipesize") == 0) {
+            opt_pipesize = 0;
+        } else if (on && strncmp(name, "pipesize=", 9) == 0 && parse_size(name + 9) > 0) {
+            opt_pipesize = parse_size(name + 9);
+        } else if (!on && strcmp(name, "place") == 0) {
+            opt_place = PLACE_OFF;
+        } else if (on && strncmp(name, "place=", 6) == 0 && place_parse(name + 6) >= 0) {
+            opt_place = place_parse(name + 6);
+        } else {
+            fprintf(stderr, "set: %s: invalid option\n", name);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * builtin_export: export 内置命令，导出变量（传给之后启动的命令）
+ * 
+ * 用法：
+ *   export                  : 按名字的顺序列出所有导出的变量
+ *   export NAME[=value] ... : 导出变量，有 =value 时同时赋值
+ * 
+ * 返回值：0；有参数不是合法的变量名时为1（其它参数照常处理）
+ */
+int builtin_export(char **tokens, int n_tokens) {
+    if (n_tokens == 1)
+        return vars_print_exported(stdout) < 0;
+    
+    int status = 0;
+    for (int i = 1; i < n_tokens; i++) {
+        if (var_export(tokens[i]) == -1) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", tokens[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * read_line: 从标准输入读一行，接在read_buf[used]后面（不包括换行）
+ * 
+ * 不能多读：标准输入是和后面的命令共用的（"while read l; do cmd; done < file"
+ * 中cmd接着读同一个fd）。能lseek的（普通文件）一次读一块，再把换行之后
+ * 多读的部分退回去；管道和终端只能一个字节一个字节地读
+ * 
+ * 返回值：read_buf中的总长度；一个字节都没有读到（文件末尾）时返回-1
+ */
+static char *read_buf;  // 各次read之间重复使用
+static size_t read_cap;
+
+static ssize_t read_line(size_t used) {
+    bool seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) != -1;
+    size_t chunk = seekable ? 4096 : 1;
+    bool got = false;
+    for (;;) {
+        if (used + chunk + 1 > read_cap) {
+            size_t cap = read_cap ? read_cap * 2 : 256;
+            while (cap < used + chunk + 1)
+                cap *= 2;
+            char *p = realloc(read_buf, cap);
+            if (p == NULL) {
+                perror("read");
+                break;
+            }
+            read_buf = p;
+            read_cap = cap;
+        }
+        ssize_t n = read(STDIN_FILENO, read_buf + used, chunk);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            perror("read");
+        if (n <= 0)
+            break;
+        got = true;
+        char *nl = memchr(read_buf + used, '\n', n);
+        if (nl != NULL) {
+            if (seekable)
+                lseek(STDIN_FILENO, (nl + 1) - (read_buf + used + n), SEEK_CUR);
+            used = nl - read_buf;
+            break;
+        }
+        used += n;
+    }
+    if (read_buf != NULL)
+        read_buf[used] = '\0';
+    return got ? (ssize_t)used : -1;
+}
+
+/*
+ * builtin_read: read 内置命令，从标准输入读一行，拆开放进变量
+ * 
+ * 用法：read [-r] [NAME ...]
+ *   按空格和制表符拆成单词，依次赋给NAME，剩下的都给最后一个NAME
+ *   （两头的空白去掉）；单词不够时后面的NAME为空。没有NAME时整行
+ *   放进REPLY。没有 -r 时反斜杠转义下一个字符（"\ " 不拆开），
+ *   行尾的反斜杠把下一行接上来
+ * 
+ * 返回值：0；读到文件末尾（没有读到任何内容）时为1，变量都设为空，
+ *         所以 "while read line; do ...; done < file" 在文件末尾结束
+ */
+int builtin_read(char **tokens, int n_tokens) {
+    bool raw = false;
+    int first = 1;
+    if (first < n_tokens && strcmp(tokens[first], "-r") == 0) {
+        raw = true;
+        first++;
+    }
+    if (first < n_tokens && tokens[first][0] == '-') {
+        fprintf(stderr, "read: %s: invalid option\nusage: read [-r] [NAME ...]\n", tokens[first]);
+        return 1;
+    }
+    for (int i = first; i < n_tokens; i++) {
+        if (!var_valid_name(tokens[i])) {
+            fprintf(stderr, "read: `%s': not a valid identifier\n", tokens[i]);
+            return 1;
+        }
+    }
+    
+    ssize_t len = read_line(0);
+    int status = (len == -1);
+    if (len == -1)
+        len = 0;
+    // 行尾没有被转义的反斜杠：去掉它，接上下一行
+    while (!raw && len > 0 && read_buf[len - 1] == '\\') {
+        int n = 0;
+        while (n < len && read_buf[len - 1 - n] == '\\')
+            n++;
+        if (n % 2 == 0)
+            break;
+        ssize_t more = read_line(len - 1);
+        len = (more == -1) ? len - 1 : more;
+        if (more == -1)
+            break;
+    }
+    
+    /*
+     * 在read_buf中原地拆开：去掉转义用的反斜杠以后，单词只会变短，
+     * 写的位置o总在读的位置p之前
+     */
+    char empty[1] = "";
+    char *p = read_buf ? read_buf : empty, *end = p + len;
+    char *const reply[] = { "REPLY" };
+    char *const *names = (first < n_tokens) ? &tokens[first] : reply;
+    int n_names = (first < n_tokens) ? n_tokens - first : 1;
+    bool split = (first < n_tokens);
+    for (int i = 0; i < n_names; i++) {
+        bool last = (i == n_names - 1);
+        while (split && p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        char *word = p, *o = p, *keep = p;  // keep: 最后一个不是空白的字符之后
+        while (p < end) {
+            if (!raw && *p == '\\' && p + 1 < end) {
+                *o++ = p[1];
+                p += 2;
+                keep = o;
+                continue;
+            }
+            if (split && (*p == ' ' || *p == '\t')) {
+                if (!last)
+                    break;
+            } else {
+                keep = o + 1;
+            }
+            *o++ = *p++;
+        }
+        if (split)
+            o = keep;
+        char saved = *o;    // o < end时是下一个单词之前的空白，p还没有读到它
+        *o = '\0';
+        var_set(names[i], word, 0);
+        *o = saved;
+    }
+    return status;
+}
+
+/*
+ * builtin_unset: unset 内置命令，删除变量（导出的变量同时从环境中去掉）
+ * 
+ * 用法：unset NAME ...
+ */
+int builtin_unset(char **tokens, int n_tokens) {
+    int status = 0;
+    for (int i = 1; i < n_tokens; i++) {
+        if (var_unset(tokens[i]) == -1) {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", tokens[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * parallel 内置命令
+ * 
+ * 用法：
+ *   parallel [-j N] [-g] [-a file] command [args...]
+ * 
+ *   从标准输入（或者 -a 指定的文件）一行一行地读取参数，每一行执行一次
+ *   command，把其中的 {} 换成这一行（没有 {} 时加在命令的最后），
+ *   同时最多运行N个（-j，默认是CPU的个数）。例如：
+ * 
+ *     parallel -j 8 gzip -9 {}                   （每个文件一个gzip）
+ *     parallel 'grep -c ERROR {} > {}.count'     （只有一个参数时当作命令行解析，
+ *                                                  可以使用 | < > ）
+ * 
+ *   -g: 分组输出。每个作业的标准输出先写到一个临时文件（Linux上是memfd，
+ *       不碰磁盘），作业结束后整块写到标准输出，不同作业的行不会交错
+ * 
+ * 返回值（$?）：失败的作业数（0表示全部成功），超过100时为101
+ * 
+ * 每个作业都是一个语法树（模板的副本），用launch_pipeline启动，
+ * 所以重定向、管道和普通命令完全一样
+ */
+
+/* 一个正在运行的作业 */
+struct par_slot {
+    struct arena arena;     // 这个作业的语法树（作业结束后清空，下一个作业重用）
+    struct pipeline *pl;    // NULL表示空闲
+    int n_live;             // 还没有结束的子进程数
+    int status;             // 最后一个命令的退出状态码
+    int out_fd;             // -g时的临时文件，否则为-1
+};
+
+/* 把word中所有的 {} 换成arg，没有 {} 时原样返回 */
+static char *par_subst(struct arena *a, char *word, const char *arg, size_t arg_len) {
+    if (strstr(word, "{}") == NULL)
+        return word;
+    
+    size_t n = 0;
+    for (const char *q = word; (q = strstr(q, "{}")) != NULL; q += 2)
+        n++;
+    char *out = arena_alloc(a, strlen(word) - 2 * n + n * arg_len + 1);
+    char *o = out;
+    const char *q = word, *p;
+    while ((p = strstr(q, "{}")) != NULL) {
+        memcpy(o, q, p - q);
+        o += p - q;
+        memcpy(o, arg, arg_len);
+        o += arg_len;
+        q = p + 2;
+    }
+    strcpy(o, q);
+    return out;
+}
+
+/* 复制模板的语法树，并把 {} 换成这一行参数 */
+static struct pipeline *par_instantiate(struct arena *a, const struct pipeline *tpl,
+                                        const char *arg, size_t arg_len) {
+    struct pipeline *pl = arena_alloc(a, sizeof(*pl));
+    *pl = *tpl;
+    
+    struct stage **link = &pl->stages;
+    for (const struct stage *t = tpl->stages; t != NULL; t = t->next) {
+        struct stage *st = arena_alloc(a, sizeof(*st));
+        memset(st, 0, sizeof(*st));
+        st->status = 1;
+        st->argc = t->argc;
+        st->argv = arena_alloc(a, (t->argc + 1) * sizeof(char *));
+        for (int i = 0; i < t->argc; i++)
+            st->argv[i] = par_subst(a, t->argv[i], arg, arg_len);
+        st->argv[t->argc] = NULL;
+        st->n_assigns = t->n_assigns;
+        st->assigns = arena_alloc(a, (t->n_assigns + 1) * sizeof(char *));
+        for (int i = 0; i < t->n_assigns; i++)
+            st->assigns[i] = par_subst(a, t->assigns[i], arg, arg_len);
+        
+        struct redir **rlink = &st->redirs;
+        for (const struct redir *tr = t->redirs; tr != NULL; tr = tr->next) {
+            struct redir *r = arena_alloc(a, sizeof(*r));
+            r->type = tr->type;
+            r->file = par_subst(a, tr->file, arg, arg_len);
+            *rlink = r;
+            rlink = &r->next;
+        }
+        *rlink = NULL;
         
+        st->pid = -1;
+        st->branch = t->branch;
+        st->next = NULL;
+        *link = st;
+        link = &st->next;
+    }
+    return pl;
+}
+
+/* 模板中有没有 {} */
+static bool par_has_placeholder(const struct pipeline *tpl) {
+    for (const struct stage *st = tpl->stages; st != NULL; st = st->next) {
+        for (int i = 0; i < st->argc; i++)
+            if (strstr(st->argv[i], "{}") != NULL)
+                return true;
+        for (const struct redir *r = st->redirs; r != NULL; r = r->next)
+            if (strstr(r->file, "{}") != NULL)
+                return true;
+    }
+    return false;
+}
+
+/* 作业结束：统计失败，输出分组的内容，槽变成空闲 */
+static void par_finish(struct par_slot *slot, int *failed) {
+    if (slot->status != 0)
+        (*failed)++;
+    
+    if (slot->out_fd != -1) {
+        char buf[65536];
+        ssize_t n;
+        lseek(slot->out_fd, 0, SEEK_SET);
+        while ((n = read(slot->out_fd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, n) != n)
+                break;
+        }
+        close(slot->out_fd);
+        slot->out_fd = -1;
+    }
+    arena_reset(&slot->arena);
+    slot->pl = NULL;
+}
+
+int builtin_parallel(char **tokens, int n_tokens) {
+    const char *usage = "parallel: usage: parallel [-j N] [-g] [-a file] command [args...]\n";
+    long n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool group = false;
+    const char *arg_file = NULL;
+    
+    /*
+     * 第一步：解析选项
+     */
+    int i = 1;
+    for (; i < n_tokens && tokens[i][0] == '-'; i++) {
+        if (strcmp(tokens[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(tokens[i], "-g") == 0) {
+            group = true;
+        } else if (strncmp(tokens[i], "-j", 2) == 0) {
+            const char *val = tokens[i][2] ? &tokens[i][2] : (i + 1 < n_tokens ? tokens[++i] : "");
+            char *end;
+            n_jobs = strtol(val, &end, 10);
+            if (*end != '\0' || end == val || n_jobs <= 0) {
+                fprintf(stderr, "parallel: -j: invalid number of jobs\n");
+                return 1;
+            }
+        } else if (strcmp(tokens[i], "-a") == 0 && i + 1 < n_tokens) {
+            arg_file = tokens[++i];
+        } else {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+    }
+    if (i == n_tokens) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+    if (n_jobs <= 0)
+        n_jobs = 1;
+    
+    /*
+     * 第二步：建立命令模板（一个语法树）
+     * 
+     *   只有一个参数：当作一行命令解析（可以有 | < >）
+     *   多个参数：直接作为一个命令的argv（参数里的空格、| 等都是普通字符）
+     * 没有 {} 时在最后一个命令的参数最后加上 {}
+     */
+    struct arena tpl_arena;
+    arena_init(&tpl_arena);
+    struct tokenizer tz;
+    tok_init(&tz);
+    struct pipeline *tpl;
+    
+    if (i == n_tokens - 1) {
+        int n = tokenize(&tz, tokens[i], strlen(tokens[i]));
+        tpl = (n > 0) ? build_ast(&tpl_arena, tz.tokens, n) : NULL;
+        if (tpl == NULL || tpl->background || tpl->stages->argc == 0) {
+            fprintf(stderr, "parallel: %s: syntax error\n", tokens[i]);
+            tok_free(&tz);
+            arena_free(&tpl_arena);
+            return 1;
+        }
     } else {
-        /*
-         * fork失败的情况（pid < 0）
-         * 这通常发生在系统资源不足时（进程数达到上限等）
-         */
-        perror("fork"); // 打印错误信息
-        last_exit_status = 1; // 设置退出状态为1（表示失败）
+        tpl = arena_alloc(&tpl_arena, sizeof(*tpl));
+        memset(tpl, 0, sizeof(*tpl));
+        tpl->stages = arena_alloc(&tpl_arena, sizeof(struct stage));
+        memset(tpl->stages, 0, sizeof(struct stage));
+        tpl->n_stages = 1;
+        tpl->stages->argv = &tokens[i];
+        tpl->stages->argc = n_tokens - i;
+    }
+    if (!par_has_placeholder(tpl)) {
+        struct stage *last = tpl->stages;
+        while (last->next != NULL)
+            last = last->next;
+        char **argv = arena_alloc(&tpl_arena, (last->argc + 2) * sizeof(char *));
+        memcpy(argv, last->argv, last->argc * sizeof(char *));
+        argv[last->argc++] = "{}";
+        argv[last->argc] = NULL;
+        last->argv = argv;
+    }
+    
+    /*
+     * 第三步：打开参数的来源
+     * 参数从标准输入读取时，作业的标准输入是/dev/null（不和parallel抢输入）
+     */
+    int arg_fd = STDIN_FILENO, job_in = -1;
+    if (arg_file != NULL) {
+        arg_fd = open(arg_file, O_RDONLY | O_CLOEXEC);
+        if (arg_fd == -1) {
+            fprintf(stderr, "parallel: %s: %s\n", arg_file, strerror(errno));
+            tok_free(&tz);
+            arena_free(&tpl_arena);
+            return 1;
+        }
+    } else {
+        job_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    struct reader rd;
+    reader_open(&rd, arg_fd);
+    
+    struct par_slot *slots = calloc(n_jobs, sizeof(*slots));
+    if (slots == NULL) {
+        perror("parallel");
+        n_jobs = 0;
+    }
+    for (long k = 0; k < n_jobs; k++) {
+        arena_init(&slots[k].arena);
+        slots[k].out_fd = -1;
+    }
+    
+    /*
+     * 第四步：主循环
+     * 
+     *   - 有空闲的槽，而且还有输入：读一行，启动一个作业
+     *   - 槽都满了（或者输入读完了）：等待任意一个作业的子进程结束
+     *     （evloop.c，只等作业自己的子进程，后台作业（&）的留给作业表），
+     *     更新那个作业。模板中有 |+ 时扇出的helper也要等（data是管道）
+     */
+    fflush(stdout); // 之前printf的内容要先输出，不能排到作业的输出后面
+    int running = 0, failed = 0;
+    bool more = (n_jobs > 0);
+    while (more || running > 0) {
+        while (more && running < n_jobs) {
+            const char *line;
+            ssize_t len = reader_getline(&rd, &line);
+            if (len == -1) {
+                more = false;
+                break;
+            }
+            
+            struct par_slot *slot = slots;
+            while (slot->pl != NULL)
+                slot++;
+            slot->pl = par_instantiate(&slot->arena, tpl, line, len);
+            if (group)
+                slot->out_fd = open_tmpfile("parallel");
+            launch_pipeline(slot->pl, job_in, slot->out_fd, 0);
+            
+            // 最后一个命令没有启动时是1；在shell进程内执行的内置命令已经有状态码了
+            struct stage *last = slot->pl->stages;
+            while (last->next != NULL)
+                last = last->next;
+            slot->status = last->status;
+            
+            slot->n_live = 0;
+            for (struct stage *st = slot->pl->stages; st != NULL; st = st->next) {
+                if (st->pid > 0) {
+                    ev_watch(st->pid, st);
+                    slot->n_live++;
+                }
+            }
+            if (slot->n_live > 0 && slot->pl->fanout_pid > 0) {
+                ev_watch(slot->pl->fanout_pid, slot->pl);
+                slot->n_live++;
+            }
+            if (slot->n_live > 0)
+                running++;
+            else
+                par_finish(slot, &failed); // 一个命令都没有启动
+        }
+        if (running == 0)
+            continue;
+        
+        void *data;
+        if (ev_wait(NULL, &data) == -1) {
+            perror("parallel: wait");
+            ev_clear();
+            break;
+        }
+        
+        for (long k = 0; k < n_jobs; k++) {
+            struct par_slot *slot = &slots[k];
+            if (slot->pl == NULL)
+                continue;
+            struct stage *st = slot->pl->stages;
+            while (st != NULL && st != data)
+                st = st->next;
+            if (st == NULL && data != slot->pl)
+                continue;
+            
+            // 它已经结束了，wait4马上返回
+            pid_t pid = (st != NULL) ? st->pid : slot->pl->fanout_pid;
+            int wstatus = 127 << 8; // 不是我们的子进程了（理论上不会发生）
+            while (wait4(pid, &wstatus, 0, NULL) == -1 && errno == EINTR)
+                ;
+            if (st == NULL)
+                slot->pl->fanout_pid = 0;
+            else if (st->next == NULL)
+                slot->status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus)
+                                                    : WEXITSTATUS(wstatus);
+            if (--slot->n_live == 0) {
+                par_finish(slot, &failed);
+                running--;
+            }
+            break;
+        }
     }
+    
+    for (long k = 0; k < n_jobs; k++)
+        arena_free(&slots[k].arena);
+    free(slots);
+    reader_close(&rd);
+    if (arg_fd != STDIN_FILENO) close(arg_fd);
+    if (job_in != -1) close(job_in);
+    tok_free(&tz);
+    arena_free(&tpl_arena);
+    
+    return failed > 100 ? 101 : failed;
 }
 
 /*
- * expand_dollar_question: 展开 $? 特殊变量
+ * execute_external: 执行外部命令（如ls, cat等系统命令）
  * 
  * 参数说明：
- *   tokens: 解析后的命令token数组（这个函数会修改这个数组）
- *   n_tokens: token的数量
+ *   st: 要执行的命令（st->argv 例如：["ls", "-l", "/home", NULL]）
  * 
- * 功能说明：
- *   这个函数实现了shell的 $? 特殊变量功能。
- *   $? 代表上一个命令的退出状态码（0表示成功，非0表示失败）。
- * 
- *   例如：
- *     $ ls /nonexistent      # 执行失败
- *     $ echo $?              # 输出上一个命令的退出码（比如2）
- *     
- *   这个函数会将命令中的 $? 替换为实际的数字字符串（如 "0", "1", "2"等）
- * 
- * 关键特性：
- *   - 使用静态缓冲区，避免内存管理问题
- *   - 可以处理同一个命令中出现多个 $? 的情况
- *   - 适用于内置命令和外部命令
- *   - 安全的空指针检查
+ * 这个函数使用spawn/wait模式：
+ *   1. spawn: 创建一个子进程并直接在其中执行命令（见spawn.c）
+ *   2. wait: 父进程等待子进程执行完成
+ * 
+ * 为什么不再直接fork？
+ *   fork要复制整个shell进程的页表，shell占用的内存越多，fork就越慢
+ *   （ASan版本的内存开销很大，更加明显）。spawn_command使用posix_spawn，
+ *   glibc中它是用clone(CLONE_VM|CLONE_VFORK)实现的：子进程在exec之前和父进程
+ *   共享内存，不需要复制页表，开销和shell的大小无关。
  */
-void expand_dollar_question(char **tokens, int n_tokens) {
+void execute_external(struct stage *st) {
     /*
-     * 使用静态缓冲区存储退出状态码的字符串形式
-     * 
-     * static关键字表示这个变量在函数调用之间保持存在
-     * （普通局部变量在函数返回后会被销毁）
-     * 这样我们可以在多次调用之间复用这个缓冲区，避免内存泄漏
+     * 描述要启动的子进程
      * 
-     * 16个字符足够存储任何退出状态码（最大9999，加上字符串结束符'\0'）
+     * in_fd/out_fd为-1表示标准输入输出都继承shell的，不做重定向
+     * （SIGINT恢复默认行为由spawn_command统一处理）
      */
-    static char qbuf[16];
+    struct spawn sp = { .argv = st->argv, .in_fd = -1, .out_fd = -1,
+                        .keep_fds = (n_procsubs > 0) };
     
     /*
-     * 将整数形式的退出状态码转换为字符串
+     * spawn_command()启动子进程，不等待它结束
      * 
-     * snprintf()函数类似于printf，但它是将格式化的字符串写入缓冲区
-     * 参数说明：
-     *   qbuf: 目标缓冲区
-     *   sizeof(qbuf): 缓冲区大小（防止溢出）
-     *   "%d": 格式字符串，表示将整数转换为十进制字符串
-     *   last_exit_status: 要转换的值（上一个命令的退出状态码）
+     * 返回值：
+     *   - 成功：子进程的PID
+     *   - 失败：-1（命令不存在、没有执行权限等），错误信息已经打印，
+     *     格式和原来子进程里execvp失败时一样
      * 
-     * 例如：如果last_exit_status是0，qbuf变成"0"
-     *      如果last_exit_status是1，qbuf变成"1"
+     * 子进程的环境是导出的shell变量，加上 "VAR=x cmd" 的赋值（vars_envp）
      */
-    snprintf(qbuf, sizeof(qbuf), "%d", last_exit_status);
+    int mark = vars_push(st->assigns, st->n_assigns);
+    st->pid = spawn_command(&sp);
+    vars_pop(mark);
+    if (st->pid < 0) {
+        last_exit_status = 1;
+        return;
+    }
     
     /*
-     * 遍历所有token，查找并替换 $? 符号
-     * 
-     * 例如：如果用户输入 "echo $?"，tokens可能是 ["echo", "$?"]
-     *       这个循环会将 tokens[1] 从 "$?" 改为指向 "0"（或实际的退出码）
+     * 父进程等待子进程执行完成，保存退出状态码（供 $? 使用）
      */
-    for (int i = 0; i < n_tokens; i++) {
-        /*
-         * 检查当前token是否为 "$?"
-         * 
-         * tokens[i] != NULL: 确保token指针有效（防止空指针）
-         * strcmp(tokens[i], "$?") == 0: 检查token的内容是否为 "$?"
-         */
-        if (tokens[i] != NULL && strcmp(tokens[i], "$?") == 0) {
-            /*
-             * 找到 $?，将其替换为实际的退出状态码字符串
-             * 
-             * 注意：我们不是复制字符串，而是直接将tokens[i]指向qbuf
-             * 这可以工作是因为qbuf是静态变量，在程序运行期间一直存在
-             */
-            tokens[i] = qbuf;
-        }
-    }
+    last_exit_status = wait_stage(st);
+}
+
+/*
+ * wait_for_child: 等待一个子进程结束，返回它的退出状态码
+ * 
+ * 参数说明：
+ *   pid: 要等待的子进程ID
+ * 
+ * 和所有的等待一样经过evloop.c（ev_reap）：子进程结束以后才回收它，
+ * 不会回收别的子进程（例如后台作业的）
+ *   WIFSIGNALED(status): 检查子进程是否被信号终止（如Ctrl+C），
+ *   这时状态码是128+信号编号（和前台管道一样）
+ *   WEXITSTATUS(status)从status中提取退出码（0表示成功，非0表示失败）
+ */
+int wait_for_child(pid_t pid) {
+    int status;
+    if (ev_reap(pid, &status, NULL) == -1)
+        return 127; // 不是我们的子进程了（理论上不会发生）
+    
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/*
+ * wait_stage: 和wait_for_child一样等待一个命令的子进程（st->pid），
+ * 回收时用wait4：内核在回收子进程时顺便返回它的资源使用
+ * （CPU时间、最大内存、上下文切换次数），不需要额外的系统调用
+ * 
+ * 结果记在语法树里：st->status、st->ru和回收的时间st->end，
+ * time 前缀用它们打印报告
+ */
+int wait_stage(struct stage *st) {
+    int status;
+    if (ev_reap(st->pid, &status, &st->ru) == -1)
+        status = 127 << 8; // 不是我们的子进程了（理论上不会发生）
+    
+    clock_gettime(CLOCK_MONOTONIC, &st->end);
+    st->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    return st->status;
 }
 
 /*
  * execute_with_redirection: 执行带输入/输出重定向的命令
  * 
  * 参数说明：
- *   tokens: 解析后的命令token数组（可能包含 < 和 > 操作符）
- *   n_tokens: token的数量
+ *   st: 要执行的命令（argv里只有命令和参数，重定向在st->redirs列表中）
  * 
  * 功能说明：
  *   这个函数处理shell的重定向功能：
@@ -708,555 +1911,1767 @@ void expand_dollar_question(char **tokens, int n_tokens) {
  *     - 0: 标准输入（stdin）- 通常是键盘
  *     - 1: 标准输出（stdout）- 通常是屏幕
  *     - 2: 标准错误（stderr）- 通常是屏幕
+ * 
+ * 原来这里要重新扫描tokens，把 < > 和文件名挑出去，拼出一个malloc的
+ * clean_tokens数组；现在语法树已经分好了，st->argv可以直接交给spawn
  */
-void execute_with_redirection(char **tokens, int n_tokens) {
-    /*
-     * 准备变量来存储重定向的文件名
-     */
-    char *input_file = NULL;   // 输入重定向的文件名（< 后面的文件）
-    char *output_file = NULL;  // 输出重定向的文件名（> 后面的文件）
-    
+void execute_with_redirection(struct stage *st) {
     /*
-     * clean_tokens用于存储去除重定向操作符后的"干净"命令
-     * 例如："cat < input.txt" 解析后变成 clean_tokens = ["cat", NULL]
-     *       这样execvp才能正确执行命令
+     * 第一步：在父进程中打开重定向文件
+     * 
+     * 原来是fork之后在子进程中open + dup2。现在父进程先打开文件，
+     * 再把fd交给spawn_command，由posix_spawn在子进程中dup2到0或1：
+     *   - < filename：只读打开，成为子进程的标准输入（文件描述符0）
+     *   - > filename：创建/清空后写入，成为子进程的标准输出（文件描述符1）
+     * 
+     * 文件打开失败时，open_redirect打印和原来一样的错误信息，
+     * 而且根本不需要创建子进程
      */
-    char *clean_tokens[MAX_TOKENS];
-    int clean_count = 0; // clean_tokens中实际有多少个token
+    int in_fd = -1, out_fd = -1;
+    bool opened = (open_redirections(st, &in_fd, &out_fd) == 0);
     
     /*
-     * 第一步：解析tokens，识别重定向操作符并提取文件名
+     * 第二步：启动子进程执行命令
      * 
-     * 遍历所有token，查找 "<" 和 ">" 符号：
-     *   - 找到 "<"：下一个token是输入文件名
-     *   - 找到 ">"：下一个token是输出文件名
-     *   - 其他token：是命令的参数，添加到clean_tokens中
+     * 重定向只影响子进程，shell自己的标准输入输出不变。
+     * 只有重定向、没有命令（例如 "> file"）时，文件已经打开
+     * （输出文件已经被创建/清空），不需要执行任何程序
      */
-    for (int i = 0; i < n_tokens; i++) {
-        if (strcmp(tokens[i], "<") == 0) {
-            /*
-             * 找到输入重定向操作符
-             */
-            // 检查是否有下一个token（即文件名）
-            if (i + 1 < n_tokens) {
-                input_file = tokens[i + 1]; // 保存输入文件名
-                i++; // 跳过文件名（下次循环直接处理再下一个token）
-            }
-        } else if (strcmp(tokens[i], ">") == 0) {
-            /*
-             * 找到输出重定向操作符
-             */
-            // 检查是否有下一个token（即文件名）
-            if (i + 1 < n_tokens) {
-                output_file = tokens[i + 1]; // 保存输出文件名
-                i++; // 跳过文件名
-            }
-        } else {
-            /*
-             * 这是一个普通的命令参数，不是重定向操作符
-             * 将其添加到clean_tokens中
-             */
-            clean_tokens[clean_count++] = tokens[i];
-        }
+    if (opened && st->argc > 0) {
+        struct spawn sp = { .argv = st->argv, .in_fd = in_fd, .out_fd = out_fd,
+                            .keep_fds = (n_procsubs > 0) };
+        int mark = vars_push(st->assigns, st->n_assigns);
+        st->pid = spawn_command(&sp);
+        vars_pop(mark);
     }
     
     /*
-     * execvp要求参数数组以NULL结尾，表示数组结束
-     * 例如：["cat", "-n", NULL]
+     * 子进程已经拿到了自己的副本，父进程关闭这些fd，避免文件描述符泄漏
      */
-    clean_tokens[clean_count] = NULL;
+    if (in_fd != -1) close(in_fd);
+    if (out_fd != -1) close(out_fd);
     
     /*
-     * 第二步：fork子进程来执行命令
+     * 第三步：等待子进程完成，保存退出状态码（供 $? 使用）
+     * 文件打不开、命令启动失败时状态码为1
+     */
+    if (st->pid > 0) {
+        last_exit_status = wait_stage(st);
+    } else {
+        last_exit_status = (opened && st->argc == 0) ? 0 : 1;
+    }
+}
+
+/*
+ * open_redirections: 按顺序打开一个命令的所有重定向文件
+ * 
+ * 参数说明：
+ *   st: 命令（重定向在st->redirs列表中，按命令行中的顺序）
+ *   in_fd, out_fd: 输入/输出。调用前是默认的fd（没有重定向时为-1，
+ *                  在管道中是管道的fd），有重定向时换成打开的文件
+ * 
+ * 返回值：
+ *   0: 全部打开成功
+ *  -1: 某个文件打不开（错误信息已经打印），已经打开的文件都关闭了
+ * 
+ * here-document（<<EOF）和here-string（<<<）是输入重定向
+ * 
+ * 同一个方向有多个重定向时（例如 "cmd > a > b"），每个文件都会打开
+ * （a也会被创建/清空），最后一个生效
+ * 
+ * 注意：这里只关闭自己打开的文件；调用者传进来的默认fd由调用者负责关闭
+ */
+int open_redirections(struct stage *st, int *in_fd, int *out_fd) {
+    int file_in = -1, file_out = -1;
+    
+    for (struct redir *r = st->redirs; r != NULL; r = r->next) {
+        // <<EOF 和 <<< 的内容放进管道或者memfd（见open_data），不写临时文件
+        int fd = (r->type == REDIR_DATA) ? open_data(r->file, strlen(r->file))
+                                         : open_redirect(r->file, r->type == REDIR_OUT);
+        if (fd == -1) {
+            if (file_in != -1) close(file_in);
+            if (file_out != -1) close(file_out);
+            return -1;
+        }
+        // 同一方向上前面打开的文件被后面的替换
+        int *slot = (r->type == REDIR_OUT) ? &file_out : &file_in;
+        if (*slot != -1) close(*slot);
+        *slot = fd;
+    }
+    
+    if (file_in != -1) *in_fd = file_in;
+    if (file_out != -1) *out_fd = file_out;
+    return 0;
+}
+
+/*
+ * execute_pipeline: 执行管道命令（处理 | 操作符）
+ * 
+ * 参数说明：
+ *   pl: 这一行命令的语法树（pl->stages是用 | 分隔的各个命令）
+ * 
+ * 功能说明：
+ *   这个函数实现了shell的管道功能。管道允许将一个命令的输出作为另一个命令的输入。
+ * 
+ *   例如："ls | grep test" 
+ *   - ls命令列出文件
+ *   - 它的输出通过管道传递给grep命令
+ *   - grep命令过滤出包含"test"的行
+ * 
+ *   更复杂的例子："ls | grep txt | wc -l"
+ *   - ls列出文件 -> grep过滤包含txt的 -> wc统计行数
+ *   - 数据从左到右流动，每个命令的输出是下一个命令的输入
+ * 
+ * 实现原理：
+ *   1. 语法树中已经按 | 分好了命令（语法错误在build_ast中就检查过了）
+ *   2. 创建管道（pipe）连接相邻的命令
+ *   3. 为每个命令启动一个子进程（spawn_command）
+ *   4. 每个子进程：
+ *      - 从上一个管道读取输入（除了第一个命令）
+ *      - 向下一个管道写入输出（除了最后一个命令）
+ *      - 执行命令
+ *   5. 父进程等待所有子进程完成
+ * 
+ * 管道的阶段数没有限制；原来要先统计命令个数、再分配命令表并把tokens
+ * 重新分割一遍，现在直接沿着语法树中的命令链表走
+ * 
+ * 每个管道的命令都放进一个新的进程组：
+ *   - 前台管道：shell在终端的前台时把终端交给这个组，结束后再拿回来；
+ *     pipekill用这个组结束所有命令（包括命令自己启动的子进程）
+ * 
+ * 后台管道（以 & 结尾）：
+ *   - 终端不交给它们（终端上的Ctrl+C不会发给它们）
+ *   - 批处理模式下，第一个命令的标准输入是/dev/null，
+ *     不会和shell抢着读脚本（和sh一样）
+ *   - 启动后不等待，加入作业表，由jobs.c在SIGCHLD之后回收
+ */
+void execute_pipeline(struct pipeline *pl) {
+    /*
+     * 第一步：启动管道中的所有命令（见launch_pipeline）
      * 
-     * 为什么要fork？
-     *   因为重定向只应该影响要执行的命令，不应该影响shell本身。
-     *   如果我们不fork就直接重定向，shell的输入输出也会被重定向，这是不对的。
+     * pgid: 子进程放进哪个进程组（见spawn.h）：第一个命令新建一个组（-1），
+     *       后面的命令加入这个组
      */
-    pid_t pid = fork();
+    int null_fd = -1;
+    if (pl->background && !interactive) {
+        null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    launch_pipeline(pl, null_fd, -1, -1);
+    if (null_fd != -1) close(null_fd);
     
-    if (pid == 0) {
+    /*
+     * 后台管道：不等待，加入作业表
+     * 启动本身算成功（状态码0）；交互模式下像sh一样打印 "[作业号] 进程ID"
+     */
+    if (pl->background) {
         /*
-         * 子进程代码块
+         * <(...) 和 >(...) 的命令、扇出的helper也放进这个作业（放在前面，
+         * 作业的状态码仍然是最后一个命令的），由作业表回收
          */
-        
-        // 恢复SIGINT信号为默认行为（让命令可以被Ctrl+C中断）
-        signal(SIGINT, SIG_DFL);
-        
+        int n_inner = (pl->fanout_pid > 0);
+        for (int i = procsub_base; i < n_procsubs; i++)
+            n_inner += procsubs[i].pl->n_stages;
+        pid_t *pids = malloc((n_inner + pl->n_stages) * sizeof(pid_t));
+        if (pids == NULL) {
+            perror("malloc");
+            last_exit_status = 1;
+            return;
+        }
+        int n = 0;
+        if (pl->fanout_pid > 0)
+            pids[n++] = pl->fanout_pid; // 扇出的helper也由作业表回收
+        for (int i = procsub_base; i < n_procsubs; i++) {
+            for (struct stage *st = procsubs[i].pl->stages; st != NULL; st = st->next)
+                pids[n++] = st->pid;
+            procsubs[i].detached = true;
+        }
+        for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+            pids[n++] = st->pid;
+        }
+        struct job *j = job_add(pids, n, pl->text, pl->text_len);
+        free(pids);
+        last_bg_pid = j->pids[n - 1];
+        if (interactive) {
+            fprintf(stderr, "[%d] %d\n", j->id, (int)last_bg_pid);
+        }
+        last_exit_status = 0;
+        return;
+    }
+    
+    /*
+     * 第二步：等待所有子进程完成
+     */
+    last_exit_status = wait_pipeline(pl);
+    if (pl->tty != -1) {
         /*
-         * 处理输入重定向
-         * 
-         * 如果用户使用了 < filename，我们需要：
-         *   1. 打开文件
-         *   2. 将标准输入（文件描述符0）重定向到这个文件
-         *   3. 这样当命令从标准输入读取时，实际是从文件读取
+         * 把终端拿回来。shell这时不在前台进程组，tcsetpgrp会产生SIGTTOU
+         * （交互模式下已经忽略了，脚本模式下临时阻塞它）
          */
-        if (input_file) {
-            /*
-             * open()函数打开文件
-             * 
-             * 参数说明：
-             *   input_file: 要打开的文件路径
-             *   O_RDONLY: 只读模式打开
-             * 
-             * 返回值：成功返回文件描述符（正整数），失败返回-1
-             */
-            int fd = open(input_file, O_RDONLY);
-            if (fd == -1) {
-                // 文件打开失败（文件不存在、权限不足等）
-                fprintf(stderr, "%s: %s\n", input_file, strerror(errno));
-                exit(1);
+        sigset_t ttou, old;
+        sigemptyset(&ttou);
+        sigaddset(&ttou, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &ttou, &old);
+        tcsetpgrp(pl->tty, getpgrp());
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+    if (opt_pipestat)
+        print_pipestat(pl, &start);
+    if (opt_placestat)
+        print_placestat(pl);
+}
+
+/*
+ * read_heredocs: 读出这一行中每个here-document的内容
+ * 
+ * 参数说明：
+ *   rd: 读命令的reader，内容就是命令后面的几行
+ *   a: 这一行的arena，内容放在这里
+ *   tz: 这一行的token，<< 后面的单词（结束标记）换成内容
+ * 
+ * 例如：
+ *   cat <<EOF > out.txt
+ *   hello $USER
+ *   EOF
+ * "hello $USER\n" 就是cat的标准输入（见open_data）。一行有几个 << 时，
+ * 内容按顺序一个接一个。
+ * 
+ *   - 结束标记是只有这个单词的一行；<<- 时每一行（包括结束标记）
+ *     开头的制表符都去掉，脚本里可以缩进
+ *   - 结束标记没有引号时，内容中的 $NAME、$(...) 照常展开；
+ *     有引号（<<'EOF'、<<"EOF"）时原样保留
+ *   - 读到文件末尾还没有结束标记：和bash一样给出警告，已经读到的就是内容
+ * 交互模式下每一行之前显示 "> "
+ */
+static char *heredoc_buf;   // 拼内容的缓冲区，各行之间重复使用
+static size_t heredoc_cap;
+
+void read_heredocs(struct reader *rd, struct arena *a, struct tokenizer *tz) {
+    for (int i = 0; i + 1 < tz->n_tokens; i++) {
+        struct token *t = &tz->tokens[i];
+        struct token *word = t + 1;
+        if (t->type != TOK_HEREDOC || word->type != TOK_WORD)
+            continue;
+        bool strip = (t->len == 3);    // <<-
+        
+        size_t used = 0;
+        for (;;) {
+            if (interactive) {
+                printf("> ");
+                fflush(stdout);
             }
-            
-            /*
-             * dup2()函数复制文件描述符
-             * 
-             * dup2(fd, 0) 的作用：
-             *   - 将文件描述符fd复制到文件描述符0（标准输入）
-             *   - 现在标准输入（0）和文件fd指向同一个文件
-             *   - 当程序从标准输入读取时，实际是从文件读取
-             * 
-             * 举个例子：
-             *   原来：0 -> 键盘输入
-             *   执行dup2(fd, 0)后：0 -> 文件内容，fd -> 文件内容
-             */
-            dup2(fd, 0);
-            
-            /*
-             * 关闭原来的文件描述符fd
-             * 
-             * 为什么？
-             *   因为dup2后，fd和0都指向同一个文件。
-             *   我们已经用0来读取文件了，不需要fd了。
-             *   关闭fd可以避免文件描述符泄漏（系统对每个进程能打开的文件数有限制）
-             */
-            close(fd);
+            const char *line;
+            ssize_t len = reader_getline(rd, &line);
+            if (len == -1) {
+                fprintf(stderr, "warning: here-document delimited by end-of-file (wanted `%s')\n",
+                        word->text);
+                break;
+            }
+            while (strip && len > 0 && *line == '\t') {
+                line++;
+                len--;
+            }
+            if ((size_t)len == word->len && memcmp(line, word->text, len) == 0)
+                break;
+            if (used + len + 1 > heredoc_cap) {
+                size_t cap = heredoc_cap ? heredoc_cap : 4096;
+                while (cap < used + len + 1)
+                    cap *= 2;
+                char *p = realloc(heredoc_buf, cap);
+                if (p == NULL) {
+                    perror("here-document");
+                    break;
+                }
+                heredoc_buf = p;
+                heredoc_cap = cap;
+            }
+            memcpy(heredoc_buf + used, line, len);
+            used += len;
+            heredoc_buf[used++] = '\n';
         }
         
         /*
-         * 处理输出重定向
-         * 
-         * 如果用户使用了 > filename，我们需要：
-         *   1. 打开文件（如果不存在则创建，如果存在则清空）
-         *   2. 将标准输出（文件描述符1）重定向到这个文件
-         *   3. 这样当命令向标准输出写入时，实际是写入文件
+         * 内容代替结束标记：有引号时不展开（当作单引号中的文字），
+         * 没有引号时有 $(...) 就标上subst，build_ast照常展开
          */
-        if (output_file) {
-            /*
-             * open()函数打开文件（用于写入）
-             * 
-             * 参数说明：
-             *   output_file: 要打开的文件路径
-             *   O_WRONLY: 只写模式
-             *   O_CREAT: 如果文件不存在则创建
-             *   O_TRUNC: 如果文件已存在，清空其内容（截断为0）
-             *   0666: 文件权限（rw-rw-rw-，所有人可读写）
-             * 
-             * 这相当于创建一个新文件，或者清空已存在的文件
-             */
-            int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (fd == -1) {
-                // 文件打开/创建失败
-                fprintf(stderr, "%s: %s\n", output_file, strerror(errno));
-                exit(1);
+        char *body = arena_alloc(a, used + 1);
+        memcpy(body, heredoc_buf, used);
+        body[used] = '\0';
+        word->text = body;
+        word->len = used;
+        word->quote = word->quote ? '\'' : 0;
+        word->subst = !word->quote && tok_find_subst(body, body + used) != NULL;
+        word->procsub = 0;
+    }
+}
+
+/*
+ * run_command: 建立一个命令（管道）的语法树并执行
+ * 
+ * 参数说明：
+ *   a: 语法树的arena，执行完清空（一行一个命令时就是这一行的arena）
+ *   toks, n: 这个命令的token（没有 ; && ||）
+ *   text, len: 命令的文字，作业表要记下（jobs、fg显示）
+ * 
+ * 把token变成语法树（只扫描一遍）：
+ *   管道 -> 每个命令 -> 参数（argv）+ 重定向列表 + 赋值（NAME=value）
+ * 后面的执行函数都直接使用语法树，不再用strcmp查找操作符
+ * 
+ * 步骤4：建树的同时展开变量（$NAME、${NAME}、$?、$!，见vars.c）
+ * 例如：用户输入 "echo $?"，如果上一个命令成功（退出码0），
+ * 语法树中的参数就是 "0"，变成 "echo 0"；"out_$?.txt" 变成 "out_0.txt"
+ * $? 和 $! 的值要先告诉变量模块。循环体中的命令每次执行都重新建树，
+ * 所以每次都是变量当时的值
+ * 
+ * 语法错误（例如 "ls |"、"| wc"、"cat <"）时状态码为1
+ */
+void run_command(struct arena *a, const struct token *toks, int n, const char *text, size_t len) {
+    var_special(last_exit_status, last_bg_pid);
+    ran_subst = false;
+    struct pipeline *pl = build_ast(a, toks, n);
+    if (pl == NULL) {
+        last_exit_status = 1;
+    } else {
+        pl->text = text;
+        pl->text_len = len;
+        procsub_inherit(procsub_base);
+        execute_command(pl);
+        set_pipestatus(pl);
+    }
+    
+    /*
+     * 这个命令的语法树不再需要，一次性释放；<(...) 和 >(...) 的命令
+     * 在这之前回收
+     */
+    procsub_finish(procsub_base);
+    arena_reset(a);
+}
+
+/*
+ * exec_simple: -c 的命令字符串只是一个简单的外部命令时，用它替换shell
+ * 
+ * 参数说明：
+ *   command: -c 后面的字符串
+ * 
+ * 例如 "sh -c 'cc -c foo.c'"：shell不fork，也不等待，直接exec cc，
+ * cc的状态码就是这个进程的状态码（和dash、bash的做法一样）。
+ * 省掉的是一次posix_spawn、一次wait和shell自己的那部分退出过程，
+ * make的每一行命令都是这样执行的。
+ * 
+ * 下面这些情况要由shell自己执行，这个函数直接返回（什么都不做）：
+ *   - 多行、; && ||、控制结构、管道、|+、后台（&）
+ *   - here-document、$(...)、<(...)：它们要启动别的命令
+ *   - 内置命令（echo、true……本来就不fork）、time/pipesize/timeout/place 前缀、
+ *     只有赋值、纯复制命令（cat < in > out，见copy.c）
+ * 
+ * 重定向在exec之前打开、放到标准输入/输出上；"VAR=x cmd" 的赋值进入
+ * 环境。exec失败（命令不存在等）时错误信息和平时一样，状态码为1
+ */
+void exec_simple(const char *command) {
+    size_t len = strlen(command);
+    if (memchr(command, '\n', len) != NULL)
+        return;
+    
+    struct tokenizer tz;
+    struct arena a;
+    tok_init(&tz);
+    arena_init(&a);
+    int n = tokenize(&tz, command, len);
+    bool simple = (n > 0 && !is_control(&tz) && tz.n_heredocs == 0);
+    for (int i = 0; simple && i < n; i++)
+        if (tz.tokens[i].subst || tz.tokens[i].procsub)
+            simple = false;
+    
+    /*
+     * build_ast只展开变量（$(...) 前面已经排除了，不会执行任何命令）
+     */
+    struct pipeline *pl = NULL;
+    if (simple) {
+        var_special(last_exit_status, last_bg_pid);
+        pl = build_ast(&a, tz.tokens, n);
+    }
+    struct stage *st = (pl != NULL) ? pl->stages : NULL;
+    if (st == NULL || pl->n_stages != 1 || pl->background || st->argc == 0
+        || builtin_lookup(st->argv[0]) != NULL || strcmp(st->argv[0], "time") == 0
+        || strcmp(st->argv[0], "pipesize") == 0 || strcmp(st->argv[0], "timeout") == 0
+        || strcmp(st->argv[0], "place") == 0 || copy_stage(st)) {
+        arena_free(&a);
+        tok_free(&tz);
+        return;
+    }
+    
+    /*
+     * 从这里开始不再回到main：打开重定向，设置环境，exec
+     */
+    int in_fd = -1, out_fd = -1;
+    if (open_redirections(st, &in_fd, &out_fd) == -1)
+        exit(1);
+    if (in_fd != -1) {
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    vars_push(st->assigns, st->n_assigns);
+    exec_command(st->argv);
+    exit(1);
+}
+
+/*
+ * run_script: 执行有 ;、&&、|| 或者控制结构的命令
+ * 
+ * 参数说明：
+ *   rd: 读命令的reader（控制结构没有结束时从这里读后面的行）
+ *   a: 每个命令的语法树的arena（见run_command）
+ *   tz: 第一行的token
+ * 
+ * 例如：
+ *   for f in a b c
+ *   do
+ *       echo $f
+ *   done
+ * 第一行的 for 没有对应的 done，所以接着读，直到所有的 if/while/until/for
+ * 都结束了（交互模式下每一行之前显示 "> "）。每一行的token复制下来接在
+ * 一起，行尾当作 ";"，然后编译成命令树（见control.c），再执行。
+ * 
+ * 循环体只在这里tokenize、编译一次：执行100000次的循环不会把循环体
+ * 重新读、重新解析100000次，每次只是用现成的token建树（展开变量）。
+ * 读到文件末尾还没有结束时是语法错误，什么都不执行，状态码为1
+ */
+static struct token *script_toks;   // 接在一起的token，各次调用之间重复使用
+static int script_cap;
+static struct arena script_arena;   // token的文字、here-document的内容、命令树
+static bool script_ready;
+
+// 把tz中的token复制到script_toks[*n]之后，再加上表示行尾的 ";"
+static bool script_append(int *n, const struct tokenizer *tz) {
+    if (*n + tz->n_tokens + 1 > script_cap) {
+        int cap = script_cap ? script_cap : 256;
+        while (cap < *n + tz->n_tokens + 1)
+            cap *= 2;
+        struct token *p = realloc(script_toks, cap * sizeof(*p));
+        if (p == NULL) {
+            perror("malloc");
+            return false;
+        }
+        script_toks = p;
+        script_cap = cap;
+    }
+    for (int i = 0; i < tz->n_tokens; i++) {
+        struct token t = tz->tokens[i];
+        t.text = arena_alloc(&script_arena, t.len + 1);
+        memcpy(t.text, tz->tokens[i].text, t.len + 1);
+        script_toks[(*n)++] = t;
+    }
+    struct token eol = { .type = TOK_SEMI, .text = "newline", .len = 7 };
+    script_toks[(*n)++] = eol;
+    return true;
+}
+
+/*
+ * 把tz这一行和后面的行接在script_toks中，直到控制结构都结束了
+ * （here-document的内容也在后面的行中，先读出来，放在script_arena）
+ * 返回值：token的个数；读到文件末尾还没有结束时返回-1；内存不够时返回0
+ */
+static int read_script(struct reader *rd, struct tokenizer *tz) {
+    if (!script_ready) {
+        arena_init(&script_arena);
+        script_ready = true;
+    }
+    int n = 0;
+    for (;;) {
+        if (tz->n_heredocs > 0)
+            read_heredocs(rd, &script_arena, tz);
+        if (!script_append(&n, tz))
+            return 0;
+        if (control_complete(script_toks, n))
+            return n;
+        if (interactive) {
+            printf("> ");
+            fflush(stdout);
+        }
+        const char *line;
+        ssize_t len = reader_getline(rd, &line);
+        if (len == -1)
+            return -1;
+        tokenize(tz, line, len);
+    }
+}
+
+void run_script(struct reader *rd, struct arena *a, struct tokenizer *tz) {
+    /*
+     * 第一步：读完整
+     */
+    int n = read_script(rd, tz);
+    if (n == -1)
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+    
+    /*
+     * 第二步：编译（语法错误时打印信息，返回NULL），执行
+     */
+    struct node *list = (n > 0) ? compile(&script_arena, script_toks, n, 1) : NULL;
+    if (list == NULL)
+        last_exit_status = 1;
+    else
+        run_list(list, a);
+    arena_reset(&script_arena);
+}
+
+/*
+ * run_cached: 用编译好的缓存执行脚本文件（SHELL56_CACHE=目录 时）
+ * 
+ * 参数说明：
+ *   script: 脚本的文件名（缓存文件按它的绝对路径命名）
+ *   fd: 打开的脚本
+ *   a: 每个命令的语法树的arena
+ * 
+ * 返回值：执行了返回0；没有设置SHELL56_CACHE、不是普通文件等情况返回-1，
+ *         调用者照常一行一行地读脚本
+ * 
+ * 缓存文件的格式和什么时候过期见bccache.c。第一次（或者脚本改了以后）
+ * 先把整个脚本编译一遍（compile_script），写成缓存文件，再执行编译的
+ * 结果；以后直接mmap缓存文件执行，脚本一个字节都不用读。
+ * 执行的顺序和结果和一行一行地读一样：每个unit执行之前回收后台作业，
+ * 有语法错误的部分执行到它的时候才报告
+ */
+static void compile_script(int fd, struct bc_builder *b) {
+    struct reader rd;
+    struct tokenizer tz;
+    if (reader_open(&rd, fd) == -1) {
+        b->failed = 1;
+        return;
+    }
+    tok_init(&tz);
+    const char *line;
+    ssize_t len;
+    while ((len = reader_getline(&rd, &line)) != -1) {
+        int n = tokenize(&tz, line, len);
+        if (n == 0)
+            continue;
+        if (is_control(&tz)) {
+            n = read_script(&rd, &tz);
+            if (n == -1)
+                bc_add(b, BC_EOF, NULL, 0, NULL, NULL, 0);
+            else if (n == 0)
+                b->failed = 1;
+            else
+                bc_add(b, BC_LIST, script_toks, n, compile(&script_arena, script_toks, n, 0), NULL, 0);
+        } else {
+            if (tz.n_heredocs > 0) {
+                if (!script_ready) {
+                    arena_init(&script_arena);
+                    script_ready = true;
+                }
+                char *copy = arena_alloc(&script_arena, len);
+                memcpy(copy, line, len);
+                line = copy;
+                read_heredocs(&rd, &script_arena, &tz);
+            }
+            bc_add(b, BC_CMD, tz.tokens, n, NULL, line, len);
+        }
+        if (script_ready)
+            arena_reset(&script_arena);
+    }
+    tok_free(&tz);
+    reader_close(&rd);
+}
+
+int run_cached(const char *script, int fd, struct arena *a) {
+    const char *dir = getenv("SHELL56_CACHE");
+    struct stat sb;
+    if (dir == NULL || *dir == '\0' || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+        return -1;
+    char *path = bc_cache_path(dir, script);
+    if (path == NULL)
+        return -1;
+    
+    /*
+     * 第一步：打开缓存文件；没有或者过期了时编译脚本，写新的缓存文件
+     * （写不了时只是这一次没有缓存）
+     */
+    struct bc_script bs;
+    if (bc_open(&bs, path, &sb, fd) == -1) {
+        struct bc_builder b;
+        bc_init(&b);
+        compile_script(fd, &b);
+        int ret = bc_finish(&b, &bs, &sb, fd);
+        bc_free(&b);
+        if (ret == -1) {
+            free(path);
+            return -1;
+        }
+        mkdir(dir, 0700);
+        bc_write(&bs, path);
+    }
+    
+    /*
+     * 第二步：一个unit一个unit地执行
+     */
+    if (!script_ready) {
+        arena_init(&script_arena);
+        script_ready = true;
+    }
+    for (int i = 0; i < bc_n_units(&bs); i++) {
+        jobs_reap();
+        const struct token *toks;
+        int n;
+        struct node *list;
+        const char *text;
+        size_t len;
+        int kind = bc_unit(&bs, i, &script_arena, &toks, &n, &list, &text, &len);
+        if (kind == BC_CMD) {
+            run_command(a, toks, n, text, len);
+        } else if (kind == BC_LIST && list != NULL) {
+            run_list(list, a);
+        } else if (kind == BC_LIST) {
+            compile(&script_arena, toks, n, 1);     // 报告语法错误
+            last_exit_status = 1;
+        } else if (kind == BC_EOF) {
+            fprintf(stderr, "syntax error: unexpected end of file\n");
+            last_exit_status = 1;
+        } else {
+            fprintf(stderr, "%s: corrupt cache file\n", path);
+            last_exit_status = 1;
+            break;
+        }
+        arena_reset(&script_arena);
+    }
+    bc_close(&bs);
+    free(path);
+    return 0;
+}
+
+/*
+ * run_list: 按顺序执行一个命令列表
+ * && 后面的命令只在状态码为0时执行，|| 后面的只在不为0时执行，
+ * 跳过的命令不改变状态码（"false && a || b" 执行b）。
+ * break/continue之后列表中剩下的命令都不执行
+ */
+void run_list(struct node *list, struct arena *a) {
+    for (struct node *nd = list; nd != NULL && !loop_break && !loop_continue; nd = nd->next) {
+        if ((nd->join == JOIN_AND && last_exit_status != 0)
+            || (nd->join == JOIN_OR && last_exit_status == 0))
+            continue;
+        run_node(nd, a);
+    }
+}
+
+/*
+ * loop_done: 循环体执行了一次之后，这一层循环是不是要结束
+ * （break，或者continue n要继续的是外面的循环）。
+ * 交互模式下循环中的命令被Ctrl+C结束时，所有的循环都结束（和bash一样，
+ * 否则 "while true; do sleep 1; done" 停不下来：shell自己忽略SIGINT）
+ */
+static bool loop_done(void) {
+    if (interactive && last_exit_status == 128 + SIGINT && loop_break == 0)
+        loop_break = loop_depth;
+    if (loop_continue == 1) {
+        loop_continue = 0;
+        return false;
+    }
+    if (loop_continue > 1) {
+        loop_continue--;
+        return true;
+    }
+    if (loop_break > 0) {
+        loop_break--;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * node_redirect: 控制结构后面的重定向（"while read l; do ...; done < file"）
+ * 
+ * 参数说明：
+ *   nd: 控制结构（nd->n_redirs > 0）
+ *   saved: 输出，原来的标准输入/输出（没有换掉、或者原来没有打开时为-1）
+ * 
+ * 和单独的内置命令一样（见builtin_run）：执行期间临时换掉shell自己的
+ * 标准输入/输出，结构中的每个命令（内置命令、外部命令）都继承它们，
+ * 所以循环中的read一行一行地读同一个文件。文件名只在开始时展开一次。
+ * "done < <(cmd)" 的cmd在整个结构执行完才回收（见node_restore）
+ * 
+ * 返回值：成功返回0；语法错误或者文件打不开时返回-1（结构不执行）
+ */
+static int node_redirect(struct node *nd, int saved[2]) {
+    struct arena words;
+    arena_init(&words);
+    var_special(last_exit_status, last_bg_pid);
+    struct pipeline *pl = build_ast(&words, nd->redirs, nd->n_redirs);
+    int fds[2] = {-1, -1};
+    int ret = (pl != NULL) ? open_redirections(pl->stages, &fds[0], &fds[1]) : -1;
+    arena_free(&words);
+    saved[0] = saved[1] = -1;
+    if (ret == -1)
+        return -1;
+    
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] == -1)
+            continue;
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    return 0;
+}
+
+/* node_restore: 换回node_redirect之前的标准输入/输出 */
+static void node_restore(const int saved[2]) {
+    fflush(stdout);
+    clearerr(stdout);
+    clearerr(stdin);
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] == -1)
+            continue;
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+}
+
+/*
+ * run_node: 执行命令列表中的一个命令
+ * 
+ * 状态码和sh一样：
+ *   - if：执行的那一部分的状态码，条件都不成立、又没有else时为0
+ *   - while/until/for：循环体最后一次的状态码，一次都没执行时为0
+ */
+void run_node(struct node *nd, struct arena *a) {
+    int status = 0;
+    int saved[2], base = procsub_base, mark = n_procsubs;
+    if (nd->n_redirs > 0) {
+        if (node_redirect(nd, saved) == -1) {
+            procsub_finish(mark);
+            last_exit_status = 1;
+            return;
+        }
+        procsub_base = n_procsubs;  // 结构中的命令执行完不回收重定向中的 <(...)
+    }
+    switch (nd->type) {
+    case NODE_CMD:
+        run_command(a, nd->toks, nd->n_toks, nd->text, nd->text_len);
+        break;
+    case NODE_IF:
+        run_list(nd->cond, a);
+        if (loop_break || loop_continue)
+            break;
+        if (last_exit_status == 0)
+            run_list(nd->body, a);
+        else if (nd->orelse != NULL)
+            run_list(nd->orelse, a);
+        else
+            last_exit_status = 0;
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        loop_depth++;
+        for (;;) {
+            run_list(nd->cond, a);
+            if (loop_break || loop_continue) {
+                if (loop_done())
+                    break;
+                continue;
             }
+            if ((last_exit_status == 0) != (nd->type == NODE_WHILE))
+                break;
+            run_list(nd->body, a);
+            status = last_exit_status;
+            if (loop_done())
+                break;
+        }
+        loop_depth--;
+        last_exit_status = status;
+        break;
+    case NODE_FOR: {
+        /*
+         * 单词在循环开始时展开一次（变量、$(...)，没有引号时拆开），
+         * 放在自己的arena中：循环体的每个命令执行完都会清空a。
+         * 单词按build_ast的结果依次是assigns和argv（在同一个数组中）
+         */
+        struct arena words;
+        arena_init(&words);
+        char **items = NULL;
+        int n_items = 0;
+        var_special(last_exit_status, last_bg_pid);
+        struct pipeline *pl = (nd->n_toks > 0) ? build_ast(&words, nd->toks, nd->n_toks) : NULL;
+        if (pl != NULL) {
+            items = pl->stages->assigns;
+            n_items = pl->stages->n_assigns + pl->stages->argc;
+        }
+        loop_depth++;
+        for (int i = 0; i < n_items; i++) {
+            var_set(nd->var, items[i], 0);
+            run_list(nd->body, a);
+            status = last_exit_status;
+            if (loop_done())
+                break;
+        }
+        loop_depth--;
+        procsub_finish(procsub_base);
+        arena_free(&words);
+        last_exit_status = status;
+        break;
+    }
+    }
+    if (nd->n_redirs > 0) {
+        node_restore(saved);
+        procsub_finish(mark);
+        procsub_base = base;
+    }
+}
+
+/*
+ * builtin_break / builtin_continue: break [n]、continue [n] 内置命令
+ * 
+ * 结束第n层（默认1，最里面的一层）循环 / 开始它的下一次。n超过
+ * 循环的层数时就是最外面的一层（和sh一样）；不在循环中时出错。
+ * 只是设置loop_break / loop_continue，由run_list和run_node处理
+ */
+static int loop_count(char **tokens, int n_tokens) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", tokens[0]);
+        return 0;
+    }
+    int n = (n_tokens > 1) ? atoi(tokens[1]) : 1;
+    if (n < 1) {
+        fprintf(stderr, "%s: %s: loop count out of range\n", tokens[0], tokens[1]);
+        return 0;
+    }
+    return (n > loop_depth) ? loop_depth : n;
+}
+
+int builtin_break(char **tokens, int n_tokens) {
+    int n = loop_count(tokens, n_tokens);
+    loop_break = n;
+    return (n == 0);
+}
+
+int builtin_continue(char **tokens, int n_tokens) {
+    int n = loop_count(tokens, n_tokens);
+    loop_continue = n;
+    return (n == 0);
+}
+
+/*
+ * command_subst: 命令替换 $(...)，执行cmd，返回它的标准输出
+ * 
+ * 参数说明：
+ *   a: 结果从这里分配（这一行的arena）
+ *   cmd, len: 括号中的命令行（可以有管道和重定向，也可以再有 $(...)；
+ *             有 ; && || 或者控制结构时在子shell中执行，见subst_subshell）
+ *   out_len: 输出，结果的长度
+ * 
+ * 返回值：命令的输出，去掉结尾的换行（和sh一样），以NUL结尾
+ * 
+ * 原来要把一个命令的输出变成另一个命令的参数，只能先 "> file" 再读回来，
+ * 每次都要写磁盘。现在命令由launch_pipeline启动，标准输出连到一个管道，
+ * shell一边读一边放进一个按需扩大的缓冲区（各次调用之间重复使用），
+ * 数据不经过磁盘。管道的容量先设大一些（最多SUBST_PIPE_SIZE），
+ * 输出很多时每次read拿到的数据更多，上下文切换更少。
+ * 
+ * 有命令在shell进程内执行时（echo、printf、cat……），它写完之前shell
+ * 没法读管道，输出超过管道容量就会卡住，所以这时输出先写到一个memfd
+ * （内存中的文件，见open_tmpfile），执行完按文件大小一次读出来。
+ * 
+ * 其它内置命令在子进程中执行，里面的cd、赋值不影响shell，和sh的子shell
+ * 一样。执行完 $? 是这个命令的状态码
+ */
+#define SUBST_PIPE_SIZE (1 << 20)
+
+static char *subst_buf;     // 读输出的缓冲区，各次调用之间重复使用
+static size_t subst_cap;
+
+// 保证缓冲区至少有need个字节
+static bool subst_reserve(size_t need) {
+    if (need <= subst_cap)
+        return true;
+    size_t cap = subst_cap ? subst_cap : 65536;
+    while (cap < need)
+        cap *= 2;
+    char *p = realloc(subst_buf, cap);
+    if (p == NULL) {
+        perror("$(...)");
+        return false;
+    }
+    subst_buf = p;
+    subst_cap = cap;
+    return true;
+}
+
+/*
+ * 命令列表和控制结构（例如 "$(for f in *.c; do wc -l < $f; done)"）在
+ * 子shell中执行：fork（不exec）出的shell执行命令树，标准输出是管道，
+ * 这里一边读一边放进缓冲区。里面的cd、赋值、break不影响这个shell，
+ * 和sh一样。返回读到的字节数，$? 是子shell的状态码
+ */
+static size_t subst_subshell(struct node *list) {
+    int fds[2];
+    if (spawn_pipe(fds) == -1) {
+        perror("pipe");
+        return 0;
+    }
+    spawn_pipe_size(fds[1], SUBST_PIPE_SIZE);
+    fflush(NULL);   // 否则缓冲区里的内容会被父子进程各输出一次
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        zygote_close();
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        interactive = false;
+        loop_depth = 0;
+        struct arena a;
+        arena_init(&a);
+        run_list(list, &a);
+        fflush(NULL);
+        _exit(last_exit_status);
+    }
+    
+    close(fds[1]);
+    size_t used = 0;
+    while (subst_reserve(used + 4096)) {
+        ssize_t r = read(fds[0], subst_buf + used, subst_cap - used - 1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        used += r;
+    }
+    close(fds[0]);
+    last_exit_status = wait_for_child(pid);
+    return used;
+}
+
+char *command_subst(struct arena *a, const char *cmd, size_t len, size_t *out_len) {
+    size_t used = 0;
+    int base = procsub_base;    // 里面的 <(...) 属于这个命令行，执行完就回收
+    procsub_base = n_procsubs;
+    
+    /*
+     * 第一步：建立语法树（独立的tokenizer和arena，里面可以再有 $(...)）
+     */
+    struct tokenizer tz;
+    struct arena tree;
+    tok_init(&tz);
+    arena_init(&tree);
+    int n = tokenize(&tz, cmd, len);
+    bool control = (n > 0 && is_control(&tz));
+    struct node *list = NULL;
+    if (control && !control_complete(tz.tokens, n))
+        fprintf(stderr, "syntax error: unexpected end of file\n");
+    else if (control)
+        list = compile(&tree, tz.tokens, n, 1);
+    struct pipeline *pl = (n > 0 && !control) ? build_ast(&tree, tz.tokens, n) : NULL;
+    ran_subst = true;
+    last_exit_status = (n > 0) ? 1 : 0;  // 空的 $() 状态码为0，语法错误为1
+    
+    struct stage *last = pl ? pl->stages : NULL;
+    while (last != NULL && last->next != NULL)
+        last = last->next;
+    
+    if (list != NULL) {
+        // 命令列表、控制结构：在子shell中执行
+        used = subst_subshell(list);
+    } else if (pl != NULL && pl->n_stages == 1 && last->argc == 0 && !copy_stage(last)) {
+        // 没有命令，只有赋值或输出重定向（例如 "$(> file)"）
+        int in_fd = -1, out_fd = -1;
+        last_exit_status = (open_redirections(last, &in_fd, &out_fd) == -1);
+        if (in_fd != -1) close(in_fd);
+        if (out_fd != -1) close(out_fd);
+    } else if (pl != NULL) {
+        /*
+         * 第二步：启动命令，标准输出是管道，或者memfd
+         */
+        bool in_shell = false;
+        for (struct stage *st = pl->stages; st != NULL && !pl->background; st = st->next) {
+            const struct builtin *b = (st->argc > 0) ? builtin_lookup(st->argv[0]) : NULL;
+            if ((b != NULL && (b->flags & BI_NOFORK)) || copy_stage(st))
+                in_shell = true;
+        }
+        int fds[2] = {-1, -1};
+        if (in_shell)
+            fds[0] = fds[1] = open_tmpfile("command substitution");
+        else if (spawn_pipe(fds) == 0)
+            spawn_pipe_size(fds[1], SUBST_PIPE_SIZE);
+        else
+            perror("pipe");
+        
+        if (fds[1] != -1) {
+            procsub_inherit(procsub_base);
+            launch_pipeline(pl, -1, fds[1], 0);
             
             /*
-             * dup2(fd, 1) 将文件描述符fd复制到文件描述符1（标准输出）
-             * 现在标准输出（1）指向文件，命令的输出会写入文件而不是屏幕
+             * 第三步：读出所有输出。管道要在命令运行的同时读，
+             * 先关闭自己的写端，所有命令都结束（关闭写端）后读到EOF；
+             * memfd要等管道中的外部命令也都结束以后再从头读
              */
-            dup2(fd, 1);
-            
-            // 关闭原来的文件描述符
-            close(fd);
+            struct stat sb;
+            size_t want = 0;
+            if (!in_shell)
+                close(fds[1]);
+            else {
+                last_exit_status = wait_pipeline(pl);
+                if (fstat(fds[0], &sb) == 0)
+                    want = sb.st_size;
+            }
+            while (subst_reserve(used + want + 1)) {
+                ssize_t r = in_shell ? pread(fds[0], subst_buf + used, subst_cap - used - 1, used)
+                                     : read(fds[0], subst_buf + used, subst_cap - used - 1);
+                if (r == -1 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                used += r;
+                want = (used + 1 == subst_cap) ? subst_cap : 0; // 缓冲区满了：加倍
+            }
+            close(fds[0]);
+            if (!in_shell)
+                last_exit_status = wait_pipeline(pl);
         }
-        
-        /*
-         * 重定向设置完成，现在执行命令
-         * 
-         * 执行时，命令会：
-         *   - 如果有输入重定向：从文件读取输入（而不是键盘）
-         *   - 如果有输出重定向：将输出写入文件（而不是屏幕）
-         */
-        execvp(clean_tokens[0], clean_tokens);
-        
-        /*
-         * 如果execvp返回，说明执行失败（通常是命令不存在）
-         */
-        fprintf(stderr, "%s: %s\n", clean_tokens[0], strerror(errno));
-        exit(EXIT_FAILURE);
-        
-    } else if (pid > 0) {
-        /*
-         * 父进程代码块：等待子进程完成
-         * 
-         * 这部分逻辑与execute_external中的完全相同：
-         *   1. 等待子进程执行完成
-         *   2. 获取子进程的退出状态码
-         *   3. 保存到全局变量中（供 $? 使用）
-         */
-        int status;
-        do {
-            waitpid(pid, &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        
-        last_exit_status = WEXITSTATUS(status);
-        
-    } else {
-        /*
-         * fork失败
-         */
-        perror("fork");
-        last_exit_status = 1;
     }
+    
+    procsub_finish(procsub_base);
+    procsub_base = base;
+    
+    /*
+     * 第四步：去掉结尾的换行，复制到这一行的arena
+     */
+    while (used > 0 && subst_buf[used - 1] == '\n')
+        used--;
+    char *out = arena_alloc(a, used + 1);
+    if (used > 0)
+        memcpy(out, subst_buf, used);
+    out[used] = '\0';
+    *out_len = used;
+    
+    arena_free(&tree);
+    tok_free(&tz);
+    return out;
 }
 
 /*
- * execute_pipeline: 执行管道命令（处理 | 操作符）
+ * process_subst: 进程替换 <(cmd) 和 >(cmd)，启动cmd，返回连到它的管道的路径
  * 
  * 参数说明：
- *   tokens: 解析后的命令token数组（可能包含多个 | 分隔的命令）
- *   n_tokens: token的数量
- * 
- * 功能说明：
- *   这个函数实现了shell的管道功能。管道允许将一个命令的输出作为另一个命令的输入。
+ *   a: 这一行的arena（返回的路径从这里分配）
+ *   cmd, len: 括号中的命令行（可以有管道、重定向、$(...)，也可以再有 <(...)）
+ *   dir: '<' 表示cmd的标准输出连到管道，命令行中的程序打开 /dev/fd/N 读它；
+ *        '>' 表示cmd从管道读标准输入，程序往 /dev/fd/N 写
  * 
- *   例如："ls | grep test" 
- *   - ls命令列出文件
- *   - 它的输出通过管道传递给grep命令
- *   - grep命令过滤出包含"test"的行
+ * 返回值："/dev/fd/N"；启动不了时返回NULL（已经打印错误信息）
  * 
- *   更复杂的例子："ls | grep txt | wc -l"
- *   - ls列出文件 -> grep过滤包含txt的 -> wc统计行数
- *   - 数据从左到右流动，每个命令的输出是下一个命令的输入
+ * 例如 "diff <(sort a) <(sort b)"：原来要先 "sort a > a.s"、"sort b > b.s"
+ * 写两个临时文件，排完一个再排另一个，最后才能运行diff。现在两个sort和
+ * diff同时运行，数据直接经过管道，不碰磁盘。
  * 
- * 实现原理：
- *   1. 将命令按 | 分割成多个独立的命令
- *   2. 创建管道（pipe）连接相邻的命令
- *   3. 为每个命令fork一个子进程
- *   4. 每个子进程：
- *      - 从上一个管道读取输入（除了第一个命令）
- *      - 向下一个管道写入输出（除了最后一个命令）
- *      - 执行命令
- *   5. 父进程等待所有子进程完成
+ * shell这一端的fd（N）平时带O_CLOEXEC，这一行的命令启动之前才去掉
+ * （procsub_inherit），所以后面再启动的 <(...) 不会拿到前面的管道，
+ * 只有真正使用它的命令有。这一行执行完后shell关闭自己这一端、回收
+ * 内部命令（procsub_finish）：读的程序提前结束时（例如 head），
+ * 写管道的命令收到SIGPIPE结束；>(...) 的命令读到EOF结束。
  * 
- * 限制：
- *   最多支持4个管道阶段（即最多5个命令，用4个|连接）
+ * 内部命令像后台命令一样启动（内置命令也在子进程中执行，不会在shell
+ * 写管道时卡住），留在shell的进程组里，不占用终端。-z 时不经过zygote
+ * （zygote只转发0/1/2）。内部命令的状态码不影响 $?（和bash一样）
  */
-void execute_pipeline(char **tokens, int n_tokens) {
+char *process_subst(struct arena *a, const char *cmd, size_t len, int dir) {
     /*
-     * TEST 12: 检测悬空管道语法错误
-     * 
-     * 需要检查以下错误情况：
-     *   - | 在开头：第一个token就是 |
-     *   - | 在结尾：最后一个token是 |
-     *   - 连续两个 |：相邻的token都是 |
+     * 第一步：建立语法树。里面的 <(...) 先启动，记在procsubs中mark之后
      */
-    if (n_tokens > 0 && strcmp(tokens[0], "|") == 0) {
-        // | 在开头，语法错误
-        last_exit_status = 1;
-        return;
+    int mark = n_procsubs;
+    struct procsub ps = { .fd = -1, .detached = false };
+    tok_init(&ps.tz);
+    arena_init(&ps.tree);
+    int n = tokenize(&ps.tz, cmd, len);
+    ps.pl = (n > 0) ? build_ast(&ps.tree, ps.tz.tokens, n) : NULL;
+    
+    bool ok = (ps.pl != NULL && !ps.pl->background && ps.pl->stages->argc > 0);
+    if (!ok)
+        fprintf(stderr, "%c(%.*s): syntax error\n", dir, (int)len, cmd);
+    if (ok && n_procsubs == procsubs_cap) {
+        int cap = procsubs_cap ? procsubs_cap * 2 : 8;
+        struct procsub *p = realloc(procsubs, cap * sizeof(*p));
+        if (p == NULL) {
+            perror("malloc");
+            ok = false;
+        } else {
+            procsubs = p;
+            procsubs_cap = cap;
+        }
     }
-    if (n_tokens > 0 && strcmp(tokens[n_tokens - 1], "|") == 0) {
-        // | 在结尾，语法错误
-        last_exit_status = 1;
-        return;
+    int fds[2];
+    if (ok && spawn_pipe(fds) == -1) {
+        perror("pipe");
+        ok = false;
     }
-    // 检查连续两个 |
-    for (int i = 0; i < n_tokens - 1; i++) {
-        if (strcmp(tokens[i], "|") == 0 && strcmp(tokens[i + 1], "|") == 0) {
-            // 连续两个 |，语法错误
-            last_exit_status = 1;
-            return;
-        }
+    if (!ok) {
+        procsub_finish(mark);
+        arena_free(&ps.tree);
+        tok_free(&ps.tz);
+        return NULL;
     }
     
     /*
-     * 第一步：将tokens分割成多个独立的命令，同时处理每个命令的重定向
-     * 
-     * commands数组存储分割后的命令（去除重定向操作符）
-     * 例如："cat < file1 | grep test > file2" 会被分割成：
-     *   commands[0] = ["cat", NULL], input_files[0] = "file1", output_files[0] = NULL
-     *   commands[1] = ["grep", "test", NULL], input_files[1] = NULL, output_files[1] = "file2"
-     * 
-     * 最多支持5个命令（4个管道），所以第一维是5
+     * 第二步：启动命令，一端连到管道，shell留着另一端
      */
-    char *commands[5][MAX_TOKENS];
-    int cmd_count = 0;           // 实际有多少个命令
-    int cmd_tokens[5] = {0};     // 每个命令有多少个token（不包括重定向操作符）
-    char *input_files[5] = {NULL};   // 每个命令的输入重定向文件
-    char *output_files[5] = {NULL};  // 每个命令的输出重定向文件
+    ps.pl->background = 1;
+    procsub_inherit(mark);
+    launch_pipeline(ps.pl, dir == '>' ? fds[0] : -1, dir == '<' ? fds[1] : -1, 0);
+    ps.fd = (dir == '<') ? fds[0] : fds[1];
+    close((dir == '<') ? fds[1] : fds[0]);
+    for (int i = mark; i < n_procsubs; i++) {
+        // 里面的 <(...) 的fd已经交给了cmd
+        if (procsubs[i].fd != -1)
+            close(procsubs[i].fd);
+        procsubs[i].fd = -1;
+    }
+    procsubs[n_procsubs++] = ps;
     
-    /*
-     * 遍历所有token，按 | 符号分割命令，同时提取重定向操作符
-     * 
-     * 例如："cat < file1 | grep test > file2" 的tokens是 
-     * ["cat", "<", "file1", "|", "grep", "test", ">", "file2"]
-     * 我们需要将其分割成：
-     *   命令0: ["cat"], 输入文件: "file1", 输出文件: NULL
-     *   命令1: ["grep", "test"], 输入文件: NULL, 输出文件: "file2"
-     */
-    int cmd_idx = 0; // 当前正在构建的命令索引（0, 1, 2...）
-    for (int i = 0; i < n_tokens; i++) {
-        if (strcmp(tokens[i], "|") == 0) {
-            /*
-             * 遇到管道符号 |，表示当前命令结束
-             * 
-             * 在命令数组末尾添加NULL（execvp要求参数数组以NULL结尾）
-             * 然后移动到下一个命令（cmd_idx++）
-             */
-            commands[cmd_idx][cmd_tokens[cmd_idx]] = NULL;
-            cmd_idx++;
-            cmd_count++; // 已完成的命令数+1
-        } else if (strcmp(tokens[i], "<") == 0) {
-            /*
-             * 输入重定向操作符 <
-             * 下一个token是输入文件名
-             */
-            if (i + 1 < n_tokens && strcmp(tokens[i + 1], "|") != 0) {
-                input_files[cmd_idx] = tokens[i + 1];
-                i++; // 跳过文件名
-            }
-        } else if (strcmp(tokens[i], ">") == 0) {
-            /*
-             * 输出重定向操作符 >
-             * 下一个token是输出文件名
-             */
-            if (i + 1 < n_tokens && strcmp(tokens[i + 1], "|") != 0) {
-                output_files[cmd_idx] = tokens[i + 1];
-                i++; // 跳过文件名
+    char *path = arena_alloc(a, 32);
+    snprintf(path, 32, "/dev/fd/%d", ps.fd);
+    return path;
+}
+
+/* procsub_inherit: 去掉mark之后的进程替换fd的O_CLOEXEC，接下来启动的命令都能拿到 */
+void procsub_inherit(int mark) {
+    for (int i = mark; i < n_procsubs; i++)
+        if (procsubs[i].fd != -1)
+            fcntl(procsubs[i].fd, F_SETFD, 0);
+}
+
+/*
+ * procsub_finish: 关闭mark之后的进程替换的fd，再等待内部命令结束
+ * （先全部关闭：每个内部命令都可能在等EOF或者SIGPIPE）
+ * 已经放进后台作业的不等待
+ */
+void procsub_finish(int mark) {
+    for (int i = mark; i < n_procsubs; i++) {
+        if (procsubs[i].fd != -1)
+            close(procsubs[i].fd);
+        procsubs[i].fd = -1;
+    }
+    for (int i = mark; i < n_procsubs; i++) {
+        if (!procsubs[i].detached)
+            wait_pipeline(procsubs[i].pl);
+        arena_free(&procsubs[i].tree);
+        tok_free(&procsubs[i].tz);
+    }
+    n_procsubs = mark;
+}
+
+/*
+ * set_pipestatus: 每条命令执行完后，把每个命令的状态码放进环境变量PIPESTATUS
+ * 
+ * 例如 "false | true | sh -c 'exit 3'" 之后 PIPESTATUS="1 0 3"，
+ * 单个命令时就是 $? 。后台命令不改变它
+ * 
+ * 它是导出的变量（和time的TIME_STAGES一样），$PIPESTATUS 和子进程都能读到。
+ * 值改变时只换掉envp中的一项（见vars.c），不影响启动命令的速度
+ */
+void set_pipestatus(struct pipeline *pl) {
+    if (pl->background)
+        return;
+    if (pl->n_stages == 1) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", last_exit_status);
+        var_set("PIPESTATUS", buf, VAR_EXPORT);
+        return;
+    }
+    
+    // 长度和命令个数成正比（管道没有长度限制），和TIME_STAGES一样按需增长
+    char *status_var = NULL;
+    size_t used = 0, cap = 0;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        char entry[16];
+        int n = snprintf(entry, sizeof(entry), "%s%d", used ? " " : "", st->status);
+        if (n < 0 || (size_t)n >= sizeof(entry))
+            continue;
+        if (used + n + 1 > cap) {
+            size_t new_cap = cap ? cap * 2 : 256;
+            while (used + n + 1 > new_cap)
+                new_cap *= 2;
+            char *p = realloc(status_var, new_cap);
+            if (p == NULL) {
+                perror("PIPESTATUS: realloc");
+                exit(1);
             }
-        } else {
-            /*
-             * 这是命令的一个token（命令名或参数），添加到当前命令中
-             * （不包括重定向操作符和文件名，因为它们已经单独处理了）
-             */
-            commands[cmd_idx][cmd_tokens[cmd_idx]] = tokens[i];
-            cmd_tokens[cmd_idx]++;
+            status_var = p;
+            cap = new_cap;
         }
+        memcpy(status_var + used, entry, n + 1);
+        used += n;
     }
+    var_set("PIPESTATUS", status_var ? status_var : "", VAR_EXPORT);
+    free(status_var);
+}
+
+/*
+ * launch_pipeline: 创建管道，启动管道中的所有命令，不等待
+ * 
+ * 参数说明：
+ *   pl: 管道的语法树，启动后每个命令的pid记在st->pid中（没有启动的为-1）
+ *   in_fd: 第一个命令的标准输入，-1表示继承shell的
+ *   out_fd: 最后一个命令的标准输出，-1表示继承shell的
+ *           （in_fd/out_fd属于调用者，这个函数不会关闭它们）
+ *   pgid: 子进程放进哪个进程组（见spawn.h）；-1时第一个启动的命令是组长，
+ *         组号记在pl->pgid中
+ * 
+ * execute_pipeline和parallel都用它启动命令
+ * 
+ * 管道中的内置命令：
+ *   - 前台管道中的BI_NOFORK命令（echo、printf、test等）在shell进程内执行
+ *     （没有pid，st->status直接设置好）。它们要等所有外部命令都启动以后，
+ *     从右往左执行：例如 "echo hi | cat" 中echo写管道时cat已经在读了；
+ *     如果先执行echo，输出超过管道容量时shell会永远阻塞
+ *   - 其它内置命令（cd、exit等会改变shell状态的），以及后台管道（&）中的
+ *     所有内置命令，在fork出的子进程中执行（builtin_fork），和外部命令一样等待
+ * 
+ * 纯复制的命令（cat，见copy.c）也可以在shell进程内执行，但它要读标准输入：
+ * 从右往左执行时，它上游的命令必须都已经在运行（是外部命令），所以只有
+ * 前面还没有在shell进程内执行的命令时才这样做，而且每个管道最多一个。
+ * 紧跟在后面的 "| cat" 合并进来："cat a | cat > b" 直接从a复制到b
+ * 
+ * 扇出（"src |+ a | b |+ c"）：src（第一个 |+ 之前的最后一个命令）写
+ * 一个管道，每个分支的第一个命令（a、c）从自己的管道读，每个分支的
+ * 最后一个命令（b、c）写out_fd。所有命令启动以后，fanout_start启动helper
+ * 进程在内核中把src的输出复制给每个分支（见fanout.c），pid记在
+ * pl->fanout_pid中
+ */
+struct deferred_stage {
+    struct stage *st;
+    struct stage *tail;         // 合并进来的最后一个命令（没有合并时就是st）
+    const struct builtin *b;    // NULL表示复制命令（copy_run）
+    int in_fd, out_fd;
+};
+
+void launch_pipeline(struct pipeline *pl, int in_fd, int out_fd, pid_t pgid) {
+    // 前台：可以在shell进程内执行内置命令。有期限的管道（timeout）除外：
+    // shell要一直在wait_pipeline中等着，期限到了才能结束它们
+    bool in_process = !pl->background && pl->timeout_ms == 0;
+    bool new_group = (pgid == -1);
+    int pipe_size = pl->pipe_size ? pl->pipe_size : opt_pipesize;
     
     /*
-     * 最后一个命令也需要以NULL结尾
-     * 并且命令总数+1（因为最后一个命令之前没有|）
+     * 放置（set -o place、place 前缀，见place.c）：第i个命令放在
+     * place_group(place_first, i) 这一组，只对有多个命令的管道
      */
-    commands[cmd_idx][cmd_tokens[cmd_idx]] = NULL;
-    cmd_count++;
+    int place = (pl->place >= 0) ? pl->place : opt_place;
+    int place_first = (place != PLACE_OFF && pl->n_stages > 1) ? place_start(pl->n_stages) : -1;
+    int stage_idx = 0;
+    struct deferred_stage *deferred = NULL;
+    int n_deferred = 0;
     
     /*
-     * 检查是否有空命令（TEST 12要求）
-     * 
-     * 如果某个命令分割后没有任何token（除了NULL），这是语法错误
+     * 扇出的管道：fan_in是src的输出，fan_out[k]是第k个分支的输入
+     * 先全部建好，shell留着fan_in的读端和每个fan_out的写端交给helper
      */
-    for (int i = 0; i < cmd_count; i++) {
-        if (cmd_tokens[i] == 0) {
-            // 空命令，语法错误
-            last_exit_status = 1;
-            return;
+    int fan_in[2] = {-1, -1};
+    int (*fan_out)[2] = NULL;
+    int n_fan = 0;      // 已经启动到第几个分支
+    if (pl->n_branches > 0) {
+        fan_out = malloc(pl->n_branches * sizeof(*fan_out));
+        int k = 0;
+        if (fan_out != NULL && spawn_pipe(fan_in) == 0) {
+            for (k = 0; k < pl->n_branches; k++) {
+                if (spawn_pipe(fan_out[k]) == -1)
+                    break;
+                if (pipe_size > 0)
+                    spawn_pipe_size(fan_out[k][1], pipe_size);
+            }
+        }
+        if (fan_out == NULL || fan_in[0] == -1 || k < pl->n_branches) {
+            perror("|+");
+            while (k > 0) {
+                k--;
+                close(fan_out[k][0]);
+                close(fan_out[k][1]);
+            }
+            if (fan_in[0] != -1) {
+                close(fan_in[0]);
+                close(fan_in[1]);
+            }
+            free(fan_out);
+            pl->pgid = 0;
+            return; // 一个命令都不启动（状态码都是1）
         }
     }
     
     /*
-     * 检查管道阶段数是否超过限制
-     * 
-     * 如果cmd_count > 4，说明有超过4个管道阶段（即超过5个命令）
-     */
-    if (cmd_count > 4) {
-        fprintf(stderr, "Too many pipeline stages (max 4)\n");
-        last_exit_status = 1;
-        return;
-    }
-    
-    /*
-     * 第二步：创建管道
+     * 逐个创建管道并启动子进程
      * 
      * 管道是一个通信通道，连接两个进程：
-     *   - 一个进程向管道写入数据
-     *   - 另一个进程从管道读取数据
+     *   - pipe_fds[0]: 读端（从管道读取数据）
+     *   - pipe_fds[1]: 写端（向管道写入数据）
      * 
-     * pipe()函数创建一个管道，返回两个文件描述符：
-     *   - pipes[i][0]: 读端（从管道读取数据）
-     *   - pipes[i][1]: 写端（向管道写入数据）
+     * 管道用spawn_pipe创建，两端都带O_CLOEXEC（close-on-exec）：
+     *   - 子进程只会通过dup2拿到自己需要的那两端（dup2得到的0/1不带CLOEXEC），
+     *     其它管道的fd在exec时由内核自动关闭，子进程不需要逐个close，
+     *     每个子进程的fd操作是常数次（原来每个子进程要关闭所有管道，总共O(n²)）
+     *   - 父进程只在启动第i个命令之前创建第i个管道，启动之后马上关闭不再需要的端，
+     *     任何时候最多持有两个管道fd，总共O(n)次操作
      * 
-     * 如果有N个命令，需要N-1个管道（每个管道连接两个相邻的命令）
-     * 例如：3个命令需要2个管道
+     * prev_read: 上一个管道的读端，也就是当前命令的标准输入（第一个命令为in_fd）
      */
-    int pipes[3][2];  // 最多3个管道（支持4个命令）
-    pid_t pids[4];    // 存储每个子进程的进程ID
-    
-    /*
-     * 创建所有需要的管道
-     * 
-     * cmd_count - 1 是因为N个命令需要N-1个管道
-     */
-    for (int i = 0; i < cmd_count - 1; i++) {
+    int prev_read = in_fd;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        // 在shell进程内执行的复制命令，以及合并进来的 "| cat"（到tail为止）
+        bool mover = in_process && n_deferred == 0 && copy_stage(st);
+        if (mover && st == pl->stages && in_fd == -1 && copy_reads_stdin(st) && isatty(STDIN_FILENO))
+            mover = false; // 终端交给了管道的进程组，shell不能再读它
+        struct stage *tail = st;
+        while (mover && tail->next != NULL && !tail->next->branch && copy_absorbs(tail, tail->next))
+            tail = tail->next;
+        
+        // 这个命令（在管道中的位置）放在哪一组
+        int group = (place_first >= 0) ? place_group(place_first, stage_idx) : -1;
+        for (struct stage *s = st; s != tail; s = s->next)
+            stage_idx++;
+        stage_idx++;
+        
+        // 分支的第一个命令从自己的扇出管道读
+        if (st->branch) {
+            if (prev_read != -1 && prev_read != in_fd) close(prev_read);
+            prev_read = fan_out[n_fan++][0];
+        }
+        
         /*
-         * pipe(pipes[i]) 创建一个新的管道
-         * 
-         * 如果成功，pipes[i][0]是读端，pipes[i][1]是写端
-         * 如果失败（系统资源不足等），返回-1
+         * 除了最后一个命令，都要创建一个管道连接到下一个命令
+         * 创建失败时，后面的命令都不再启动（已经启动的照常等待；
+         * 没有启动的命令pid为-1）
+         * 下一个命令是一个分支时：src写扇出的管道，分支的最后一个命令写out_fd
          */
-        if (pipe(pipes[i]) == -1) {
+        int pipe_fds[2] = {-1, -1};
+        bool ends_branch = (tail->next == NULL || tail->next->branch);
+        if (tail->next != NULL && tail->next->branch && n_fan == 0) {
+            pipe_fds[1] = fan_in[1];
+            fan_in[1] = -1;
+        } else if (!ends_branch && spawn_pipe(pipe_fds) == -1) {
             perror("pipe");
-            last_exit_status = 1;
-            return;
+            break;
         }
-    }
-    
-    /*
-     * 第三步：为每个命令fork一个子进程
-     * 
-     * 每个命令都需要在独立的进程中执行，这样它们才能通过管道通信
-     */
-    for (int i = 0; i < cmd_count; i++) {
+        // 管道的容量：pipesize前缀或者set -o pipesize（pipestat要报告它）
+        if (pipe_fds[1] != -1 && (pipe_size > 0 || opt_pipestat))
+            tail->pipe_cap = spawn_pipe_size(pipe_fds[1], pipe_size);
+        
+        // 默认的标准输入/输出：管道，或者调用者给的fd
+        int def_in = prev_read;
+        int def_out = (pipe_fds[1] != -1) ? pipe_fds[1] : out_fd;
+        int cmd_in = def_in, cmd_out = def_out;
+        
         /*
-         * fork一个子进程来执行第i个命令
+         * 处理文件重定向（会覆盖管道重定向）
+         * 
+         * TEST 6要求支持：cmd1 < file1 | cmd2 > file2
+         * 文件在父进程中打开，打开失败时这个命令不启动，视为以状态码1退出
          */
-        pids[i] = fork();
-        
-        if (pids[i] == 0) {
-            /*
-             * 子进程代码块：设置输入输出重定向并执行命令
-             */
-            
-            // 恢复SIGINT信号为默认行为
-            signal(SIGINT, SIG_DFL);
-            
-            /*
-             * 第一步：先设置管道重定向
-             * 
-             * 设置输入重定向：从上一个管道读取
-             * 第一个命令（i=0）如果没有输入文件重定向，从标准输入读取
-             * 其他命令（i>0）需要从前一个管道（pipes[i-1]）读取输入
-             */
-            if (i > 0) {
-                /*
-                 * dup2(pipes[i-1][0], 0) 将管道i-1的读端复制到标准输入
-                 * 这样命令从标准输入读取时，实际是从上一个命令的输出读取
-                 */
-                dup2(pipes[i-1][0], 0);
-            }
-            
-            /*
-             * 设置输出重定向：写入下一个管道
-             * 
-             * 最后一个命令如果没有输出文件重定向，向标准输出写入
-             * 其他命令需要向管道i的写端写入输出
-             */
-            if (i < cmd_count - 1) {
-                /*
-                 * dup2(pipes[i][1], 1) 将管道i的写端复制到标准输出
-                 * 这样命令向标准输出写入时，实际是写入管道，被下一个命令读取
-                 */
-                dup2(pipes[i][1], 1);
+        const struct builtin *b = (st->argc > 0) ? builtin_lookup(st->argv[0]) : NULL;
+        int opened = open_redirections(st, &cmd_in, &cmd_out);
+        if (opened == 0 && tail != st) {
+            // 合并进来的cat只可能有输出重定向，它决定输出到哪里
+            int unused = -1;
+            opened = open_redirections(tail, &unused, &cmd_out);
+            if (opened == -1 && cmd_in != def_in) {
+                close(cmd_in);
+                cmd_in = def_in;
             }
-            
+        }
+        if (opened == -1) {
+            // 这个命令不启动
+        } else if (mover || (b != NULL && in_process && (b->flags & BI_NOFORK))) {
             /*
-             * 第二步：处理文件重定向（会覆盖管道重定向）
-             * 
-             * TEST 6要求支持：cmd1 < file1 | cmd2 > file2
-             * 文件重定向的优先级高于管道重定向
+             * 在shell进程内执行的命令：先不执行，它的标准输入/输出留着
+             * 不关闭（所有权交给deferred），等外部命令都启动以后再执行
              */
-            
-            // 处理输入文件重定向（< filename）
-            if (input_files[i] != NULL) {
-                int fd = open(input_files[i], O_RDONLY);
-                if (fd == -1) {
-                    fprintf(stderr, "%s: %s\n", input_files[i], strerror(errno));
-                    exit(1);
-                }
-                dup2(fd, 0);  // 覆盖标准输入（可能已经设置为管道）
-                close(fd);
-            }
-            
-            // 处理输出文件重定向（> filename）
-            if (output_files[i] != NULL) {
-                int fd = open(output_files[i], O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                if (fd == -1) {
-                    fprintf(stderr, "%s: %s\n", output_files[i], strerror(errno));
-                    exit(1);
-                }
-                dup2(fd, 1);  // 覆盖标准输出（可能已经设置为管道）
-                close(fd);
+            if (deferred == NULL)
+                deferred = malloc(pl->n_stages * sizeof(*deferred));
+            if (deferred != NULL) {
+                deferred[n_deferred++] = (struct deferred_stage){ st, tail, mover ? NULL : b,
+                                                                  cmd_in, cmd_out };
+                // 被重定向文件换掉的管道端不再需要
+                if (cmd_in != def_in && prev_read != -1 && prev_read != in_fd) close(prev_read);
+                if (cmd_out != def_out && pipe_fds[1] != -1) close(pipe_fds[1]);
+                prev_read = pipe_fds[0];
+                st = tail;
+                continue;
             }
-            
-            /*
-             * 关闭所有管道文件描述符
-             * 
-             * 为什么要关闭？
-             *   1. 我们已经用dup2将需要的管道端复制到了0和1（或者被文件重定向覆盖了）
-             *   2. 原始的管道文件描述符不再需要
-             *   3. 关闭它们可以避免文件描述符泄漏
-             *   4. 更重要的是：管道只有在所有写端都关闭后，读端才会收到EOF
-             *      如果不关闭，最后一个命令可能永远等不到输入结束
-             */
-            for (int j = 0; j < cmd_count - 1; j++) {
-                close(pipes[j][0]); // 关闭读端
-                close(pipes[j][1]); // 关闭写端
+            perror("malloc");
+        } else if (b != NULL) {
+            // 子进程继承shell这时的CPU集合和内存策略
+            if (group >= 0 && place_enter(group, place) == 0)
+                st->place = group;
+            int mark = vars_push(st->assigns, st->n_assigns);
+            st->pid = builtin_fork(b, st->argv, st->argc, cmd_in, cmd_out, pgid);
+            vars_pop(mark);
+            if (pgid == -1 && st->pid > 0)
+                pgid = st->pid;
+        } else {
+            struct spawn sp = { .argv = st->argv, .in_fd = cmd_in, .out_fd = cmd_out,
+                                .pgid = pgid, .keep_fds = (n_procsubs > 0) };
+            if (group >= 0 && place_enter(group, place) == 0)
+                st->place = group;
+            int mark = vars_push(st->assigns, st->n_assigns);
+            st->pid = spawn_command(&sp);
+            vars_pop(mark);
+            // zygote创建的子进程继承不到shell的设置
+            if (st->place >= 0 && st->pid > 0 && zygote_active())
+                place_pid(st->pid, st->place);
+            if (pgid == -1 && st->pid > 0)
+                pgid = st->pid; // 第一个启动的命令是进程组长
+        }
+        
+        /*
+         * 父进程关闭已经交给子进程的fd：
+         *   - 上一个管道的读端（当前命令已经拿到了）
+         *   - 当前管道的写端（当前命令已经拿到了）
+         *     写端必须关闭，否则下一个命令永远等不到EOF
+         *   - 重定向文件（cmd_in/cmd_out被换成了文件的fd）
+         * 当前管道的读端留给下一个命令；调用者的in_fd/out_fd不关闭
+         */
+        if (cmd_in != def_in) close(cmd_in);
+        if (cmd_out != def_out) close(cmd_out);
+        if (prev_read != -1 && prev_read != in_fd) close(prev_read);
+        if (pipe_fds[1] != -1) close(pipe_fds[1]);
+        prev_read = pipe_fds[0];
+        st = tail;
+    }
+    if (prev_read != -1 && prev_read != in_fd) close(prev_read);
+    pl->pgid = (pgid > 0) ? pgid : 0;
+    if (place_first >= 0)
+        place_leave();  // shell自己恢复原来的CPU集合和内存策略
+    
+    /*
+     * 扇出：helper拿走fan_in的读端和每个分支的写端，shell关闭自己的
+     * （没有启动的分支的读端也在这里关闭，helper写它时得到EPIPE）
+     */
+    if (fan_out != NULL) {
+        int *outs = malloc(pl->n_branches * sizeof(int));
+        for (int k = 0; k < pl->n_branches; k++) {
+            if (k >= n_fan)
+                close(fan_out[k][0]);
+            if (outs != NULL)
+                outs[k] = fan_out[k][1];
+        }
+        if (outs != NULL && fan_in[1] == -1)
+            pl->fanout_pid = fanout_start(fan_in[0], outs, pl->n_branches, pl->pgid);
+        for (int k = 0; k < pl->n_branches; k++)
+            close(fan_out[k][1]);
+        close(fan_in[0]);
+        if (fan_in[1] != -1) close(fan_in[1]);
+        free(outs);
+        free(fan_out);
+    }
+    
+    /*
+     * 前台管道有自己的进程组：如果shell在终端的前台，把终端交给这个组，
+     * Ctrl+C只发给管道中的命令（拿回来见execute_pipeline）。
+     * 在这之前就读终端的命令会被SIGTTIN停下来，交出终端后用SIGCONT让它们继续
+     */
+    if (new_group && !pl->background && pl->pgid > 0) {
+        for (int fd = 0; fd < 3; fd++) {
+            if (isatty(fd) && tcgetpgrp(fd) == getpgrp()) {
+                tcsetpgrp(fd, pl->pgid);
+                kill(-pl->pgid, SIGCONT);
+                pl->tty = fd;
+                break;
             }
-            
-            /*
-             * 重定向设置完成，执行命令
-             * 
-             * 执行时，命令会：
-             *   - 从标准输入读取（可能是文件或管道）
-             *   - 向标准输出写入（可能是文件或管道或标准输出）
-             */
-            execvp(commands[i][0], commands[i]);
-            
-            /*
-             * 如果execvp返回，说明执行失败
-             */
-            fprintf(stderr, "%s: %s\n", commands[i][0], strerror(errno));
-            exit(EXIT_FAILURE);
-            
-        } else if (pids[i] < 0) {
-            /*
-             * fork失败
-             */
-            perror("fork");
-            last_exit_status = 1;
-            return;
         }
     }
     
     /*
-     * 第四步：父进程关闭所有管道文件描述符
-     * 
-     * 为什么要关闭？
-     *   1. 父进程不需要使用管道（只有子进程之间需要通信）
-     *   2. 关闭所有写端是必要的：管道只有在所有写端都关闭后，读端才会收到EOF
-     *      如果不关闭父进程持有的写端，最后一个命令可能永远等不到输入结束
-     *   3. 关闭读端虽然不是必须的，但可以避免资源浪费
+     * 从右往左执行shell进程内的命令，执行完关闭它的标准输入/输出
+     * （关闭写端后下游命令读到EOF；关闭读端后上游命令再写会收到SIGPIPE）
+     * 合并进来的cat和复制命令的状态码一样
+     */
+    for (int i = n_deferred - 1; i >= 0; i--) {
+        struct deferred_stage *d = &deferred[i];
+        int mark = vars_push(d->st->assigns, d->st->n_assigns);
+        int status = (d->b != NULL) ? builtin_run(d->b, d->st->argv, d->st->argc, d->in_fd, d->out_fd)
+                                    : copy_run(d->st, d->in_fd, d->out_fd);
+        vars_pop(mark);
+        for (struct stage *s = d->st; ; s = s->next) {
+            s->status = status;
+            clock_gettime(CLOCK_MONOTONIC, &s->end);
+            if (s == d->tail)
+                break;
+        }
+        if (d->in_fd != -1 && d->in_fd != in_fd) close(d->in_fd);
+        if (d->out_fd != -1 && d->out_fd != out_fd) close(d->out_fd);
+    }
+    free(deferred);
+}
+
+/*
+ * read_stage_stats: pipestat和placestat用，在回收之前读取结束的命令的统计数据
+ * 
+ * 命令结束以后、回收以前它是僵尸进程，/proc/<pid>/io（读写的字节数）、
+ * /proc/<pid>/schedstat（在CPU上运行的时间、在运行队列中等待的时间）和
+ * /proc/<pid>/stat（最后在哪个CPU上运行）还在，回收以后就没有了
+ */
+static void read_stage_stats(struct stage *st) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)st->pid);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        char key[32];
+        unsigned long long value;
+        while (fscanf(f, "%31[^:]: %llu ", key, &value) == 2) {
+            if (strcmp(key, "rchar") == 0)
+                st->rchar = value;
+            else if (strcmp(key, "wchar") == 0)
+                st->wchar = value;
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/schedstat", (int)st->pid);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%llu %llu", &st->run_ns, &st->wait_ns) != 2)
+            st->run_ns = st->wait_ns = 0;
+        fclose(f);
+    }
+    st->cpu = place_cpu(st->pid);
+}
+
+/*
+ * print_pipestat: set -o pipestat 时，前台管道结束后在标准错误上报告每个命令
+ * 
+ * 例如：
+ *   $ set -o pipestat
+ *   $ pipesize 1M zcat big.gz | sort | uniq -c > /dev/null
+ *   pipestat     pipe        read     written      cpu  blocked  command
+ *   [1]         1024K   104857600  1073741824    1.912    0.410  zcat big.gz
+ *   [2]         1024K  1073741824  1073741824    6.004    1.977  sort
+ *   [3]             -  1073741824     1804123    0.733    7.104  uniq -c
+ * 
+ *   pipe: 这个命令输出的管道的容量（最后一个命令为 "-"）
+ *   read/written: 读/写的字节数（/proc/<pid>/io的rchar/wchar，包括文件和管道）
+ *   cpu: 在CPU上运行的时间（秒）
+ *   blocked: 阻塞的时间 = 从管道启动到这个命令结束的时间 - 运行的时间
+ *            - 在运行队列中等待CPU的时间。管道的上游写满了管道、下游读空了
+ *            管道时都会阻塞，管道容量太小时这一列会很大
+ * 在shell进程内执行的命令（echo、cat等）没有这些数据，显示 "-"
+ */
+void print_pipestat(struct pipeline *pl, const struct timespec *start) {
+    fprintf(stderr, "%-8s %8s %11s %11s %8s %8s  %s\n",
+            "pipestat", "pipe", "read", "written", "cpu", "blocked", "command");
+    int i = 1;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next, i++) {
+        char label[16], pipe[16];
+        snprintf(label, sizeof(label), "[%d]", i);
+        if (st->pipe_cap > 0)
+            snprintf(pipe, sizeof(pipe), "%dK", st->pipe_cap / 1024);
+        else
+            snprintf(pipe, sizeof(pipe), "-");
+        fprintf(stderr, "%-8s %8s ", label, pipe);
+        
+        if (st->pid <= 0) {
+            fprintf(stderr, "%11s %11s %8s %8s ", "-", "-", "-", "-");
+        } else {
+            double life = (st->end.tv_sec - start->tv_sec)
+                        + (st->end.tv_nsec - start->tv_nsec) / 1e9;
+            double cpu = st->run_ns / 1e9;
+            double blocked = life - cpu - st->wait_ns / 1e9;
+            if (blocked < 0)
+                blocked = 0;
+            fprintf(stderr, "%11llu %11llu %8.3f %8.3f ", st->rchar, st->wchar, cpu, blocked);
+        }
+        for (int k = 0; k < st->argc; k++)
+            fprintf(stderr, " %s", st->argv[k]);
+        fprintf(stderr, "\n");
+    }
+}
+
+/*
+ * print_placestat: set -o placestat 时，前台管道结束后在标准错误上报告
+ * 每个命令放在了哪里
+ * 
+ * 例如：
+ *   $ set -o place=llc
+ *   $ set -o placestat
+ *   $ zcat big.gz | sort | uniq -c > /dev/null
+ *   placestat  pinned             cpu   llc  node  command
+ *   [1]        0-7                  3     0     0  zcat big.gz
+ *   [2]        0-7                  5     0     0  sort
+ *   [3]        0-7                  2     0     0  uniq -c
+ * 
+ *   pinned: 这个命令限制在哪些CPU上（一个LLC组，见place.c）；"-" 表示没有限制
+ *   cpu: 结束之前最后在哪个CPU上运行
+ *   llc/node: 这个CPU属于哪个LLC组、哪个NUMA节点
+ * 没有放置时也可以用它看调度器把命令放在了哪里。
+ * 在shell进程内执行的命令（echo、cat等）没有这些数据，显示 "-"
+ */
+void print_placestat(struct pipeline *pl) {
+    fprintf(stderr, "%-10s %-16s %5s %5s %5s  %s\n",
+            "placestat", "pinned", "cpu", "llc", "node", "command");
+    int i = 1;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next, i++) {
+        char label[16], pinned[64] = "-";
+        snprintf(label, sizeof(label), "[%d]", i);
+        if (st->place >= 0)
+            place_format(st->place, pinned, sizeof(pinned));
+        fprintf(stderr, "%-10s %-16s ", label, pinned);
+        
+        if (st->pid <= 0 || st->cpu < 0) {
+            fprintf(stderr, "%5s %5s %5s ", "-", "-", "-");
+        } else {
+            int llc = place_llc(st->cpu), node = place_node(st->cpu);
+            fprintf(stderr, "%5d ", st->cpu);
+            if (llc >= 0) fprintf(stderr, "%5d ", llc); else fprintf(stderr, "%5s ", "-");
+            if (node >= 0) fprintf(stderr, "%5d ", node); else fprintf(stderr, "%5s ", "-");
+        }
+        for (int k = 0; k < st->argc; k++)
+            fprintf(stderr, " %s", st->argv[k]);
+        fprintf(stderr, "\n");
+    }
+}
+
+/*
+ * stage_failed: 这个状态码算不算失败（pipekill用）
+ * 被SIGPIPE杀死不算：那是下游已经不再读了，是管道正常结束的方式
+ */
+static bool stage_failed(int status) {
+    return status != 0 && status != 128 + SIGPIPE;
+}
+
+/*
+ * kill_pipeline: 结束管道中还在运行的命令（pipekill和timeout用SIGTERM，
+ * timeout最后用SIGKILL）
+ * 管道有自己的进程组时发给整个组（命令自己启动的子进程也会收到）
+ */
+static void kill_pipeline(struct pipeline *pl, int sig) {
+    if (pl->pgid > 0) {
+        kill(-pl->pgid, sig);
+        return;
+    }
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        // 还没有回收的（回收以后pid可能被别的进程重用）
+        if (st->pid > 0 && st->end.tv_sec == 0 && st->end.tv_nsec == 0)
+            kill(st->pid, sig);
+    }
+}
+
+/* 记下一个回收了的命令的状态码（被信号杀死时是128+信号编号，和sh一样） */
+static void finish_stage(struct stage *st, int wstatus, const struct rusage *ru) {
+    st->status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
+    st->ru = *ru;
+    clock_gettime(CLOCK_MONOTONIC, &st->end);
+}
+
+/*
+ * wait_pipeline: 等待管道中所有已经启动的命令结束
+ * 
+ * 返回值：管道的退出状态码
+ * 
+ * 根据shell的惯例，管道的退出状态码是最后一个命令的退出状态码
+ * 例如："false | true"，虽然第一个命令失败，但整个管道返回0（因为true成功）
+ * 没有启动的命令（找不到命令、重定向文件打不开）视为以状态码1退出
+ * 
+ * set -o pipefail：最右边一个失败（状态码不是0）的命令的状态码，
+ *                  都成功时为0。"false | true" 返回1
+ * set -o pipekill：任何一个命令失败（被SIGPIPE杀死不算），马上结束其它
+ *                  还在运行的命令，不再让注定失败的管道继续占用CPU
+ * 每个命令的状态码都留在st->status中（PIPESTATUS，见set_pipestatus）
+ */
+int wait_pipeline(struct pipeline *pl) {
+    /*
+     * 按结束的顺序回收，而不是按命令的顺序逐个等待：
+     * 这样每个命令的回收时间（st->end）就是它真正结束的时间，
+     * 例如 "yes | head -1" 中head先结束，time报告里能看出来；
+     * pipekill也要在第一个命令失败时马上知道
      */
-    for (int i = 0; i < cmd_count - 1; i++) {
-        close(pipes[i][0]); // 关闭读端
-        close(pipes[i][1]); // 关闭写端
+    int n_live = 0;
+    bool failed = false; // 在shell进程内执行的命令失败了，或者有命令没有启动
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        if (st->pid > 0)
+            n_live++;
+        else if (stage_failed(st->status))
+            failed = true;
     }
+    bool killed = opt_pipekill && failed && n_live > 0;
+    if (killed)
+        kill_pipeline(pl, SIGTERM);
     
     /*
-     * 第五步：等待所有子进程完成
+     * 每个命令交给evloop.c（Linux上是一个pidfd，放进epoll集合；没有pidfd
+     * 时由SIGCHLD驱动），等待任意一个结束，再用wait4回收那一个：只回收
+     * 这个管道自己的命令，后台作业的子进程留给作业表（jobs_reap）
      * 
-     * 父进程需要等待所有命令执行完成
-     * 然后提取最后一个命令的退出状态码（作为整个管道的退出状态）
+     * timeout：等待有期限。期限到了给管道发SIGTERM，下一个期限是
+     * kill_after_ms以后，那时还没有结束的发SIGKILL，之后一直等
      */
-    for (int i = 0; i < cmd_count; i++) {
-        /*
-         * 等待第i个子进程完成
-         */
-        int status;
-        do {
-            waitpid(pids[i], &status, WUNTRACED);
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        if (st->pid > 0)
+            ev_watch(st->pid, st);
+    }
+    struct timespec deadline;
+    bool has_deadline = n_live > 0 && pl->timeout_ms > 0;
+    if (has_deadline)
+        ev_deadline(&deadline, pl->timeout_ms);
+    
+    while (n_live > 0) {
+        int wstatus;
+        struct rusage ru;
+        void *data;
+        int r = ev_wait(has_deadline ? &deadline : NULL, &data);
+        if (r == 0) {
+            // 期限到了：先SIGTERM，再SIGKILL
+            pl->timed_out++;
+            kill_pipeline(pl, pl->timed_out == 1 ? SIGTERM : SIGKILL);
+            has_deadline = (pl->timed_out == 1);
+            if (has_deadline)
+                ev_deadline(&deadline, pl->kill_after_ms);
+            continue;
+        }
+        if (r == -1) {
+            perror("wait");
+            ev_clear();
+            break;
+        }
+        struct stage *st = data;
+        if (opt_pipestat || opt_placestat)
+            read_stage_stats(st);
+        pid_t pid;
+        while ((pid = wait4(st->pid, &wstatus, 0, &ru)) == -1 && errno == EINTR)
+            ;
+        n_live--;
+        if (pid == -1)
+            continue; // 已经不是我们的子进程了（理论上不会发生）
         
-        /*
-         * 如果是最后一个命令，保存其退出状态码
-         * 
-         * 根据shell的惯例，管道的退出状态码是最后一个命令的退出状态码
-         * 例如："false | true"，虽然第一个命令失败，但整个管道返回0（因为true成功）
-         */
-        if (i == cmd_count - 1) {
-            last_exit_status = WEXITSTATUS(status);
+        finish_stage(st, wstatus, &ru);
+        if (opt_pipekill && !killed && n_live > 0 && stage_failed(st->status)) {
+            killed = true;
+            kill_pipeline(pl, SIGTERM);
         }
     }
-}
\ No newline at end of file
+    // 扇出的helper：所有分支都结束以后它马上也会结束（不算进状态码）
+    if (pl->fanout_pid > 0) {
+        ev_reap(pl->fanout_pid, NULL, NULL);
+        pl->fanout_pid = 0;
+    }
+    
+    /*
+     * 管道的状态码：最后一个命令的；pipefail时是最右边一个失败的命令的
+     * （扇出时是最后一个分支的最后一个命令的，每个分支的状态码见PIPESTATUS）
+     * 超时结束的管道是124，要用SIGKILL才结束的是137（128+9）
+     */
+    if (pl->timed_out)
+        return (pl->timed_out > 1) ? 128 + SIGKILL : 124;
+    int last = 0, rightmost_failure = 0;
+    for (struct stage *st = pl->stages; st != NULL; st = st->next) {
+        last = st->status;
+        if (st->status != 0)
+            rightmost_failure = st->status;
+    }
+    return opt_pipefail ? rightmost_failure : last;
+}
@@ -0,0 +1,349 @@
+/*
+ * file:        spawn.c
+ * description: process spawn layer for shell56
+ *
+ * 三条执行路径（execute_external / execute_with_redirection / execute_pipeline）
+ * 原来都是 fork() 之后在子进程里 signal + open + dup2 + execvp。fork 要复制
+ * 整个页表，shell 的内存越大越慢，ASan 版本尤其明显。
+ *
+ * 这里统一改用 posix_spawn：
+ *   - glibc 的 posix_spawn 内部是 clone(CLONE_VM|CLONE_VFORK)，不复制页表
+ *   - SIGINT 恢复默认 -> posix_spawnattr_setsigdefault
+ *   - 重定向和管道连接 -> file actions 里的 dup2
+ *   - 其它fd（管道、重定向文件）都带 O_CLOEXEC，exec 时自动关闭
+ *   - 重定向文件在父进程中打开（O_CLOEXEC），出错时能打印和原来一样的信息
+ *   - exec 失败时 posix_spawn 直接把 errno 返回给父进程
+ *
+ * ./shell56 -z 时改由zygote进程创建子进程（见zygote.c），
+ * PATH查找和错误信息仍然在这里
+ */
+
+#define _GNU_SOURCE	/* pipe2 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <limits.h>	/* PIPE_BUF */
+#include <unistd.h>
+#include <sys/mman.h>	/* memfd_create */
+
+#include "spawn.h"
+#include "pathcache.h"
+#include "zygote.h"
+#include "vars.h"
+
+/*
+ * 子进程的属性（只初始化一次）：
+ *   attr: 留在shell的进程组里（普通的前台命令）
+ *   pg_attr: 放进另一个进程组（后台作业），组号每次调用时设置
+ */
+static posix_spawnattr_t attr, pg_attr;
+static int attr_ready;
+
+static posix_spawnattr_t *spawn_attr(pid_t pgid)
+{
+    if (!attr_ready) {
+        sigset_t def;
+        sigemptyset(&def);
+        sigaddset(&def, SIGINT);  /* shell 忽略 Ctrl+C，子进程要恢复默认 */
+        sigaddset(&def, SIGTTOU); /* 交互模式下shell忽略 SIGTTOU（见fg） */
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigdefault(&attr, &def);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+        posix_spawnattr_init(&pg_attr);
+        posix_spawnattr_setsigdefault(&pg_attr, &def);
+        posix_spawnattr_setflags(&pg_attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+        attr_ready = 1;
+    }
+    if (pgid == 0)
+        return &attr;
+    posix_spawnattr_setpgroup(&pg_attr, pgid == -1 ? 0 : pgid);
+    return &pg_attr;
+}
+
+/*
+ * 没有 #! 的脚本 execve 会返回 ENOEXEC，execvp 的做法是交给 /bin/sh 执行，
+ * 这里保持同样的行为：argv变成 "sh path 参数..."（malloc的数组）
+ */
+static char **sh_args(const char *path, char **argv)
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+
+    char **sh_argv = malloc((argc + 2) * sizeof(char *));
+    if (sh_argv == NULL)
+        return NULL;
+    sh_argv[0] = "sh";
+    sh_argv[1] = (char *)path;
+    memcpy(&sh_argv[2], &argv[1], argc * sizeof(char *));  /* 包括结尾的NULL */
+    return sh_argv;
+}
+
+static int spawn_sh(pid_t *pid, const char *path, char **argv,
+                    posix_spawn_file_actions_t *fa, posix_spawnattr_t *sa)
+{
+    char **sh_argv = sh_args(path, argv);
+    if (sh_argv == NULL)
+        return ENOMEM;
+    int err = posix_spawn(pid, "/bin/sh", fa, sa, sh_argv, vars_envp());
+    free(sh_argv);
+    return err;
+}
+
+/*
+ * spawn_command: 启动一个外部命令，不等待它结束
+ *
+ * 参数说明：
+ *   sp: 命令参数、标准输入/输出要连接到哪里，以及放进哪个进程组
+ *
+ * 返回值：
+ *   成功返回子进程的pid；失败返回-1，并已经打印了错误信息
+ *   （格式和原来子进程里execvp失败时一样："命令: 错误描述"）
+ *
+ * 路径来自PATH查找缓存。如果缓存的路径已经失效（ENOENT），把它从缓存中
+ * 删除并重新查找一次。
+ * 
+ * 子进程的环境是导出的shell变量（vars_envp，只在变量改变后才重建）
+ */
+pid_t spawn_command(const struct spawn *sp)
+{
+    char *name = sp->argv[0];
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t *sa = spawn_attr(sp->pgid);
+    pid_t pid = -1;
+    int err = 0;
+
+    posix_spawn_file_actions_init(&fa);
+    if (sp->in_fd >= 0 && sp->in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, sp->in_fd, STDIN_FILENO);
+    if (sp->out_fd >= 0 && sp->out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, sp->out_fd, STDOUT_FILENO);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const char *path = path_lookup(name, &err);
+        if (path == NULL)
+            break;
+        /*
+         * -z: 由zygote创建（见zygote.c，ENOEXEC在zygote里处理）。
+         * zygote只拿到0/1/2，子进程要用 /dev/fd/N 时不能用它
+         */
+        int via_zygote = zygote_active() && !sp->keep_fds;
+        if (via_zygote)
+            err = zygote_spawn(&pid, path, sp);
+        if (!via_zygote || !zygote_active()) {
+            err = posix_spawn(&pid, path, &fa, sa, sp->argv, vars_envp());
+            if (err == ENOEXEC)
+                err = spawn_sh(&pid, path, sp->argv, &fa, sa);
+        }
+        if (err != ENOENT || path == name)
+            break;
+        /* 缓存的路径失效了（文件被删除或移动），重新查找一次 */
+        path_forget(name);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * exec_command: 用外部命令替换shell进程本身（-c 只有一个简单命令时，
+ * 见exec_simple），不创建子进程
+ *
+ * 路径的查找、没有 #! 的脚本交给 /bin/sh、错误信息都和spawn_command一样。
+ * 成功时不返回；返回表示失败，错误信息已经打印
+ */
+void exec_command(char **argv)
+{
+    char *name = argv[0];
+    int err = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const char *path = path_lookup(name, &err);
+        if (path == NULL)
+            break;
+        execve(path, argv, vars_envp());
+        err = errno;
+        char **sh_argv = (err == ENOEXEC) ? sh_args(path, argv) : NULL;
+        if (sh_argv != NULL) {
+            execve("/bin/sh", sh_argv, vars_envp());
+            err = errno;
+            free(sh_argv);
+        }
+        if (err != ENOENT || path == name)
+            break;
+        path_forget(name);  /* 缓存的路径失效了，重新查找一次 */
+    }
+    fprintf(stderr, "%s: %s\n", name, strerror(err));
+}
+
+/*
+ * open_redirect: 在父进程中打开重定向文件
+ *
+ * 参数说明：
+ *   file: 文件名
+ *   for_output: 0 表示 < （只读），1 表示 > （创建/清空后写入）
+ *
+ * 返回值：成功返回fd（带 O_CLOEXEC，只会通过 dup2 传给子进程），
+ *         失败打印 "文件名: 错误描述" 并返回-1
+ */
+int open_redirect(const char *file, int for_output)
+{
+    int fd;
+    if (for_output)
+        fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    else
+        fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+    return fd;
+}
+
+/*
+ * spawn_pipe: 创建一个两端都带 O_CLOEXEC 的管道
+ *
+ * 子进程通过 dup2 拿到需要的那一端（dup2 出来的 0/1 不带 CLOEXEC），
+ * 其它管道fd在 exec 时自动关闭，不需要在子进程里逐个 close。
+ * macOS 没有 pipe2，退回到 pipe + fcntl（shell 是单线程的，中间不会有别的
+ * 线程 fork）。
+ */
+int spawn_pipe(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1)
+        return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/*
+ * spawn_pipe_size: 设置管道的容量（默认64 KiB）
+ *
+ * 参数说明：
+ *   fd: 管道的任意一端
+ *   size: 想要的容量（字节），超过 /proc/sys/fs/pipe-max-size 时用这个上限；
+ *         0表示不改变，只查询
+ *
+ * 返回值：实际的容量（内核向上取整到页大小的2的幂；用户的管道内存
+ *         超过 pipe-user-pages-soft 时设置会失败，容量不变）；
+ *         不支持 F_SETPIPE_SZ 的系统上返回-1
+ *
+ * 容量大的管道，上下游命令每次能读/写更多数据，高吞吐量的管道
+ * （例如 "zcat | sort | uniq"）中的上下文切换少得多
+ */
+int spawn_pipe_size(int fd, int size)
+{
+#ifdef F_SETPIPE_SZ
+    static int max_size;
+    if (max_size == 0) {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f == NULL || fscanf(f, "%d", &max_size) != 1 || max_size <= 0)
+            max_size = 1 << 20;
+        if (f != NULL)
+            fclose(f);
+    }
+    if (size > max_size)
+        size = max_size;
+    if (size > 0)
+        fcntl(fd, F_SETPIPE_SZ, size);
+    return fcntl(fd, F_GETPIPE_SZ);
+#else
+    (void)fd;
+    (void)size;
+    return -1;
+#endif
+}
+
+/*
+ * open_tmpfile: 创建一个匿名的临时文件（读写，带 O_CLOEXEC）
+ *
+ * 用来暂存子进程的输出（例如 parallel -g）。Linux上用memfd_create，
+ * 文件只在内存里，不碰磁盘；其它系统在/tmp下创建文件后马上unlink。
+ *
+ * 参数说明：
+ *   who: 谁在用这个文件，用作memfd的名字和错误信息的前缀
+ *
+ * 返回值：成功返回fd，失败打印 "who: 错误描述" 并返回-1
+ */
+int open_tmpfile(const char *who)
+{
+    int fd;
+#ifdef __linux__
+    fd = memfd_create(who, MFD_CLOEXEC);
+    if (fd != -1)
+        return fd;
+#endif
+    char path[] = "/tmp/shell56-XXXXXX";
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror(who);
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/*
+ * open_data: 一个读出来是data的fd（here-document、here-string的标准输入）
+ *
+ * 参数说明：
+ *   data, len: 内容
+ *
+ * 返回值：成功返回fd（带 O_CLOEXEC），
+ *         失败打印 "here-document: 错误描述" 并返回-1
+ *
+ * 原来只能先写一个临时文件再 "< file"。现在内容不碰磁盘：
+ *   - 不超过PIPE_BUF字节：写进一个管道（一次write，不会阻塞），
+ *     关闭写端，命令读完就是EOF
+ *   - 更长的：写进memfd（内存中的文件，见open_tmpfile），封上
+ *     （F_SEAL_WRITE等，命令拿到的内容不会再被改变），位置移回开头。
+ *     命令可以像普通文件一样lseek、mmap，纯复制命令（cat <<EOF > file）
+ *     可以直接sendfile
+ */
+int open_data(const char *data, size_t len)
+{
+    int fds[2];
+    if (len <= PIPE_BUF && spawn_pipe(fds) == 0) {
+        if (len == 0 || write(fds[1], data, len) == (ssize_t)len) {
+            close(fds[1]);
+            return fds[0];
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = -1;
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    fd = memfd_create("here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+    if (fd == -1 && (fd = open_tmpfile("here-document")) == -1)
+        return -1;
+    for (size_t off = 0; off < len; ) {
+        ssize_t w = write(fd, data + off, len - off);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("here-document");
+            close(fd);
+            return -1;
+        }
+        off += w;
+    }
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
@@ -0,0 +1,35 @@
+/*
+ * file:        spawn.h
+ * description: process spawn layer (posix_spawn) for shell56
+ */
+
+/* standard include file protection:
+*/
+#ifndef __SPAWN_H__
+#define __SPAWN_H__
+
+#include <sys/types.h>
+
+/* one child to start: argv plus how its stdin/stdout are wired
+*/
+struct spawn {
+    char **argv;            /* argv[0] is the command name */
+    int in_fd;              /* becomes fd 0 in the child, -1 = inherit */
+    int out_fd;             /* becomes fd 1 in the child, -1 = inherit */
+    pid_t pgid;             /* 0 = stay in the shell's process group,
+                               -1 = lead a new group, else join pgid */
+    int keep_fds;           /* the child also uses fds the shell left open
+                               (process substitution): don't use the zygote */
+};
+
+/* function declarations:
+*/
+pid_t spawn_command(const struct spawn *sp);
+void exec_command(char **argv);
+int open_redirect(const char *file, int for_output);
+int spawn_pipe(int fds[2]);
+int spawn_pipe_size(int fd, int size);
+int open_tmpfile(const char *who);
+int open_data(const char *data, size_t len);
+
+#endif
@@ -106,7 +106,271 @@ echo "---"
 echo -e "echo 'Signal handling test'\necho 'Shell should not exit on ^C in interactive mode'\nexit" | ./shell56
 echo
 
+# Test 11: PATH lookup cache
+echo "Test 11: PATH lookup cache (hash builtin)"
+echo "ls -d /tmp"
+echo "hash"
+echo "invalid_command"
+echo "hash -s"
+echo "hash -r"
+echo "hash"
+echo "exit"
+echo "---"
+echo -e "ls -d /tmp\nhash\ninvalid_command\nhash -s\nhash -r\nhash\nexit" | ./shell56
+echo
+
+# Test 12: Background jobs
+echo "Test 12: Background jobs (&, jobs, wait)"
+echo "sleep 1 &"
+echo "sleep 1 | sleep 1 &"
+echo "jobs"
+echo "wait"
+echo "sh -c 'exit 3' &"
+echo "wait \$!"
+echo "echo 'wait status: '\$?"
+echo "exit"
+echo "---"
+echo -e "sleep 1 &\nsleep 1 | sleep 1 &\njobs\nwait\nsh -c 'exit 3' &\nwait \$!\necho 'wait status: '\$?\nexit" | ./shell56
+echo
+
+# Test 13: parallel builtin
+echo "Test 13: parallel builtin"
+printf '0\n1\n2\n' > parallel_args.txt
+echo "parallel -j 1 -a parallel_args.txt echo arg:{}"
+echo "parallel -j 4 -a parallel_args.txt 'sh -c \"exit {}\"'"
+echo "echo failed jobs: \$?"
+echo "exit"
+echo "---"
+echo -e "parallel -j 1 -a parallel_args.txt echo arg:{}\nparallel -j 4 -a parallel_args.txt 'sh -c \"exit {}\"'\necho failed jobs: \$?\nexit" | ./shell56
+echo
+
+# Test 14: In-process builtins (echo, true/false, test, printf)
+echo "Test 14: In-process builtins"
+echo "false"
+echo "echo status: \$?"
+echo "[ -d /tmp ]"
+echo "echo status: \$?"
+echo "test 2 -gt 3"
+echo "echo status: \$?"
+echo "printf '%s=%03d\\n' a 7 b 42"
+echo "echo hello | wc -c"
+echo "echo redirected > builtin_out.txt"
+echo "cat builtin_out.txt"
+echo "exit"
+echo "---"
+echo -e "false\necho status: \$?\n[ -d /tmp ]\necho status: \$?\ntest 2 -gt 3\necho status: \$?\nprintf '%s=%03d\\\\n' a 7 b 42\necho hello | wc -c\necho redirected > builtin_out.txt\ncat builtin_out.txt\nexit" | ./shell56
+echo
+
+# Test 15: pipefail, pipekill and PIPESTATUS
+echo "Test 15: pipefail, pipekill and PIPESTATUS"
+echo "false | true"
+echo "printenv PIPESTATUS"
+echo "set -o pipefail"
+echo "false | true"
+echo "echo status: \$?"
+echo "set -o pipekill"
+echo "sh -c 'exit 3' | sleep 5"
+echo "printenv PIPESTATUS"
+echo "exit"
+echo "---"
+echo -e "false | true\nprintenv PIPESTATUS\nset -o pipefail\nfalse | true\necho status: \$?\nset -o pipekill\nsh -c 'exit 3' | sleep 5\nprintenv PIPESTATUS\nexit" | ./shell56
+echo
+
+# Test 16: Shell variables
+echo "Test 16: Shell variables"
+echo "NAME=world"
+echo "echo hello \$NAME \${NAME}s '\$NAME'"
+echo "false"
+echo "echo out_\$?.txt"
+echo "GREETING=\"hi there\" sh -c 'echo \$GREETING'"
+echo "export NAME"
+echo "sh -c 'echo \$NAME'"
+echo "unset NAME"
+echo "echo [\$NAME]"
+echo "B=zz"
+echo "echo \"x \\\$B y\" \\\$B \"\\\$(echo no)\" \"q\\\"q\""
+echo "exit"
+echo "---"
+echo -e "NAME=world\necho hello \$NAME \${NAME}s '\$NAME'\nfalse\necho out_\$?.txt\nGREETING=\"hi there\" sh -c 'echo \$GREETING'\nexport NAME\nsh -c 'echo \$NAME'\nunset NAME\necho [\$NAME]\nB=zz\necho \"x \\\$B y\" \\\$B \"\\\$(echo no)\" \"q\\\"q\"\nexit" | ./shell56
+echo
+
+# Test 17: Command substitution
+echo "Test 17: Command substitution"
+echo "echo [\$(echo hello world)] \"[\$(printf 'a  b')]\""
+echo "echo out_\$(echo 42).txt"
+echo "LINES=\$(printf 'x\\ny\\n')"
+echo "echo \"\$LINES\" | wc -l"
+echo "echo \$(echo \$(echo nested) | tr a-z A-Z)"
+echo "X=\$(false)"
+echo "echo status: \$?"
+echo "exit"
+echo "---"
+echo -e "echo [\$(echo hello world)] \"[\$(printf 'a  b')]\"\necho out_\$(echo 42).txt\nLINES=\$(printf 'x\\\\ny\\\\n')\necho \"\$LINES\" | wc -l\necho \$(echo \$(echo nested) | tr a-z A-Z)\nX=\$(false)\necho status: \$?\nexit" | ./shell56
+echo
+
+# Test 18: Process substitution
+echo "Test 18: Process substitution"
+echo "printf 'c\\na\\nb\\n' > test_ps1.txt"
+echo "printf 'b\\nc\\nd\\n' > test_ps2.txt"
+echo "diff <(sort test_ps1.txt) <(sort test_ps2.txt)"
+echo "paste <(seq 3) <(seq 4 6)"
+echo "head -1 <(yes)"
+echo "seq 5 | tee >(wc -l) > /dev/null"
+echo "exit"
+echo "---"
+echo -e "printf 'c\\\\na\\\\nb\\\\n' > test_ps1.txt\nprintf 'b\\\\nc\\\\nd\\\\n' > test_ps2.txt\ndiff <(sort test_ps1.txt) <(sort test_ps2.txt)\npaste <(seq 3) <(seq 4 6)\nhead -1 <(yes)\nseq 5 | tee >(wc -l) > /dev/null\nexit" | ./shell56
+echo
+
+# Test 19: Fan-out |+
+echo "Test 19: Fan-out |+"
+echo "seq 5 |+ wc -l |+ tail -1"
+echo "seq 1000 |+ grep -c 7 > test_fan.txt |+ sort -rn | head -1"
+echo "cat test_fan.txt"
+echo "true |+ false |+ true"
+echo "echo status \$? \$PIPESTATUS"
+echo "exit"
+echo "---"
+echo -e "seq 5 |+ wc -l |+ tail -1\nseq 1000 |+ grep -c 7 > test_fan.txt |+ sort -rn | head -1\ncat test_fan.txt\ntrue |+ false |+ true\necho status \$? \$PIPESTATUS\nexit" | ./shell56
+echo
+
+# Test 20: Here-documents and here-strings
+echo "Test 20: Here-documents and here-strings"
+echo "X=world"
+echo "cat <<EOF"
+echo "hello \$X"
+echo "EOF"
+echo "cat <<'EOF' | tr a-z A-Z"
+echo "literal \$X"
+echo "EOF"
+echo "tr a-z A-Z <<< \"here \$X\""
+echo "exit"
+echo "---"
+echo -e "X=world\ncat <<EOF\nhello \$X\nEOF\ncat <<'EOF' | tr a-z A-Z\nliteral \$X\nEOF\ntr a-z A-Z <<< \"here \$X\"\nexit" | ./shell56
+echo
+
+# Test 21: Command lists and control flow
+echo "Test 21: Command lists and control flow"
+echo "false && echo no || echo yes; echo done"
+echo "for x in a b c; do if test \$x = b; then continue; fi; echo \$x; done"
+echo "i=0"
+echo "while true"
+echo "do"
+echo "  echo i=\$i; i=\$(echo \$i | tr 01 12)"
+echo "  if test \$i = 2; then break; fi"
+echo "done"
+echo "echo \"\$(for w in p q; do printf \$w; done)\""
+echo "exit"
+echo "---"
+echo -e "false && echo no || echo yes; echo done\nfor x in a b c; do if test \$x = b; then continue; fi; echo \$x; done\ni=0\nwhile true\ndo\n  echo i=\$i; i=\$(echo \$i | tr 01 12)\n  if test \$i = 2; then break; fi\ndone\necho \"\$(for w in p q; do printf \$w; done)\"\nexit" | ./shell56
+echo
+
+# Test 22: Script cache (SHELL56_CACHE)
+echo "Test 22: Script cache (SHELL56_CACHE)"
+echo -e "for x in 1 2; do echo cached \$x; done\ncat <<EOF\nbody\nEOF" > test_bc.sh
+cat test_bc.sh
+echo "--- cold, then warm"
+SHELL56_CACHE=test_bc_cache ./shell56 test_bc.sh
+SHELL56_CACHE=test_bc_cache ./shell56 test_bc.sh
+ls test_bc_cache | wc -l
+echo
+
+# Test 23: -c and -s
+echo "Test 23: -c and -s"
+echo "./shell56 -c 'echo hi'"
+echo "./shell56 -c 'sh -c \"exit 7\"'; echo \$?"
+echo "./shell56 -c 'echo a; echo b'"
+echo "./shell56 -c 'X=5 printenv X'"
+echo "echo 'echo from stdin' | ./shell56 -s"
+echo "---"
+./shell56 -c 'echo hi'
+./shell56 -c 'sh -c "exit 7"'; echo $?
+./shell56 -c 'echo a; echo b'
+./shell56 -c 'X=5 printenv X'
+echo 'echo from stdin' | ./shell56 -s
+echo
+
+# Test 24: timeout prefix
+echo "Test 24: timeout prefix"
+echo "timeout 0.3 sleep 5 | sleep 5"
+echo "echo status \$? \$PIPESTATUS"
+echo "timeout 5 sh -c 'exit 3'"
+echo "echo status \$?"
+echo "timeout -k 0.2 0.2 sh -c 'trap \"\" TERM; sleep 5'"
+echo "echo status \$?"
+echo "timeout soon sleep 1"
+echo "echo status \$?"
+echo "exit"
+echo "---"
+echo -e "timeout 0.3 sleep 5 | sleep 5\necho status \$? \$PIPESTATUS\ntimeout 5 sh -c 'exit 3'\necho status \$?\ntimeout -k 0.2 0.2 sh -c 'trap \"\" TERM; sleep 5'\necho status \$?\ntimeout soon sleep 1\necho status \$?\nexit" | ./shell56
+echo
+
+# Test 25: Pipeline placement (set -o place, place prefix)
+echo "Test 25: Pipeline placement"
+echo "set -o place=llc"
+echo "seq 1000 | sort -rn | head -1"
+echo "place node seq 5 | wc -l"
+echo "place off seq 3 | tail -1"
+echo "place nowhere seq 3"
+echo "echo status \$?"
+echo "set +o place"
+echo "set | grep place"
+echo "exit"
+echo "---"
+echo -e "set -o place=llc\nseq 1000 | sort -rn | head -1\nplace node seq 5 | wc -l\nplace off seq 3 | tail -1\nplace nowhere seq 3\necho status \$?\nset +o place\nset | grep place\nexit" | ./shell56
+echo
+
+# Test 26: Background job killed by a signal
+echo "Test 26: Background job killed by a signal"
+echo "sh -c 'kill -9 \$\$' &"
+echo "wait \$!"
+echo "echo 'wait status: '\$?"
+echo "exit"
+echo "---"
+echo -e "sh -c 'kill -9 \$\$' &\nwait \$!\necho 'wait status: '\$?\nexit" | ./shell56
+echo
+
+# Test 27: Redirections on compound commands and read
+echo "Test 27: Redirections on compound commands and read"
+echo "printf 'a b c\\nd e\\n' > input.txt"
+echo "while read x y; do echo \"\$y/\$x\"; done < input.txt"
+echo "for w in 1 2; do echo \$w; done > test_loop.txt"
+echo "cat test_loop.txt"
+echo "read -r line < input.txt; echo \$line"
+echo "exit"
+echo "---"
+echo -e "printf 'a b c\\\\nd e\\\\n' > input.txt\nwhile read x y; do echo \"\$y/\$x\"; done < input.txt\nfor w in 1 2; do echo \$w; done > test_loop.txt\ncat test_loop.txt\nread -r line < input.txt; echo \$line\nexit" | ./shell56
+echo
+
+# Test 28: In-process copy stages (cat and < in > out without a cat process)
+echo "Test 28: In-process copy stages"
+echo "printf 'one\\ntwo\\n' > input.txt"
+echo "cat < input.txt > test_copy.txt"
+echo "cat test_copy.txt"
+echo "cat input.txt | cat > test_copy.txt"
+echo "wc -l < test_copy.txt"
+echo "echo mid | cat input.txt - input.txt"
+echo "cat /nonexistent_file; echo 'cat status: '\$?"
+echo "cat /proc/self/status > test_copy.txt; grep -c '^Name:' test_copy.txt"
+echo "exit"
+echo "---"
+echo -e "printf 'one\\\\ntwo\\\\n' > input.txt\ncat < input.txt > test_copy.txt\ncat test_copy.txt\ncat input.txt | cat > test_copy.txt\nwc -l < test_copy.txt\necho mid | cat input.txt - input.txt\ncat /nonexistent_file; echo 'cat status: '\$?\ncat /proc/self/status > test_copy.txt; grep -c '^Name:' test_copy.txt\nexit" | ./shell56 2>&1
+echo
+
+# Test 29: Pipe capacity and pipe statistics (pipesize, set -o pipestat)
+echo "Test 29: Pipe capacity and pipe statistics"
+echo "pipesize 1M seq 100000 | wc -l"
+echo "set -o pipesize=64K"
+echo "set | grep pipesize"
+echo "set -o pipestat"
+echo "seq 1000 | wc -l"
+echo "exit"
+echo "(byte counts and times are left out of the pipestat report)"
+echo "---"
+echo -e "pipesize 1M seq 100000 | wc -l\nset -o pipesize=64K\nset | grep pipesize\nset -o pipestat\nseq 1000 | wc -l\nexit" | ./shell56 2>&1 | sed -E 's/^(\[[0-9]+\] +[^ ]+) +[0-9]+ +[0-9]+ +[0-9.]+ +[0-9.]+ /\1  /'
+echo
+
 echo "=== All tests completed ==="
 echo "Cleaning up test files..."
-rm -f test_output.txt input.txt
+rm -f test_output.txt input.txt test_loop.txt parallel_args.txt builtin_out.txt test_ps1.txt test_ps2.txt test_fan.txt test_bc.sh test_copy.txt
+rm -rf test_bc_cache
 echo "Test files cleaned up."
@@ -0,0 +1,507 @@
+/*
+ * file:        vars.c
+ * description: shell variables (hashed symbol table) and $ expansion
+ *
+ * 原来只有 $? 和 $!，而且只有整个参数正好是 "$?" 时才替换；其它变量
+ * 都不支持，子进程的环境就是shell启动时的environ。
+ *
+ * 现在shell有自己的变量表：
+ *   - 开放寻址 + 线性探测的哈希表（和pathcache.c一样），每个变量是一个
+ *     malloc得到的 "NAME=value" 字符串，导出的变量可以直接放进envp
+ *   - 启动时导入所有环境变量（都是导出的）
+ *   - 传给子进程的envp按需重建：增加、删除导出的变量时只做一个标记，
+ *     下一次启动命令时才重建，之后启动的命令都重用同一个数组。已经在
+ *     envp中的变量改变值时（例如每个命令之后的PIPESTATUS）直接换掉
+ *     envp中的那一项，不需要重建
+ *   - "VAR=x cmd" 的赋值只在这个命令执行期间有效（vars_push/vars_pop），
+ *     不进哈希表
+ *
+ * 展开（var_expand）：$NAME、${NAME}、$?、$!、$$，可以出现在一个参数的
+ * 中间（例如 out_$?.txt）。和zsh一样，展开的结果不再按空格拆成多个参数。
+ * 调用者先量出展开后的长度，再把结果一次写进这一行的arena（见ast.c）
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "vars.h"
+#include "parser.h"     /* ESC_DOLLAR */
+
+extern char **environ;
+
+/* 初始容量（必须是2的幂），装载因子超过 1/2 时扩容 */
+#define INITIAL_CAP 64
+
+struct var {
+    char *str;          /* "NAME=value"，NULL表示空槽 */
+    size_t name_len;
+    uint32_t hash;
+    int flags;          /* VAR_xxx */
+    int env_index;      /* 在envp中的位置，-1表示不在 */
+};
+
+static struct var *table;
+static size_t cap, count;
+
+/* 导出的变量组成的envp（指向表中的字符串）；envp_dirty表示需要重建 */
+static char **envp;
+static size_t envp_len, envp_cap;
+static int envp_dirty = 1;
+
+/* vars_push的临时赋值（"NAME=value"），后push的优先；
+ * 有临时赋值时，envp和它们合并到temp_envp中 */
+static char **temp;
+static int n_temp, temp_cap;
+static char **temp_envp;
+static size_t temp_envp_cap;
+
+/* $? 和 $! 的值（见var_special） */
+static int special_status;
+static pid_t special_bg_pid;
+
+static void *xrealloc(void *p, size_t n)
+{
+    if ((p = realloc(p, n)) == NULL) {
+        perror("vars");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* FNV-1a 哈希 */
+static uint32_t hash_name(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* 在表中查找变量，返回它所在的槽，或者它应该插入的空槽 */
+static struct var *find_slot(const char *name, size_t len, uint32_t h)
+{
+    size_t mask = cap - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        struct var *v = &table[i];
+        if (v->str == NULL)
+            return v;
+        if (v->hash == h && v->name_len == len && memcmp(v->str, name, len) == 0)
+            return v;
+    }
+}
+
+static void grow(void)
+{
+    struct var *old = table;
+    size_t old_cap = cap;
+
+    cap = cap ? cap * 2 : INITIAL_CAP;
+    table = calloc(cap, sizeof(*table));
+    if (table == NULL) {
+        perror("vars");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i].str != NULL)
+            *find_slot(old[i].str, old[i].name_len, old[i].hash) = old[i];
+    free(old);
+}
+
+/* 删除一个槽里的变量，后续条目往前挪（backward shift deletion，见pathcache.c） */
+static void remove_slot(struct var *v)
+{
+    size_t mask = cap - 1;
+    size_t i = v - table;
+
+    if (v->flags & VAR_EXPORT)
+        envp_dirty = 1;
+    free(v->str);
+    count--;
+
+    for (size_t j = (i + 1) & mask; table[j].str != NULL; j = (j + 1) & mask) {
+        size_t home = table[j].hash & mask;
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    memset(&table[i], 0, sizeof(table[i]));
+}
+
+/* 变量名：字母或下划线开头，后面是字母、数字、下划线 */
+static int name_start(int c)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static int name_char(int c)
+{
+    return name_start(c) || (c >= '0' && c <= '9');
+}
+
+/* s开头的变量名的长度（0表示不是变量名） */
+static size_t scan_name(const char *s, const char *end)
+{
+    const char *p = s;
+    if (p < end && name_start((unsigned char)*p))
+        for (p++; p < end && name_char((unsigned char)*p); p++)
+            ;
+    return p - s;
+}
+
+/* 临时赋值中的 "NAME=value"，没有时返回NULL */
+static const char *lookup_temp(const char *name, size_t len)
+{
+    for (int i = n_temp - 1; i >= 0; i--)
+        if (strncmp(temp[i], name, len) == 0 && temp[i][len] == '=')
+            return temp[i];
+    return NULL;
+}
+
+/* 变量的值（先看临时赋值，再看表），没有设置时返回NULL */
+static const char *get_n(const char *name, size_t len)
+{
+    const char *s = lookup_temp(name, len);
+    if (s != NULL)
+        return s + len + 1;
+    if (cap == 0)
+        return NULL;
+    struct var *v = find_slot(name, len, hash_name(name, len));
+    return v->str ? v->str + len + 1 : NULL;
+}
+
+static int set_n(const char *name, size_t len, const char *value, int flags)
+{
+    size_t value_len = strlen(value);
+    char *str = malloc(len + value_len + 2);
+    if (str == NULL) {
+        perror("vars");
+        return -1;
+    }
+    memcpy(str, name, len);
+    str[len] = '=';
+    memcpy(str + len + 1, value, value_len + 1);
+
+    if ((count + 1) * 2 > cap)
+        grow();
+    uint32_t h = hash_name(name, len);
+    struct var *v = find_slot(name, len, h);
+    if (v->str != NULL) {
+        flags |= v->flags;  // 导出的变量重新赋值以后仍然是导出的
+        free(v->str);
+    } else {
+        count++;
+        v->env_index = -1;
+    }
+    v->str = str;
+    v->name_len = len;
+    v->hash = h;
+    v->flags = flags;
+    if (v->env_index >= 0 && !envp_dirty)
+        envp[v->env_index] = str;
+    else if (flags & VAR_EXPORT)
+        envp_dirty = 1;
+    return 0;
+}
+
+/* 启动时导入environ，所有变量都是导出的 */
+void vars_init(void)
+{
+    for (char **e = environ; *e != NULL; e++) {
+        size_t len = var_name_len(*e);
+        if (len > 0)
+            set_n(*e, len, *e + len + 1, VAR_EXPORT);
+    }
+}
+
+/*
+ * var_get: 读取变量
+ *
+ * 返回值：变量的值（由变量表持有，下一次修改这个变量之前有效），
+ *         没有设置时返回NULL
+ */
+const char *var_get(const char *name)
+{
+    return get_n(name, strlen(name));
+}
+
+/*
+ * var_set: 设置变量
+ *
+ * 参数说明：
+ *   name, value: 变量名和值（都会复制）
+ *   flags: VAR_EXPORT表示导出；已经导出的变量不会因为flags为0而取消导出
+ *
+ * 返回值：成功返回0；内存不够时返回-1
+ */
+int var_set(const char *name, const char *value, int flags)
+{
+    return set_n(name, strlen(name), value, flags);
+}
+
+/* var_assign: 执行赋值 "NAME=value"；不是赋值时返回-1 */
+int var_assign(const char *word, int flags)
+{
+    size_t len = var_name_len(word);
+    if (len == 0)
+        return -1;
+    return set_n(word, len, word + len + 1, flags);
+}
+
+/*
+ * var_export: export的一个参数，"NAME=value" 或者 "NAME"
+ *
+ * 返回值：成功返回0；不是合法的变量名时返回-1
+ *
+ * 导出一个还没有设置的变量时，和zsh一样把它设为空字符串
+ */
+int var_export(const char *name)
+{
+    if (strchr(name, '=') != NULL)
+        return var_assign(name, VAR_EXPORT);
+    size_t len = strlen(name);
+    if (len == 0 || scan_name(name, name + len) != len)
+        return -1;
+    if (cap > 0) {
+        struct var *v = find_slot(name, len, hash_name(name, len));
+        if (v->str != NULL) {
+            if (!(v->flags & VAR_EXPORT))
+                envp_dirty = 1;
+            v->flags |= VAR_EXPORT;
+            return 0;
+        }
+    }
+    return set_n(name, len, "", VAR_EXPORT);
+}
+
+/* var_valid_name: name是不是合法的变量名 */
+int var_valid_name(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 0 && scan_name(name, name + len) == len;
+}
+
+/* var_unset: 删除变量；不是合法的变量名时返回-1，没有这个变量不算错误 */
+int var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || scan_name(name, name + len) != len)
+        return -1;
+    if (cap > 0) {
+        struct var *v = find_slot(name, len, hash_name(name, len));
+        if (v->str != NULL)
+            remove_slot(v);
+    }
+    return 0;
+}
+
+/*
+ * var_name_len: word是不是赋值 "NAME=value"
+ *
+ * 返回值：NAME的长度；不是赋值时返回0
+ */
+size_t var_name_len(const char *word)
+{
+    size_t len = 0;
+    if (name_start((unsigned char)word[0]))
+        for (len = 1; name_char((unsigned char)word[len]); len++)
+            ;
+    return (len > 0 && word[len] == '=') ? len : 0;
+}
+
+/* var_special: 设置 $? 和 $! 的值（在建立语法树之前调用） */
+void var_special(int status, pid_t bg_pid)
+{
+    special_status = status;
+    special_bg_pid = bg_pid;
+}
+
+/*
+ * s指向一个 '$'：解析后面的变量引用
+ *
+ * 返回值：引用占的字节数（包括 '$'）；0表示不是变量引用，'$'原样保留。
+ * 变量的值放在*val中（没有设置的变量为NULL），$? 这样的数字写在num中
+ */
+static size_t parse_ref(const char *s, const char *end, const char **val, char *num)
+{
+    const char *p = s + 1;
+    int braced = (p < end && *p == '{');
+    if (braced)
+        p++;
+
+    size_t len = scan_name(p, end);
+    if (len > 0) {
+        *val = get_n(p, len);
+    } else if (p < end && (*p == '?' || *p == '!' || *p == '$')) {
+        long n = (*p == '?') ? special_status :
+                 (*p == '!') ? (long)special_bg_pid : (long)getpid();
+        snprintf(num, 24, "%ld", n);
+        *val = num;
+        len = 1;
+    } else {
+        return 0;
+    }
+    p += len;
+
+    if (braced) {
+        if (p >= end || *p != '}')
+            return 0;   // "${NAME" 没有结束，或者 ${} 里不是变量名
+        p++;
+    }
+    return p - s;
+}
+
+/*
+ * var_expand: 展开s（长度len）中的所有变量引用
+ *
+ * 参数说明：
+ *   s, len: 参数的文字（不需要以NUL结尾）
+ *   out: 写展开的结果（不写结尾的NUL）；NULL表示只计算长度
+ *
+ * 返回值：展开后的长度
+ *
+ * 没有设置的变量展开成空字符串；'$' 后面不是变量名（例如 "$5"、"a$"）
+ * 时原样保留。ESC_DOLLAR（tokenizer中的 \$）展开成一个不开始变量的 '$'
+ */
+size_t var_expand(const char *s, size_t len, char *out)
+{
+    const char *end = s + len;
+    size_t n = 0;
+    char num[24];
+
+    while (s < end) {
+        const char *d = s;
+        while (d < end && *d != '$' && *d != ESC_DOLLAR)
+            d++;
+        size_t lit = d - s;
+        if (out != NULL)
+            memcpy(out + n, s, lit);
+        n += lit;
+        if (d == end)
+            break;
+
+        const char *val = NULL;
+        size_t used = (*d == '$') ? parse_ref(d, end, &val, num) : 0;
+        if (used == 0) {
+            if (out != NULL)
+                out[n] = '$';
+            n++;
+            s = d + 1;
+            continue;
+        }
+        if (val != NULL) {
+            size_t val_len = strlen(val);
+            if (out != NULL)
+                memcpy(out + n, val, val_len);
+            n += val_len;
+        }
+        s = d + used;
+    }
+    return n;
+}
+
+/*
+ * vars_envp: 子进程的环境（导出的变量，加上当前的临时赋值）
+ *
+ * 返回值：NULL结尾的数组，下一次修改变量（或者vars_push/vars_pop）之前有效
+ *
+ * 没有临时赋值时，只有导出的变量改变以后才重建，大部分命令直接重用
+ */
+char **vars_envp(void)
+{
+    if (envp_dirty) {
+        envp_len = 0;
+        for (size_t i = 0; i < cap; i++)
+            if (table[i].str != NULL && (table[i].flags & VAR_EXPORT))
+                envp_len++;
+        if (envp_len + 1 > envp_cap) {
+            envp_cap = 2 * (envp_len + 1);
+            envp = xrealloc(envp, envp_cap * sizeof(char *));
+        }
+        size_t k = 0;
+        for (size_t i = 0; i < cap; i++) {
+            if (table[i].str != NULL && (table[i].flags & VAR_EXPORT)) {
+                table[i].env_index = k;
+                envp[k++] = table[i].str;
+            }
+        }
+        envp[k] = NULL;
+        envp_dirty = 0;
+    }
+    if (n_temp == 0)
+        return envp;
+
+    /* 被临时赋值覆盖的变量不要，同一个名字赋值了两次时只要后一个 */
+    if (envp_len + n_temp + 1 > temp_envp_cap) {
+        temp_envp_cap = envp_len + n_temp + 1;
+        temp_envp = xrealloc(temp_envp, temp_envp_cap * sizeof(char *));
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < envp_len; i++)
+        if (lookup_temp(envp[i], strcspn(envp[i], "=")) == NULL)
+            temp_envp[k++] = envp[i];
+    for (int i = 0; i < n_temp; i++)
+        if (lookup_temp(temp[i], var_name_len(temp[i])) == temp[i])
+            temp_envp[k++] = temp[i];
+    temp_envp[k] = NULL;
+    return temp_envp;
+}
+
+/*
+ * vars_push: "VAR=x cmd" 的赋值，在vars_pop之前有效
+ *
+ * 参数说明：
+ *   words, n: "NAME=value" 字符串（不复制，vars_pop之前调用者要保留它们）
+ *
+ * 返回值：传给vars_pop的标记
+ *
+ * 这些赋值对var_get、展开和vars_envp可见，而且都是导出的
+ */
+int vars_push(char **words, int n)
+{
+    int mark = n_temp;
+    if (n_temp + n > temp_cap) {
+        temp_cap = 2 * (n_temp + n);
+        temp = xrealloc(temp, temp_cap * sizeof(char *));
+    }
+    for (int i = 0; i < n; i++)
+        temp[n_temp++] = words[i];
+    return mark;
+}
+
+void vars_pop(int mark)
+{
+    n_temp = mark;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* 按名字的顺序打印导出的变量（export不带参数时），返回变量的个数 */
+int vars_print_exported(FILE *fp)
+{
+    char **list = malloc((count + 1) * sizeof(char *));
+    if (list == NULL) {
+        perror("export");
+        return -1;
+    }
+    int n = 0;
+    for (size_t i = 0; i < cap; i++)
+        if (table[i].str != NULL && (table[i].flags & VAR_EXPORT))
+            list[n++] = table[i].str;
+    qsort(list, n, sizeof(char *), cmp_str);
+    for (int i = 0; i < n; i++) {
+        size_t len = strcspn(list[i], "=");
+        fprintf(fp, "export %.*s=\"%s\"\n", (int)len, list[i], list[i] + len + 1);
+    }
+    free(list);
+    return n;
+}
@@ -0,0 +1,36 @@
+/*
+ * file:        vars.h
+ * description: shell variables (hashed symbol table) and $ expansion
+ */
+
+/* standard include file protection:
+*/
+#ifndef __VARS_H__
+#define __VARS_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* variable flags:
+*/
+#define VAR_EXPORT 1        /* passed to commands in their environment */
+
+/* function declarations:
+*/
+void vars_init(void);
+const char *var_get(const char *name);
+int var_set(const char *name, const char *value, int flags);
+int var_assign(const char *word, int flags);
+int var_export(const char *name);
+int var_unset(const char *name);
+size_t var_name_len(const char *word);
+int var_valid_name(const char *name);
+void var_special(int status, pid_t bg_pid);
+size_t var_expand(const char *s, size_t len, char *out);
+char **vars_envp(void);
+int vars_push(char **words, int n);
+void vars_pop(int mark);
+int vars_print_exported(FILE *fp);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * file:        zygote.c
+ * description: fork-server (zygote) helper process for spawning commands
+ *
+ * ./shell56 -z 在启动时（shell还很小的时候）fork出一个helper进程，
+ * 之后所有外部命令都由它来创建：
+ *
+ *   shell56 --(socketpair: path, argv, envp, cwd, fd 0/1/2)--> zygote
+ *   zygote:  clone(CLONE_PARENT) -> 子进程 execve
+ *   zygote --(pid, errno)--> shell56
+ *
+ * 创建子进程的开销只和zygote的大小有关，和shell后来长到多大无关。
+ * 命令的标准输入/输出/错误用 SCM_RIGHTS 随请求一起传过去（子进程
+ * dup2到0/1/2），所以管道和重定向照常工作。
+ *
+ * CLONE_PARENT：新进程的父进程不是zygote，而是zygote的父进程（shell），
+ * 结束时SIGCHLD发给shell，shell照常回收（evloop.c），作业表、
+ * time、管道的等待都不需要改。这是Linux特有的，其它系统上 -z 不可用，
+ * 照常使用posix_spawn。
+ *
+ * 子进程是否exec成功，zygote通过一个O_CLOEXEC的管道得知：exec成功时
+ * 管道被内核关闭，读到EOF；失败时子进程把errno写进管道再退出。
+ * 所以shell收到回复时，子进程已经exec了（进程组也已经设置好了），
+ * 和posix_spawn的保证一样。
+ */
+
+#define _GNU_SOURCE	/* CLONE_PARENT, MSG_CMSG_CLOEXEC, pipe2 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "zygote.h"
+#include "vars.h"
+#include "evloop.h"
+
+/* 请求头；后面跟着len个字节：path, cwd, argv..., envp...（每个以NUL结尾） */
+struct zreq {
+    unsigned int len;
+    int pgid;           /* 和struct spawn一样：0, -1, 或者组号 */
+    int argc;
+    int envc;
+};
+
+/* 回复：子进程的pid（没有创建时为-1），exec失败时的errno */
+struct zrep {
+    int pid;
+    int err;
+};
+
+static int zfd = -1;        /* shell这边的socket，-1表示没有zygote */
+
+/* 可用时返回1 */
+int zygote_active(void)
+{
+    return zfd != -1;
+}
+
+/* 不再使用zygote（在fork出的子进程中调用：socket是和父进程共用的） */
+void zygote_close(void)
+{
+    if (zfd != -1) {
+        close(zfd);
+        zfd = -1;
+    }
+}
+
+#ifdef __linux__
+
+/* 读满n个字节；对方关闭或出错时返回-1 */
+static int read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/*
+ * 在zygote中运行：子进程（已经是shell的子进程了）设置好进程组、信号和
+ * 0/1/2，然后exec。没有 #! 的脚本和execvp一样交给 /bin/sh
+ */
+static void zygote_child(const struct zreq *rq, char *path, char **argv, char **envp,
+                         const int fds[3], int err_fd)
+{
+    if (rq->pgid != 0)
+        setpgid(0, rq->pgid == -1 ? 0 : rq->pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    for (int i = 0; i < 3; i++)
+        dup2(fds[i], i);    /* dup2出来的0/1/2不带CLOEXEC */
+
+    execve(path, argv, envp);
+    if (errno == ENOEXEC) {
+        argv[-1] = path;    /* argv前面留了两个位置 */
+        argv[-2] = "sh";
+        execve("/bin/sh", argv - 2, envp);
+    }
+    int err = errno;
+    if (write(err_fd, &err, sizeof(err)) == -1) {}
+    _exit(127);
+}
+
+/*
+ * zygote的主循环：接收请求、创建子进程、回复，直到shell关闭socket
+ */
+static void zygote_main(int fd)
+{
+    /*
+     * zygote不需要终端：0/1/2换成/dev/null（否则shell的标准输出是管道时，
+     * zygote会一直占着写端）。子进程的0/1/2每次由shell传过来
+     */
+    int null_fd = open("/dev/null", O_RDWR);
+    for (int i = 0; i < 3 && null_fd != -1; i++)
+        dup2(null_fd, i);
+    if (null_fd > 2)
+        close(null_fd);
+    signal(SIGINT, SIG_IGN);    /* 和shell在同一个进程组，Ctrl+C不能杀死它 */
+
+    char *buf = NULL, **vec = NULL;
+    size_t buf_cap = 0, vec_cap = 0;
+    char cwd[4096] = "";
+
+    for (;;) {
+        /*
+         * 第一步：接收请求头和随它一起来的3个fd
+         */
+        struct zreq rq;
+        int fds[3] = {-1, -1, -1};
+        char cbuf[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = { .iov_base = &rq, .iov_len = sizeof(rq) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+        ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            _exit(0);       /* shell退出了 */
+        if ((size_t)n < sizeof(rq) && read_full(fd, (char *)&rq + n, sizeof(rq) - n) == -1)
+            _exit(0);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (c != NULL && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fds, CMSG_DATA(c), sizeof(fds));
+
+        /*
+         * 第二步：接收字符串，拆成path、cwd、argv和envp
+         * argv前面多留两个位置给 "sh path"（ENOEXEC）
+         */
+        if (rq.len > buf_cap) {
+            buf_cap = rq.len;
+            buf = realloc(buf, buf_cap);
+        }
+        size_t n_vec = rq.argc + rq.envc + 4;
+        if (n_vec > vec_cap) {
+            vec_cap = n_vec;
+            vec = realloc(vec, vec_cap * sizeof(char *));
+        }
+        if (buf == NULL || vec == NULL || read_full(fd, buf, rq.len) == -1)
+            _exit(1);
+
+        char *p = buf;
+        char *path = p;
+        p += strlen(p) + 1;
+        char *dir = p;
+        p += strlen(p) + 1;
+        char **argv = vec + 2;
+        for (int i = 0; i < rq.argc; i++, p += strlen(p) + 1)
+            argv[i] = p;
+        argv[rq.argc] = NULL;
+        char **envp = argv + rq.argc + 1;
+        for (int i = 0; i < rq.envc; i++, p += strlen(p) + 1)
+            envp[i] = p;
+        envp[rq.envc] = NULL;
+
+        // 子进程继承zygote的当前目录；shell的目录变了才chdir
+        if (strcmp(dir, cwd) != 0 && chdir(dir) == 0)
+            snprintf(cwd, sizeof(cwd), "%s", dir);
+
+        /*
+         * 第三步：创建子进程
+         * 只有flags、没有新的栈时，clone和fork一样从这里返回两次
+         */
+        struct zrep rep = { .pid = -1, .err = 0 };
+        int ep[2];
+        if (pipe2(ep, O_CLOEXEC) == -1) {
+            rep.err = errno;
+        } else {
+            pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+            if (pid == 0) {
+                close(ep[0]);
+                zygote_child(&rq, path, argv, envp, fds, ep[1]);
+            }
+            close(ep[1]);
+            if (pid == -1) {
+                rep.err = errno;
+            } else {
+                rep.pid = pid;
+                // EOF：exec成功；读到errno：exec失败，子进程以127退出
+                while (read(ep[0], &rep.err, sizeof(rep.err)) == -1 && errno == EINTR)
+                    ;
+            }
+            close(ep[0]);
+        }
+        for (int i = 0; i < 3; i++)
+            if (fds[i] != -1)
+                close(fds[i]);
+
+        if (write(fd, &rep, sizeof(rep)) != sizeof(rep))
+            _exit(1);
+    }
+}
+
+/*
+ * zygote_start: 创建zygote进程（在main的最开始调用，shell还很小）
+ *
+ * 返回值：成功返回0；失败返回-1（已经打印错误信息），之后照常用posix_spawn
+ */
+int zygote_start(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("zygote: socketpair");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+        _exit(0);
+    }
+    close(sv[1]);
+    zfd = sv[0];
+    return 0;
+}
+
+/*
+ * zygote_spawn: 请zygote启动一个命令（spawn_command在zygote可用时调用）
+ *
+ * 参数说明：
+ *   pid: 输出，子进程的pid
+ *   path: 已经查好的可执行文件路径（PATH查找缓存仍然在shell里）
+ *   sp: argv、标准输入/输出（-1表示用shell自己的）、进程组
+ *
+ * 返回值：和posix_spawn一样，成功返回0，失败返回errno
+ *
+ * zygote不在了（例如被杀死了）时关闭socket并返回EAGAIN；spawn_command
+ * 看到zygote_active()变成0，改用posix_spawn重新启动这个命令
+ */
+int zygote_spawn(pid_t *pid, const char *path, const struct spawn *sp)
+{
+    static char *buf;
+    static size_t buf_cap;
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+
+    /*
+     * 第一步：把所有字符串打包成一块
+     */
+    struct zreq rq = { .len = 0, .pgid = sp->pgid, .argc = 0, .envc = 0 };
+    char **envp = vars_envp();
+    size_t len = strlen(path) + 1 + strlen(cwd) + 1;
+    for (; sp->argv[rq.argc] != NULL; rq.argc++)
+        len += strlen(sp->argv[rq.argc]) + 1;
+    for (; envp[rq.envc] != NULL; rq.envc++)
+        len += strlen(envp[rq.envc]) + 1;
+    if (len > buf_cap) {
+        buf_cap = len * 2;
+        buf = realloc(buf, buf_cap);
+        if (buf == NULL) {
+            buf_cap = 0;
+            return ENOMEM;
+        }
+    }
+    char *p = buf;
+    p = stpcpy(p, path) + 1;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 0; i < rq.argc; i++)
+        p = stpcpy(p, sp->argv[i]) + 1;
+    for (int i = 0; i < rq.envc; i++)
+        p = stpcpy(p, envp[i]) + 1;
+    rq.len = len;
+
+    /*
+     * 第二步：请求头 + 字符串一起发送，0/1/2作为SCM_RIGHTS附在上面
+     */
+    int fds[3] = { sp->in_fd >= 0 ? sp->in_fd : STDIN_FILENO,
+                   sp->out_fd >= 0 ? sp->out_fd : STDOUT_FILENO,
+                   STDERR_FILENO };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov[2] = { { .iov_base = &rq, .iov_len = sizeof(rq) },
+                            { .iov_base = buf, .iov_len = len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    /* 字符串很多时sendmsg可能只发送一部分，剩下的用write补上 */
+    ssize_t sent = sendmsg(zfd, &msg, MSG_NOSIGNAL);
+    size_t total = sizeof(rq) + len;
+    while (sent >= (ssize_t)sizeof(rq) && (size_t)sent < total) {
+        ssize_t r = send(zfd, buf + (sent - sizeof(rq)), total - sent, MSG_NOSIGNAL);
+        if (r == -1 && errno == EINTR)
+            continue;
+        sent = (r == -1) ? -1 : sent + r;
+    }
+
+    /*
+     * 第三步：等待回复
+     */
+    struct zrep rep;
+    if (sent != (ssize_t)total || read_full(zfd, &rep, sizeof(rep)) == -1) {
+        fprintf(stderr, "zygote: helper exited, using posix_spawn\n");
+        close(zfd);
+        zfd = -1;
+        return EAGAIN;
+    }
+    if (rep.err != 0 && rep.pid > 0) {
+        // exec失败的子进程是shell的子进程，马上回收
+        ev_reap(rep.pid, NULL, NULL);
+    }
+    *pid = rep.pid;
+    return rep.err;
+}
+
+#else   /* !__linux__ */
+
+int zygote_start(void)
+{
+    fprintf(stderr, "zygote: not supported on this system, using posix_spawn\n");
+    return -1;
+}
+
+int zygote_spawn(pid_t *pid, const char *path, const struct spawn *sp)
+{
+    (void)pid;
+    (void)path;
+    (void)sp;
+    return ENOSYS;
+}
+
+#endif
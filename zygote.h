@@ -0,0 +1,22 @@
+/*
+ * file:        zygote.h
+ * description: fork-server (zygote) helper process for spawning commands
+ */
+
+/* standard include file protection:
+*/
+#ifndef __ZYGOTE_H__
+#define __ZYGOTE_H__
+
+#include <sys/types.h>
+
+#include "spawn.h"
+
+/* function declarations:
+*/
+int zygote_start(void);
+int zygote_active(void);
+void zygote_close(void);
+int zygote_spawn(pid_t *pid, const char *path, const struct spawn *sp);
+
+#endif